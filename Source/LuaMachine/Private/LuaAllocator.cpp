@@ -0,0 +1,280 @@
+// Copyright 2018-2023 - Roberto De Ioris
+
+#include "LuaAllocator.h"
+#include "LuaState.h"
+
+DECLARE_MEMORY_STAT(TEXT("Lua Memory"), STAT_LuaMemory, STATGROUP_LuaMachine);
+DECLARE_MEMORY_STAT(TEXT("Lua Pooled Memory"), STAT_LuaPooledMemory, STATGROUP_LuaMachine);
+
+FLuaAllocator::FLuaAllocator(const bool bInPooling)
+	: Budget(0)
+	, ProtectedDepth(0)
+	, bInBridge(false)
+	, bPooling(bInPooling)
+	, LiveBytes(0)
+	, PeakBytes(0)
+	, Frees(0)
+	, ReportedBytes(0)
+{
+	LastFrameAllocations.AddZeroed(NumSizeClasses + 1);
+}
+
+FLuaAllocator::~FLuaAllocator()
+{
+	DEC_MEMORY_STAT_BY(STAT_LuaMemory, ReportedBytes);
+	DEC_MEMORY_STAT_BY(STAT_LuaPooledMemory, Pages.Num() * PageSize);
+
+	for (void* Page : Pages)
+	{
+		FMemory::Free(Page);
+	}
+}
+
+void* FLuaAllocator::AllocSmall(const int32 SizeClass)
+{
+	FSizeClass& Class = SizeClasses[SizeClass];
+	if (FFreeBlock* Block = Class.FreeList)
+	{
+		Class.FreeList = Block->Next;
+		GetPageHeader(Block)->UsedBlocks++;
+		return Block;
+	}
+
+	const SIZE_T BlockSize = (SizeClass + 1) * SizeClassGranularity;
+	if (Class.Cursor + BlockSize > Class.End)
+	{
+		uint8* Page = (uint8*)FMemory::Malloc(PageSize, PageSize);
+		if (!Page)
+		{
+			return nullptr;
+		}
+		Pages.Add(Page);
+		INC_MEMORY_STAT_BY(STAT_LuaPooledMemory, PageSize);
+		((FPageHeader*)Page)->UsedBlocks = 0;
+		// the tail of the previous page (smaller than a block) is just lost
+		Class.Cursor = Page + PageHeaderSize;
+		Class.End = Page + PageSize;
+	}
+
+	void* Block = Class.Cursor;
+	Class.Cursor += BlockSize;
+	GetPageHeader(Block)->UsedBlocks++;
+	return Block;
+}
+
+void* FLuaAllocator::Malloc(const SIZE_T Size)
+{
+	void* Ptr = nullptr;
+	if (bPooling && Size <= MaxSmallSize)
+	{
+		const int32 SizeClass = GetSizeClass(Size);
+		Ptr = AllocSmall(SizeClass);
+		SizeClasses[SizeClass].Allocations++;
+		SizeClasses[SizeClass].FrameAllocations++;
+	}
+	else
+	{
+		Ptr = FMemory::Malloc(Size, SizeClassGranularity);
+		LargeAllocations++;
+		LargeFrameAllocations++;
+	}
+
+	if (Ptr)
+	{
+		LiveBytes += Size;
+		PeakBytes = FMath::Max(PeakBytes, LiveBytes);
+	}
+	return Ptr;
+}
+
+void FLuaAllocator::Free(void* Ptr, const SIZE_T Size)
+{
+	if (bPooling && Size <= MaxSmallSize)
+	{
+		FSizeClass& Class = SizeClasses[GetSizeClass(Size)];
+		FFreeBlock* Block = (FFreeBlock*)Ptr;
+		Block->Next = Class.FreeList;
+		Class.FreeList = Block;
+		GetPageHeader(Block)->UsedBlocks--;
+	}
+	else
+	{
+		FMemory::Free(Ptr);
+	}
+
+	LiveBytes -= Size;
+	Frees++;
+}
+
+void* FLuaAllocator::Alloc(void* UserData, void* Ptr, size_t OldSize, size_t NewSize)
+{
+	FLuaAllocator* Allocator = (FLuaAllocator*)UserData;
+
+	if (NewSize == 0)
+	{
+		if (Ptr)
+		{
+			Allocator->Free(Ptr, OldSize);
+		}
+		return nullptr;
+	}
+
+	// when Ptr is NULL, OldSize is the type of the Lua object, not a size
+	if (!Ptr)
+	{
+		if (!Allocator->CanGrow(0, NewSize))
+		{
+			return nullptr;
+		}
+		return Allocator->Malloc(NewSize);
+	}
+
+	if (!Allocator->CanGrow(OldSize, NewSize))
+	{
+		return nullptr;
+	}
+
+	if (!Allocator->bPooling || (OldSize > MaxSmallSize && NewSize > MaxSmallSize))
+	{
+		void* NewPtr = FMemory::Realloc(Ptr, NewSize, SizeClassGranularity);
+		if (NewPtr)
+		{
+			Allocator->LiveBytes = Allocator->LiveBytes - OldSize + NewSize;
+			Allocator->PeakBytes = FMath::Max(Allocator->PeakBytes, Allocator->LiveBytes);
+		}
+		return NewPtr;
+	}
+
+	if (OldSize <= MaxSmallSize && NewSize <= MaxSmallSize)
+	{
+		// still fits in the same block
+		if (GetSizeClass(OldSize) == GetSizeClass(NewSize))
+		{
+			Allocator->LiveBytes = Allocator->LiveBytes - OldSize + NewSize;
+			Allocator->PeakBytes = FMath::Max(Allocator->PeakBytes, Allocator->LiveBytes);
+			return Ptr;
+		}
+	}
+
+	// moving between a size class and another (or the big blocks)
+	void* NewPtr = Allocator->Malloc(NewSize);
+	if (!NewPtr)
+	{
+		return nullptr;
+	}
+	FMemory::Memcpy(NewPtr, Ptr, FMath::Min(OldSize, NewSize));
+	Allocator->Free(Ptr, OldSize);
+	return NewPtr;
+}
+
+bool FLuaAllocator::AddExternalBytes(const SIZE_T Size)
+{
+	// like for the Lua allocations, the budget is enforced only inside protected calls
+	if (Budget > 0 && ProtectedDepth > 0 && LiveBytes + Size > Budget)
+	{
+		return false;
+	}
+	LiveBytes += Size;
+	PeakBytes = FMath::Max(PeakBytes, LiveBytes);
+	return true;
+}
+
+void FLuaAllocator::RemoveExternalBytes(const SIZE_T Size)
+{
+	LiveBytes -= Size;
+}
+
+void* FLuaAllocator::AllocFMemory(void* UserData, void* Ptr, size_t OldSize, size_t NewSize)
+{
+	if (NewSize == 0)
+	{
+		FMemory::Free(Ptr);
+		return nullptr;
+	}
+	return FMemory::Realloc(Ptr, NewSize);
+}
+
+void FLuaAllocator::EndFrame()
+{
+	for (int32 SizeClass = 0; SizeClass < NumSizeClasses; SizeClass++)
+	{
+		LastFrameAllocations[SizeClass] = SizeClasses[SizeClass].FrameAllocations;
+		SizeClasses[SizeClass].FrameAllocations = 0;
+	}
+	LastFrameAllocations[NumSizeClasses] = LargeFrameAllocations;
+	LargeFrameAllocations = 0;
+
+	// report only the difference, multiple states share the same stat
+	if (LiveBytes >= ReportedBytes)
+	{
+		INC_MEMORY_STAT_BY(STAT_LuaMemory, LiveBytes - ReportedBytes);
+	}
+	else
+	{
+		DEC_MEMORY_STAT_BY(STAT_LuaMemory, ReportedBytes - LiveBytes);
+	}
+	ReportedBytes = LiveBytes;
+}
+
+SIZE_T FLuaAllocator::Trim()
+{
+	if (!bPooling || Pages.Num() == 0)
+	{
+		return 0;
+	}
+
+	// the free blocks of the empty pages are unlinked before releasing them
+	for (FSizeClass& Class : SizeClasses)
+	{
+		FFreeBlock** Link = &Class.FreeList;
+		while (FFreeBlock* Block = *Link)
+		{
+			if (GetPageHeader(Block)->UsedBlocks == 0)
+			{
+				*Link = Block->Next;
+			}
+			else
+			{
+				Link = &Block->Next;
+			}
+		}
+
+		// no more bump allocations in an empty page
+		if (Class.Cursor && GetPageHeader(Class.End - 1)->UsedBlocks == 0)
+		{
+			Class.Cursor = nullptr;
+			Class.End = nullptr;
+		}
+	}
+
+	SIZE_T ReleasedBytes = 0;
+	for (int32 PageIndex = Pages.Num() - 1; PageIndex >= 0; PageIndex--)
+	{
+		if (((FPageHeader*)Pages[PageIndex])->UsedBlocks == 0)
+		{
+			FMemory::Free(Pages[PageIndex]);
+			Pages.RemoveAtSwap(PageIndex, 1, false);
+			ReleasedBytes += PageSize;
+		}
+	}
+
+	DEC_MEMORY_STAT_BY(STAT_LuaPooledMemory, ReleasedBytes);
+	return ReleasedBytes;
+}
+
+FLuaMemoryStats FLuaAllocator::GetStats() const
+{
+	FLuaMemoryStats Stats;
+	Stats.LiveBytes = (int32)FMath::Min<SIZE_T>(LiveBytes, MAX_int32);
+	Stats.PeakBytes = (int32)FMath::Min<SIZE_T>(PeakBytes, MAX_int32);
+	Stats.PooledBytes = (int32)FMath::Min<SIZE_T>(Pages.Num() * PageSize, MAX_int32);
+	uint32 Allocations = LargeAllocations;
+	for (const FSizeClass& Class : SizeClasses)
+	{
+		Allocations += Class.Allocations;
+	}
+	Stats.Allocations = (int32)Allocations;
+	Stats.Frees = (int32)Frees;
+	Stats.FrameAllocationsBySizeClass = LastFrameAllocations;
+	return Stats;
+}
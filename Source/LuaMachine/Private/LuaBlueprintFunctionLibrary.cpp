@@ -65,9 +65,11 @@ FLuaValue ULuaBlueprintFunctionLibrary::LuaCreateObject(UObject* InObject)
 
 FLuaValue ULuaBlueprintFunctionLibrary::LuaCreateUFunction(UObject* InObject, const FString& FunctionName)
 {
-	if (InObject && InObject->FindFunction(FName(*FunctionName)))
+	// no UFunction can have a name not registered yet
+	const FName FunctionFName(*FunctionName, FNAME_Find);
+	if (InObject && !FunctionFName.IsNone() && InObject->FindFunction(FunctionFName))
 	{
-		FLuaValue Value = FLuaValue::Function(FName(*FunctionName));
+		FLuaValue Value = FLuaValue::Function(FunctionFName);
 		Value.Object = InObject;
 		return Value;
 	}
@@ -82,6 +84,8 @@ FLuaValue ULuaBlueprintFunctionLibrary::LuaCreateTable(UObject* WorldContextObje
 	if (!L)
 		return LuaValue;
 
+	FLuaStateOwnershipScope OwnershipScope(L);
+
 	return L->CreateLuaTable();
 }
 
@@ -92,6 +96,8 @@ FLuaValue ULuaBlueprintFunctionLibrary::LuaCreateLazyTable(UObject* WorldContext
 	if (!L)
 		return LuaValue;
 
+	FLuaStateOwnershipScope OwnershipScope(L);
+
 	return L->CreateLuaLazyTable();
 }
 
@@ -102,6 +108,8 @@ FLuaValue ULuaBlueprintFunctionLibrary::LuaCreateThread(UObject* WorldContextObj
 	if (!L)
 		return LuaValue;
 
+	FLuaStateOwnershipScope OwnershipScope(L);
+
 	return L->CreateLuaThread(Value);
 }
 
@@ -114,6 +122,8 @@ FLuaValue ULuaBlueprintFunctionLibrary::LuaCreateObjectInState(UObject* WorldCon
 	if (!L)
 		return LuaValue;
 
+	FLuaStateOwnershipScope OwnershipScope(L);
+
 	LuaValue = FLuaValue(InObject);
 	LuaValue.LuaState = L;
 	return LuaValue;
@@ -136,6 +146,117 @@ void ULuaBlueprintFunctionLibrary::LuaStateReload(UObject* WorldContextObject, T
 	FLuaMachineModule::Get().GetLuaState(State, WorldContextObject->GetWorld());
 }
 
+void ULuaBlueprintFunctionLibrary::LuaStateInitAsync(UObject* WorldContextObject, TSubclassOf<ULuaState> State, FLuaStateInitialized Initialized)
+{
+	FLuaMachineModule::Get().GetLuaStateAsync(State, WorldContextObject->GetWorld(), [Initialized](ULuaState* LuaState)
+		{
+			Initialized.ExecuteIfBound(LuaState);
+		});
+}
+
+void ULuaBlueprintFunctionLibrary::LuaJobDispatch(UObject* WorldContextObject, TSubclassOf<ULuaState> State, const FString& Function, TArray<FLuaValue> Args, FLuaJobCompleted Completed)
+{
+	ULuaState* L = FLuaMachineModule::Get().GetLuaState(State, WorldContextObject->GetWorld());
+	if (!L || !L->GetLuaJobSystem())
+	{
+		Completed.ExecuteIfBound(FLuaValue(FString("the job system is not enabled for this state")), false);
+		return;
+	}
+
+	TArray<FLuaJobValue> JobArgs;
+	JobArgs.SetNum(Args.Num());
+	FLuaStateOwnershipScope OwnershipScope(L);
+	for (int32 Index = 0; Index < Args.Num(); Index++)
+	{
+		FString Error;
+		L->FromLuaValue(Args[Index]);
+		const bool bCopied = FLuaJobValue::FromLua(L->GetInternalLuaState(), -1, JobArgs[Index], Error);
+		L->Pop();
+		if (!bCopied)
+		{
+			Completed.ExecuteIfBound(FLuaValue(Error), false);
+			return;
+		}
+	}
+
+	TWeakObjectPtr<ULuaState> WeakLuaState(L);
+	L->GetLuaJobSystem()->Dispatch(Function, MoveTemp(JobArgs), [WeakLuaState, Completed](const FLuaJob& Job)
+		{
+			if (!Job.bSuccess)
+			{
+				Completed.ExecuteIfBound(FLuaValue(Job.Error), false);
+				return;
+			}
+
+			FLuaValue ReturnValue;
+			if (Job.Results.Num() > 0 && WeakLuaState.IsValid() && WeakLuaState->GetInternalLuaState())
+			{
+				FLuaStateOwnershipScope OwnershipScope(WeakLuaState.Get());
+				Job.Results[0].ToLua(WeakLuaState->GetInternalLuaState());
+				ReturnValue = WeakLuaState->ToLuaValue(-1);
+				WeakLuaState->Pop();
+			}
+			Completed.ExecuteIfBound(ReturnValue, true);
+		});
+}
+
+void ULuaBlueprintFunctionLibrary::LuaGlobalCallAsync(UObject* WorldContextObject, TSubclassOf<ULuaState> State, const FString& Name, TArray<FLuaValue> Args, FLuaCallCompleted Completed)
+{
+	ULuaState* L = FLuaMachineModule::Get().GetLuaState(State, WorldContextObject->GetWorld());
+	if (!L)
+	{
+		Completed.ExecuteIfBound(FLuaValue(), false);
+		return;
+	}
+
+	auto Call = [L, Name, Args = MoveTemp(Args)](FLuaValue& ReturnValue) mutable
+	{
+		int32 ItemsToPop = L->GetFieldFromTree(Name);
+
+		int NArgs = 0;
+		for (FLuaValue& Arg : Args)
+		{
+			L->FromLuaValue(Arg);
+			NArgs++;
+		}
+
+		const bool bSuccess = L->PCall(NArgs, ReturnValue);
+		// the function has been replaced by the return value (or the error)
+		L->Pop(ItemsToPop);
+		return bSuccess;
+	};
+
+	FLuaStateThread* LuaThread = L->GetLuaThread();
+	if (!LuaThread)
+	{
+		FLuaValue ReturnValue;
+		const bool bSuccess = Call(ReturnValue);
+		Completed.ExecuteIfBound(ReturnValue, bSuccess);
+		return;
+	}
+
+	// the state (and so L) outlives its thread, the commands are executed before it is stopped
+	LuaThread->Enqueue([LuaThread, Call = MoveTemp(Call), Completed]() mutable
+		{
+			FLuaValue ReturnValue;
+			const bool bSuccess = Call(ReturnValue);
+			LuaThread->PostToGameThread([Completed, ReturnValue = MoveTemp(ReturnValue), bSuccess]()
+				{
+					Completed.ExecuteIfBound(ReturnValue, bSuccess);
+				});
+		});
+}
+
+bool ULuaBlueprintFunctionLibrary::LuaStateHibernate(UObject* WorldContextObject, TSubclassOf<ULuaState> State, TArray<uint8>& Image)
+{
+	return FLuaMachineModule::Get().HibernateLuaState(State, WorldContextObject->GetWorld(), Image);
+}
+
+bool ULuaBlueprintFunctionLibrary::LuaStateRestore(UObject* WorldContextObject, TSubclassOf<ULuaState> State, const TArray<uint8>& Image)
+{
+	return FLuaMachineModule::Get().RestoreLuaState(State, WorldContextObject->GetWorld(), Image) != nullptr;
+}
+
 FString ULuaBlueprintFunctionLibrary::Conv_LuaValueToString(const FLuaValue& Value)
 {
 	return Value.ToString();
@@ -251,6 +372,8 @@ FLuaValue ULuaBlueprintFunctionLibrary::LuaGetGlobal(UObject* WorldContextObject
 	if (!L)
 		return FLuaValue();
 
+	FLuaStateOwnershipScope OwnershipScope(L);
+
 	uint32 ItemsToPop = L->GetFieldFromTree(Name);
 	FLuaValue ReturnValue = L->ToLuaValue(-1);
 	L->Pop(ItemsToPop);
@@ -263,6 +386,8 @@ int64 ULuaBlueprintFunctionLibrary::LuaValueToPointer(UObject* WorldContextObjec
 	if (!L)
 		return 0;
 
+	FLuaStateOwnershipScope OwnershipScope(L);
+
 	L->FromLuaValue(Value);
 	const void* Ptr = L->ToPointer(-1);
 	L->Pop();
@@ -404,6 +529,8 @@ FLuaValue ULuaBlueprintFunctionLibrary::LuaRunFile(UObject* WorldContextObject,
 	if (!L)
 		return ReturnValue;
 
+	FLuaStateOwnershipScope OwnershipScope(L);
+
 	if (!L->RunFile(Filename, bIgnoreNonExistent, 1))
 	{
 		if (L->bLogError)
@@ -427,6 +554,8 @@ FLuaValue ULuaBlueprintFunctionLibrary::LuaRunNonContentFile(UObject* WorldConte
 	if (!L)
 		return ReturnValue;
 
+	FLuaStateOwnershipScope OwnershipScope(L);
+
 	if (!L->RunFile(Filename, bIgnoreNonExistent, 1, true))
 	{
 		if (L->bLogError)
@@ -452,6 +581,8 @@ FLuaValue ULuaBlueprintFunctionLibrary::LuaRunString(UObject* WorldContextObject
 		return ReturnValue;
 	}
 
+	FLuaStateOwnershipScope OwnershipScope(L);
+
 	return L->RunString(CodeString, CodePath);
 }
 
@@ -484,6 +615,8 @@ FLuaValue ULuaBlueprintFunctionLibrary::LuaRunCodeAsset(UObject* WorldContextObj
 	if (!L)
 		return ReturnValue;
 
+	FLuaStateOwnershipScope OwnershipScope(L);
+
 	if (!L->RunCodeAsset(CodeAsset, 1))
 	{
 		if (L->bLogError)
@@ -505,6 +638,8 @@ FLuaValue ULuaBlueprintFunctionLibrary::LuaRunByteCode(UObject* WorldContextObje
 	if (!L)
 		return ReturnValue;
 
+	FLuaStateOwnershipScope OwnershipScope(L);
+
 	if (!L->RunCode(ByteCode, CodePath, 1))
 	{
 		if (L->bLogError)
@@ -597,6 +732,8 @@ void ULuaBlueprintFunctionLibrary::LuaHttpRequest(UObject* WorldContextObject, T
 	if (!L)
 		return;
 
+	FLuaStateOwnershipScope OwnershipScope(L);
+
 #if ENGINE_MAJOR_VERSION > 4 || ENGINE_MINOR_VERSION >= 26
 	TSharedRef<IHttpRequest, ESPMode::ThreadSafe> HttpRequest = FHttpModule::Get().CreateRequest();
 #else
@@ -623,6 +760,7 @@ void ULuaBlueprintFunctionLibrary::HttpGenericRequestDone(FHttpRequestPtr Reques
 		return;
 
 	TSharedRef<FLuaSmartReference> SmartContext = Context.Pin().ToSharedRef();
+	FLuaStateOwnershipScope OwnershipScope(SmartContext->LuaState);
 
 	SmartContext->LuaState->RemoveLuaSmartReference(SmartContext);
 
@@ -633,8 +771,9 @@ void ULuaBlueprintFunctionLibrary::HttpGenericRequestDone(FHttpRequestPtr Reques
 	}
 
 	FLuaValue StatusCode = FLuaValue(Response->GetResponseCode());
-	FLuaValue Headers = SmartContext->LuaState->CreateLuaTable();
-	for (auto HeaderLine : Response->GetAllHeaders())
+	TArray<FString> AllHeaders = Response->GetAllHeaders();
+	FLuaTableBuilder HeadersBuilder(SmartContext->LuaState, 0, AllHeaders.Num());
+	for (const FString& HeaderLine : AllHeaders)
 	{
 		int32 Index;
 		if (HeaderLine.Len() > 2 && HeaderLine.FindChar(':', Index))
@@ -643,14 +782,16 @@ void ULuaBlueprintFunctionLibrary::HttpGenericRequestDone(FHttpRequestPtr Reques
 			if (Index > 0)
 				Key = HeaderLine.Left(Index);
 			FString Value = HeaderLine.Right(HeaderLine.Len() - (Index + 2));
-			Headers.SetField(Key, FLuaValue(Value));
+			HeadersBuilder.SetField(Key, FLuaValue(Value));
 		}
 	}
+	FLuaValue Headers = HeadersBuilder.Finish();
 	FLuaValue Content = FLuaValue(Response->GetContent());
-	FLuaValue LuaHttpResponse = SmartContext->LuaState->CreateLuaTable();
-	LuaHttpResponse.SetFieldByIndex(1, StatusCode);
-	LuaHttpResponse.SetFieldByIndex(2, Headers);
-	LuaHttpResponse.SetFieldByIndex(3, Content);
+	FLuaTableBuilder ResponseBuilder(SmartContext->LuaState, 3);
+	ResponseBuilder.Add(StatusCode);
+	ResponseBuilder.Add(Headers);
+	ResponseBuilder.Add(Content);
+	FLuaValue LuaHttpResponse = ResponseBuilder.Finish();
 	ResponseReceived.ExecuteIfBound(SmartContext->Value, LuaHttpResponse);
 }
 
@@ -776,6 +917,8 @@ void ULuaBlueprintFunctionLibrary::LuaTableFillObject(FLuaValue InTable, UObject
 	if (!L)
 		return;
 
+	FLuaStateOwnershipScope OwnershipScope(L);
+
 	UStruct* Class = Cast<UStruct>(InObject);
 	if (!Class)
 		Class = InObject->GetClass();
@@ -799,6 +942,8 @@ FLuaValue ULuaBlueprintFunctionLibrary::LuaTableGetField(FLuaValue Table, const
 	if (!L)
 		return FLuaValue();
 
+	FLuaStateOwnershipScope OwnershipScope(L);
+
 	return Table.GetField(Key);
 }
 
@@ -812,7 +957,17 @@ FLuaValue ULuaBlueprintFunctionLibrary::LuaComponentGetField(FLuaValue LuaCompon
 	if (!L)
 		return ReturnValue;
 
+	FLuaStateOwnershipScope OwnershipScope(L);
+
 	ULuaComponent* Component = Cast<ULuaComponent>(LuaComponent.Object);
+	if (!Component)
+		return ReturnValue;
+
+	// the instance table is the authoritative storage once the component has been exposed to Lua
+	if (Component->LuaInstanceTable.Type == ELuaValueType::Table && Component->LuaInstanceTable.LuaState.IsValid())
+	{
+		return Component->LuaInstanceTable.GetField(Key);
+	}
 
 	FLuaValue* LuaValue = Component->Table.Find(Key);
 	if (LuaValue)
@@ -891,6 +1046,8 @@ FLuaValue ULuaBlueprintFunctionLibrary::LuaTableGetByIndex(FLuaValue Table, int3
 	if (!L)
 		return FLuaValue();
 
+	FLuaStateOwnershipScope OwnershipScope(L);
+
 	return Table.GetFieldByIndex(Index);
 }
 
@@ -899,6 +1056,9 @@ FLuaValue ULuaBlueprintFunctionLibrary::AssignLuaValueToLuaState(UObject* WorldC
 	ULuaState* L = FLuaMachineModule::Get().GetLuaState(State, WorldContextObject->GetWorld());
 	if (!L)
 		return Value;
+
+	FLuaStateOwnershipScope OwnershipScope(L);
+
 	Value.LuaState = L;
 	return Value;
 }
@@ -912,6 +1072,8 @@ FLuaValue ULuaBlueprintFunctionLibrary::LuaTableSetByIndex(FLuaValue Table, int3
 	if (!L)
 		return FLuaValue();
 
+	FLuaStateOwnershipScope OwnershipScope(L);
+
 	return Table.SetFieldByIndex(Index, Value);
 }
 
@@ -925,14 +1087,50 @@ FLuaValue ULuaBlueprintFunctionLibrary::LuaTableSetField(FLuaValue Table, const
 	if (!L)
 		return ReturnValue;
 
+	FLuaStateOwnershipScope OwnershipScope(L);
+
 	return Table.SetField(Key, Value);
 }
 
+static bool LuaFindIndexedLuaComponent(AActor* Actor, TSubclassOf<ULuaState> State, const FString* Name, FLuaValue& LuaValue)
+{
+	UWorld* World = Actor->GetWorld();
+	ULuaWorldSubsystem* LuaWorldSubsystem = World ? World->GetSubsystem<ULuaWorldSubsystem>() : nullptr;
+	if (!LuaWorldSubsystem)
+	{
+		return false;
+	}
+
+	FName ComponentName = NAME_None;
+	if (Name)
+	{
+		// no need to add a new name to the table for a lookup
+		ComponentName = FName(**Name, FNAME_Find);
+		if (ComponentName == NAME_None)
+		{
+			return false;
+		}
+	}
+
+	ULuaComponent* LuaComponent = nullptr;
+	if (!LuaWorldSubsystem->FindLuaComponent(Actor, State, ComponentName, LuaComponent))
+	{
+		return false;
+	}
+
+	LuaValue = FLuaValue(LuaComponent);
+	return true;
+}
+
 FLuaValue ULuaBlueprintFunctionLibrary::GetLuaComponentAsLuaValue(AActor* Actor)
 {
 	if (!Actor)
 		return FLuaValue();
 
+	FLuaValue IndexedLuaComponent;
+	if (LuaFindIndexedLuaComponent(Actor, nullptr, nullptr, IndexedLuaComponent))
+		return IndexedLuaComponent;
+
 	return FLuaValue(Actor->GetComponentByClass(ULuaComponent::StaticClass()));
 }
 
@@ -940,6 +1138,11 @@ FLuaValue ULuaBlueprintFunctionLibrary::GetLuaComponentByStateAsLuaValue(AActor*
 {
 	if (!Actor)
 		return FLuaValue();
+
+	FLuaValue IndexedLuaComponent;
+	if (State && LuaFindIndexedLuaComponent(Actor, State, nullptr, IndexedLuaComponent))
+		return IndexedLuaComponent;
+
 #if ENGINE_MAJOR_VERSION < 5 && ENGINE_MINOR_VERSION < 24
 	TArray<UActorComponent*> Components = Actor->GetComponentsByClass(ULuaComponent::StaticClass());
 #else
@@ -966,6 +1169,10 @@ FLuaValue ULuaBlueprintFunctionLibrary::GetLuaComponentByNameAsLuaValue(AActor*
 	if (!Actor)
 		return FLuaValue();
 
+	FLuaValue IndexedLuaComponent;
+	if (LuaFindIndexedLuaComponent(Actor, nullptr, &Name, IndexedLuaComponent))
+		return IndexedLuaComponent;
+
 #if ENGINE_MAJOR_VERSION < 5 && ENGINE_MINOR_VERSION < 24
 	TArray<UActorComponent*> Components = Actor->GetComponentsByClass(ULuaComponent::StaticClass());
 #else
@@ -992,6 +1199,10 @@ FLuaValue ULuaBlueprintFunctionLibrary::GetLuaComponentByStateAndNameAsLuaValue(
 	if (!Actor)
 		return FLuaValue();
 
+	FLuaValue IndexedLuaComponent;
+	if (LuaFindIndexedLuaComponent(Actor, State, &Name, IndexedLuaComponent))
+		return IndexedLuaComponent;
+
 #if ENGINE_MAJOR_VERSION < 5 && ENGINE_MINOR_VERSION < 24
 	TArray<UActorComponent*> Components = Actor->GetComponentsByClass(ULuaComponent::StaticClass());
 #else
@@ -1018,6 +1229,9 @@ int32 ULuaBlueprintFunctionLibrary::LuaGetTop(UObject* WorldContextObject, TSubc
 	ULuaState* L = FLuaMachineModule::Get().GetLuaState(State, WorldContextObject->GetWorld());
 	if (!L)
 		return MIN_int32;
+
+	FLuaStateOwnershipScope OwnershipScope(L);
+
 	return L->GetTop();
 }
 
@@ -1026,6 +1240,8 @@ void ULuaBlueprintFunctionLibrary::LuaSetGlobal(UObject* WorldContextObject, TSu
 	ULuaState* L = FLuaMachineModule::Get().GetLuaState(State, WorldContextObject->GetWorld());
 	if (!L)
 		return;
+
+	FLuaStateOwnershipScope OwnershipScope(L);
 	L->SetFieldFromTree(Name, Value, true);
 }
 
@@ -1036,6 +1252,8 @@ FLuaValue ULuaBlueprintFunctionLibrary::LuaGlobalCall(UObject* WorldContextObjec
 	if (!L)
 		return ReturnValue;
 
+	FLuaStateOwnershipScope OwnershipScope(L);
+
 	int32 ItemsToPop = L->GetFieldFromTree(Name);
 
 	int NArgs = 0;
@@ -1060,9 +1278,9 @@ TArray<FLuaValue> ULuaBlueprintFunctionLibrary::LuaGlobalCallMulti(UObject* Worl
 	if (!L)
 		return ReturnValue;
 
-	int32 ItemsToPop = L->GetFieldFromTree(Name);
+	FLuaStateOwnershipScope OwnershipScope(L);
 
-	int32 StackTop = L->GetTop();
+	int32 ItemsToPop = L->GetFieldFromTree(Name);
 
 	int NArgs = 0;
 	for (FLuaValue& Arg : Args)
@@ -1071,24 +1289,13 @@ TArray<FLuaValue> ULuaBlueprintFunctionLibrary::LuaGlobalCallMulti(UObject* Worl
 		NArgs++;
 	}
 
-	FLuaValue LastReturnValue;
-	if (L->PCall(NArgs, LastReturnValue, LUA_MULTRET))
 	{
-
-		int32 NumOfReturnValues = (L->GetTop() - StackTop) + 1;
-		if (NumOfReturnValues > 0)
-		{
-			for (int32 i = -1; i >= -(NumOfReturnValues); i--)
-			{
-				ReturnValue.Insert(L->ToLuaValue(i), 0);
-			}
-			L->Pop(NumOfReturnValues - 1);
-		}
-
+		FLuaCallResult CallResult = L->PCallMulti(NArgs);
+		CallResult.AppendTo(ReturnValue);
 	}
 
-	// we have the return value and the function has been removed, so we do not need to change ItemsToPop
-	L->Pop(ItemsToPop);
+	// the function slot has been popped by the call result
+	L->Pop(ItemsToPop - 1);
 
 	return ReturnValue;
 }
@@ -1100,6 +1307,8 @@ FLuaValue ULuaBlueprintFunctionLibrary::LuaGlobalCallValue(UObject* WorldContext
 	if (!L)
 		return ReturnValue;
 
+	FLuaStateOwnershipScope OwnershipScope(L);
+
 	L->FromLuaValue(Value);
 
 	int NArgs = 0;
@@ -1123,9 +1332,9 @@ TArray<FLuaValue> ULuaBlueprintFunctionLibrary::LuaGlobalCallValueMulti(UObject*
 	if (!L)
 		return ReturnValue;
 
-	L->FromLuaValue(Value);
+	FLuaStateOwnershipScope OwnershipScope(L);
 
-	int32 StackTop = L->GetTop();
+	L->FromLuaValue(Value);
 
 	int NArgs = 0;
 	for (FLuaValue& Arg : Args)
@@ -1134,23 +1343,8 @@ TArray<FLuaValue> ULuaBlueprintFunctionLibrary::LuaGlobalCallValueMulti(UObject*
 		NArgs++;
 	}
 
-	FLuaValue LastReturnValue;
-	if (L->PCall(NArgs, LastReturnValue, LUA_MULTRET))
-	{
-
-		int32 NumOfReturnValues = (L->GetTop() - StackTop) + 1;
-		if (NumOfReturnValues > 0)
-		{
-			for (int32 i = -1; i >= -(NumOfReturnValues); i--)
-			{
-				ReturnValue.Insert(L->ToLuaValue(i), 0);
-			}
-			L->Pop(NumOfReturnValues - 1);
-		}
-
-	}
-
-	L->Pop();
+	FLuaCallResult CallResult = L->PCallMulti(NArgs);
+	CallResult.AppendTo(ReturnValue);
 
 	return ReturnValue;
 }
@@ -1163,6 +1357,8 @@ FLuaValue ULuaBlueprintFunctionLibrary::LuaValueCall(FLuaValue Value, TArray<FLu
 	if (!L)
 		return ReturnValue;
 
+	FLuaStateOwnershipScope OwnershipScope(L);
+
 	L->FromLuaValue(Value);
 
 	int NArgs = 0;
@@ -1198,6 +1394,8 @@ FLuaValue ULuaBlueprintFunctionLibrary::LuaTableKeyCall(FLuaValue InTable, const
 	if (!L)
 		return ReturnValue;
 
+	FLuaStateOwnershipScope OwnershipScope(L);
+
 	FLuaValue Value = InTable.GetField(Key);
 	if (Value.Type == ELuaValueType::Nil)
 		return ReturnValue;
@@ -1215,6 +1413,8 @@ FLuaValue ULuaBlueprintFunctionLibrary::LuaTableKeyCallWithSelf(FLuaValue InTabl
 	if (!L)
 		return ReturnValue;
 
+	FLuaStateOwnershipScope OwnershipScope(L);
+
 	FLuaValue Value = InTable.GetField(Key);
 	if (Value.Type == ELuaValueType::Nil)
 		return ReturnValue;
@@ -1234,6 +1434,8 @@ FLuaValue ULuaBlueprintFunctionLibrary::LuaTableIndexCall(FLuaValue InTable, int
 	if (!L)
 		return ReturnValue;
 
+	FLuaStateOwnershipScope OwnershipScope(L);
+
 	FLuaValue Value = InTable.GetFieldByIndex(Index);
 	if (Value.Type == ELuaValueType::Nil)
 		return ReturnValue;
@@ -1295,16 +1497,16 @@ FLuaValue ULuaBlueprintFunctionLibrary::LuaTablePack(UObject* WorldContextObject
 	if (!L)
 		return ReturnValue;
 
-	ReturnValue = L->CreateLuaTable();
+	FLuaStateOwnershipScope OwnershipScope(L);
 
-	int32 Index = 1;
+	FLuaTableBuilder Builder(L, Values.Num());
 
 	for (FLuaValue& Value : Values)
 	{
-		ReturnValue.SetFieldByIndex(Index++, Value);
+		Builder.Add(Value);
 	}
 
-	return ReturnValue;
+	return Builder.Finish();
 }
 
 FLuaValue ULuaBlueprintFunctionLibrary::LuaTableMergePack(UObject* WorldContextObject, TSubclassOf<ULuaState> State, TArray<FLuaValue> Values1, TArray<FLuaValue> Values2)
@@ -1314,21 +1516,21 @@ FLuaValue ULuaBlueprintFunctionLibrary::LuaTableMergePack(UObject* WorldContextO
 	if (!L)
 		return ReturnValue;
 
-	ReturnValue = L->CreateLuaTable();
+	FLuaStateOwnershipScope OwnershipScope(L);
 
-	int32 Index = 1;
+	FLuaTableBuilder Builder(L, Values1.Num() + Values2.Num());
 
 	for (FLuaValue& Value : Values1)
 	{
-		ReturnValue.SetFieldByIndex(Index++, Value);
+		Builder.Add(Value);
 	}
 
 	for (FLuaValue& Value : Values2)
 	{
-		ReturnValue.SetFieldByIndex(Index++, Value);
+		Builder.Add(Value);
 	}
 
-	return ReturnValue;
+	return Builder.Finish();
 }
 
 FLuaValue ULuaBlueprintFunctionLibrary::LuaTableFromMap(UObject* WorldContextObject, TSubclassOf<ULuaState> State, TMap<FString, FLuaValue> Map)
@@ -1338,14 +1540,16 @@ FLuaValue ULuaBlueprintFunctionLibrary::LuaTableFromMap(UObject* WorldContextObj
 	if (!L)
 		return ReturnValue;
 
-	ReturnValue = L->CreateLuaTable();
+	FLuaStateOwnershipScope OwnershipScope(L);
+
+	FLuaTableBuilder Builder(L, 0, Map.Num());
 
 	for (TPair<FString, FLuaValue>& Pair : Map)
 	{
-		ReturnValue.SetField(Pair.Key, Pair.Value);
+		Builder.SetField(Pair.Key, Pair.Value);
 	}
 
-	return ReturnValue;
+	return Builder.Finish();
 }
 
 TArray<FLuaValue> ULuaBlueprintFunctionLibrary::LuaTableRange(FLuaValue InTable, int32 First, int32 Last)
@@ -1384,9 +1588,9 @@ TArray<FLuaValue> ULuaBlueprintFunctionLibrary::LuaValueCallMulti(FLuaValue Valu
 	if (!L)
 		return ReturnValue;
 
-	L->FromLuaValue(Value);
+	FLuaStateOwnershipScope OwnershipScope(L);
 
-	int32 StackTop = L->GetTop();
+	L->FromLuaValue(Value);
 
 	int NArgs = 0;
 	for (FLuaValue& Arg : Args)
@@ -1395,23 +1599,8 @@ TArray<FLuaValue> ULuaBlueprintFunctionLibrary::LuaValueCallMulti(FLuaValue Valu
 		NArgs++;
 	}
 
-	FLuaValue LastReturnValue;
-	if (L->PCall(NArgs, LastReturnValue, LUA_MULTRET))
-	{
-
-		int32 NumOfReturnValues = (L->GetTop() - StackTop) + 1;
-		if (NumOfReturnValues > 0)
-		{
-			for (int32 i = -1; i >= -(NumOfReturnValues); i--)
-			{
-				ReturnValue.Insert(L->ToLuaValue(i), 0);
-			}
-			L->Pop(NumOfReturnValues - 1);
-		}
-
-	}
-
-	L->Pop();
+	FLuaCallResult CallResult = L->PCallMulti(NArgs);
+	CallResult.AppendTo(ReturnValue);
 
 	return ReturnValue;
 }
@@ -1425,6 +1614,8 @@ void ULuaBlueprintFunctionLibrary::LuaValueYield(FLuaValue Value, TArray<FLuaVal
 	if (!L)
 		return;
 
+	FLuaStateOwnershipScope OwnershipScope(L);
+
 	L->FromLuaValue(Value);
 
 	int32 StackTop = L->GetTop();
@@ -1452,6 +1643,8 @@ TArray<FLuaValue> ULuaBlueprintFunctionLibrary::LuaValueResumeMulti(FLuaValue Va
 	if (!L)
 		return ReturnValue;
 
+	FLuaStateOwnershipScope OwnershipScope(L);
+
 	L->FromLuaValue(Value);
 
 	int32 StackTop = L->GetTop();
@@ -1465,14 +1658,9 @@ TArray<FLuaValue> ULuaBlueprintFunctionLibrary::LuaValueResumeMulti(FLuaValue Va
 
 	L->Resume(-1 - NArgs, NArgs);
 
-	int32 NumOfReturnValues = (L->GetTop() - StackTop);
-	if (NumOfReturnValues > 0)
 	{
-		for (int32 i = -1; i >= -(NumOfReturnValues); i--)
-		{
-			ReturnValue.Insert(L->ToLuaValue(i), 0);
-		}
-		L->Pop(NumOfReturnValues);
+		FLuaCallResult ResumeResult(L, StackTop + 1, L->GetTop() - StackTop);
+		ResumeResult.AppendTo(ReturnValue);
 	}
 
 	L->Pop();
@@ -1554,6 +1742,8 @@ FLuaValue ULuaBlueprintFunctionLibrary::LuaTableSetMetaTable(FLuaValue InTable,
 	if (!L)
 		return ReturnValue;
 
+	FLuaStateOwnershipScope OwnershipScope(L);
+
 	return InTable.SetMetaTable(InMetaTable);
 }
 
@@ -1564,6 +1754,8 @@ int32 ULuaBlueprintFunctionLibrary::LuaValueLength(FLuaValue Value)
 	if (!L)
 		return 0;
 
+	FLuaStateOwnershipScope OwnershipScope(L);
+
 	L->FromLuaValue(Value);
 	L->Len(-1);
 	int32 Length = L->ToInteger(-1);
@@ -1583,6 +1775,8 @@ TArray<FLuaValue> ULuaBlueprintFunctionLibrary::LuaTableGetKeys(FLuaValue Table)
 	if (!L)
 		return Keys;
 
+	FLuaStateOwnershipScope OwnershipScope(L);
+
 	L->FromLuaValue(Table);
 	L->PushNil(); // first key
 	while (L->Next(-2))
@@ -1607,6 +1801,8 @@ TArray<FLuaValue> ULuaBlueprintFunctionLibrary::LuaTableGetValues(FLuaValue Tabl
 	if (!L)
 		return Keys;
 
+	FLuaStateOwnershipScope OwnershipScope(L);
+
 	L->FromLuaValue(Table);
 	L->PushNil(); // first key
 	while (L->Next(-2))
@@ -1626,6 +1822,8 @@ FLuaValue ULuaBlueprintFunctionLibrary::LuaTableAssetToLuaTable(UObject* WorldCo
 	if (!L)
 		return FLuaValue();
 
+	FLuaStateOwnershipScope OwnershipScope(L);
+
 	return TableAsset->ToLuaTable(L);
 }
 
@@ -1635,6 +1833,8 @@ FLuaValue ULuaBlueprintFunctionLibrary::LuaNewLuaUserDataObject(UObject* WorldCo
 	if (!L)
 		return FLuaValue();
 
+	FLuaStateOwnershipScope OwnershipScope(L);
+
 	return L->NewLuaUserDataObject(UserDataObjectClass, bTrackObject);
 }
 
@@ -1652,6 +1852,8 @@ bool ULuaBlueprintFunctionLibrary::LuaTableImplements(FLuaValue Table, ULuaTable
 	if (!L)
 		return false;
 
+	FLuaStateOwnershipScope OwnershipScope(L);
+
 	for (TPair<FString, FLuaValue>& Pair : TableAsset->Table)
 	{
 		FLuaValue Item = Table.GetField(Pair.Key);
@@ -1690,15 +1892,41 @@ int32 ULuaBlueprintFunctionLibrary::LuaGetUsedMemory(UObject* WorldContextObject
 	if (!L)
 		return -1;
 
+	FLuaStateOwnershipScope OwnershipScope(L);
+
 	return L->GC(LUA_GCCOUNT);
 }
 
+FLuaMemoryStats ULuaBlueprintFunctionLibrary::LuaGetMemoryStats(UObject* WorldContextObject, TSubclassOf<ULuaState> State)
+{
+	ULuaState* L = FLuaMachineModule::Get().GetLuaState(State, WorldContextObject->GetWorld());
+	if (!L)
+		return FLuaMemoryStats();
+
+	FLuaStateOwnershipScope OwnershipScope(L);
+
+	return L->GetLuaMemoryStats();
+}
+
+FLuaGCStats ULuaBlueprintFunctionLibrary::LuaGetGCStats(UObject* WorldContextObject, TSubclassOf<ULuaState> State)
+{
+	ULuaState* L = FLuaMachineModule::Get().GetLuaState(State, WorldContextObject->GetWorld());
+	if (!L)
+		return FLuaGCStats();
+
+	FLuaStateOwnershipScope OwnershipScope(L);
+
+	return L->GetLuaGCStats();
+}
+
 void ULuaBlueprintFunctionLibrary::LuaGCCollect(UObject* WorldContextObject, TSubclassOf<ULuaState> State)
 {
 	ULuaState* L = FLuaMachineModule::Get().GetLuaState(State, WorldContextObject->GetWorld());
 	if (!L)
 		return;
 
+	FLuaStateOwnershipScope OwnershipScope(L);
+
 	L->GC(LUA_GCCOLLECT);
 }
 
@@ -1708,6 +1936,8 @@ void ULuaBlueprintFunctionLibrary::LuaGCStop(UObject* WorldContextObject, TSubcl
 	if (!L)
 		return;
 
+	FLuaStateOwnershipScope OwnershipScope(L);
+
 	L->GC(LUA_GCSTOP);
 }
 
@@ -1717,14 +1947,32 @@ void ULuaBlueprintFunctionLibrary::LuaGCRestart(UObject* WorldContextObject, TSu
 	if (!L)
 		return;
 
+	FLuaStateOwnershipScope OwnershipScope(L);
+
 	L->GC(LUA_GCRESTART);
 }
 
+FLuaTickStats ULuaBlueprintFunctionLibrary::LuaGetTickStats(UObject* WorldContextObject, TSubclassOf<ULuaState> State)
+{
+	UWorld* World = WorldContextObject ? WorldContextObject->GetWorld() : nullptr;
+	if (!World)
+		return FLuaTickStats();
+
+	ULuaWorldSubsystem* LuaWorldSubsystem = World->GetSubsystem<ULuaWorldSubsystem>();
+	if (!LuaWorldSubsystem)
+		return FLuaTickStats();
+
+	return LuaWorldSubsystem->GetLuaTickStats(State);
+}
+
 void ULuaBlueprintFunctionLibrary::LuaSetUserDataMetaTable(UObject* WorldContextObject, TSubclassOf<ULuaState> State, FLuaValue MetaTable)
 {
 	ULuaState* L = FLuaMachineModule::Get().GetLuaState(State, WorldContextObject->GetWorld());
 	if (!L)
 		return;
+
+	FLuaStateOwnershipScope OwnershipScope(L);
+
 	L->SetUserDataMetaTable(MetaTable);
 }
 
@@ -1810,6 +2058,8 @@ bool ULuaBlueprintFunctionLibrary::LuaValueFromJson(UObject* WorldContextObject,
 	if (!L)
 		return false;
 
+	FLuaStateOwnershipScope OwnershipScope(L);
+
 	TSharedPtr<FJsonValue> JsonValue;
 	TSharedRef< TJsonReader<TCHAR> > JsonReader = TJsonReaderFactory<TCHAR>::Create(Json);
 	if (!FJsonSerializer::Deserialize(JsonReader, JsonValue))
@@ -1984,13 +2234,20 @@ void ULuaBlueprintFunctionLibrary::GetLuaReflectionType(UObject* InObject, const
 		return;
 	}
 
-	if (Class->FindPropertyByName(FName(*Name)) != nullptr)
+	// resolved once, without adding the unknown names to the name table
+	const FName FieldName(*Name, FNAME_Find);
+	if (FieldName.IsNone())
+	{
+		return;
+	}
+
+	if (Class->FindPropertyByName(FieldName) != nullptr)
 	{
 		LuaReflectionTypes = ELuaReflectionType::Property;
 		return;
 	}
 
-	if (Class->FindFunctionByName(FName(*Name)))
+	if (Class->FindFunctionByName(FieldName))
 	{
 		LuaReflectionTypes = ELuaReflectionType::Function;
 		return;
@@ -2009,23 +2266,20 @@ void ULuaBlueprintFunctionLibrary::UnregisterLuaConsoleCommand(const FString& Co
 
 ULuaState* ULuaBlueprintFunctionLibrary::CreateDynamicLuaState(UObject* WorldContextObject, TSubclassOf<ULuaState> LuaStateClass)
 {
-	if (!LuaStateClass)
-	{
-		return nullptr;
-	}
-
-	if (LuaStateClass == ULuaState::StaticClass())
-	{
-		UE_LOG(LogLuaMachine, Error, TEXT("attempt to use LuaState Abstract class, please create a child of LuaState"));
-		return nullptr;
-	}
+	return FLuaMachineModule::Get().AcquireDynamicLuaState(LuaStateClass, WorldContextObject->GetWorld());
+}
 
+void ULuaBlueprintFunctionLibrary::ReleaseDynamicLuaState(ULuaState* LuaState)
+{
+	FLuaMachineModule::Get().ReleaseDynamicLuaState(LuaState);
+}
 
-	ULuaState* NewLuaState = NewObject<ULuaState>((UObject*)GetTransientPackage(), LuaStateClass);
-	if (!NewLuaState)
-	{
-		return nullptr;
-	}
+void ULuaBlueprintFunctionLibrary::WarmDynamicLuaStatePool(UObject* WorldContextObject, TSubclassOf<ULuaState> LuaStateClass)
+{
+	FLuaMachineModule::Get().WarmDynamicLuaStatePool(LuaStateClass, WorldContextObject->GetWorld());
+}
 
-	return NewLuaState->GetLuaState(WorldContextObject->GetWorld());
+ULuaState* ULuaBlueprintFunctionLibrary::CloneLuaState(UObject* WorldContextObject, ULuaState* LuaState)
+{
+	return FLuaMachineModule::Get().CloneLuaState(LuaState, WorldContextObject->GetWorld());
 }
@@ -0,0 +1,538 @@
+// Copyright 2018-2023 - Roberto De Ioris
+
+#include "LuaBulkBuffer.h"
+#include "LuaState.h"
+#include "Components/SceneComponent.h"
+#include "Components/ActorComponent.h"
+#include "GameFramework/Actor.h"
+
+static const char* LuaBulkBufferMetatableName = "LuaMachine.BulkBuffer";
+
+FLuaBulkBuffer* FLuaBulkBuffer::New(lua_State* L, const int32 Num, const int32 Stride)
+{
+	const int32 ClampedStride = FMath::Clamp(Stride, 1, MaxStride);
+	const int64 Elements = (int64)FMath::Max(Num, 0) * ClampedStride;
+	check(Elements <= MAX_int32 / (int64)sizeof(float));
+
+	FLuaBulkBuffer* Buffer = new (lua_newuserdata(L, sizeof(FLuaBulkBuffer))) FLuaBulkBuffer();
+	Buffer->Stride = ClampedStride;
+	luaL_setmetatable(L, LuaBulkBufferMetatableName);
+
+	// the __gc metamethod gives the bytes back
+	FLuaAllocator* Allocator = FLuaAllocator::Get(L);
+	if (Allocator && !Allocator->AddExternalBytes(Elements * sizeof(float)))
+	{
+		lua_pop(L, 1);
+		return nullptr;
+	}
+	Buffer->Data.SetNumZeroed((int32)Elements);
+	return Buffer;
+}
+
+FLuaBulkBuffer* FLuaBulkBuffer::Get(lua_State* L, int Index)
+{
+	return (FLuaBulkBuffer*)luaL_testudata(L, Index, LuaBulkBufferMetatableName);
+}
+
+static int LuaBulkBuffer__index(lua_State* L)
+{
+	FLuaAllocator::FBridgeScope BridgeScope(L);
+	FLuaBulkBuffer* Buffer = (FLuaBulkBuffer*)luaL_checkudata(L, 1, LuaBulkBufferMetatableName);
+	if (lua_type(L, 2) == LUA_TSTRING)
+	{
+		const char* Key = lua_tostring(L, 2);
+		if (!FCStringAnsi::Strcmp(Key, "stride"))
+		{
+			lua_pushinteger(L, Buffer->Stride);
+			return 1;
+		}
+		if (!FCStringAnsi::Strcmp(Key, "count"))
+		{
+			lua_pushinteger(L, Buffer->Data.Num() / Buffer->Stride);
+			return 1;
+		}
+		lua_pushnil(L);
+		return 1;
+	}
+
+	// 1-based like Lua arrays
+	const lua_Integer Index = luaL_checkinteger(L, 2) - 1;
+	if (Index < 0 || Index >= Buffer->Data.Num())
+	{
+		lua_pushnil(L);
+		return 1;
+	}
+	lua_pushnumber(L, Buffer->Data[Index]);
+	return 1;
+}
+
+static int LuaBulkBuffer__newindex(lua_State* L)
+{
+	FLuaAllocator::FBridgeScope BridgeScope(L);
+	FLuaBulkBuffer* Buffer = (FLuaBulkBuffer*)luaL_checkudata(L, 1, LuaBulkBufferMetatableName);
+	const lua_Integer Index = luaL_checkinteger(L, 2) - 1;
+	if (Index < 0 || Index >= Buffer->Data.Num())
+	{
+		return luaL_error(L, "bulk buffer index %d out of range (size %d)", (int)(Index + 1), Buffer->Data.Num());
+	}
+	Buffer->Data[Index] = (float)luaL_checknumber(L, 3);
+	return 0;
+}
+
+static int LuaBulkBuffer__len(lua_State* L)
+{
+	FLuaAllocator::FBridgeScope BridgeScope(L);
+	FLuaBulkBuffer* Buffer = (FLuaBulkBuffer*)luaL_checkudata(L, 1, LuaBulkBufferMetatableName);
+	lua_pushinteger(L, Buffer->Data.Num());
+	return 1;
+}
+
+static int LuaBulkBuffer__gc(lua_State* L)
+{
+	FLuaAllocator::FBridgeScope BridgeScope(L);
+	FLuaBulkBuffer* Buffer = (FLuaBulkBuffer*)luaL_checkudata(L, 1, LuaBulkBufferMetatableName);
+	if (FLuaAllocator* Allocator = FLuaAllocator::Get(L))
+	{
+		Allocator->RemoveExternalBytes(Buffer->Data.Num() * sizeof(float));
+	}
+	Buffer->~FLuaBulkBuffer();
+	return 0;
+}
+
+enum class ELuaBulkField : uint8
+{
+	Location,
+	Rotation,
+	Scale,
+	Velocity,
+	Property,
+};
+
+struct FLuaBulkFieldAccessor
+{
+	ELuaBulkField Field;
+	FName PropertyName;
+	int32 Stride;
+
+	// properties are resolved once per class
+	UClass* CachedClass;
+	// values per element of CachedProperty (can differ from Stride, the layout of the buffer)
+	int32 CachedPropertyStride;
+#if ENGINE_MAJOR_VERSION > 4 || ENGINE_MINOR_VERSION >= 25
+	FProperty* CachedProperty;
+#else
+	UProperty* CachedProperty;
+#endif
+
+	FLuaBulkFieldAccessor(const char* FieldName)
+		: Field(ELuaBulkField::Property)
+		, Stride(3)
+		, CachedClass(nullptr)
+		, CachedPropertyStride(0)
+		, CachedProperty(nullptr)
+	{
+		if (!FCStringAnsi::Strcmp(FieldName, "location"))
+		{
+			Field = ELuaBulkField::Location;
+		}
+		else if (!FCStringAnsi::Strcmp(FieldName, "rotation"))
+		{
+			Field = ELuaBulkField::Rotation;
+		}
+		else if (!FCStringAnsi::Strcmp(FieldName, "scale"))
+		{
+			Field = ELuaBulkField::Scale;
+		}
+		else if (!FCStringAnsi::Strcmp(FieldName, "velocity"))
+		{
+			Field = ELuaBulkField::Velocity;
+		}
+		else
+		{
+			PropertyName = FName(UTF8_TO_TCHAR(FieldName));
+			Stride = 0;
+		}
+	}
+
+	static USceneComponent* GetSceneComponent(UObject* Object)
+	{
+		if (AActor* Actor = Cast<AActor>(Object))
+		{
+			return Actor->GetRootComponent();
+		}
+		if (USceneComponent* SceneComponent = Cast<USceneComponent>(Object))
+		{
+			return SceneComponent;
+		}
+		// LuaComponents (and the other non-scene components) use their owner transform
+		if (UActorComponent* ActorComponent = Cast<UActorComponent>(Object))
+		{
+			return ActorComponent->GetOwner() ? ActorComponent->GetOwner()->GetRootComponent() : nullptr;
+		}
+		return nullptr;
+	}
+
+	/* returns the number of values per element of the property (0 if not supported) */
+	int32 ResolveProperty(UObject* Object)
+	{
+		if (Object->GetClass() != CachedClass)
+		{
+			CachedClass = Object->GetClass();
+			CachedPropertyStride = 0;
+			CachedProperty = CachedClass->FindPropertyByName(PropertyName);
+			if (CachedProperty)
+			{
+				CachedPropertyStride = GetPropertyStride(CachedProperty);
+				if (CachedPropertyStride == 0)
+				{
+					CachedProperty = nullptr;
+				}
+			}
+		}
+		return CachedPropertyStride;
+	}
+
+#if ENGINE_MAJOR_VERSION > 4 || ENGINE_MINOR_VERSION >= 25
+	static int32 GetPropertyStride(FProperty* Property)
+	{
+		if (CastField<FFloatProperty>(Property) || CastField<FDoubleProperty>(Property) || CastField<FIntProperty>(Property))
+		{
+			return 1;
+		}
+		FStructProperty* StructProperty = CastField<FStructProperty>(Property);
+#else
+	static int32 GetPropertyStride(UProperty* Property)
+	{
+		if (Cast<UFloatProperty>(Property) || Cast<UDoubleProperty>(Property) || Cast<UIntProperty>(Property))
+		{
+			return 1;
+		}
+		UStructProperty* StructProperty = Cast<UStructProperty>(Property);
+#endif
+		if (StructProperty && (StructProperty->Struct == TBaseStructure<FVector>::Get() || StructProperty->Struct == TBaseStructure<FRotator>::Get()))
+		{
+			return 3;
+		}
+		return 0;
+	}
+
+	void Read(UObject* Object, float* Values)
+	{
+		if (Field != ELuaBulkField::Property)
+		{
+			USceneComponent* SceneComponent = GetSceneComponent(Object);
+			if (!SceneComponent)
+			{
+				return;
+			}
+			FVector Vector = FVector::ZeroVector;
+			switch (Field)
+			{
+			case ELuaBulkField::Location:
+				Vector = SceneComponent->GetComponentLocation();
+				break;
+			case ELuaBulkField::Rotation:
+			{
+				const FRotator Rotator = SceneComponent->GetComponentRotation();
+				Vector = FVector(Rotator.Pitch, Rotator.Yaw, Rotator.Roll);
+			}
+			break;
+			case ELuaBulkField::Scale:
+				Vector = SceneComponent->GetComponentScale();
+				break;
+			case ELuaBulkField::Velocity:
+				Vector = SceneComponent->GetComponentVelocity();
+				break;
+			default:
+				break;
+			}
+			Values[0] = (float)Vector.X;
+			Values[1] = (float)Vector.Y;
+			Values[2] = (float)Vector.Z;
+			return;
+		}
+
+		if (ResolveProperty(Object) != Stride)
+		{
+			return;
+		}
+
+		void* Ptr = CachedProperty->ContainerPtrToValuePtr<void>(Object);
+#if ENGINE_MAJOR_VERSION > 4 || ENGINE_MINOR_VERSION >= 25
+		if (CastField<FFloatProperty>(CachedProperty))
+#else
+		if (Cast<UFloatProperty>(CachedProperty))
+#endif
+		{
+			Values[0] = *(float*)Ptr;
+		}
+#if ENGINE_MAJOR_VERSION > 4 || ENGINE_MINOR_VERSION >= 25
+		else if (CastField<FDoubleProperty>(CachedProperty))
+#else
+		else if (Cast<UDoubleProperty>(CachedProperty))
+#endif
+		{
+			Values[0] = (float)*(double*)Ptr;
+		}
+#if ENGINE_MAJOR_VERSION > 4 || ENGINE_MINOR_VERSION >= 25
+		else if (CastField<FIntProperty>(CachedProperty))
+#else
+		else if (Cast<UIntProperty>(CachedProperty))
+#endif
+		{
+			Values[0] = (float)*(int32*)Ptr;
+		}
+		else if (Stride == 3)
+		{
+#if ENGINE_MAJOR_VERSION > 4 || ENGINE_MINOR_VERSION >= 25
+			if (CastField<FStructProperty>(CachedProperty)->Struct == TBaseStructure<FVector>::Get())
+#else
+			if (Cast<UStructProperty>(CachedProperty)->Struct == TBaseStructure<FVector>::Get())
+#endif
+			{
+				const FVector* Vector = (FVector*)Ptr;
+				Values[0] = (float)Vector->X;
+				Values[1] = (float)Vector->Y;
+				Values[2] = (float)Vector->Z;
+			}
+			else
+			{
+				const FRotator* Rotator = (FRotator*)Ptr;
+				Values[0] = (float)Rotator->Pitch;
+				Values[1] = (float)Rotator->Yaw;
+				Values[2] = (float)Rotator->Roll;
+			}
+		}
+	}
+
+	bool Write(UObject* Object, const float* Values)
+	{
+		if (Field != ELuaBulkField::Property)
+		{
+			USceneComponent* SceneComponent = GetSceneComponent(Object);
+			if (!SceneComponent)
+			{
+				return false;
+			}
+			switch (Field)
+			{
+			case ELuaBulkField::Location:
+				SceneComponent->SetWorldLocation(FVector(Values[0], Values[1], Values[2]));
+				return true;
+			case ELuaBulkField::Rotation:
+				SceneComponent->SetWorldRotation(FRotator(Values[0], Values[1], Values[2]));
+				return true;
+			case ELuaBulkField::Scale:
+				SceneComponent->SetWorldScale3D(FVector(Values[0], Values[1], Values[2]));
+				return true;
+			default:
+				// velocity is read-only
+				break;
+			}
+			return false;
+		}
+
+		if (ResolveProperty(Object) != Stride)
+		{
+			return false;
+		}
+
+		void* Ptr = CachedProperty->ContainerPtrToValuePtr<void>(Object);
+#if ENGINE_MAJOR_VERSION > 4 || ENGINE_MINOR_VERSION >= 25
+		if (CastField<FFloatProperty>(CachedProperty))
+#else
+		if (Cast<UFloatProperty>(CachedProperty))
+#endif
+		{
+			*(float*)Ptr = Values[0];
+		}
+#if ENGINE_MAJOR_VERSION > 4 || ENGINE_MINOR_VERSION >= 25
+		else if (CastField<FDoubleProperty>(CachedProperty))
+#else
+		else if (Cast<UDoubleProperty>(CachedProperty))
+#endif
+		{
+			*(double*)Ptr = Values[0];
+		}
+#if ENGINE_MAJOR_VERSION > 4 || ENGINE_MINOR_VERSION >= 25
+		else if (CastField<FIntProperty>(CachedProperty))
+#else
+		else if (Cast<UIntProperty>(CachedProperty))
+#endif
+		{
+			*(int32*)Ptr = (int32)Values[0];
+		}
+		else if (Stride == 3)
+		{
+#if ENGINE_MAJOR_VERSION > 4 || ENGINE_MINOR_VERSION >= 25
+			if (CastField<FStructProperty>(CachedProperty)->Struct == TBaseStructure<FVector>::Get())
+#else
+			if (Cast<UStructProperty>(CachedProperty)->Struct == TBaseStructure<FVector>::Get())
+#endif
+			{
+				*(FVector*)Ptr = FVector(Values[0], Values[1], Values[2]);
+			}
+			else
+			{
+				*(FRotator*)Ptr = FRotator(Values[0], Values[1], Values[2]);
+			}
+		}
+		return true;
+	}
+};
+
+static UObject* LuaBulkGetObject(lua_State* L, int Index)
+{
+	if (lua_type(L, Index) != LUA_TUSERDATA)
+	{
+		return nullptr;
+	}
+	FLuaUserData* UserData = (FLuaUserData*)lua_touserdata(L, Index);
+	if (UserData->Type != ELuaValueType::UObject)
+	{
+		return nullptr;
+	}
+	return UserData->Context.Get();
+}
+
+static int LuaBulk_new(lua_State* L)
+{
+	FLuaAllocator::FBridgeScope BridgeScope(L);
+	const lua_Integer Num = luaL_checkinteger(L, 1);
+	const lua_Integer Stride = luaL_optinteger(L, 2, 1);
+	luaL_argcheck(L, Num >= 0, 1, "negative count");
+	luaL_argcheck(L, Stride >= 1 && Stride <= FLuaBulkBuffer::MaxStride, 2, "stride out of range");
+	luaL_argcheck(L, Num <= (lua_Integer)(MAX_int32 / sizeof(float)) / Stride, 1, "too many elements");
+	if (!FLuaBulkBuffer::New(L, (int32)Num, (int32)Stride))
+	{
+		return luaL_error(L, "not enough memory for a bulk buffer of %d elements", (int)Num);
+	}
+	return 1;
+}
+
+static int LuaBulk_gather(lua_State* L)
+{
+	FLuaAllocator::FBridgeScope BridgeScope(L);
+	// actors are touched only by the game thread
+	ULuaState* LuaState = ULuaState::GetFromExtraSpace(L);
+	if (LuaState && LuaState->GetLuaThread() && !IsInGameThread())
+	{
+		return LuaState->GetLuaThread()->CallOnGameThread(L, LuaBulk_gather);
+	}
+
+	luaL_checktype(L, 1, LUA_TTABLE);
+	FLuaBulkFieldAccessor Accessor(luaL_checkstring(L, 2));
+
+	const int32 Num = (int32)lua_rawlen(L, 1);
+
+	// the stride of a property is known only after finding it in the first valid object
+	if (Accessor.Field == ELuaBulkField::Property)
+	{
+		for (int32 Index = 1; Index <= Num; Index++)
+		{
+			lua_rawgeti(L, 1, Index);
+			UObject* Object = LuaBulkGetObject(L, -1);
+			lua_pop(L, 1);
+			if (Object)
+			{
+				Accessor.Stride = Accessor.ResolveProperty(Object);
+				if (Accessor.Stride == 0)
+				{
+					return luaL_error(L, "unsupported bulk field \"%s\"", lua_tostring(L, 2));
+				}
+				break;
+			}
+		}
+		if (Accessor.Stride == 0)
+		{
+			Accessor.Stride = 1;
+		}
+	}
+
+	luaL_argcheck(L, Accessor.Stride <= FLuaBulkBuffer::MaxStride && Num <= (int32)(MAX_int32 / sizeof(float)) / Accessor.Stride, 1, "too many objects");
+	FLuaBulkBuffer* Buffer = FLuaBulkBuffer::New(L, Num, Accessor.Stride);
+	if (!Buffer)
+	{
+		return luaL_error(L, "not enough memory for a bulk buffer of %d elements", Num);
+	}
+	float* Values = Buffer->Data.GetData();
+	for (int32 Index = 1; Index <= Num; Index++)
+	{
+		lua_rawgeti(L, 1, Index);
+		if (UObject* Object = LuaBulkGetObject(L, -1))
+		{
+			Accessor.Read(Object, Values);
+		}
+		lua_pop(L, 1);
+		Values += Accessor.Stride;
+	}
+	return 1;
+}
+
+static int LuaBulk_scatter(lua_State* L)
+{
+	FLuaAllocator::FBridgeScope BridgeScope(L);
+	ULuaState* LuaState = ULuaState::GetFromExtraSpace(L);
+	if (LuaState && LuaState->GetLuaThread() && !IsInGameThread())
+	{
+		return LuaState->GetLuaThread()->CallOnGameThread(L, LuaBulk_scatter);
+	}
+
+	FLuaBulkBuffer* Buffer = (FLuaBulkBuffer*)luaL_checkudata(L, 1, LuaBulkBufferMetatableName);
+	luaL_checktype(L, 2, LUA_TTABLE);
+	FLuaBulkFieldAccessor Accessor(luaL_checkstring(L, 3));
+
+	if (Accessor.Field == ELuaBulkField::Property)
+	{
+		Accessor.Stride = Buffer->Stride;
+	}
+	else if (Buffer->Stride != 3)
+	{
+		return luaL_error(L, "bulk field \"%s\" requires a buffer with stride 3", lua_tostring(L, 3));
+	}
+
+	const int32 Num = FMath::Min((int32)lua_rawlen(L, 2), Buffer->Data.Num() / Buffer->Stride);
+	const float* Values = Buffer->Data.GetData();
+	int32 Written = 0;
+	for (int32 Index = 1; Index <= Num; Index++)
+	{
+		lua_rawgeti(L, 2, Index);
+		if (UObject* Object = LuaBulkGetObject(L, -1))
+		{
+			if (Accessor.Write(Object, Values))
+			{
+				Written++;
+			}
+		}
+		lua_pop(L, 1);
+		Values += Buffer->Stride;
+	}
+
+	lua_pushinteger(L, Written);
+	return 1;
+}
+
+int FLuaBulkBuffer::OpenLibrary(lua_State* L)
+{
+	if (luaL_newmetatable(L, LuaBulkBufferMetatableName))
+	{
+		lua_pushcfunction(L, LuaBulkBuffer__index);
+		lua_setfield(L, -2, "__index");
+		lua_pushcfunction(L, LuaBulkBuffer__newindex);
+		lua_setfield(L, -2, "__newindex");
+		lua_pushcfunction(L, LuaBulkBuffer__len);
+		lua_setfield(L, -2, "__len");
+		lua_pushcfunction(L, LuaBulkBuffer__gc);
+		lua_setfield(L, -2, "__gc");
+	}
+	lua_pop(L, 1);
+
+	lua_createtable(L, 0, 3);
+	lua_pushcfunction(L, LuaBulk_new);
+	lua_setfield(L, -2, "new");
+	lua_pushcfunction(L, LuaBulk_gather);
+	lua_setfield(L, -2, "gather");
+	lua_pushcfunction(L, LuaBulk_scatter);
+	lua_setfield(L, -2, "scatter");
+	return 1;
+}
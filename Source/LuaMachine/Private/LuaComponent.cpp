@@ -3,6 +3,7 @@
 #include "LuaComponent.h"
 #include "LuaMachine.h"
 #include "LuaBlueprintFunctionLibrary.h"
+#include "LuaWorldSubsystem.h"
 #include "GameFramework/Actor.h"
 
 
@@ -18,6 +19,9 @@ ULuaComponent::ULuaComponent()
 	bLazy = false;
 	bLogError = false;
 	bImplicitSelf = false;
+	bLuaTick = false;
+	LuaTickFunction = TEXT("tick");
+	LuaTickGroup = TG_PrePhysics;
 }
 
 void ULuaComponent::OnRegister()
@@ -26,13 +30,59 @@ void ULuaComponent::OnRegister()
 
 	if (GetWorld()->IsGameWorld())
 	{
+		ULuaWorldSubsystem* LuaWorldSubsystem = GetWorld()->GetSubsystem<ULuaWorldSubsystem>();
+		if (LuaWorldSubsystem)
+		{
+			LuaWorldSubsystem->RegisterLuaComponent(this);
+		}
+
 		for (const FString& GlobalName : GlobalNames)
 		{
-			ULuaBlueprintFunctionLibrary::LuaSetGlobal(GetWorld(), LuaState, GlobalName, FLuaValue(this));
+			if (!LuaWorldSubsystem || !LuaWorldSubsystem->RegisterLuaGlobalName(LuaState, GlobalName, this))
+			{
+				ULuaBlueprintFunctionLibrary::LuaSetGlobal(GetWorld(), LuaState, GlobalName, FLuaValue(this));
+			}
 		}
 	}
 }
 
+void ULuaComponent::UnregisterLuaGlobalNames()
+{
+	UWorld* World = GetWorld();
+	if (!World)
+		return;
+
+	if (ULuaWorldSubsystem* LuaWorldSubsystem = World->GetSubsystem<ULuaWorldSubsystem>())
+	{
+		for (const FString& GlobalName : GlobalNames)
+		{
+			LuaWorldSubsystem->UnregisterLuaGlobalName(LuaState, GlobalName, this);
+		}
+	}
+}
+
+void ULuaComponent::OnUnregister()
+{
+	UWorld* World = GetWorld();
+	if (World && World->IsGameWorld())
+	{
+		if (ULuaWorldSubsystem* LuaWorldSubsystem = World->GetSubsystem<ULuaWorldSubsystem>())
+		{
+			LuaWorldSubsystem->UnregisterLuaComponent(this);
+		}
+
+		UnregisterLuaGlobalNames();
+
+		// do not spawn a state just for releasing the cached userdata
+		if (ULuaState* L = FLuaMachineModule::Get().GetLuaState(LuaState, World, true))
+		{
+			L->ReleaseCachedUObject(this);
+		}
+	}
+
+	Super::OnUnregister();
+}
+
 // Called when the game starts
 void ULuaComponent::BeginPlay()
 {
@@ -41,8 +91,28 @@ void ULuaComponent::BeginPlay()
 	if (!bLazy)
 		FLuaMachineModule::Get().GetLuaState(LuaState, GetWorld());
 
-	// ...
+	if (bLuaTick)
+	{
+		if (ULuaWorldSubsystem* LuaWorldSubsystem = GetWorld()->GetSubsystem<ULuaWorldSubsystem>())
+		{
+			LuaWorldSubsystem->RegisterTickingComponent(this);
+		}
+	}
+}
+
+void ULuaComponent::EndPlay(const EEndPlayReason::Type EndPlayReason)
+{
+	if (bLuaTick)
+	{
+		if (ULuaWorldSubsystem* LuaWorldSubsystem = GetWorld()->GetSubsystem<ULuaWorldSubsystem>())
+		{
+			LuaWorldSubsystem->UnregisterTickingComponent(this);
+		}
+	}
+
+	UnregisterLuaGlobalNames();
 
+	Super::EndPlay(EndPlayReason);
 }
 
 // Called every frame
@@ -58,6 +128,55 @@ ULuaState* ULuaComponent::LuaComponentGetState()
 	return FLuaMachineModule::Get().GetLuaState(LuaState, GetWorld());
 }
 
+TMap<FString, FLuaValue> ULuaComponent::LuaGetTable() const
+{
+	ULuaState* L = LuaInstanceTable.LuaState.Get();
+	if (!L)
+	{
+		return Table;
+	}
+
+	FLuaStateOwnershipScope OwnershipScope(L);
+	TMap<FString, FLuaValue> Fields;
+	// the instance table is only read
+	if (!L->GetInstanceTableFields(const_cast<ULuaComponent*>(this), Fields))
+	{
+		return Table;
+	}
+	return Fields;
+}
+
+void ULuaComponent::LuaSetTable(const TMap<FString, FLuaValue>& NewTable)
+{
+	Table = NewTable;
+	LuaReloadTable();
+}
+
+void ULuaComponent::LuaSetMetatable(const TMap<FString, FLuaValue>& NewMetatable)
+{
+	Metatable = NewMetatable;
+	// rebuilt at the next push (the cached userdata of the state are updated too)
+	LuaUserDataMetatable = FLuaValue();
+}
+
+void ULuaComponent::LuaSyncTable()
+{
+	if (ULuaState* L = LuaInstanceTable.LuaState.Get())
+	{
+		FLuaStateOwnershipScope OwnershipScope(L);
+		L->SyncInstanceTable(this);
+	}
+}
+
+void ULuaComponent::LuaReloadTable()
+{
+	if (ULuaState* L = LuaInstanceTable.LuaState.Get())
+	{
+		FLuaStateOwnershipScope OwnershipScope(L);
+		L->ReloadInstanceTable(this);
+	}
+}
+
 FLuaValue ULuaComponent::LuaGetField(const FString& Name)
 {
 	FLuaValue ReturnValue;
@@ -65,6 +184,8 @@ FLuaValue ULuaComponent::LuaGetField(const FString& Name)
 	if (!L)
 		return ReturnValue;
 
+	FLuaStateOwnershipScope OwnershipScope(L);
+
 	// push component pointer as userdata
 	L->NewUObject(this, nullptr);
 	L->SetupAndAssignUserDataMetatable(this, Metatable, nullptr);
@@ -84,6 +205,8 @@ void ULuaComponent::LuaSetField(const FString& Name, FLuaValue Value)
 	if (!L)
 		return;
 
+	FLuaStateOwnershipScope OwnershipScope(L);
+
 	// push component pointer as userdata
 	L->NewUObject(this, nullptr);
 	L->SetupAndAssignUserDataMetatable(this, Metatable, nullptr);
@@ -103,6 +226,8 @@ FLuaValue ULuaComponent::LuaCallFunction(const FString& Name, TArray<FLuaValue>
 	if (!L)
 		return ReturnValue;
 
+	FLuaStateOwnershipScope OwnershipScope(L);
+
 	// push component pointer as userdata
 	L->NewUObject(this, nullptr);
 	L->SetupAndAssignUserDataMetatable(this, Metatable, nullptr);
@@ -142,12 +267,13 @@ TArray<FLuaValue> ULuaComponent::LuaCallFunctionMulti(FString Name, TArray<FLuaV
 	if (!L)
 		return ReturnValue;
 
+	FLuaStateOwnershipScope OwnershipScope(L);
+
 	// push component pointer as userdata
 	L->NewUObject(this, nullptr);
 	L->SetupAndAssignUserDataMetatable(this, Metatable, nullptr);
 
 	int32 ItemsToPop = L->GetFieldFromTree(Name, bGlobal);
-	int32 StackTop = L->GetTop();
 
 	// first argument (self/actor)
 	L->PushValue(-(ItemsToPop + 1));
@@ -158,31 +284,25 @@ TArray<FLuaValue> ULuaComponent::LuaCallFunctionMulti(FString Name, TArray<FLuaV
 		NArgs++;
 	}
 
-	FLuaValue LastReturnValue;
-	if (!L->PCall(NArgs, LastReturnValue, LUA_MULTRET))
 	{
-		if (L->InceptionLevel == 0)
+		FLuaCallResult CallResult = L->PCallMulti(NArgs);
+		if (!CallResult.Succeeded())
 		{
-			if (bLogError)
-				L->LogError(L->LastError);
-			OnLuaError.Broadcast(L->LastError);
-		}
-	}
-	else
-	{
-		int32 NumOfReturnValues = (L->GetTop() - StackTop) + 1;
-		if (NumOfReturnValues > 0)
-		{
-			for (int32 i = -1; i >= -(NumOfReturnValues); i--)
+			if (L->InceptionLevel == 0)
 			{
-				ReturnValue.Insert(L->ToLuaValue(i), 0);
+				if (bLogError)
+					L->LogError(L->LastError);
+				OnLuaError.Broadcast(L->LastError);
 			}
-			L->Pop(NumOfReturnValues - 1);
+		}
+		else
+		{
+			CallResult.AppendTo(ReturnValue);
 		}
 	}
 
-	// the return value and the function has been removed, so we do not need to change ItemsToPop
-	L->Pop(ItemsToPop + 1);
+	// the function slot has been popped by the call result
+	L->Pop(ItemsToPop);
 
 	return ReturnValue;
 }
@@ -195,6 +315,8 @@ FLuaValue ULuaComponent::LuaCallValue(FLuaValue Value, TArray<FLuaValue> Args)
 	if (!L)
 		return ReturnValue;
 
+	FLuaStateOwnershipScope OwnershipScope(L);
+
 	// push function
 	L->FromLuaValue(Value);
 	// push component pointer as userdata
@@ -276,9 +398,10 @@ TArray<FLuaValue> ULuaComponent::LuaCallValueMulti(FLuaValue Value, TArray<FLuaV
 	if (!L)
 		return ReturnValue;
 
+	FLuaStateOwnershipScope OwnershipScope(L);
+
 	// push function
 	L->FromLuaValue(Value);
-	int32 StackTop = L->GetTop();
 
 	// push component pointer as userdata
 	L->NewUObject(this, nullptr);
@@ -291,8 +414,8 @@ TArray<FLuaValue> ULuaComponent::LuaCallValueMulti(FLuaValue Value, TArray<FLuaV
 		NArgs++;
 	}
 
-	FLuaValue LastReturnValue;
-	if (!L->PCall(NArgs, LastReturnValue, LUA_MULTRET))
+	FLuaCallResult CallResult = L->PCallMulti(NArgs);
+	if (!CallResult.Succeeded())
 	{
 		if (L->InceptionLevel == 0)
 		{
@@ -303,19 +426,9 @@ TArray<FLuaValue> ULuaComponent::LuaCallValueMulti(FLuaValue Value, TArray<FLuaV
 	}
 	else
 	{
-		int32 NumOfReturnValues = (L->GetTop() - StackTop) + 1;
-		if (NumOfReturnValues > 0)
-		{
-			for (int32 i = -1; i >= -(NumOfReturnValues); i--)
-			{
-				ReturnValue.Insert(L->ToLuaValue(i), 0);
-			}
-			L->Pop(NumOfReturnValues - 1);
-		}
+		CallResult.AppendTo(ReturnValue);
 	}
 
-	L->Pop();
-
 	return ReturnValue;
 }
 
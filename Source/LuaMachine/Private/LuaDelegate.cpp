@@ -3,6 +3,7 @@
 
 #include "LuaDelegate.h"
 #include "LuaBlueprintFunctionLibrary.h"
+#include "UObject/StructOnScope.h"
 
 void ULuaDelegate::LuaDelegateFunction()
 {
@@ -15,26 +16,59 @@ void ULuaDelegate::SetupLuaDelegate(UFunction* InSignature, ULuaState* InLuaStat
 	LuaValue = InLuaValue;
 }
 
+static void LuaDelegateCall(ULuaState* L, FLuaValue& LuaValue, UFunction* Signature, void* Parms)
+{
+	// arguments go straight to the Lua stack, no intermediate array
+	L->FromLuaValue(LuaValue);
+	int NArgs = 0;
+#if  ENGINE_MAJOR_VERSION > 4 ||ENGINE_MINOR_VERSION >= 25
+	for (TFieldIterator<FProperty> It(Signature); (It && (It->PropertyFlags & (CPF_Parm | CPF_ReturnParm)) == CPF_Parm); ++It)
+	{
+		FProperty* Prop = *It;
+#else
+	for (TFieldIterator<UProperty> It(Signature); (It && (It->PropertyFlags & (CPF_Parm | CPF_ReturnParm)) == CPF_Parm); ++It)
+	{
+		UProperty* Prop = *It;
+#endif
+		bool bPropSuccess = false;
+		FLuaValue Arg = L->FromProperty(Parms, Prop, bPropSuccess, 0);
+		L->FromLuaValue(Arg);
+		NArgs++;
+	}
+
+	FLuaValue ReturnValue;
+	L->PCall(NArgs, ReturnValue);
+	L->Pop();
+}
+
 void ULuaDelegate::ProcessEvent(UFunction* Function, void* Parms)
 {
-	if (!LuaState.IsValid())
+	ULuaState* L = LuaState.Get();
+	if (!L || !L->GetInternalLuaState())
+	{
+		return;
+	}
+
+	FLuaStateThread* LuaThread = L->GetLuaThread();
+	if (!LuaThread || LuaThread->IsOwnedByCurrentThread())
 	{
+		LuaDelegateCall(L, LuaValue, LuaDelegateSignature, Parms);
 		return;
 	}
 
-	TArray<FLuaValue> LuaArgs;
+	// queued to the dedicated thread of the state, with a copy of the arguments
+	TSharedPtr<FStructOnScope> ParmsCopy = MakeShared<FStructOnScope>(LuaDelegateSignature);
 #if  ENGINE_MAJOR_VERSION > 4 ||ENGINE_MINOR_VERSION >= 25
 	for (TFieldIterator<FProperty> It(LuaDelegateSignature); (It && (It->PropertyFlags & (CPF_Parm | CPF_ReturnParm)) == CPF_Parm); ++It)
-	{
-		FProperty* Prop = *It;
 #else
 	for (TFieldIterator<UProperty> It(LuaDelegateSignature); (It && (It->PropertyFlags & (CPF_Parm | CPF_ReturnParm)) == CPF_Parm); ++It)
-	{
-		UProperty* Prop = *It;
 #endif
-		bool bPropSuccess = false;
-		LuaArgs.Add(LuaState->FromProperty(Parms, Prop, bPropSuccess, 0));
+	{
+		It->CopyCompleteValue_InContainer(ParmsCopy->GetStructMemory(), Parms);
 	}
 
-	ULuaBlueprintFunctionLibrary::LuaGlobalCallValue(LuaState->GetWorld(), LuaState->GetClass(), LuaValue, LuaArgs);
+	LuaThread->Enqueue([L, Value = LuaValue, Signature = LuaDelegateSignature, ParmsCopy]() mutable
+		{
+			LuaDelegateCall(L, Value, Signature, ParmsCopy->GetStructMemory());
+		});
 }
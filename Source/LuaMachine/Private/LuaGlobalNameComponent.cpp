@@ -2,6 +2,7 @@
 
 #include "LuaGlobalNameComponent.h"
 #include "LuaBlueprintFunctionLibrary.h"
+#include "LuaWorldSubsystem.h"
 
 // Sets default values for this component's properties
 ULuaGlobalNameComponent::ULuaGlobalNameComponent()
@@ -19,7 +20,37 @@ void ULuaGlobalNameComponent::OnRegister()
 
 	if (GetWorld()->IsGameWorld() && !LuaGlobalName.IsEmpty())
 	{
-		ULuaBlueprintFunctionLibrary::LuaSetGlobal(GetWorld(), LuaState, LuaGlobalName, FLuaValue(GetOwner()));
+		ULuaWorldSubsystem* LuaWorldSubsystem = GetWorld()->GetSubsystem<ULuaWorldSubsystem>();
+		if (!LuaWorldSubsystem || !LuaWorldSubsystem->RegisterLuaGlobalName(LuaState, LuaGlobalName, GetOwner()))
+		{
+			ULuaBlueprintFunctionLibrary::LuaSetGlobal(GetWorld(), LuaState, LuaGlobalName, FLuaValue(GetOwner()));
+		}
+	}
+}
+
+void ULuaGlobalNameComponent::OnUnregister()
+{
+	UnregisterLuaGlobalName();
+
+	Super::OnUnregister();
+}
+
+void ULuaGlobalNameComponent::EndPlay(const EEndPlayReason::Type EndPlayReason)
+{
+	UnregisterLuaGlobalName();
+
+	Super::EndPlay(EndPlayReason);
+}
+
+void ULuaGlobalNameComponent::UnregisterLuaGlobalName()
+{
+	UWorld* World = GetWorld();
+	if (!World || LuaGlobalName.IsEmpty())
+		return;
+
+	if (ULuaWorldSubsystem* LuaWorldSubsystem = World->GetSubsystem<ULuaWorldSubsystem>())
+	{
+		LuaWorldSubsystem->UnregisterLuaGlobalName(LuaState, LuaGlobalName, GetOwner());
 	}
 }
 
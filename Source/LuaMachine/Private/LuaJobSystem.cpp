@@ -0,0 +1,509 @@
+// Copyright 2018-2023 - Roberto De Ioris
+
+#include "LuaJobSystem.h"
+#include "LuaState.h"
+#include "HAL/RunnableThread.h"
+#include "HAL/Event.h"
+
+// instructions between two checks of the stopping job system
+#define LUAMACHINE_JOB_CANCEL_HOOK_COUNT 10000
+
+static int LuaJobWorkerPanic(lua_State* L)
+{
+	UE_LOG(LogLuaMachine, Fatal, TEXT("Lua panic in job worker: %s"), ANSI_TO_TCHAR(lua_tostring(L, -1)));
+	return 0;
+}
+
+// long (or endless) jobs would block the shutdown of the job system, they are interrupted with an error
+static void LuaJobCancelHook(lua_State* L, lua_Debug* Debug)
+{
+	const FLuaJobSystem* JobSystem = *(FLuaJobSystem**)lua_getextraspace(L);
+	if (JobSystem && JobSystem->IsStopping())
+	{
+		luaL_error(L, "job system stopped");
+	}
+}
+
+static bool LuaJobValueFromLua(lua_State* L, int Index, FLuaJobValue& Value, FString& Error, TArray<const void*>& Tables)
+{
+	Index = lua_absindex(L, Index);
+	switch (lua_type(L, Index))
+	{
+	case LUA_TNIL:
+		Value.Type = ELuaJobValueType::Nil;
+		return true;
+	case LUA_TBOOLEAN:
+		Value.Type = ELuaJobValueType::Bool;
+		Value.Bool = lua_toboolean(L, Index) != 0;
+		return true;
+	case LUA_TNUMBER:
+		if (lua_isinteger(L, Index))
+		{
+			Value.Type = ELuaJobValueType::Integer;
+			Value.Integer = lua_tointeger(L, Index);
+		}
+		else
+		{
+			Value.Type = ELuaJobValueType::Number;
+			Value.Number = lua_tonumber(L, Index);
+		}
+		return true;
+	case LUA_TSTRING:
+	{
+		size_t Length = 0;
+		const char* String = lua_tolstring(L, Index, &Length);
+		Value.Type = ELuaJobValueType::String;
+		Value.String.Append((const uint8*)String, Length);
+	}
+	return true;
+	case LUA_TTABLE:
+	{
+		// shared subtables are copied, cycles are not supported
+		const void* Pointer = lua_topointer(L, Index);
+		if (Tables.Contains(Pointer))
+		{
+			Error = TEXT("cyclic tables cannot be passed to jobs");
+			return false;
+		}
+		Tables.Push(Pointer);
+		luaL_checkstack(L, 4, nullptr);
+
+		Value.Type = ELuaJobValueType::Table;
+		lua_pushnil(L);
+		while (lua_next(L, Index) != 0)
+		{
+			FLuaJobValue& Key = Value.Keys.AddDefaulted_GetRef();
+			FLuaJobValue& FieldValue = Value.Values.AddDefaulted_GetRef();
+			if (!LuaJobValueFromLua(L, -2, Key, Error, Tables) || !LuaJobValueFromLua(L, -1, FieldValue, Error, Tables))
+			{
+				lua_pop(L, 2);
+				return false;
+			}
+			lua_pop(L, 1);
+		}
+		Tables.Pop();
+	}
+	return true;
+	default:
+		Error = FString::Printf(TEXT("values of type %s cannot be passed to jobs"), ANSI_TO_TCHAR(luaL_typename(L, Index)));
+		return false;
+	}
+}
+
+bool FLuaJobValue::FromLua(lua_State* L, int Index, FLuaJobValue& Value, FString& Error)
+{
+	TArray<const void*> Tables;
+	return LuaJobValueFromLua(L, Index, Value, Error, Tables);
+}
+
+void FLuaJobValue::ToLua(lua_State* L) const
+{
+	switch (Type)
+	{
+	case ELuaJobValueType::Bool:
+		lua_pushboolean(L, Bool ? 1 : 0);
+		break;
+	case ELuaJobValueType::Integer:
+		lua_pushinteger(L, Integer);
+		break;
+	case ELuaJobValueType::Number:
+		lua_pushnumber(L, Number);
+		break;
+	case ELuaJobValueType::String:
+		lua_pushlstring(L, (const char*)String.GetData(), String.Num());
+		break;
+	case ELuaJobValueType::Table:
+		luaL_checkstack(L, 4, nullptr);
+		lua_createtable(L, 0, Keys.Num());
+		for (int32 FieldIndex = 0; FieldIndex < Keys.Num(); FieldIndex++)
+		{
+			Keys[FieldIndex].ToLua(L);
+			Values[FieldIndex].ToLua(L);
+			lua_rawset(L, -3);
+		}
+		break;
+	default:
+		lua_pushnil(L);
+		break;
+	}
+}
+
+FLuaJobSystem::FWorker::FWorker(FLuaJobSystem* InJobSystem) : JobSystem(InJobSystem), Thread(nullptr)
+{
+	WakeUp = FPlatformProcess::GetSynchEventFromPool(false);
+}
+
+FLuaJobSystem::FWorker::~FWorker()
+{
+	FPlatformProcess::ReturnSynchEventToPool(WakeUp);
+}
+
+uint32 FLuaJobSystem::FWorker::Run()
+{
+	// the worker VM never touches UObjects, plain FMemory allocations are enough
+	lua_State* L = lua_newstate(FLuaAllocator::AllocFMemory, nullptr);
+	if (!L)
+	{
+		return 1;
+	}
+	lua_atpanic(L, LuaJobWorkerPanic);
+	// the hook is inherited by the coroutines created by the jobs
+	*(FLuaJobSystem**)lua_getextraspace(L) = JobSystem;
+	lua_sethook(L, LuaJobCancelHook, LUA_MASKCOUNT, LUAMACHINE_JOB_CANCEL_HOOK_COUNT);
+	luaL_openlibs(L);
+
+	for (const TPair<FString, TArray<uint8>>& Chunk : JobSystem->Code)
+	{
+		if (luaL_loadbuffer(L, (const char*)Chunk.Value.GetData(), Chunk.Value.Num(), TCHAR_TO_ANSI(*(FString("@") + Chunk.Key))) || lua_pcall(L, 0, 0, 0))
+		{
+			UE_LOG(LogLuaMachine, Error, TEXT("Lua job worker error: %s"), ANSI_TO_TCHAR(lua_tostring(L, -1)));
+			lua_pop(L, 1);
+		}
+	}
+
+	while (!JobSystem->bStopping)
+	{
+		TSharedPtr<FLuaJob> Job = JobSystem->PopJob();
+		if (!Job.IsValid())
+		{
+			WakeUp->Wait();
+			continue;
+		}
+
+		JobSystem->RunJob(L, *Job);
+		// the game thread can drain it only after the promise is set (the job system could be stopping)
+		Job->Promise.SetValue();
+		JobSystem->CompletedJobs.Enqueue(Job);
+	}
+
+	lua_close(L);
+	return 0;
+}
+
+void FLuaJobSystem::FWorker::Stop()
+{
+	WakeUp->Trigger();
+}
+
+FLuaJobSystem::FLuaJobSystem(const int32 NumWorkers, const TArray<TPair<FString, TArray<uint8>>>& InCode)
+	: Code(InCode)
+{
+	const int32 MaxWorkers = FMath::Max(FPlatformMisc::NumberOfCoresIncludingHyperthreads() - 1, 1);
+	for (int32 WorkerIndex = 0; WorkerIndex < FMath::Clamp(NumWorkers, 1, MaxWorkers); WorkerIndex++)
+	{
+		FWorker* Worker = new FWorker(this);
+		Worker->Thread = FRunnableThread::Create(Worker, *FString::Printf(TEXT("LuaJobWorker%d"), WorkerIndex));
+		if (!Worker->Thread)
+		{
+			delete Worker;
+			continue;
+		}
+		Workers.Add(Worker);
+	}
+}
+
+FLuaJobSystem::~FLuaJobSystem()
+{
+	bStopping = true;
+	for (FWorker* Worker : Workers)
+	{
+		Worker->WakeUp->Trigger();
+	}
+
+	for (FWorker* Worker : Workers)
+	{
+		Worker->Thread->WaitForCompletion();
+		delete Worker->Thread;
+		delete Worker;
+	}
+
+	// nobody will run them
+	for (TSharedPtr<FLuaJob>& Job : PendingJobs)
+	{
+		Job->Error = TEXT("job system stopped");
+		Job->Promise.SetValue();
+		CompletedJobs.Enqueue(Job);
+	}
+	PendingJobs.Empty();
+
+	// the owners are still waiting for the results of the completed and cancelled jobs
+	DrainCompletedJobs();
+}
+
+TSharedRef<FLuaJob> FLuaJobSystem::Dispatch(const FString& Function, TArray<FLuaJobValue> Args, TFunction<void(const FLuaJob&)> OnCompleted)
+{
+	TSharedRef<FLuaJob> Job = MakeShared<FLuaJob>();
+	Job->Function = Function;
+	Job->Args = MoveTemp(Args);
+	Job->OnCompleted = MoveTemp(OnCompleted);
+	Job->Future = Job->Promise.GetFuture().Share();
+
+	if (Workers.Num() == 0)
+	{
+		Job->Error = TEXT("no job workers available");
+		Job->Promise.SetValue();
+		CompletedJobs.Enqueue(Job);
+		return Job;
+	}
+
+	{
+		FScopeLock Lock(&PendingJobsLock);
+		PendingJobs.Add(Job);
+	}
+
+	// the first idle worker gets it, the others go back to sleep
+	for (FWorker* Worker : Workers)
+	{
+		Worker->WakeUp->Trigger();
+	}
+
+	return Job;
+}
+
+TSharedPtr<FLuaJob> FLuaJobSystem::PopJob()
+{
+	FScopeLock Lock(&PendingJobsLock);
+	if (PendingJobs.Num() == 0)
+	{
+		return nullptr;
+	}
+	TSharedPtr<FLuaJob> Job = PendingJobs[0];
+	PendingJobs.RemoveAt(0, 1, false);
+	return Job;
+}
+
+// the job entry (a light userdata), every step can raise an error (a missing function, memory errors, unsupported results)
+static int LuaJobRun(lua_State* L)
+{
+	FLuaJob& Job = *(FLuaJob*)lua_touserdata(L, 1);
+	lua_settop(L, 0);
+
+	lua_getglobal(L, TCHAR_TO_UTF8(*Job.Function));
+	if (!lua_isfunction(L, -1))
+	{
+		lua_pushfstring(L, "unknown job function %s", TCHAR_TO_UTF8(*Job.Function));
+		return lua_error(L);
+	}
+
+	luaL_checkstack(L, Job.Args.Num(), nullptr);
+	for (const FLuaJobValue& Arg : Job.Args)
+	{
+		Arg.ToLua(L);
+	}
+
+	lua_call(L, Job.Args.Num(), LUA_MULTRET);
+
+	const int NumResults = lua_gettop(L);
+	Job.Results.SetNum(NumResults);
+	for (int Index = 1; Index <= NumResults; Index++)
+	{
+		if (!FLuaJobValue::FromLua(L, Index, Job.Results[Index - 1], Job.Error))
+		{
+			lua_pushstring(L, TCHAR_TO_UTF8(*Job.Error));
+			return lua_error(L);
+		}
+	}
+
+	Job.bSuccess = true;
+	return 0;
+}
+
+void FLuaJobSystem::RunJob(lua_State* L, FLuaJob& Job)
+{
+	lua_settop(L, 0);
+
+	lua_pushcfunction(L, LuaJobRun);
+	lua_pushlightuserdata(L, &Job);
+	if (lua_pcall(L, 1, 0, 0))
+	{
+		const char* Error = lua_tostring(L, -1);
+		Job.Error = Error ? UTF8_TO_TCHAR(Error) : TEXT("unknown error");
+		Job.Results.Empty();
+		Job.bSuccess = false;
+	}
+
+	lua_settop(L, 0);
+}
+
+void FLuaJobSystem::DrainCompletedJobs()
+{
+	TSharedPtr<FLuaJob> Job;
+	while (CompletedJobs.Dequeue(Job))
+	{
+		if (Job->OnCompleted)
+		{
+			Job->OnCompleted(*Job);
+		}
+	}
+}
+
+static FLuaJobSystem* LuaGetJobSystem(lua_State* L)
+{
+	ULuaState* LuaState = ULuaState::GetFromExtraSpace(L);
+	FLuaJobSystem* LuaJobSystem = LuaState ? LuaState->GetLuaJobSystem() : nullptr;
+	if (!LuaJobSystem)
+	{
+		luaL_error(L, "the job system is not enabled for this state (LuaJobWorkers)");
+	}
+	return LuaJobSystem;
+}
+
+static const char* LuaJobHandleMetatableName = "LuaMachine.JobHandle";
+
+/* the userdata returned by job.dispatch (the job is released once its result is delivered) */
+struct FLuaJobHandle
+{
+	// like FLuaBulkBuffer, the userdata readers of ULuaState check the type first
+	ELuaValueType Type;
+
+	TSharedPtr<FLuaJob> Job;
+
+	FLuaJobHandle() : Type(ELuaValueType::Nil)
+	{
+	}
+};
+
+static int LuaJobHandle__gc(lua_State* L)
+{
+	FLuaJobHandle* Handle = (FLuaJobHandle*)luaL_checkudata(L, 1, LuaJobHandleMetatableName);
+	Handle->~FLuaJobHandle();
+	return 0;
+}
+
+static FLuaJobHandle* LuaCheckJobHandle(lua_State* L, int Index)
+{
+	FLuaJobHandle* Handle = (FLuaJobHandle*)luaL_checkudata(L, Index, LuaJobHandleMetatableName);
+	if (!Handle->Job.IsValid())
+	{
+		luaL_error(L, "invalid job handle (the result has already been delivered)");
+	}
+	return Handle;
+}
+
+// nil while running, then true and the results or false and the error
+static int LuaJobPushResult(lua_State* L, FLuaJobHandle* Handle)
+{
+	if (!Handle->Job->Future.IsReady())
+	{
+		lua_pushnil(L);
+		return 1;
+	}
+
+	// the handle is released once the result is delivered
+	TSharedPtr<FLuaJob> CompletedJob = Handle->Job;
+	Handle->Job.Reset();
+
+	if (!CompletedJob->bSuccess)
+	{
+		lua_pushboolean(L, 0);
+		lua_pushstring(L, TCHAR_TO_UTF8(*CompletedJob->Error));
+		return 2;
+	}
+
+	luaL_checkstack(L, CompletedJob->Results.Num() + 1, nullptr);
+	lua_pushboolean(L, 1);
+	for (const FLuaJobValue& Result : CompletedJob->Results)
+	{
+		Result.ToLua(L);
+	}
+	return CompletedJob->Results.Num() + 1;
+}
+
+static int LuaJob_dispatch(lua_State* L)
+{
+	FLuaJobSystem* LuaJobSystem = LuaGetJobSystem(L);
+	const char* Function = luaL_checkstring(L, 1);
+
+	// the error is raised once the arguments are gone (lua_error would skip their destructors)
+	bool bInvalidArgs = false;
+	{
+		FLuaAllocator::FBridgeScope BridgeScope(L);
+		TArray<FLuaJobValue> Args;
+		const int NumArgs = lua_gettop(L) - 1;
+		Args.SetNum(NumArgs);
+		for (int Index = 0; Index < NumArgs; Index++)
+		{
+			FString Error;
+			if (!FLuaJobValue::FromLua(L, Index + 2, Args[Index], Error))
+			{
+				luaL_where(L, 1);
+				lua_pushfstring(L, "argument %d: %s", Index + 2, TCHAR_TO_UTF8(*Error));
+				lua_concat(L, 2);
+				bInvalidArgs = true;
+				break;
+			}
+		}
+
+		if (!bInvalidArgs)
+		{
+			// allocated before dispatching, a memory error would lose the job
+			FLuaJobHandle* Handle = new (lua_newuserdata(L, sizeof(FLuaJobHandle))) FLuaJobHandle();
+			luaL_setmetatable(L, LuaJobHandleMetatableName);
+			Handle->Job = LuaJobSystem->Dispatch(UTF8_TO_TCHAR(Function), MoveTemp(Args));
+		}
+	}
+
+	if (bInvalidArgs)
+	{
+		return lua_error(L);
+	}
+	return 1;
+}
+
+static int LuaJob_done(lua_State* L)
+{
+	FLuaAllocator::FBridgeScope BridgeScope(L);
+	FLuaJobHandle* Handle = LuaCheckJobHandle(L, 1);
+	lua_pushboolean(L, Handle->Job->Future.IsReady() ? 1 : 0);
+	return 1;
+}
+
+static int LuaJob_result(lua_State* L)
+{
+	FLuaAllocator::FBridgeScope BridgeScope(L);
+	return LuaJobPushResult(L, LuaCheckJobHandle(L, 1));
+}
+
+static int LuaJob_awaitk(lua_State* L, int Status, lua_KContext Context)
+{
+	// the handle is still the first argument when the coroutine is resumed (and it is kept alive by the stack)
+	FLuaJobHandle* Handle = LuaCheckJobHandle(L, 1);
+	if (!Handle->Job->Future.IsReady())
+	{
+		// whoever resumes the coroutine will find it still waiting
+		return lua_yieldk(L, 0, Context, LuaJob_awaitk);
+	}
+	return LuaJobPushResult(L, Handle);
+}
+
+static int LuaJob_await(lua_State* L)
+{
+	FLuaAllocator::FBridgeScope BridgeScope(L);
+	LuaCheckJobHandle(L, 1);
+	if (!lua_isyieldable(L))
+	{
+		return luaL_error(L, "job.await can only be used in a coroutine (use job.done and job.result)");
+	}
+	return LuaJob_awaitk(L, LUA_OK, 0);
+}
+
+int FLuaJobSystem::OpenLibrary(lua_State* L)
+{
+	if (luaL_newmetatable(L, LuaJobHandleMetatableName))
+	{
+		lua_pushcfunction(L, LuaJobHandle__gc);
+		lua_setfield(L, -2, "__gc");
+	}
+	lua_pop(L, 1);
+
+	lua_createtable(L, 0, 4);
+	lua_pushcfunction(L, LuaJob_dispatch);
+	lua_setfield(L, -2, "dispatch");
+	lua_pushcfunction(L, LuaJob_done);
+	lua_setfield(L, -2, "done");
+	lua_pushcfunction(L, LuaJob_result);
+	lua_setfield(L, -2, "result");
+	lua_pushcfunction(L, LuaJob_await);
+	lua_setfield(L, -2, "await");
+	return 1;
+}
@@ -1,7 +1,9 @@
 // Copyright 2018-2023 - Roberto De Ioris
 
 #include "LuaMachine.h"
+#include "LuaStateSnapshot.h"
 #include "LuaBlueprintFunctionLibrary.h"
+#include "Misc/CoreDelegates.h"
 #if WITH_EDITOR
 #include "Editor/UnrealEd/Public/Editor.h"
 #include "Editor/PropertyEditor/Public/PropertyEditorModule.h"
@@ -27,6 +29,26 @@ void FLuaMachineModule::StartupModule()
 	FWorldDelegates::LevelAddedToWorld.AddRaw(this, &FLuaMachineModule::LuaLevelAddedToWorld);
 	FWorldDelegates::LevelRemovedFromWorld.AddRaw(this, &FLuaMachineModule::LuaLevelRemovedFromWorld);
 
+	// deferred work of the states (outside of any Lua call)
+	FCoreDelegates::OnEndFrame.AddRaw(this, &FLuaMachineModule::LuaEndFrame);
+
+	// the dynamic state pools are refilled in the game tick
+#if ENGINE_MAJOR_VERSION > 4
+	LuaPoolTickHandle = FTSTicker::GetCoreTicker().AddTicker(FTickerDelegate::CreateRaw(this, &FLuaMachineModule::LuaPoolTick));
+#else
+	LuaPoolTickHandle = FTicker::GetCoreTicker().AddTicker(FTickerDelegate::CreateRaw(this, &FLuaMachineModule::LuaPoolTick));
+#endif
+
+	// give memory back when the engine is running low
+	FCoreDelegates::GetMemoryTrimDelegate().AddRaw(this, &FLuaMachineModule::LuaMemoryTrim);
+	FCoreDelegates::GetOutOfMemoryDelegate().AddRaw(this, &FLuaMachineModule::LuaMemoryTrim);
+
+	// the loading screen is a good time for full collections
+	FCoreUObjectDelegates::PreLoadMap.AddRaw(this, &FLuaMachineModule::LuaPreLoadMap);
+
+	// pooled dynamic states are bound to the world they have been initialized for
+	FWorldDelegates::OnWorldCleanup.AddRaw(this, &FLuaMachineModule::LuaWorldCleanup);
+
 }
 
 void FLuaMachineModule::LuaLevelAddedToWorld(ULevel* Level, UWorld* World)
@@ -59,15 +81,311 @@ void FLuaMachineModule::LuaLevelRemovedFromWorld(ULevel* Level, UWorld* World)
 	}
 }
 
+void FLuaMachineModule::LuaMemoryTrim()
+{
+	if (!IsInGameThread())
+	{
+		bPendingMemoryTrim = true;
+		return;
+	}
+
+	bPendingMemoryTrim = false;
+	for (ULuaState* LuaState : GetRegisteredLuaStates())
+	{
+		if (LuaState && LuaState->GetInternalLuaState())
+		{
+			LuaState->LuaMemoryTrim();
+		}
+	}
+
+	for (TWeakObjectPtr<ULuaState>& LuaState : DynamicLuaStates)
+	{
+		if (LuaState.IsValid() && LuaState->GetInternalLuaState())
+		{
+			LuaState->LuaMemoryTrim();
+		}
+	}
+}
+
+void FLuaMachineModule::LuaPreLoadMap(const FString& MapName)
+{
+	for (ULuaState* LuaState : GetRegisteredLuaStates())
+	{
+		if (LuaState && LuaState->GetInternalLuaState() && LuaState->bLuaGCScheduler)
+		{
+			LuaState->LuaGCFullCycle();
+		}
+	}
+
+	for (TWeakObjectPtr<ULuaState>& LuaState : DynamicLuaStates)
+	{
+		if (LuaState.IsValid() && LuaState->GetInternalLuaState() && LuaState->bLuaGCScheduler)
+		{
+			LuaState->LuaGCFullCycle();
+		}
+	}
+}
+
+void FLuaMachineModule::LuaWorldCleanup(UWorld* World, bool bSessionEnded, bool bCleanupResources)
+{
+#if ENGINE_MAJOR_VERSION >= 5 && ENGINE_MINOR_VERSION >= 4
+	TMap<TSubclassOf<ULuaState>, TObjectPtr<ULuaState>> WorldLuaStates;
+#else
+	TMap<TSubclassOf<ULuaState>, ULuaState*> WorldLuaStates;
+#endif
+	if (PerWorldLuaStates.RemoveAndCopyValue(World, WorldLuaStates))
+	{
+#if ENGINE_MAJOR_VERSION >= 5 && ENGINE_MINOR_VERSION >= 4
+		for (TPair<TSubclassOf<ULuaState>, TObjectPtr<ULuaState>>& Pair : WorldLuaStates)
+#else
+		for (TPair<TSubclassOf<ULuaState>, ULuaState*>& Pair : WorldLuaStates)
+#endif
+		{
+			if (FLuaCommandExecutor* LuaConsole = Pair.Value->GetLuaConsole())
+			{
+				IModularFeatures::Get().UnregisterModularFeature(IConsoleCommandExecutor::ModularFeatureName(), LuaConsole);
+			}
+			Pair.Value->RetireLuaState();
+		}
+		OnRegisteredLuaStatesChanged.Broadcast();
+	}
+
+	for (TPair<TSubclassOf<ULuaState>, FLuaDynamicStatePool>& Pair : DynamicLuaStatePools)
+	{
+		if (Pair.Value.World.Get() == World || !Pair.Value.World.IsValid())
+		{
+			for (ULuaState* LuaState : Pair.Value.LuaStates)
+			{
+				LuaState->RetireLuaState();
+			}
+			Pair.Value.LuaStates.Empty();
+			Pair.Value.World = nullptr;
+		}
+	}
+}
+
+bool FLuaMachineModule::IsSharedLuaState(const ULuaState* LuaState) const
+{
+	if (!LuaState)
+	{
+		return false;
+	}
+
+#if ENGINE_MAJOR_VERSION >= 5 && ENGINE_MINOR_VERSION >= 4
+	const TObjectPtr<ULuaState>* SharedLuaState = LuaStates.Find(LuaState->GetClass());
+#else
+	ULuaState* const* SharedLuaState = LuaStates.Find(LuaState->GetClass());
+#endif
+	if (SharedLuaState && *SharedLuaState == LuaState)
+	{
+		return true;
+	}
+
+	if (LuaState->bPerWorld)
+	{
+		if (const auto* WorldLuaStates = PerWorldLuaStates.Find(LuaState->GetWorld()))
+		{
+			SharedLuaState = WorldLuaStates->Find(LuaState->GetClass());
+			return SharedLuaState && *SharedLuaState == LuaState;
+		}
+	}
+	return false;
+}
+
+ULuaState* FLuaMachineModule::NewDynamicLuaState(TSubclassOf<ULuaState> LuaStateClass, UWorld* InWorld)
+{
+	ULuaState* NewLuaState = NewObject<ULuaState>((UObject*)GetTransientPackage(), LuaStateClass);
+	if (!NewLuaState)
+	{
+		return nullptr;
+	}
+
+	DynamicLuaStates.Add(NewLuaState);
+
+	return NewLuaState->GetLuaState(InWorld);
+}
+
+ULuaState* FLuaMachineModule::AcquireDynamicLuaState(TSubclassOf<ULuaState> LuaStateClass, UWorld* InWorld)
+{
+	if (!LuaStateClass)
+	{
+		return nullptr;
+	}
+
+	if (LuaStateClass == ULuaState::StaticClass())
+	{
+		UE_LOG(LogLuaMachine, Error, TEXT("attempt to use LuaState Abstract class, please create a child of LuaState"));
+		return nullptr;
+	}
+
+	if (LuaStateClass->GetDefaultObject<ULuaState>()->DynamicPoolSize <= 0)
+	{
+		return NewDynamicLuaState(LuaStateClass, InWorld);
+	}
+
+	FLuaDynamicStatePool& Pool = DynamicLuaStatePools.FindOrAdd(LuaStateClass);
+	// states initialized for another world cannot be reused
+	if (Pool.World.Get() != InWorld)
+	{
+		for (ULuaState* LuaState : Pool.LuaStates)
+		{
+			LuaState->RetireLuaState();
+		}
+		Pool.LuaStates.Empty();
+		Pool.World = InWorld;
+	}
+
+	if (Pool.LuaStates.Num() > 0)
+	{
+		// the pool is refilled by the next tick
+		return Pool.LuaStates.Pop()->GetLuaState(InWorld);
+	}
+
+	return NewDynamicLuaState(LuaStateClass, InWorld);
+}
+
+ULuaState* FLuaMachineModule::CloneLuaState(ULuaState* SourceLuaState, UWorld* InWorld)
+{
+	if (!SourceLuaState)
+	{
+		return nullptr;
+	}
+
+	TSharedPtr<const FLuaStateSnapshot> LuaSnapshot = SourceLuaState->GetLuaSnapshot();
+	if (!LuaSnapshot.IsValid())
+	{
+		UE_LOG(LogLuaMachine, Error, TEXT("unable to clone %s: the state is not initialized"), *SourceLuaState->GetName());
+		return nullptr;
+	}
+
+	ULuaState* NewLuaState = NewObject<ULuaState>((UObject*)GetTransientPackage(), SourceLuaState->GetClass());
+	if (!NewLuaState)
+	{
+		return nullptr;
+	}
+
+	NewLuaState->InitSnapshot = LuaSnapshot;
+	DynamicLuaStates.Add(NewLuaState);
+
+	return NewLuaState->GetLuaState(InWorld);
+}
+
+void FLuaMachineModule::ReleaseDynamicLuaState(ULuaState* LuaState)
+{
+	if (!LuaState)
+	{
+		return;
+	}
+
+	// the shared states are not ours
+	if (IsSharedLuaState(LuaState))
+	{
+		return;
+	}
+
+	LuaState->RetireLuaState();
+}
+
+void FLuaMachineModule::WarmDynamicLuaStatePool(TSubclassOf<ULuaState> LuaStateClass, UWorld* InWorld)
+{
+	if (!LuaStateClass || LuaStateClass == ULuaState::StaticClass() || LuaStateClass->GetDefaultObject<ULuaState>()->DynamicPoolSize <= 0)
+	{
+		return;
+	}
+
+	FLuaDynamicStatePool& Pool = DynamicLuaStatePools.FindOrAdd(LuaStateClass);
+	if (Pool.World.Get() != InWorld)
+	{
+		for (ULuaState* LuaState : Pool.LuaStates)
+		{
+			LuaState->RetireLuaState();
+		}
+		Pool.LuaStates.Empty();
+		Pool.World = InWorld;
+	}
+}
+
+void FLuaMachineModule::RefillDynamicLuaStatePools()
+{
+	for (TPair<TSubclassOf<ULuaState>, FLuaDynamicStatePool>& Pair : DynamicLuaStatePools)
+	{
+		UWorld* World = Pair.Value.World.Get();
+		if (!World || !Pair.Key)
+		{
+			continue;
+		}
+
+		// one state per class per frame, initializing is the expensive part
+		if (Pair.Value.LuaStates.Num() < Pair.Key->GetDefaultObject<ULuaState>()->DynamicPoolSize)
+		{
+			if (ULuaState* NewLuaState = NewDynamicLuaState(Pair.Key, World))
+			{
+				Pair.Value.LuaStates.Add(NewLuaState);
+			}
+		}
+	}
+}
+
+bool FLuaMachineModule::LuaPoolTick(float DeltaTime)
+{
+	RefillDynamicLuaStatePools();
+	return true;
+}
+
+void FLuaMachineModule::LuaEndFrame()
+{
+	if (bPendingMemoryTrim)
+	{
+		LuaMemoryTrim();
+	}
+
+	for (ULuaState* LuaState : GetRegisteredLuaStates())
+	{
+		if (LuaState && LuaState->GetInternalLuaState())
+		{
+			LuaState->LuaEndFrame();
+		}
+	}
+
+	DynamicLuaStates.RemoveAllSwap([](const TWeakObjectPtr<ULuaState>& LuaState) { return !LuaState.IsValid() || !LuaState->GetInternalLuaState(); });
+	// copy, blueprint events could create new states
+	const TArray<TWeakObjectPtr<ULuaState>> CurrentDynamicLuaStates = DynamicLuaStates;
+	for (const TWeakObjectPtr<ULuaState>& LuaState : CurrentDynamicLuaStates)
+	{
+		if (LuaState.IsValid() && LuaState->GetInternalLuaState())
+		{
+			LuaState->LuaEndFrame();
+		}
+	}
+}
+
 void FLuaMachineModule::ShutdownModule()
 {
 	// This function may be called during shutdown to clean up your module.  For modules that support dynamic reloading,
 	// we call this function before unloading the module.
+	FCoreDelegates::OnEndFrame.RemoveAll(this);
+#if ENGINE_MAJOR_VERSION > 4
+	FTSTicker::GetCoreTicker().RemoveTicker(LuaPoolTickHandle);
+#else
+	FTicker::GetCoreTicker().RemoveTicker(LuaPoolTickHandle);
+#endif
+	FCoreDelegates::GetMemoryTrimDelegate().RemoveAll(this);
+	FCoreDelegates::GetOutOfMemoryDelegate().RemoveAll(this);
+	FCoreUObjectDelegates::PreLoadMap.RemoveAll(this);
+	FWorldDelegates::OnWorldCleanup.RemoveAll(this);
 }
 
 void FLuaMachineModule::AddReferencedObjects(FReferenceCollector& Collector)
 {
 	Collector.AddReferencedObjects(LuaStates);
+	for (auto& Pair : PerWorldLuaStates)
+	{
+		Collector.AddReferencedObjects(Pair.Value);
+	}
+	for (TPair<TSubclassOf<ULuaState>, FLuaDynamicStatePool>& Pair : DynamicLuaStatePools)
+	{
+		Collector.AddReferencedObjects(Pair.Value.LuaStates);
+	}
 }
 
 void FLuaMachineModule::CleanupLuaStates(bool bIsSimulating)
@@ -97,6 +415,20 @@ void FLuaMachineModule::CleanupLuaStates(bool bIsSimulating)
 	}
 
 	LuaStates = PersistentLuaStates;
+
+	// per-world states never outlive their world
+	for (auto& WorldPair : PerWorldLuaStates)
+	{
+		for (auto& Pair : WorldPair.Value)
+		{
+			if (FLuaCommandExecutor* LuaConsole = Pair.Value->GetLuaConsole())
+			{
+				IModularFeatures::Get().UnregisterModularFeature(IConsoleCommandExecutor::ModularFeatureName(), LuaConsole);
+			}
+		}
+	}
+	PerWorldLuaStates.Empty();
+
 	OnRegisteredLuaStatesChanged.Broadcast();
 }
 
@@ -113,19 +445,118 @@ ULuaState* FLuaMachineModule::GetLuaState(TSubclassOf<ULuaState> LuaStateClass,
 		return nullptr;
 	}
 
-	if (!LuaStates.Contains(LuaStateClass))
+	auto& ClassLuaStates = GetClassLuaStates(LuaStateClass, InWorld);
+
+	if (!ClassLuaStates.Contains(LuaStateClass))
 	{
 		if (bCheckOnly)
 		{
 			return nullptr;
 		}
 		ULuaState* NewLuaState = NewObject<ULuaState>((UObject*)GetTransientPackage(), LuaStateClass);
-		LuaStates.Add(LuaStateClass, NewLuaState);
+		ClassLuaStates.Add(LuaStateClass, NewLuaState);
 		OnNewLuaState.Broadcast(NewLuaState);
 		OnRegisteredLuaStatesChanged.Broadcast();
 	}
 
-	return LuaStates[LuaStateClass]->GetLuaState(InWorld);
+	return ClassLuaStates[LuaStateClass]->GetLuaState(InWorld);
+}
+
+void FLuaMachineModule::GetLuaStateAsync(TSubclassOf<ULuaState> LuaStateClass, UWorld* InWorld, TFunction<void(ULuaState*)> OnInitialized)
+{
+	if (!LuaStateClass || LuaStateClass == ULuaState::StaticClass())
+	{
+		if (OnInitialized)
+		{
+			OnInitialized(nullptr);
+		}
+		return;
+	}
+
+	auto& ClassLuaStates = GetClassLuaStates(LuaStateClass, InWorld);
+
+	if (!ClassLuaStates.Contains(LuaStateClass))
+	{
+		ULuaState* NewLuaState = NewObject<ULuaState>((UObject*)GetTransientPackage(), LuaStateClass);
+		ClassLuaStates.Add(LuaStateClass, NewLuaState);
+		OnNewLuaState.Broadcast(NewLuaState);
+		OnRegisteredLuaStatesChanged.Broadcast();
+	}
+
+	ClassLuaStates[LuaStateClass]->LuaStateInitAsync(InWorld, MoveTemp(OnInitialized));
+}
+
+#if ENGINE_MAJOR_VERSION >= 5 && ENGINE_MINOR_VERSION >= 4
+TMap<TSubclassOf<ULuaState>, TObjectPtr<ULuaState>>& FLuaMachineModule::GetClassLuaStates(TSubclassOf<ULuaState> LuaStateClass, UWorld* InWorld)
+#else
+TMap<TSubclassOf<ULuaState>, ULuaState*>& FLuaMachineModule::GetClassLuaStates(TSubclassOf<ULuaState> LuaStateClass, UWorld* InWorld)
+#endif
+{
+	// without a world (editor scripting, commandlets) even per-world classes get the process-wide instance
+	if (InWorld && LuaStateClass->GetDefaultObject<ULuaState>()->bPerWorld)
+	{
+		return PerWorldLuaStates.FindOrAdd(InWorld);
+	}
+	return LuaStates;
+}
+
+bool FLuaMachineModule::HibernateLuaState(TSubclassOf<ULuaState> LuaStateClass, UWorld* InWorld, TArray<uint8>& Image)
+{
+	ULuaState* LuaState = GetLuaState(LuaStateClass, InWorld, true);
+	if (!LuaState)
+	{
+		return false;
+	}
+
+	// the capture walks the VM (a state with a dedicated thread could be running a command)
+	TSharedPtr<FLuaStateSnapshot> LuaSnapshot;
+	{
+		FLuaStateOwnershipScope OwnershipScope(LuaState);
+		LuaSnapshot = FLuaStateSnapshot::Capture(LuaState);
+	}
+	if (!LuaSnapshot.IsValid())
+	{
+		return false;
+	}
+
+	LuaSnapshot->Save(Image);
+	return true;
+}
+
+ULuaState* FLuaMachineModule::RestoreLuaState(TSubclassOf<ULuaState> LuaStateClass, UWorld* InWorld, const TArray<uint8>& Image)
+{
+	if (!LuaStateClass || LuaStateClass == ULuaState::StaticClass())
+	{
+		return nullptr;
+	}
+
+	FString Error;
+	TSharedPtr<FLuaStateSnapshot> LuaSnapshot = FLuaStateSnapshot::Load(Image, Error);
+	if (!LuaSnapshot.IsValid())
+	{
+		UE_LOG(LogLuaMachine, Error, TEXT("unable to restore %s: %s"), *LuaStateClass->GetName(), *Error);
+		return nullptr;
+	}
+
+	// Lua does not verify bytecode, a crafted image could corrupt the process
+	if (LuaSnapshot->ByteCodes.Num() > 0 && !LuaStateClass->GetDefaultObject<ULuaState>()->bAllowBytecodeImages)
+	{
+		UE_LOG(LogLuaMachine, Error, TEXT("unable to restore %s: the image contains Lua bytecode and bAllowBytecodeImages is disabled"), *LuaStateClass->GetName());
+		return nullptr;
+	}
+
+	if (ULuaState* CurrentLuaState = GetLuaState(LuaStateClass, InWorld, true))
+	{
+		UnregisterLuaState(CurrentLuaState);
+	}
+
+	ULuaState* NewLuaState = NewObject<ULuaState>((UObject*)GetTransientPackage(), LuaStateClass);
+	NewLuaState->InitSnapshot = LuaSnapshot;
+	GetClassLuaStates(LuaStateClass, InWorld).Add(LuaStateClass, NewLuaState);
+	OnNewLuaState.Broadcast(NewLuaState);
+	OnRegisteredLuaStatesChanged.Broadcast();
+
+	return NewLuaState->GetLuaState(InWorld);
 }
 
 TArray<ULuaState*> FLuaMachineModule::GetRegisteredLuaStates()
@@ -140,6 +571,14 @@ TArray<ULuaState*> FLuaMachineModule::GetRegisteredLuaStates()
 		RegisteredStates.Add(Pair.Value);
 	}
 
+	for (auto& WorldPair : PerWorldLuaStates)
+	{
+		for (auto& Pair : WorldPair.Value)
+		{
+			RegisteredStates.Add(Pair.Value);
+		}
+	}
+
 	return RegisteredStates;
 }
 
@@ -161,8 +600,23 @@ void FLuaMachineModule::UnregisterLuaState(ULuaState* LuaState)
 
 	if (FoundLuaStateClass)
 	{
+		// the objects surviving the state get back the fields written by scripts
+		LuaState->SyncInstanceTables();
 		LuaStates.Remove(FoundLuaStateClass);
 	}
+	else
+	{
+		for (auto& WorldPair : PerWorldLuaStates)
+		{
+			const TSubclassOf<ULuaState>* WorldLuaStateClass = WorldPair.Value.FindKey(LuaState);
+			if (WorldLuaStateClass)
+			{
+				LuaState->SyncInstanceTables();
+				WorldPair.Value.Remove(*WorldLuaStateClass);
+				break;
+			}
+		}
+	}
 
 	// trick for waking up on low-level destructor
 	OnRegisteredLuaStatesChanged.Broadcast();
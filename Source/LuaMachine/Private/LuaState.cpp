@@ -1,11 +1,14 @@
 // Copyright 2018-2023 - Roberto De Ioris
 
 #include "LuaState.h"
+#include "LuaStateSnapshot.h"
 #include "LuaComponent.h"
 #include "LuaUserDataObject.h"
 #include "LuaMachine.h"
 #include "LuaBlueprintPackage.h"
 #include "LuaBlueprintFunctionLibrary.h"
+#include "LuaBulkBuffer.h"
+#include "LuaWorldSubsystem.h"
 #if ENGINE_MAJOR_VERSION >= 5 && ENGINE_MINOR_VERSION > 0
 #include "AssetRegistry/AssetRegistryModule.h"
 #else
@@ -13,150 +16,404 @@
 #endif
 #include "GameFramework/Actor.h"
 #include "Runtime/Core/Public/Misc/FileHelper.h"
+#include "Misc/MemStack.h"
+#include "Async/Async.h"
 #include "Runtime/Core/Public/Misc/Paths.h"
 #include "Runtime/Core/Public/Serialization/BufferArchive.h"
 #include "Runtime/CoreUObject/Public/UObject/TextProperty.h"
 
 LUAMACHINE_API DEFINE_LOG_CATEGORY(LogLuaMachine);
 
+DECLARE_DWORD_COUNTER_STAT(TEXT("Lua Deferred Unrefs"), STAT_LuaDeferredUnrefs, STATGROUP_LuaMachine);
+DECLARE_CYCLE_STAT(TEXT("Lua GC"), STAT_LuaGC, STATGROUP_LuaMachine);
+
+// step size boundaries (in KB) of the GC scheduler
+#define LUAMACHINE_GC_MIN_STEP 16
+#define LUAMACHINE_GC_MAX_STEP 4096
+
+// LuaCodeAsset, LuaFilename and UserDataMetaTableFromCodeAsset
+#define LUAMACHINE_PRECOMPILED_CHUNKS 3
+
+// Lua code running in the dedicated thread of a state reaches UObjects (and Blueprint events) only through the game thread
+#define LUAMACHINE_GAME_THREAD_ONLY(Function) if (LuaState->LuaThread && !IsInGameThread())\
+	{\
+		return LuaState->LuaThread->CallOnGameThread(L, Function);\
+	}
+
+#define LUAMACHINE_CHECK_OWNER() checkf(IsLuaStateOwner(), TEXT("the VM of %s is owned by its dedicated thread (use FLuaStateOwnershipScope or queue a command)"), *GetName())
+
 ULuaState::ULuaState()
 {
 	L = nullptr;
 	bLuaOpenLibs = true;
+	bLuaOpenBulkLibrary = false;
+	bLuaPoolAllocator = false;
+	LuaMemoryBudget = 0;
+	bLuaGCScheduler = false;
+	LuaGCBudget = 1;
+	LuaGCLastCount = 0;
 	bDisabled = false;
 	bLogError = true;
 	bAddProjectContentDirToPackagePath = true;
 	bPersistent = false;
+	bAllowBytecodeImages = false;
+	bPerWorld = false;
+	bAsyncInitPrecompiled = false;
+	LuaJobWorkers = 0;
+	bLuaDedicatedThread = false;
+	DynamicPoolSize = 0;
 	bEnableLineHook = false;
 	bEnableCallHook = false;
 	bEnableReturnHook = false;
 	bEnableCountHook = false;
 	bRawLuaFunctionCall = false;
+	LuaTickMaxInterval = 0;
+	LuaTickLODDistance = 10000;
+	LuaTickBudget = 0;
 
 	FCoreUObjectDelegates::GetPostGarbageCollect().AddUObject(this, &ULuaState::GCLuaDelegatesCheck);
 }
 
-ULuaState* ULuaState::GetLuaState(UWorld* InWorld)
+// lua_newstate does not set a panic function (luaL_newstate would)
+static int LuaMachinePanic(lua_State* L)
 {
-	CurrentWorld = InWorld;
+	const char* Message = lua_tostring(L, -1);
+	UE_LOG(LogLuaMachine, Fatal, TEXT("unprotected error in Lua call: %s"), Message ? UTF8_TO_TCHAR(Message) : TEXT("unknown error"));
+	return 0;
+}
 
-	if (L != nullptr)
+lua_Alloc ULuaState::GetLuaAllocFunction(void*& UserData)
+{
+	LuaAllocator = MakeUnique<FLuaAllocator>(bLuaPoolAllocator);
+	LuaAllocator->Budget = LuaMemoryBudget > 0 ? (SIZE_T)LuaMemoryBudget : 0;
+	UserData = LuaAllocator.Get();
+	return FLuaAllocator::Alloc;
+}
+
+void ULuaState::SetLuaMemoryBudget(const int64 Budget)
+{
+	LuaMemoryBudget = Budget;
+	if (LuaAllocator)
 	{
-		return this;
+		LuaAllocator->Budget = LuaMemoryBudget > 0 ? (SIZE_T)LuaMemoryBudget : 0;
 	}
+}
 
-	if (bDisabled)
+void ULuaState::ShutdownLuaThread()
+{
+	if (LuaThread)
+	{
+		LuaThread->Shutdown();
+		LuaThread.Reset();
+	}
+}
+
+void ULuaState::CloseUnrefQueue()
+{
+	if (UnrefQueue)
+	{
+		UnrefQueue->Close();
+		UnrefQueue = nullptr;
+	}
+}
+
+void ULuaState::RetireLuaState()
+{
+	bDisabled = true;
+
+	// Lua code of the dedicated thread is waiting for this call, the VM cannot be closed under its feet
+	if (LuaThread && LuaThread->IsLentToGameThread())
+	{
+		TWeakObjectPtr<ULuaState> WeakLuaState(this);
+		AsyncTask(ENamedThreads::GameThread, [WeakLuaState]()
+			{
+				if (WeakLuaState.IsValid())
+				{
+					WeakLuaState->RetireLuaState();
+				}
+			});
+		return;
+	}
+
+	LuaStateAsyncInitCancel();
+	ShutdownLuaThread();
+	LuaJobSystem.Reset();
+	if (!L)
+	{
+		return;
+	}
+
+	// the objects surviving the state get back the fields written by scripts
+	SyncInstanceTables();
+
+	CloseUnrefQueue();
+	lua_close(L);
+	L = nullptr;
+
+	// the interned pointers and the cached refs belong to the closed VM
+	InternedLuaStrings.Empty();
+	InternedNames.Empty();
+	CachedUObjects.Empty();
+	InstancePrototypeMetatables.Empty();
+	SharedUserDataMetatables.Empty();
+	UserDataMetaTable = FLuaValue();
+	LuaAllocator.Reset();
+
+	// nothing queued for the closed VM can leak into the next one (the unrefs, the dedicated thread and the jobs are already done)
+	InceptionLevel = 0;
+	InceptionErrors.Empty();
+	LuaGCStats = FLuaGCStats();
+	LuaGCLastCount = 0;
+
+	// lua_close ran the __gc metamethods of the remaining userdata
+	FlushPendingLuaGC();
+}
+
+TSharedPtr<const FLuaStateSnapshot> ULuaState::GetLuaSnapshot(const bool bRefresh)
+{
+	// the snapshot does not depend on the VM, so it survives RetireLuaState()
+	if (!LuaSnapshot.IsValid() || bRefresh)
+	{
+		if (!L)
+		{
+			return LuaSnapshot;
+		}
+		FLuaStateOwnershipScope OwnershipScope(this);
+		LuaSnapshot = FLuaStateSnapshot::Capture(this);
+	}
+	return LuaSnapshot;
+}
+
+void ULuaState::LuaMemoryTrim()
+{
+	if (LuaThread && !IsLuaStateOwner())
+	{
+		LuaThread->Enqueue([this]() { LuaMemoryTrim(); });
+		return;
+	}
+
+	// never collect in the middle of a call
+	if (!L || (LuaAllocator && LuaAllocator->ProtectedDepth > 0))
+	{
+		return;
+	}
+
+	ProtectedGC(LUA_GCCOLLECT);
+
+	// the pages emptied by the collection go back to the system
+	if (LuaAllocator)
+	{
+		LuaAllocator->Trim();
+	}
+}
+
+FLuaMemoryStats ULuaState::GetLuaMemoryStats() const
+{
+	if (LuaAllocator)
+	{
+		return LuaAllocator->GetStats();
+	}
+
+	FLuaMemoryStats Stats;
+	if (L)
+	{
+		Stats.LiveBytes = lua_gc(L, LUA_GCCOUNT, 0) * 1024 + lua_gc(L, LUA_GCCOUNTB, 0);
+		Stats.PeakBytes = Stats.LiveBytes;
+	}
+	return Stats;
+}
+
+// the assets are patched by the game thread, the workers only read them
+static void LuaFixCodeAssetByteCode(ULuaCode* CodeAsset)
+{
+#if PLATFORM_ANDROID
+	// fix size_t of the bytecode
+	if (CodeAsset && CodeAsset->bCooked && CodeAsset->bCookAsBytecode && CodeAsset->ByteCode.Num() >= 14 && CodeAsset->ByteCode[13] != sizeof(size_t))
+		CodeAsset->ByteCode[13] = sizeof(size_t);
+#endif
+}
+
+static bool LuaLoadCodeAsset(lua_State* State, ULuaCode* CodeAsset, FString& Error)
+{
+	const FString FullCodePath = FString("@") + CodeAsset->GetPathName();
+	int Ret = 0;
+	if (CodeAsset->bCooked && CodeAsset->bCookAsBytecode)
+	{
+		if (IsInGameThread())
+		{
+			LuaFixCodeAssetByteCode(CodeAsset);
+		}
+		Ret = luaL_loadbuffer(State, (const char*)CodeAsset->ByteCode.GetData(), CodeAsset->ByteCode.Num(), TCHAR_TO_ANSI(*FullCodePath));
+	}
+	else
+	{
+		FTCHARToUTF8 Code(*CodeAsset->Code.ToString());
+		Ret = luaL_loadbuffer(State, Code.Get(), Code.Length(), TCHAR_TO_ANSI(*FullCodePath));
+	}
+
+	if (Ret != LUA_OK)
+	{
+		Error = FString::Printf(TEXT("Lua loading error: %s"), ANSI_TO_TCHAR(lua_tostring(State, -1)));
+		lua_pop(State, 1);
+		return false;
+	}
+	return true;
+}
+
+// pushes nil for non existent files (like RunFile with bIgnoreNonExistent)
+static bool LuaLoadContentFile(lua_State* State, const FString& Filename, FString& Error)
+{
+	const FString AbsoluteFilename = FPaths::Combine(FPaths::ProjectContentDir(), Filename);
+	if (!FPaths::FileExists(AbsoluteFilename))
+	{
+		lua_pushnil(State);
+		return true;
+	}
+
+	TArray<uint8> Code;
+	if (!FFileHelper::LoadFileToArray(Code, *AbsoluteFilename))
+	{
+		Error = FString::Printf(TEXT("Unable to open file %s"), *Filename);
+		return false;
+	}
+
+	const FString FullCodePath = FString("@") + AbsoluteFilename;
+	if (luaL_loadbuffer(State, (const char*)Code.GetData(), Code.Num(), TCHAR_TO_ANSI(*FullCodePath)))
 	{
+		Error = FString::Printf(TEXT("Lua loading error: %s"), ANSI_TO_TCHAR(lua_tostring(State, -1)));
+		lua_pop(State, 1);
+		return false;
+	}
+	return true;
+}
+
+lua_State* ULuaState::LuaStateOpen(lua_Alloc AllocFunction, void* AllocUserData, const bool bPrecompileScripts, FString& Error)
+{
+	lua_State* State = lua_newstate(AllocFunction, AllocUserData);
+	if (!State)
+	{
+		Error = FString::Printf(TEXT("unable to create the Lua VM for %s"), *GetName());
 		return nullptr;
 	}
+	lua_atpanic(State, LuaMachinePanic);
 
-	L = luaL_newstate();
+	if (bLuaGCScheduler)
+	{
+		lua_gc(State, LUA_GCSTOP, 0);
+	}
 
 	if (bLuaOpenLibs)
 	{
-		luaL_openlibs(L);
+		luaL_openlibs(State);
 	}
 
 	// load "package" for allowing minimal setup
-	luaL_requiref(L, "package", luaopen_package, 1);
-	lua_pop(L, 1);
+	luaL_requiref(State, "package", luaopen_package, 1);
+	lua_pop(State, 1);
 
 	if (!bLuaOpenLibs)
 	{
 		if (LuaLibsLoader.bLoadBase)
 		{
-			luaL_requiref(L, "_G", luaopen_base, 1);
-			lua_pop(L, 1);
+			luaL_requiref(State, "_G", luaopen_base, 1);
+			lua_pop(State, 1);
 		}
 
 		if (LuaLibsLoader.bLoadCoroutine)
 		{
-			luaL_requiref(L, "coroutine", luaopen_coroutine, 1);
-			lua_pop(L, 1);
+			luaL_requiref(State, "coroutine", luaopen_coroutine, 1);
+			lua_pop(State, 1);
 		}
 
 		if (LuaLibsLoader.bLoadTable)
 		{
-			luaL_requiref(L, "table", luaopen_table, 1);
-			lua_pop(L, 1);
+			luaL_requiref(State, "table", luaopen_table, 1);
+			lua_pop(State, 1);
 		}
 
 		if (LuaLibsLoader.bLoadIO)
 		{
-			luaL_requiref(L, "io", luaopen_io, 1);
-			lua_pop(L, 1);
+			luaL_requiref(State, "io", luaopen_io, 1);
+			lua_pop(State, 1);
 		}
 
 		if (LuaLibsLoader.bLoadOS)
 		{
-			luaL_requiref(L, "os", luaopen_os, 1);
-			lua_pop(L, 1);
+			luaL_requiref(State, "os", luaopen_os, 1);
+			lua_pop(State, 1);
 		}
 
 		if (LuaLibsLoader.bLoadString)
 		{
-			luaL_requiref(L, "string", luaopen_string, 1);
-			lua_pop(L, 1);
+			luaL_requiref(State, "string", luaopen_string, 1);
+			lua_pop(State, 1);
 		}
 
 		if (LuaLibsLoader.bLoadMath)
 		{
-			luaL_requiref(L, "math", luaopen_math, 1);
-			lua_pop(L, 1);
+			luaL_requiref(State, "math", luaopen_math, 1);
+			lua_pop(State, 1);
 		}
 
 		if (LuaLibsLoader.bLoadUTF8)
 		{
-			luaL_requiref(L, "utf8", luaopen_utf8, 1);
-			lua_pop(L, 1);
+			luaL_requiref(State, "utf8", luaopen_utf8, 1);
+			lua_pop(State, 1);
 		}
 
 		if (LuaLibsLoader.bLoadDebug)
 		{
-			luaL_requiref(L, "debug", luaopen_debug, 1);
-			lua_pop(L, 1);
+			luaL_requiref(State, "debug", luaopen_debug, 1);
+			lua_pop(State, 1);
 		}
 	}
 
-	ULuaState** LuaExtraSpacePtr = (ULuaState**)lua_getextraspace(L);
+	ULuaState** LuaExtraSpacePtr = (ULuaState**)lua_getextraspace(State);
 	*LuaExtraSpacePtr = this;
 	// get the global table
-	lua_pushglobaltable(L);
+	lua_pushglobaltable(State);
 	// override print
-	PushCFunction(ULuaState::TableFunction_print);
-	SetField(-2, "print");
+	lua_pushcfunction(State, ULuaState::TableFunction_print);
+	lua_setfield(State, -2, "print");
+
+	if (bLuaOpenBulkLibrary)
+	{
+		luaL_requiref(State, "bulk", FLuaBulkBuffer::OpenLibrary, 1);
+		lua_pop(State, 1);
+	}
 
-	GetField(-1, "package");
+	lua_getfield(State, -1, "package");
 	if (!OverridePackagePath.IsEmpty())
 	{
-		OverridePackagePath.ReplaceInline(*FString("$(CONTENT_DIR)"), *FPaths::ProjectContentDir());
-		lua_pushstring(L, TCHAR_TO_ANSI(*OverridePackagePath));
-		SetField(-2, "path");
+		// properties are not modified, this could run on a worker thread
+		const FString PackagePath = OverridePackagePath.Replace(TEXT("$(CONTENT_DIR)"), *FPaths::ProjectContentDir());
+		lua_pushstring(State, TCHAR_TO_ANSI(*PackagePath));
+		lua_setfield(State, -2, "path");
 	}
 
 	if (bAddProjectContentDirToPackagePath)
 	{
-		GetField(-1, "path");
-		const char* CurrentLuaPath = lua_tostring(L, -1);
+		lua_getfield(State, -1, "path");
+		const char* CurrentLuaPath = lua_tostring(State, -1);
 		FString NewPackagePath = FString(CurrentLuaPath) + ";" + FPaths::ProjectContentDir() + "/?.lua";
-		Pop();
-		lua_pushstring(L, TCHAR_TO_ANSI(*NewPackagePath));
-		SetField(-2, "path");
+		lua_pop(State, 1);
+		lua_pushstring(State, TCHAR_TO_ANSI(*NewPackagePath));
+		lua_setfield(State, -2, "path");
 	}
 
 	for (FString SubDir : AppendProjectContentDirSubDir)
 	{
-		GetField(-1, "path");
-		const char* CurrentLuaPath = lua_tostring(L, -1);
+		lua_getfield(State, -1, "path");
+		const char* CurrentLuaPath = lua_tostring(State, -1);
 		FString NewPackagePath = FString(CurrentLuaPath) + ";" + FPaths::ProjectContentDir() / SubDir + "/?.lua";
-		Pop();
-		lua_pushstring(L, TCHAR_TO_ANSI(*NewPackagePath));
-		SetField(-2, "path");
+		lua_pop(State, 1);
+		lua_pushstring(State, TCHAR_TO_ANSI(*NewPackagePath));
+		lua_setfield(State, -2, "path");
 	}
 
 	if (!OverridePackageCPath.IsEmpty())
 	{
-		OverridePackageCPath.ReplaceInline(*FString("$(CONTENT_DIR)"), *FPaths::ProjectContentDir());
+		FString PackageCPath = OverridePackageCPath.Replace(TEXT("$(CONTENT_DIR)"), *FPaths::ProjectContentDir());
 
 		static const FString libExtension =
 #if PLATFORM_MAC || PLATFORM_IOS
@@ -169,126 +426,430 @@ ULuaState* ULuaState::GetLuaState(UWorld* InWorld)
 			FString("");
 #endif
 
-		OverridePackageCPath.ReplaceInline(*FString("$(LIB_EXT)"), *libExtension);
+		PackageCPath.ReplaceInline(TEXT("$(LIB_EXT)"), *libExtension);
 
-		lua_pushstring(L, TCHAR_TO_ANSI(*OverridePackageCPath));
-		SetField(-2, "cpath");
-	}
-	// manage RequireTable
-	GetField(-1, "preload");
-	for (TPair<FString, ULuaCode*>& Pair : RequireTable)
-	{
-		PushCFunction(ULuaState::TableFunction_package_preload);
-		SetField(-2, TCHAR_TO_ANSI(*Pair.Key));
+		lua_pushstring(State, TCHAR_TO_ANSI(*PackageCPath));
+		lua_setfield(State, -2, "cpath");
 	}
 
-	// pop package.prelod
-	Pop(1);
+	// pop package (RequireTable and the assets searcher are installed by LuaStateSetup)
+	lua_pop(State, 1);
 
-	// manage searchers
-	GetField(-1, "searchers");
-	PushCFunction(ULuaState::TableFunction_package_loader);
-	constexpr int PackageLoadersFirstAvailableIndex = 5;
-	lua_seti(L, -2, PackageLoadersFirstAvailableIndex);
+	// pop global table
+	lua_pop(State, 1);
 
-	// pop package.searchers (and package)
-	Pop(2);
+	for (ULuaCode* CodeAsset : LuaPureInitCodeAssets)
+	{
+		if (!CodeAsset)
+		{
+			continue;
+		}
 
+		if (!LuaLoadCodeAsset(State, CodeAsset, Error))
+		{
+			lua_close(State);
+			return nullptr;
+		}
 
-	for (TPair<FString, FLuaValue>& Pair : Table)
-	{
-		FromLuaValue(Pair.Value, this, L);
-		SetField(-2, TCHAR_TO_ANSI(*Pair.Key));
+		int Ret = 0;
+		{
+			FLuaAllocator::FProtectedScope ProtectedScope(LuaAllocator.Get());
+			Ret = lua_pcall(State, 0, 0, 0);
+		}
+		if (Ret != LUA_OK)
+		{
+			Error = FString::Printf(TEXT("Lua execution error: %s"), ANSI_TO_TCHAR(lua_tostring(State, -1)));
+			lua_close(State);
+			return nullptr;
+		}
 	}
 
-	for (TPair<FString, TSubclassOf<ULuaBlueprintPackage>>& Pair : LuaBlueprintPackagesTable)
+	// compiled here, executed by LuaStateSetup() (the first LUAMACHINE_PRECOMPILED_CHUNKS slots of the stack)
+	if (bPrecompileScripts)
 	{
-		if (Pair.Value)
+		bool bLoaded = true;
+		if (LuaCodeAsset)
 		{
-			NewTable();
-			ULuaBlueprintPackage* LuaBlueprintPackage = NewObject<ULuaBlueprintPackage>(this, Pair.Value);
-			if (LuaBlueprintPackage)
+			bLoaded = LuaLoadCodeAsset(State, LuaCodeAsset, Error);
+		}
+		else
+		{
+			lua_pushnil(State);
+		}
+
+		if (bLoaded)
+		{
+			if (!LuaFilename.IsEmpty())
 			{
-				for (auto LuaPair : LuaBlueprintPackage->Table)
-				{
-					FromLuaValue(LuaPair.Value, LuaBlueprintPackage);
-					SetField(-2, TCHAR_TO_ANSI(*LuaPair.Key));
-				}
-				// this avoid the package to be GC'd
-				LuaBlueprintPackages.Add(Pair.Key, LuaBlueprintPackage);
-				LuaBlueprintPackage->SelfTable = ToLuaValue(-1);
-				LuaBlueprintPackage->Init();
-				LuaBlueprintPackage->ReceiveInit();
+				bLoaded = LuaLoadContentFile(State, LuaFilename, Error);
+			}
+			else
+			{
+				lua_pushnil(State);
 			}
 		}
-		else
+
+		if (bLoaded)
 		{
-			PushNil();
+			if (UserDataMetaTableFromCodeAsset)
+			{
+				bLoaded = LuaLoadCodeAsset(State, UserDataMetaTableFromCodeAsset, Error);
+			}
+			else
+			{
+				lua_pushnil(State);
+			}
+		}
+
+		if (!bLoaded)
+		{
+			lua_close(State);
+			return nullptr;
 		}
-		SetField(-2, TCHAR_TO_ANSI(*Pair.Key));
 	}
 
-	// pop global table
-	Pop();
+	return State;
+}
 
-	// This allows subclasses to do any last minute initialization on lua state before
-	// we load code
-	ReceiveLuaStatePreInitialized();
+ULuaState* ULuaState::GetLuaState(UWorld* InWorld)
+{
+	CurrentWorld = InWorld;
 
-	int DebugMask = 0;
-	// install hooks
-	if (bEnableLineHook)
+	if (L != nullptr)
 	{
-		DebugMask |= LUA_MASKLINE;
+		return this;
 	}
-	if (bEnableCallHook)
+
+	if (bDisabled)
 	{
-		DebugMask |= LUA_MASKCALL;
+		return nullptr;
 	}
-	if (bEnableReturnHook)
+
+	// a background initialization is running, wait for it and complete it now
+	if (AsyncInitFuture.IsValid())
 	{
-		DebugMask |= LUA_MASKRET;
+		return LuaStateAsyncInitComplete();
 	}
-	if (bEnableCountHook)
+
+	void* AllocUserData = nullptr;
+	lua_Alloc AllocFunction = GetLuaAllocFunction(AllocUserData);
+	FString Error;
+	lua_State* NewL = LuaStateOpen(AllocFunction, AllocUserData, false, Error);
+	return LuaStateSetup(NewL, false, Error);
+}
+
+void ULuaState::LuaStateInitAsync(UWorld* InWorld, TFunction<void(ULuaState*)> OnInitialized)
+{
+	CurrentWorld = InWorld;
+
+	if (L || bDisabled)
 	{
-		DebugMask |= LUA_MASKCOUNT;
+		if (OnInitialized)
+		{
+			OnInitialized(L ? this : nullptr);
+		}
+		return;
 	}
 
-	if (DebugMask != 0)
+	if (OnInitialized)
 	{
-		lua_sethook(L, Debug_Hook, DebugMask, HookInstructionCount);
+		AsyncInitCallbacks.Add(MoveTemp(OnInitialized));
 	}
 
-	if (LuaCodeAsset)
+	if (AsyncInitFuture.IsValid())
 	{
-		if (!RunCodeAsset(LuaCodeAsset))
-		{
-			if (bLogError)
-				LogError(LastError);
-			ReceiveLuaError(LastError);
-			bDisabled = true;
-			return nullptr;
-		}
+		return;
 	}
 
-	if (!LuaFilename.IsEmpty())
+	void* AllocUserData = nullptr;
+	lua_Alloc AllocFunction = GetLuaAllocFunction(AllocUserData);
+	// clones get their scripts from the snapshot
+	bAsyncInitPrecompiled = !InitSnapshot.IsValid();
+	const bool bPrecompileScripts = bAsyncInitPrecompiled;
+	AsyncInitError.Empty();
+
+	LuaFixCodeAssetByteCode(LuaCodeAsset);
+	LuaFixCodeAssetByteCode(UserDataMetaTableFromCodeAsset);
+	for (ULuaCode* CodeAsset : LuaPureInitCodeAssets)
 	{
-		if (!RunFile(LuaFilename, true))
-		{
-			if (bLogError)
-				LogError(LastError);
-			ReceiveLuaError(LastError);
-			bDisabled = true;
-			return nullptr;
-		}
+		LuaFixCodeAssetByteCode(CodeAsset);
 	}
 
-	if (UserDataMetaTableFromCodeAsset)
-	{
-		if (!RunCodeAsset(UserDataMetaTableFromCodeAsset, 1))
+	TWeakObjectPtr<ULuaState> WeakThis(this);
+	// the state cannot be destroyed before the worker is done (the destructor waits for it)
+	AsyncInitFuture = Async(EAsyncExecution::ThreadPool, [this, AllocFunction, AllocUserData, bPrecompileScripts]()
 		{
-			if (bLogError)
-				LogError(LastError);
+			return LuaStateOpen(AllocFunction, AllocUserData, bPrecompileScripts, AsyncInitError);
+		},
+		[WeakThis]()
+		{
+			AsyncTask(ENamedThreads::GameThread, [WeakThis]()
+				{
+					if (WeakThis.IsValid())
+					{
+						WeakThis->LuaStateAsyncInitComplete();
+					}
+				});
+		});
+}
+
+void ULuaState::LuaStateAsyncInitCancel()
+{
+	if (!AsyncInitFuture.IsValid())
+	{
+		return;
+	}
+
+	// the worker is using this object, it must be done before going on
+	if (lua_State* NewL = AsyncInitFuture.Get())
+	{
+		lua_close(NewL);
+	}
+	AsyncInitFuture.Reset();
+
+	TArray<TFunction<void(ULuaState*)>> Callbacks = MoveTemp(AsyncInitCallbacks);
+	for (TFunction<void(ULuaState*)>& Callback : Callbacks)
+	{
+		Callback(nullptr);
+	}
+}
+
+ULuaState* ULuaState::LuaStateAsyncInitComplete()
+{
+	// already completed by a synchronous GetLuaState()
+	if (!AsyncInitFuture.IsValid())
+	{
+		return L ? this : nullptr;
+	}
+
+	lua_State* NewL = AsyncInitFuture.Get();
+	AsyncInitFuture.Reset();
+
+	ULuaState* InitializedLuaState = LuaStateSetup(NewL, bAsyncInitPrecompiled, AsyncInitError);
+
+	TArray<TFunction<void(ULuaState*)>> Callbacks = MoveTemp(AsyncInitCallbacks);
+	for (TFunction<void(ULuaState*)>& Callback : Callbacks)
+	{
+		Callback(InitializedLuaState);
+	}
+
+	return InitializedLuaState;
+}
+
+bool ULuaState::RunPrecompiledChunk(const int Slot, const int NRet)
+{
+	lua_pushvalue(L, Slot);
+	if (lua_isnil(L, -1))
+	{
+		lua_pop(L, 1);
+		for (int Index = 0; Index < NRet; Index++)
+		{
+			lua_pushnil(L);
+		}
+		return true;
+	}
+
+	DrainPendingUnrefs();
+	FLuaAllocator::FProtectedScope ProtectedScope(LuaAllocator.Get());
+	if (lua_pcall(L, 0, NRet, 0))
+	{
+		LastError = FString::Printf(TEXT("Lua execution error: %s"), ANSI_TO_TCHAR(lua_tostring(L, -1)));
+		return false;
+	}
+	return true;
+}
+
+ULuaState* ULuaState::LuaStateSetup(lua_State* NewL, const bool bPrecompiled, const FString& Error)
+{
+	if (!NewL)
+	{
+		LastError = Error;
+		if (bLogError)
+			LogError(LastError);
+		ReceiveLuaError(LastError);
+		bDisabled = true;
+		return nullptr;
+	}
+
+	L = NewL;
+	UnrefQueue = new FLuaUnrefQueue();
+
+	if (bLuaGCScheduler)
+	{
+		LuaGCStats.StepSize = LUAMACHINE_GC_MIN_STEP;
+	}
+
+	if (LuaJobWorkers > 0)
+	{
+		// the workers get a copy of the code, assets are not touched outside of the game thread
+		TArray<TPair<FString, TArray<uint8>>> LuaJobCode;
+		for (ULuaCode* CodeAsset : LuaJobCodeAssets)
+		{
+			if (!CodeAsset)
+			{
+				continue;
+			}
+			TArray<uint8> Code;
+			if (CodeAsset->bCooked && CodeAsset->bCookAsBytecode)
+			{
+				Code = CodeAsset->ByteCode;
+#if PLATFORM_ANDROID
+				// fix size_t of the bytecode
+				if (Code.Num() >= 14)
+					Code[13] = sizeof(size_t);
+#endif
+			}
+			else
+			{
+				FTCHARToUTF8 Source(*CodeAsset->Code.ToString());
+				Code.Append((const uint8*)Source.Get(), Source.Length());
+			}
+			LuaJobCode.Add(TPair<FString, TArray<uint8>>(CodeAsset->GetPathName(), MoveTemp(Code)));
+		}
+		LuaJobSystem = MakeUnique<FLuaJobSystem>(LuaJobWorkers, LuaJobCode);
+		luaL_requiref(L, "job", FLuaJobSystem::OpenLibrary, 1);
+		Pop();
+	}
+
+	// RequireTable and the assets searcher need the game thread (and L), so they are not available to LuaPureInitCodeAssets
+	lua_getglobal(L, "package");
+	lua_getfield(L, -1, "preload");
+	for (TPair<FString, ULuaCode*>& Pair : RequireTable)
+	{
+		lua_pushcfunction(L, ULuaState::TableFunction_package_preload);
+		lua_setfield(L, -2, TCHAR_TO_ANSI(*Pair.Key));
+	}
+
+	// pop package.preload
+	lua_pop(L, 1);
+
+	// manage searchers
+	lua_getfield(L, -1, "searchers");
+	lua_pushcfunction(L, ULuaState::TableFunction_package_loader);
+	constexpr int PackageLoadersFirstAvailableIndex = 5;
+	lua_seti(L, -2, PackageLoadersFirstAvailableIndex);
+
+	// pop package.searchers (and package)
+	lua_pop(L, 2);
+
+	// get the global table
+	lua_pushglobaltable(L);
+
+	// world scoped global names are resolved on first access
+	NewTable();
+	PushCFunction(ULuaState::MetaTableFunctionGlobal__index);
+	SetField(-2, "__index");
+	lua_setmetatable(L, -2);
+
+	for (TPair<FString, FLuaValue>& Pair : Table)
+	{
+		FromLuaValue(Pair.Value, this, L);
+		SetField(-2, TCHAR_TO_ANSI(*Pair.Key));
+	}
+
+	for (TPair<FString, TSubclassOf<ULuaBlueprintPackage>>& Pair : LuaBlueprintPackagesTable)
+	{
+		if (Pair.Value)
+		{
+			NewTable();
+			ULuaBlueprintPackage* LuaBlueprintPackage = NewObject<ULuaBlueprintPackage>(this, Pair.Value);
+			if (LuaBlueprintPackage)
+			{
+				for (auto LuaPair : LuaBlueprintPackage->Table)
+				{
+					FromLuaValue(LuaPair.Value, LuaBlueprintPackage);
+					SetField(-2, TCHAR_TO_ANSI(*LuaPair.Key));
+				}
+				// this avoid the package to be GC'd
+				LuaBlueprintPackages.Add(Pair.Key, LuaBlueprintPackage);
+				LuaBlueprintPackage->SelfTable = ToLuaValue(-1);
+				LuaBlueprintPackage->Init();
+				LuaBlueprintPackage->ReceiveInit();
+			}
+		}
+		else
+		{
+			PushNil();
+		}
+		SetField(-2, TCHAR_TO_ANSI(*Pair.Key));
+	}
+
+	// pop global table
+	Pop();
+
+	// This allows subclasses to do any last minute initialization on lua state before
+	// we load code
+	ReceiveLuaStatePreInitialized();
+
+	int DebugMask = 0;
+	// install hooks
+	if (bEnableLineHook)
+	{
+		DebugMask |= LUA_MASKLINE;
+	}
+	if (bEnableCallHook)
+	{
+		DebugMask |= LUA_MASKCALL;
+	}
+	if (bEnableReturnHook)
+	{
+		DebugMask |= LUA_MASKRET;
+	}
+	if (bEnableCountHook)
+	{
+		DebugMask |= LUA_MASKCOUNT;
+	}
+
+	if (DebugMask != 0)
+	{
+		lua_sethook(L, Debug_Hook, DebugMask, HookInstructionCount);
+	}
+
+	if (InitSnapshot.IsValid())
+	{
+		// a clone: the scripts already ran in the original state
+		FString SnapshotError;
+		if (!InitSnapshot->Restore(this, SnapshotError))
+		{
+			LastError = FString::Printf(TEXT("unable to restore snapshot: %s"), *SnapshotError);
+			if (bLogError)
+				LogError(LastError);
+			ReceiveLuaError(LastError);
+			bDisabled = true;
+			return nullptr;
+		}
+	}
+
+	if (LuaCodeAsset && !InitSnapshot.IsValid())
+	{
+		if (!(bPrecompiled ? RunPrecompiledChunk(1) : RunCodeAsset(LuaCodeAsset)))
+		{
+			if (bLogError)
+				LogError(LastError);
+			ReceiveLuaError(LastError);
+			bDisabled = true;
+			return nullptr;
+		}
+	}
+
+	if (!LuaFilename.IsEmpty() && !InitSnapshot.IsValid())
+	{
+		if (!(bPrecompiled ? RunPrecompiledChunk(2) : RunFile(LuaFilename, true)))
+		{
+			if (bLogError)
+				LogError(LastError);
+			ReceiveLuaError(LastError);
+			bDisabled = true;
+			return nullptr;
+		}
+	}
+
+	if (UserDataMetaTableFromCodeAsset && !InitSnapshot.IsValid())
+	{
+		if (!(bPrecompiled ? RunPrecompiledChunk(3, 1) : RunCodeAsset(UserDataMetaTableFromCodeAsset, 1)))
+		{
+			if (bLogError)
+				LogError(LastError);
 			ReceiveLuaError(LastError);
 			bDisabled = true;
 			return nullptr;
@@ -297,6 +858,14 @@ ULuaState* ULuaState::GetLuaState(UWorld* InWorld)
 		Pop();
 	}
 
+	if (bPrecompiled)
+	{
+		for (int Slot = 0; Slot < LUAMACHINE_PRECOMPILED_CHUNKS; Slot++)
+		{
+			lua_remove(L, 1);
+		}
+	}
+
 	LuaStateInit();
 	ReceiveLuaStateInitialized();
 
@@ -308,6 +877,17 @@ ULuaState* ULuaState::GetLuaState(UWorld* InWorld)
 	}
 #endif
 
+	// from now on the game thread needs an ownership scope for touching the VM
+	if (bLuaDedicatedThread && !(GetFlags() & RF_ClassDefaultObject))
+	{
+		LuaThread = MakeShared<FLuaStateThread, ESPMode::ThreadSafe>(this);
+		if (!LuaThread->Start())
+		{
+			LogWarning(FString::Printf(TEXT("unable to start the dedicated thread of %s, the VM will stay in the game thread"), *GetName()));
+			LuaThread.Reset();
+		}
+	}
+
 
 	return this;
 }
@@ -383,6 +963,8 @@ bool ULuaState::RunCode(const FString& Code, const FString& CodePath, int NRet)
 
 bool ULuaState::RunCode(const TArray<uint8>& Code, const FString& CodePath, int NRet)
 {
+	LUAMACHINE_CHECK_OWNER();
+
 	FString FullCodePath = FString("@") + CodePath;
 
 	if (luaL_loadbuffer(L, (const char*)Code.GetData(), Code.Num(), TCHAR_TO_ANSI(*FullCodePath)))
@@ -392,6 +974,8 @@ bool ULuaState::RunCode(const TArray<uint8>& Code, const FString& CodePath, int
 	}
 	else
 	{
+		DrainPendingUnrefs();
+		FLuaAllocator::FProtectedScope ProtectedScope(LuaAllocator.Get());
 
 		if (lua_pcall(L, 0, NRet, 0))
 		{
@@ -439,6 +1023,8 @@ TArray<uint8> ULuaState::ToByteCode(const FString& Code, const FString& CodePath
 
 void ULuaState::FromLuaValue(FLuaValue& LuaValue, UObject* CallContext, lua_State* State)
 {
+	LUAMACHINE_CHECK_OWNER();
+
 	if (!State)
 	{
 		State = this->L;
@@ -457,8 +1043,12 @@ void ULuaState::FromLuaValue(FLuaValue& LuaValue, UObject* CallContext, lua_Stat
 		break;
 	case ELuaValueType::String:
 	{
-		TArray<uint8> Bytes = LuaValue.ToBytes();
-		lua_pushlstring(State, (const char*)Bytes.GetData(), Bytes.Num());
+		// the bytes only live until lua_pushlstring copies them
+		FMemMark Mark(FMemStack::Get());
+		const int32 Len = LuaValue.String.Len();
+		uint8* Bytes = new(FMemStack::Get()) uint8[Len > 0 ? Len : 1];
+		LuaValue.ToBytes(Bytes);
+		lua_pushlstring(State, (const char*)Bytes, Len);
 	}
 	break;
 	case ELuaValueType::Table:
@@ -467,11 +1057,11 @@ void ULuaState::FromLuaValue(FLuaValue& LuaValue, UObject* CallContext, lua_Stat
 			lua_newtable(State);
 			lua_pushvalue(State, -1);
 			// hold references in the main state
-			LuaValue.LuaRef = luaL_ref(this->L, LUA_REGISTRYINDEX);
-			LuaValue.LuaState = this;
+			LuaValue.SetRef(this, luaL_ref(this->L, LUA_REGISTRYINDEX));
 			break;
 		}
-		if (this != LuaValue.LuaState)
+		// the ref could belong to a closed VM of this state
+		if (this != LuaValue.LuaState || LuaValue.UnrefQueue != UnrefQueue)
 		{
 			lua_pushnil(State);
 			break;
@@ -485,11 +1075,10 @@ void ULuaState::FromLuaValue(FLuaValue& LuaValue, UObject* CallContext, lua_Stat
 		{
 			lua_newthread(State);
 			lua_pushvalue(State, -1);
-			LuaValue.LuaRef = luaL_ref(this->L, LUA_REGISTRYINDEX);
-			LuaValue.LuaState = this;
+			LuaValue.SetRef(this, luaL_ref(this->L, LUA_REGISTRYINDEX));
 			break;
 		}
-		if (this != LuaValue.LuaState)
+		if (this != LuaValue.LuaState || LuaValue.UnrefQueue != UnrefQueue)
 		{
 			lua_pushnil(State);
 			break;
@@ -499,7 +1088,7 @@ void ULuaState::FromLuaValue(FLuaValue& LuaValue, UObject* CallContext, lua_Stat
 			lua_xmove(this->L, State, 1);
 		break;
 	case ELuaValueType::Function:
-		if (this != LuaValue.LuaState || LuaValue.LuaRef == LUA_NOREF)
+		if (this != LuaValue.LuaState || LuaValue.LuaRef == LUA_NOREF || LuaValue.UnrefQueue != UnrefQueue)
 		{
 			lua_pushnil(State);
 			break;
@@ -516,6 +1105,16 @@ void ULuaState::FromLuaValue(FLuaValue& LuaValue, UObject* CallContext, lua_Stat
 			break;
 		}
 
+		if (ULuaComponent* LuaComponent = Cast<ULuaComponent>(LuaValue.Object))
+		{
+			// components of this state share a single cached userdata
+			if (LuaComponent->LuaState == GetClass())
+			{
+				PushCachedUObject(LuaComponent, State);
+				break;
+			}
+		}
+
 		NewUObject(LuaValue.Object, State);
 		if (ULuaComponent* LuaComponent = Cast<ULuaComponent>(LuaValue.Object))
 		{
@@ -523,11 +1122,6 @@ void ULuaState::FromLuaValue(FLuaValue& LuaValue, UObject* CallContext, lua_Stat
 			{
 				UE_LOG(LogLuaMachine, Warning, TEXT("%s has no associated LuaState"), *LuaComponent->GetFullName());
 			}
-			// ensure we are in the same LuaState
-			else if (LuaComponent->LuaState == GetClass())
-			{
-				SetupAndAssignUserDataMetatable(LuaComponent, LuaComponent->Metatable, State);
-			}
 		}
 		else if (ULuaUserDataObject* LuaUserDataObject = Cast<ULuaUserDataObject>(LuaValue.Object))
 		{
@@ -635,6 +1229,8 @@ void ULuaState::FromLuaValue(FLuaValue& LuaValue, UObject* CallContext, lua_Stat
 
 FLuaValue ULuaState::ToLuaValue(int Index, lua_State* State)
 {
+	LUAMACHINE_CHECK_OWNER();
+
 	if (!State)
 	{
 		State = this->L;
@@ -666,8 +1262,7 @@ FLuaValue ULuaState::ToLuaValue(int Index, lua_State* State)
 		if (State != this->L)
 			lua_xmove(State, this->L, 1);
 		LuaValue.Type = ELuaValueType::Table;
-		LuaValue.LuaState = this;
-		LuaValue.LuaRef = luaL_ref(this->L, LUA_REGISTRYINDEX);
+		LuaValue.SetRef(this, luaL_ref(this->L, LUA_REGISTRYINDEX));
 	}
 	else if (lua_isthread(State, Index))
 	{
@@ -675,8 +1270,7 @@ FLuaValue ULuaState::ToLuaValue(int Index, lua_State* State)
 		if (State != this->L)
 			lua_xmove(State, this->L, 1);
 		LuaValue.Type = ELuaValueType::Thread;
-		LuaValue.LuaState = this;
-		LuaValue.LuaRef = luaL_ref(this->L, LUA_REGISTRYINDEX);
+		LuaValue.SetRef(this, luaL_ref(this->L, LUA_REGISTRYINDEX));
 	}
 	else if (lua_isfunction(State, Index))
 	{
@@ -684,8 +1278,7 @@ FLuaValue ULuaState::ToLuaValue(int Index, lua_State* State)
 		if (State != this->L)
 			lua_xmove(State, this->L, 1);
 		LuaValue.Type = ELuaValueType::Function;
-		LuaValue.LuaState = this;
-		LuaValue.LuaRef = luaL_ref(this->L, LUA_REGISTRYINDEX);
+		LuaValue.SetRef(this, luaL_ref(this->L, LUA_REGISTRYINDEX));
 	}
 	else if (lua_isuserdata(State, Index))
 	{
@@ -720,10 +1313,26 @@ int32 ULuaState::GetTop()
 	return lua_gettop(L);
 }
 
+// marks a field removed from an instance table (while still present in its prototype),
+// it looks like a FLuaUserData of Nil type, so ToLuaValue() will just return nil
+static ELuaValueType LuaInstanceFieldTombstone = ELuaValueType::Nil;
+
+static void LuaPushInstanceFieldTombstone(lua_State* L)
+{
+	lua_pushlightuserdata(L, &LuaInstanceFieldTombstone);
+}
+
+static bool LuaIsInstanceFieldTombstone(lua_State* L, int Index)
+{
+	return lua_type(L, Index) == LUA_TLIGHTUSERDATA && lua_touserdata(L, Index) == &LuaInstanceFieldTombstone;
+}
+
 int ULuaState::MetaTableFunctionUserData__index(lua_State* L)
 {
+	FLuaAllocator::FBridgeScope BridgeScope(L);
 
 	ULuaState* LuaState = ULuaState::GetFromExtraSpace(L);
+	LUAMACHINE_GAME_THREAD_ONLY(ULuaState::MetaTableFunctionUserData__index);
 	FLuaUserData* UserData = (FLuaUserData*)lua_touserdata(L, 1);
 
 	if (!UserData->Context.IsValid())
@@ -737,7 +1346,32 @@ int ULuaState::MetaTableFunctionUserData__index(lua_State* L)
 	ULuaUserDataObject* LuaUserDataObject = nullptr;
 	ULuaComponent* LuaComponent = nullptr;
 
-	FString Key = ANSI_TO_TCHAR(lua_tostring(L, 2));
+	// fields are stored in the instance table (the userdata uservalue)
+	const bool bHasInstanceTable = lua_getuservalue(L, 1) == LUA_TTABLE;
+	if (bHasInstanceTable)
+	{
+		// non-raw access, so that the shared prototype is checked too
+		lua_pushvalue(L, 2);
+		if (lua_gettable(L, -2) != LUA_TNIL)
+		{
+			if (LuaIsInstanceFieldTombstone(L, -1))
+			{
+				lua_pushnil(L);
+			}
+			return 1;
+		}
+		lua_pop(L, 1);
+	}
+	lua_pop(L, 1);
+
+	// string keys are interned, no need to transcode and hash them on every access
+	FString KeyFallback;
+	const FLuaInternedName* InternedKey = LuaState->InternName(2, L);
+	if (!InternedKey)
+	{
+		KeyFallback = UTF8_TO_TCHAR(lua_tostring(L, 2));
+	}
+	const FString& Key = InternedKey ? InternedKey->String : KeyFallback;
 
 	LuaComponent = Cast<ULuaComponent>(Context);
 
@@ -754,9 +1388,9 @@ int ULuaState::MetaTableFunctionUserData__index(lua_State* L)
 		}
 	}
 
-	if (TablePtr)
+	if (TablePtr && !bHasInstanceTable)
 	{
-		FLuaValue* LuaValue = TablePtr->Find(Key);
+		FLuaValue* LuaValue = InternedKey ? TablePtr->FindByHash(InternedKey->StringHash, Key) : TablePtr->Find(Key);
 		if (LuaValue)
 		{
 			LuaState->FromLuaValue(*LuaValue, Context, L);
@@ -785,7 +1419,9 @@ int ULuaState::MetaTableFunctionUserData__index(lua_State* L)
 
 int ULuaState::MetaTableFunctionUserData__newindex(lua_State* L)
 {
+	FLuaAllocator::FBridgeScope BridgeScope(L);
 	ULuaState* LuaState = ULuaState::GetFromExtraSpace(L);
+	LUAMACHINE_GAME_THREAD_ONLY(ULuaState::MetaTableFunctionUserData__newindex);
 	FLuaUserData* UserData = (FLuaUserData*)lua_touserdata(L, 1);
 	if (!UserData->Context.IsValid())
 	{
@@ -806,11 +1442,44 @@ int ULuaState::MetaTableFunctionUserData__newindex(lua_State* L)
 		TablePtr = &LuaUserDataObject->Table;
 	}
 
+	if (lua_getuservalue(L, 1) == LUA_TTABLE)
+	{
+		lua_pushvalue(L, 2);
+		const bool bNewKey = lua_gettable(L, -2) == LUA_TNIL || LuaIsInstanceFieldTombstone(L, -1);
+		lua_pop(L, 1);
+		if (bNewKey && LuaComponent)
+		{
+			if (LuaComponent->ReceiveLuaMetaNewIndex(LuaState->ToLuaValue(2, L), LuaState->ToLuaValue(3, L)))
+			{
+				return 0;
+			}
+		}
+		// copy on write, the prototype is never modified
+		lua_pushvalue(L, 2);
+		if (lua_isnil(L, 3) && !bNewKey)
+		{
+			LuaPushInstanceFieldTombstone(L);
+		}
+		else
+		{
+			lua_pushvalue(L, 3);
+		}
+		lua_rawset(L, -3);
+		return 0;
+	}
+	lua_pop(L, 1);
+
 	if (TablePtr)
 	{
-		FString Key = ANSI_TO_TCHAR(lua_tostring(L, 2));
+		FString KeyFallback;
+		const FLuaInternedName* InternedKey = LuaState->InternName(2, L);
+		if (!InternedKey)
+		{
+			KeyFallback = UTF8_TO_TCHAR(lua_tostring(L, 2));
+		}
+		const FString& Key = InternedKey ? InternedKey->String : KeyFallback;
 
-		FLuaValue* LuaValue = TablePtr->Find(Key);
+		FLuaValue* LuaValue = InternedKey ? TablePtr->FindByHash(InternedKey->StringHash, Key) : TablePtr->Find(Key);
 		if (LuaValue)
 		{
 			*LuaValue = LuaState->ToLuaValue(3, L);
@@ -869,7 +1538,14 @@ TMap<FString, FLuaValue> ULuaState::LuaGetLocals(int32 Level)
 
 void ULuaState::Debug_Hook(lua_State* L, lua_Debug* ar)
 {
+	FLuaAllocator::FBridgeScope BridgeScope(L);
 	ULuaState* LuaState = ULuaState::GetFromExtraSpace(L);
+	if (LuaState->LuaThread && !IsInGameThread())
+	{
+		LuaState->LuaThread->RunOnGameThread([L, ar]() { Debug_Hook(L, ar); });
+		return;
+	}
+
 	FLuaDebug LuaDebug;
 	lua_getinfo(L, "lSn", ar);
 	LuaDebug.CurrentLine = ar->currentline;
@@ -899,7 +1575,9 @@ void ULuaState::Debug_Hook(lua_State* L, lua_Debug* ar)
 
 int ULuaState::MetaTableFunctionUserData__eq(lua_State* L)
 {
+	FLuaAllocator::FBridgeScope BridgeScope(L);
 	ULuaState* LuaState = ULuaState::GetFromExtraSpace(L);
+	LUAMACHINE_GAME_THREAD_ONLY(ULuaState::MetaTableFunctionUserData__eq);
 
 	FLuaUserData* UserData = (FLuaUserData*)lua_touserdata(L, 1);
 	if (!UserData->Context.IsValid())
@@ -944,7 +1622,9 @@ int ULuaState::MetaTableFunctionUserData__eq(lua_State* L)
 
 int ULuaState::MetaTableFunctionUserData__gc(lua_State* L)
 {
+	FLuaAllocator::FBridgeScope BridgeScope(L);
 	ULuaState* LuaState = ULuaState::GetFromExtraSpace(L);
+	LUAMACHINE_GAME_THREAD_ONLY(ULuaState::MetaTableFunctionUserData__gc);
 
 	FLuaUserData* UserData = (FLuaUserData*)lua_touserdata(L, 1);
 	if (!UserData->Context.IsValid())
@@ -953,10 +1633,17 @@ int ULuaState::MetaTableFunctionUserData__gc(lua_State* L)
 	}
 
 	ULuaUserDataObject* LuaUserDataObject = Cast<ULuaUserDataObject>(UserData->Context.Get());
-	if (LuaUserDataObject)
+	// other userdata could still point to the same object
+	if (LuaUserDataObject && --LuaUserDataObject->LuaUserDataRefs <= 0)
 	{
-		LuaState->TrackedLuaUserDataObjects.Remove(LuaUserDataObject);
-		LuaUserDataObject->ReceiveLuaGC();
+		LuaUserDataObject->LuaUserDataRefs = 0;
+		LuaState->UntrackLuaUserDataObject(LuaUserDataObject);
+		// blueprint events are not safe in the middle of a collection step
+		if (!LuaUserDataObject->bLuaGCPending)
+		{
+			LuaUserDataObject->bLuaGCPending = true;
+			LuaState->PendingLuaGCUserDataObjects.Add(LuaUserDataObject);
+		}
 	}
 
 	lua_pushnil(L);
@@ -965,7 +1652,9 @@ int ULuaState::MetaTableFunctionUserData__gc(lua_State* L)
 
 int ULuaState::MetaTableFunction__call(lua_State* L)
 {
+	FLuaAllocator::FBridgeScope BridgeScope(L);
 	ULuaState* LuaState = ULuaState::GetFromExtraSpace(L);
+	LUAMACHINE_GAME_THREAD_ONLY(ULuaState::MetaTableFunction__call);
 	FLuaUserData* LuaCallContext = (FLuaUserData*)lua_touserdata(L, 1);
 
 	if (!LuaCallContext->Context.IsValid() || !LuaCallContext->Function.IsValid())
@@ -1205,7 +1894,9 @@ int ULuaState::MetaTableFunction__call(lua_State* L)
 
 int ULuaState::MetaTableFunction__rawcall(lua_State * L)
 {
+	FLuaAllocator::FBridgeScope BridgeScope(L);
 	ULuaState* LuaState = ULuaState::GetFromExtraSpace(L);
+	LUAMACHINE_GAME_THREAD_ONLY(ULuaState::MetaTableFunction__rawcall);
 	FLuaUserData* LuaCallContext = (FLuaUserData*)lua_touserdata(L, 1);
 
 	if (!LuaCallContext->Context.IsValid() || !LuaCallContext->Function.IsValid())
@@ -1363,7 +2054,9 @@ int ULuaState::MetaTableFunction__rawcall(lua_State * L)
 
 int ULuaState::MetaTableFunction__rawbroadcast(lua_State * L)
 {
+	FLuaAllocator::FBridgeScope BridgeScope(L);
 	ULuaState* LuaState = ULuaState::GetFromExtraSpace(L);
+	LUAMACHINE_GAME_THREAD_ONLY(ULuaState::MetaTableFunction__rawbroadcast);
 	FLuaUserData* LuaCallContext = (FLuaUserData*)lua_touserdata(L, 1);
 
 	if (!LuaCallContext->MulticastScriptDelegate || !LuaCallContext->Function.IsValid())
@@ -1424,32 +2117,60 @@ int ULuaState::MetaTableFunction__rawbroadcast(lua_State * L)
 	return 1;
 }
 
-int ULuaState::TableFunction_print(lua_State * L)
+int ULuaState::MetaTableFunctionGlobal__index(lua_State* L)
 {
+	FLuaAllocator::FBridgeScope BridgeScope(L);
 	ULuaState* LuaState = ULuaState::GetFromExtraSpace(L);
-	TArray<FString> Messages;
+	LUAMACHINE_GAME_THREAD_ONLY(ULuaState::MetaTableFunctionGlobal__index);
+	UWorld* World = LuaState->GetWorld();
 
-	int n = lua_gettop(L);
-	lua_getglobal(L, "tostring");
-	for (int i = 1; i <= n; i++)
+	// the registry is for the shared state of the class, not for the dynamic ones
+	if (lua_type(L, 2) == LUA_TSTRING && World && FLuaMachineModule::Get().IsSharedLuaState(LuaState))
+	{
+		ULuaWorldSubsystem* LuaWorldSubsystem = World->GetSubsystem<ULuaWorldSubsystem>();
+		if (LuaWorldSubsystem && LuaWorldSubsystem->ResolveLuaGlobalName(LuaState, lua_tostring(L, 2), L))
+		{
+			return 1;
+		}
+	}
+
+	lua_pushnil(L);
+	return 1;
+}
+
+int ULuaState::TableFunction_print(lua_State * L)
+{
+	FLuaAllocator::FBridgeScope BridgeScope(L);
+	ULuaState* LuaState = ULuaState::GetFromExtraSpace(L);
+	FString Message;
+
+	int n = lua_gettop(L);
+	lua_getglobal(L, "tostring");
+	for (int i = 1; i <= n; i++)
 	{
 		lua_pushvalue(L, -1);
 		lua_pushvalue(L, i);
 		lua_call(L, 1, 1);
-		const char* s = lua_tostring(L, -1);
+		size_t Len = 0;
+		const char* s = lua_tolstring(L, -1, &Len);
 		if (!s)
 			return luaL_error(L, "'tostring must return a string to 'print'");
-		FString Value = ANSI_TO_TCHAR(s);
+		if (i > 1)
+		{
+			Message.AppendChar(TEXT('\t'));
+		}
+		Message.Append(ANSI_TO_TCHAR(s));
 		lua_pop(L, 1);
-		Messages.Add(Value);
 	}
-	LuaState->Log(FString::Join(Messages, TEXT("\t")));
+	LuaState->Log(Message);
 	return 0;
 }
 
 int ULuaState::TableFunction_package_loader_codeasset(lua_State * L)
 {
+	FLuaAllocator::FBridgeScope BridgeScope(L);
 	ULuaState* LuaState = ULuaState::GetFromExtraSpace(L);
+	LUAMACHINE_GAME_THREAD_ONLY(ULuaState::TableFunction_package_loader_codeasset);
 
 	// use the second (sanitized by the loader) argument
 	FString Key = ANSI_TO_TCHAR(lua_tostring(L, 2));
@@ -1479,7 +2200,9 @@ int ULuaState::TableFunction_package_loader_codeasset(lua_State * L)
 
 int ULuaState::TableFunction_package_loader_asset(lua_State * L)
 {
+	FLuaAllocator::FBridgeScope BridgeScope(L);
 	ULuaState* LuaState = ULuaState::GetFromExtraSpace(L);
+	LUAMACHINE_GAME_THREAD_ONLY(ULuaState::TableFunction_package_loader_asset);
 
 	// use the second (sanitized by the loader) argument
 	const FString Key = ANSI_TO_TCHAR(lua_tostring(L, 2));
@@ -1493,7 +2216,9 @@ int ULuaState::TableFunction_package_loader_asset(lua_State * L)
 
 int ULuaState::TableFunction_package_loader(lua_State * L)
 {
+	FLuaAllocator::FBridgeScope BridgeScope(L);
 	ULuaState* LuaState = ULuaState::GetFromExtraSpace(L);
+	LUAMACHINE_GAME_THREAD_ONLY(ULuaState::TableFunction_package_loader);
 
 	FString Key = ANSI_TO_TCHAR(lua_tostring(L, 1));
 
@@ -1551,7 +2276,9 @@ int ULuaState::TableFunction_package_loader(lua_State * L)
 
 int ULuaState::TableFunction_package_preload(lua_State * L)
 {
+	FLuaAllocator::FBridgeScope BridgeScope(L);
 	ULuaState* LuaState = ULuaState::GetFromExtraSpace(L);
+	LUAMACHINE_GAME_THREAD_ONLY(ULuaState::TableFunction_package_preload);
 
 	if (LuaState->L != L)
 	{
@@ -1643,6 +2370,7 @@ void ULuaState::ReceiveLuaStateInitialized_Implementation()
 
 void ULuaState::NewTable()
 {
+	LUAMACHINE_CHECK_OWNER();
 	lua_newtable(L);
 }
 
@@ -1658,11 +2386,13 @@ void ULuaState::GetMetaTable(int Index)
 
 void ULuaState::SetField(int Index, const char* FieldName)
 {
+	LUAMACHINE_CHECK_OWNER();
 	lua_setfield(L, Index, FieldName);
 }
 
 void ULuaState::GetField(int Index, const char* FieldName)
 {
+	LUAMACHINE_CHECK_OWNER();
 	lua_getfield(L, Index, FieldName);
 }
 
@@ -1678,6 +2408,7 @@ void ULuaState::RawSetI(int Index, int N)
 
 void ULuaState::PushGlobalTable()
 {
+	LUAMACHINE_CHECK_OWNER();
 	lua_pushglobaltable(L);
 }
 
@@ -1688,6 +2419,8 @@ void ULuaState::PushRegistryTable()
 
 int32 ULuaState::GetFieldFromTree(const FString & Tree, bool bGlobal)
 {
+	LUAMACHINE_CHECK_OWNER();
+
 	TArray<FString> Parts;
 	Tree.ParseIntoArray(Parts, TEXT("."));
 	if (Parts.Num() == 0)
@@ -1750,6 +2483,8 @@ void ULuaState::SetFieldFromTree(const FString & Tree, FLuaValue & Value, bool b
 
 void ULuaState::NewUObject(UObject * Object, lua_State * State)
 {
+	LUAMACHINE_CHECK_OWNER();
+
 	if (!State)
 	{
 		State = this->L;
@@ -1762,21 +2497,26 @@ void ULuaState::NewUObject(UObject * Object, lua_State * State)
 
 void ULuaState::GetGlobal(const char* Name)
 {
+	LUAMACHINE_CHECK_OWNER();
 	lua_getglobal(L, Name);
 }
 
 void ULuaState::SetGlobal(const char* Name)
 {
+	LUAMACHINE_CHECK_OWNER();
 	lua_setglobal(L, Name);
 }
 
 void ULuaState::PushValue(int Index)
 {
+	LUAMACHINE_CHECK_OWNER();
 	lua_pushvalue(L, Index);
 }
 
 bool ULuaState::PCall(int NArgs, FLuaValue & Value, int NRet)
 {
+	LUAMACHINE_CHECK_OWNER();
+
 	bool bSuccess = Call(NArgs, Value, NRet);
 	if (!bSuccess)
 	{
@@ -1788,7 +2528,21 @@ bool ULuaState::PCall(int NArgs, FLuaValue & Value, int NRet)
 		{
 			if (bLogError)
 				LogError(LastError);
-			ReceiveLuaError(LastError);
+			if (LuaThread && !IsInGameThread())
+			{
+				TWeakObjectPtr<ULuaState> WeakLuaState(this);
+				LuaThread->PostToGameThread([WeakLuaState, Error = LastError]()
+					{
+						if (WeakLuaState.IsValid())
+						{
+							WeakLuaState->ReceiveLuaError(Error);
+						}
+					});
+			}
+			else
+			{
+				ReceiveLuaError(LastError);
+			}
 		}
 	}
 	return bSuccess;
@@ -1796,8 +2550,21 @@ bool ULuaState::PCall(int NArgs, FLuaValue & Value, int NRet)
 
 bool ULuaState::Call(int NArgs, FLuaValue & Value, int NRet)
 {
-	if (lua_pcall(L, NArgs, NRet, 0))
+	LUAMACHINE_CHECK_OWNER();
+
+	DrainPendingUnrefs();
+
+	// temporaries of the C functions called by the VM are released when the call returns
+	FMemMark Mark(FMemStack::Get());
+	FLuaAllocator::FProtectedScope ProtectedScope(LuaAllocator.Get());
+
+	const int Ret = lua_pcall(L, NArgs, NRet, 0);
+	if (Ret != LUA_OK)
 	{
+		if (Ret == LUA_ERRMEM)
+		{
+			UE_LOG(LogLuaMachine, Warning, TEXT("%s is out of memory (budget: %lld bytes)"), *GetName(), LuaMemoryBudget);
+		}
 		LastError = FString::Printf(TEXT("Lua error: %s"), ANSI_TO_TCHAR(lua_tostring(L, -1)));
 		return false;
 	}
@@ -1809,8 +2576,18 @@ bool ULuaState::Call(int NArgs, FLuaValue & Value, int NRet)
 	return true;
 }
 
+FLuaCallResult ULuaState::PCallMulti(int NArgs)
+{
+	const int32 FunctionIndex = GetTop() - NArgs;
+	FLuaValue UnusedValue;
+	const bool bSuccess = PCall(NArgs, UnusedValue, LUA_MULTRET);
+	// on error the message is left in the function slot, the result view will pop it
+	return FLuaCallResult(this, FunctionIndex, bSuccess ? (GetTop() - FunctionIndex + 1) : 0, bSuccess);
+}
+
 void ULuaState::Pop(int32 Amount)
 {
+	LUAMACHINE_CHECK_OWNER();
 	lua_pop(L, Amount);
 }
 
@@ -1824,6 +2601,90 @@ void ULuaState::PushCFunction(lua_CFunction Function)
 	lua_pushcfunction(L, Function);
 }
 
+// interned names are never released (until the state is closed), so just stop caching after this limit
+#define LUAMACHINE_MAX_INTERNED_NAMES 8192
+// only short strings are deduplicated by Lua (LUAI_MAXSHORTLEN), longer ones would not have a stable pointer
+#define LUAMACHINE_MAX_INTERNED_NAME_LEN 40
+
+const FLuaInternedName* ULuaState::InternName(int Index, lua_State* State)
+{
+	if (!State)
+	{
+		State = this->L;
+	}
+
+	if (lua_type(State, Index) != LUA_TSTRING)
+	{
+		return nullptr;
+	}
+
+	size_t StringLength = 0;
+	const char* String = lua_tolstring(State, Index, &StringLength);
+	// the pointer is stable as long as the string is referenced (and interned strings are pinned in the registry)
+	if (TUniquePtr<FLuaInternedName>* InternedName = InternedLuaStrings.Find(String))
+	{
+		return InternedName->Get();
+	}
+
+	if (InternedLuaStrings.Num() >= LUAMACHINE_MAX_INTERNED_NAMES || StringLength > LUAMACHINE_MAX_INTERNED_NAME_LEN || FCStringAnsi::Strlen(String) != StringLength)
+	{
+		return nullptr;
+	}
+
+	TUniquePtr<FLuaInternedName> NewInternedName = MakeUnique<FLuaInternedName>();
+	NewInternedName->String = UTF8_TO_TCHAR(String);
+	NewInternedName->Name = FName(*NewInternedName->String);
+	NewInternedName->StringHash = GetTypeHash(NewInternedName->String);
+
+	lua_pushvalue(State, Index);
+	if (State != this->L)
+		lua_xmove(State, this->L, 1);
+	NewInternedName->LuaRef = luaL_ref(this->L, LUA_REGISTRYINDEX);
+
+	const FLuaInternedName* InternedName = NewInternedName.Get();
+	InternedLuaStrings.Add(String, MoveTemp(NewInternedName));
+	return InternedName;
+}
+
+FName ULuaState::ToName(int Index, lua_State* State)
+{
+	if (const FLuaInternedName* InternedName = InternName(Index, State))
+	{
+		return InternedName->Name;
+	}
+	return ToLuaValue(Index, State).ToName();
+}
+
+void ULuaState::PushName(FName Name, lua_State* State)
+{
+	if (!State)
+	{
+		State = this->L;
+	}
+
+	// FName comparison is case insensitive, while Lua strings are not
+	FLuaPinnedName* PinnedName = InternedNames.Find(Name);
+	if (PinnedName && PinnedName->Name.IsEqual(Name, ENameCase::CaseSensitive))
+	{
+		lua_rawgeti(State, LUA_REGISTRYINDEX, PinnedName->LuaRef);
+		return;
+	}
+
+	FTCHARToUTF8 NameUTF8(*Name.ToString());
+	lua_pushlstring(State, NameUTF8.Get(), NameUTF8.Length());
+
+	if (!PinnedName && InternedNames.Num() < LUAMACHINE_MAX_INTERNED_NAMES)
+	{
+		lua_pushvalue(State, -1);
+		if (State != this->L)
+			lua_xmove(State, this->L, 1);
+		FLuaPinnedName NewPinnedName;
+		NewPinnedName.Name = Name;
+		NewPinnedName.LuaRef = luaL_ref(this->L, LUA_REGISTRYINDEX);
+		InternedNames.Add(Name, NewPinnedName);
+	}
+}
+
 void* ULuaState::NewUserData(size_t DataSize)
 {
 	return lua_newuserdata(L, DataSize);
@@ -1843,8 +2704,27 @@ void ULuaState::UnrefChecked(int Ref)
 	Unref(Ref);
 }
 
+void ULuaState::DrainPendingUnrefs()
+{
+	// in case of moved value (like when compiling a blueprint), L should be nullptr
+	if (!L || !UnrefQueue)
+	{
+		return;
+	}
+
+	int32 Drained = 0;
+	int Ref = LUA_NOREF;
+	while (UnrefQueue->Dequeue(Ref))
+	{
+		luaL_unref(L, LUA_REGISTRYINDEX, Ref);
+		Drained++;
+	}
+	INC_DWORD_STAT_BY(STAT_LuaDeferredUnrefs, Drained);
+}
+
 int ULuaState::NewRef()
 {
+	LUAMACHINE_CHECK_OWNER();
 	return luaL_ref(L, LUA_REGISTRYINDEX);
 }
 
@@ -1890,6 +2770,8 @@ bool ULuaState::Yield(int Index, int NArgs)
 
 bool ULuaState::Resume(int Index, int NArgs)
 {
+	LUAMACHINE_CHECK_OWNER();
+
 	lua_State* Coroutine = lua_tothread(L, Index);
 	if (!Coroutine)
 		return false;
@@ -1901,8 +2783,14 @@ bool ULuaState::Resume(int Index, int NArgs)
 		return false;
 	}
 
+	DrainPendingUnrefs();
+
 	lua_xmove(L, Coroutine, NArgs);
-	int Ret = lua_resume(Coroutine, L, NArgs);
+	int Ret = LUA_OK;
+	{
+		FLuaAllocator::FProtectedScope ProtectedScope(LuaAllocator.Get());
+		Ret = lua_resume(Coroutine, L, NArgs);
+	}
 	if (Ret != LUA_OK && Ret != LUA_YIELD)
 	{
 		lua_pushboolean(L, 0);
@@ -1918,9 +2806,38 @@ bool ULuaState::Resume(int Index, int NArgs)
 
 int ULuaState::GC(int What, int Data)
 {
+	// collections run the __gc metamethods
+	if (What == LUA_GCCOLLECT || What == LUA_GCSTEP)
+	{
+		return ProtectedGC(What, Data);
+	}
 	return lua_gc(L, What, Data);
 }
 
+static int LuaProtectedGC(lua_State* L)
+{
+	lua_pushinteger(L, lua_gc(L, (int)lua_tointeger(L, 1), (int)lua_tointeger(L, 2)));
+	return 1;
+}
+
+int ULuaState::ProtectedGC(const int What, const int Data)
+{
+	// an error in a __gc metamethod would be a panic outside of a protected call
+	lua_pushcfunction(L, LuaProtectedGC);
+	lua_pushinteger(L, What);
+	lua_pushinteger(L, Data);
+	if (lua_pcall(L, 2, 1, 0) != LUA_OK)
+	{
+		const char* Error = lua_tostring(L, -1);
+		LogError(FString::Printf(TEXT("Lua error while collecting garbage: %s"), Error ? UTF8_TO_TCHAR(Error) : TEXT("unknown error")));
+		lua_pop(L, 1);
+		return 0;
+	}
+	const int Result = (int)lua_tointeger(L, -1);
+	lua_pop(L, 1);
+	return Result;
+}
+
 void ULuaState::Len(int Index)
 {
 	lua_len(L, Index);
@@ -1946,150 +2863,527 @@ FLuaValue ULuaState::CreateLuaTable()
 	return NewTable;
 }
 
-FLuaValue ULuaState::CreateLuaLazyTable()
+#if ENGINE_MAJOR_VERSION > 4 || ENGINE_MINOR_VERSION >= 25
+#define LUAVALUE_PROP_IS(Prop, Type) (CastField<F##Type>(Prop) != nullptr)
+#else
+#define LUAVALUE_PROP_IS(Prop, Type) (Cast<U##Type>(Prop) != nullptr)
+#endif
+
+// bulk transfer of POD arrays (tight loops of raw sets/gets, no FLuaValue in the middle)
+static FORCEINLINE void LuaPushPOD(lua_State* L, const float Value) { lua_pushnumber(L, Value); }
+static FORCEINLINE void LuaPushPOD(lua_State* L, const double Value) { lua_pushnumber(L, Value); }
+static FORCEINLINE void LuaPushPOD(lua_State* L, const int8 Value) { lua_pushinteger(L, Value); }
+static FORCEINLINE void LuaPushPOD(lua_State* L, const uint8 Value) { lua_pushinteger(L, Value); }
+static FORCEINLINE void LuaPushPOD(lua_State* L, const int16 Value) { lua_pushinteger(L, Value); }
+static FORCEINLINE void LuaPushPOD(lua_State* L, const uint16 Value) { lua_pushinteger(L, Value); }
+static FORCEINLINE void LuaPushPOD(lua_State* L, const int32 Value) { lua_pushinteger(L, Value); }
+static FORCEINLINE void LuaPushPOD(lua_State* L, const uint32 Value) { lua_pushinteger(L, Value); }
+static FORCEINLINE void LuaPushPOD(lua_State* L, const int64 Value) { lua_pushinteger(L, Value); }
+
+static FORCEINLINE lua_Integer LuaToPODInteger(lua_State* L, const int Index)
 {
-	FLuaValue NewTable;
-	NewTable.Type = ELuaValueType::Table;
-	NewTable.LuaState = this;
-	return NewTable;
+	int bIsInteger = 0;
+	lua_Integer Value = lua_tointegerx(L, Index, &bIsInteger);
+	return bIsInteger ? Value : (lua_Integer)lua_tonumber(L, Index);
 }
 
-FLuaValue ULuaState::CreateLuaThread(FLuaValue Value)
+static FORCEINLINE void LuaToPOD(lua_State* L, const int Index, float& Value) { Value = (float)lua_tonumber(L, Index); }
+static FORCEINLINE void LuaToPOD(lua_State* L, const int Index, double& Value) { Value = lua_tonumber(L, Index); }
+static FORCEINLINE void LuaToPOD(lua_State* L, const int Index, int8& Value) { Value = (int8)LuaToPODInteger(L, Index); }
+static FORCEINLINE void LuaToPOD(lua_State* L, const int Index, uint8& Value) { Value = (uint8)LuaToPODInteger(L, Index); }
+static FORCEINLINE void LuaToPOD(lua_State* L, const int Index, int16& Value) { Value = (int16)LuaToPODInteger(L, Index); }
+static FORCEINLINE void LuaToPOD(lua_State* L, const int Index, uint16& Value) { Value = (uint16)LuaToPODInteger(L, Index); }
+static FORCEINLINE void LuaToPOD(lua_State* L, const int Index, int32& Value) { Value = (int32)LuaToPODInteger(L, Index); }
+static FORCEINLINE void LuaToPOD(lua_State* L, const int Index, uint32& Value) { Value = (uint32)LuaToPODInteger(L, Index); }
+static FORCEINLINE void LuaToPOD(lua_State* L, const int Index, int64& Value) { Value = (int64)LuaToPODInteger(L, Index); }
+
+template<typename T>
+static void LuaPushPODArray(lua_State* L, const T* Data, const int32 Num)
 {
-	FLuaValue NewThread;
-	NewThread.Type = ELuaValueType::Thread;
-	NewThread.LuaState = this;
-	FromLuaValue(NewThread);
-	lua_State* NewLuaThread = lua_tothread(L, -1);
-	FromLuaValue(Value, nullptr, NewLuaThread);
-	Pop();
-	return NewThread;
+	lua_createtable(L, Num, 0);
+	for (int32 ArrayIndex = 0; ArrayIndex < Num; ArrayIndex++)
+	{
+		LuaPushPOD(L, Data[ArrayIndex]);
+		lua_rawseti(L, -2, ArrayIndex + 1);
+	}
 }
 
-ELuaThreadStatus ULuaState::GetLuaThreadStatus(FLuaValue Value)
+template<typename T>
+static void LuaReadPODArray(lua_State* L, const int TableIndex, T* Data, const int32 Num)
 {
-	if (Value.Type != ELuaValueType::Thread || Value.LuaState != this)
-		return ELuaThreadStatus::Invalid;
-
-	FromLuaValue(Value);
-	lua_State* LuaThread = lua_tothread(L, -1);
-	int ReturnValue = lua_status(LuaThread);
-	Pop();
-
-	if (ReturnValue == 0)
-		return ELuaThreadStatus::Ok;
-
-	if (ReturnValue == LUA_YIELD)
-		return ELuaThreadStatus::Suspended;
-
-	return ELuaThreadStatus::Error;
+	for (int32 ArrayIndex = 0; ArrayIndex < Num; ArrayIndex++)
+	{
+		lua_rawgeti(L, TableIndex, ArrayIndex + 1);
+		LuaToPOD(L, -1, Data[ArrayIndex]);
+		lua_pop(L, 1);
+	}
 }
 
-int32 ULuaState::GetLuaThreadStackTop(FLuaValue Value)
+// vectors are packed as x1, y1, z1, x2, y2, z2...
+static void LuaPushPackedVectorArray(lua_State* L, const FVector* Data, const int32 Num)
 {
-	if (Value.Type != ELuaValueType::Thread || Value.LuaState != this)
-		return MIN_int32;
-
-	FromLuaValue(Value);
-	lua_State* LuaThread = lua_tothread(L, -1);
-	int ReturnValue = lua_gettop(LuaThread);
-	Pop();
-
-	return ReturnValue;
+	lua_createtable(L, Num * 3, 0);
+	for (int32 ArrayIndex = 0; ArrayIndex < Num; ArrayIndex++)
+	{
+		lua_pushnumber(L, Data[ArrayIndex].X);
+		lua_rawseti(L, -2, ArrayIndex * 3 + 1);
+		lua_pushnumber(L, Data[ArrayIndex].Y);
+		lua_rawseti(L, -2, ArrayIndex * 3 + 2);
+		lua_pushnumber(L, Data[ArrayIndex].Z);
+		lua_rawseti(L, -2, ArrayIndex * 3 + 3);
+	}
 }
 
-TSharedRef<FLuaSmartReference> ULuaState::AddLuaSmartReference(FLuaValue Value)
+// same layout generated by StructToLuaTable() ({X=..., Y=..., Z=...} for each item)
+static void LuaPushVectorTableArray(lua_State* L, const FVector* Data, const int32 Num)
 {
-	TSharedRef<FLuaSmartReference> Ref = MakeShared<FLuaSmartReference>();
-	Ref->LuaState = this;
-	Ref->Value = Value;
-
-	LuaSmartReferences.Add(Ref);
-
-	return Ref;
+	lua_createtable(L, Num, 0);
+	for (int32 ArrayIndex = 0; ArrayIndex < Num; ArrayIndex++)
+	{
+		lua_createtable(L, 0, 3);
+		lua_pushnumber(L, Data[ArrayIndex].X);
+		lua_setfield(L, -2, "X");
+		lua_pushnumber(L, Data[ArrayIndex].Y);
+		lua_setfield(L, -2, "Y");
+		lua_pushnumber(L, Data[ArrayIndex].Z);
+		lua_setfield(L, -2, "Z");
+		lua_rawseti(L, -2, ArrayIndex + 1);
+	}
 }
 
-void ULuaState::RemoveLuaSmartReference(TSharedRef<FLuaSmartReference> Ref)
+static int32 LuaGetVectorArrayNum(lua_State* L, const int TableIndex, bool& bPacked)
 {
-	LuaSmartReferences.Remove(Ref);
+	lua_rawgeti(L, TableIndex, 1);
+	bPacked = lua_type(L, -1) == LUA_TNUMBER;
+	lua_pop(L, 1);
+	const int32 Len = (int32)lua_rawlen(L, TableIndex);
+	return bPacked ? Len / 3 : Len;
 }
 
-ULuaState::~ULuaState()
+static bool LuaGetVectorComponent(lua_State* L, const int ItemIndex, const char* FieldName, const char* FieldNameLower, double& Value)
 {
-	FCoreUObjectDelegates::GetPostGarbageCollect().Remove(GCLuaDelegatesHandle);
-
-#if WITH_EDITOR
-	if (LuaConsole.LuaState)
+	lua_pushstring(L, FieldName);
+	lua_rawget(L, ItemIndex);
+	if (lua_isnil(L, -1))
 	{
-		IModularFeatures::Get().UnregisterModularFeature(IConsoleCommandExecutor::ModularFeatureName(), &LuaConsole);
+		lua_pop(L, 1);
+		lua_pushstring(L, FieldNameLower);
+		lua_rawget(L, ItemIndex);
 	}
-#endif
-
-	FLuaMachineModule::Get().UnregisterLuaState(this);
-
-	if (L)
+	const bool bFound = lua_type(L, -1) == LUA_TNUMBER || lua_type(L, -1) == LUA_TSTRING;
+	if (bFound)
 	{
-		lua_close(L);
-		L = nullptr;
+		Value = lua_tonumber(L, -1);
 	}
+	lua_pop(L, 1);
+	return bFound;
 }
 
-#if ENGINE_MAJOR_VERSION > 4 || ENGINE_MINOR_VERSION >= 25
-#define LUAVALUE_PROP_CAST(Type, Type2) F##Type* __##Type##__ = CastField<F##Type>(Property);\
-	if (__##Type##__)\
-	{\
-		return FLuaValue((Type2)__##Type##__->GetPropertyValue_InContainer(Buffer, Index));\
-	}
+static void LuaReadVectorArray(lua_State* L, const int TableIndex, FVector* Data, const int32 Num, const bool bPacked)
+{
+	for (int32 ArrayIndex = 0; ArrayIndex < Num; ArrayIndex++)
+	{
+		if (bPacked)
+		{
+			lua_rawgeti(L, TableIndex, ArrayIndex * 3 + 1);
+			Data[ArrayIndex].X = lua_tonumber(L, -1);
+			lua_rawgeti(L, TableIndex, ArrayIndex * 3 + 2);
+			Data[ArrayIndex].Y = lua_tonumber(L, -1);
+			lua_rawgeti(L, TableIndex, ArrayIndex * 3 + 3);
+			Data[ArrayIndex].Z = lua_tonumber(L, -1);
+			lua_pop(L, 3);
+			continue;
+		}
 
-#define LUAVALUE_PROP_CAST_TOSTRING(Type) F##Type* __##Type##__ = CastField<F##Type>(Property);\
-	if (__##Type##__)\
-	{\
-		return FLuaValue(__##Type##__->GetPropertyValue_InContainer(Buffer, Index).ToString());\
+		lua_rawgeti(L, TableIndex, ArrayIndex + 1);
+		if (lua_istable(L, -1))
+		{
+			const int ItemIndex = lua_gettop(L);
+			double Component = 0;
+			if (LuaGetVectorComponent(L, ItemIndex, "X", "x", Component))
+				Data[ArrayIndex].X = Component;
+			if (LuaGetVectorComponent(L, ItemIndex, "Y", "y", Component))
+				Data[ArrayIndex].Y = Component;
+			if (LuaGetVectorComponent(L, ItemIndex, "Z", "z", Component))
+				Data[ArrayIndex].Z = Component;
+		}
+		lua_pop(L, 1);
 	}
+}
 
-#define LUAVALUE_PROP_SET(Type, Value) F##Type* __##Type##__ = CastField<F##Type>(Property);\
-	if (__##Type##__)\
-	{\
-		__##Type##__->SetPropertyValue_InContainer(Buffer, Value, Index);\
-		return;\
-	}
+#if ENGINE_MAJOR_VERSION > 4 || ENGINE_MINOR_VERSION >= 25
+static bool LuaIsVectorProperty(FProperty* Property)
+{
+	FStructProperty* StructProperty = CastField<FStructProperty>(Property);
 #else
-#define LUAVALUE_PROP_CAST(Type, Type2) U##Type* __##Type##__ = Cast<U##Type>(Property);\
-	if (__##Type##__)\
-	{\
-		return FLuaValue((Type2)__##Type##__->GetPropertyValue_InContainer(Buffer, Index));\
-	}
+static bool LuaIsVectorProperty(UProperty* Property)
+{
+	UStructProperty* StructProperty = Cast<UStructProperty>(Property);
+#endif
+	return StructProperty && StructProperty->Struct == TBaseStructure<FVector>::Get();
+}
 
-#define LUAVALUE_PROP_CAST_TOSTRING(Type) U##Type* __##Type##__ = Cast<U##Type>(Property);\
-	if (__##Type##__)\
+#if ENGINE_MAJOR_VERSION > 4 || ENGINE_MINOR_VERSION >= 25
+static bool LuaPushPODArrayFromProperty(lua_State* L, FProperty* Inner, const uint8* Data, const int32 Num)
+#else
+static bool LuaPushPODArrayFromProperty(lua_State* L, UProperty* Inner, const uint8* Data, const int32 Num)
+#endif
+{
+#define LUAVALUE_POD_PUSH(PropertyType, Type) if (LUAVALUE_PROP_IS(Inner, PropertyType))\
 	{\
-		return FLuaValue(__##Type##__->GetPropertyValue_InContainer(Buffer, Index).ToString());\
+		LuaPushPODArray(L, reinterpret_cast<const Type*>(Data), Num);\
+		return true;\
 	}
 
-#define LUAVALUE_PROP_SET(Type, Value) U##Type* __##Type##__ = Cast<U##Type>(Property);\
-	if (__##Type##__)\
-	{\
-		__##Type##__->SetPropertyValue_InContainer(Buffer, Value, Index);\
-		return;\
+	LUAVALUE_POD_PUSH(FloatProperty, float);
+	LUAVALUE_POD_PUSH(DoubleProperty, double);
+	LUAVALUE_POD_PUSH(IntProperty, int32);
+	LUAVALUE_POD_PUSH(Int64Property, int64);
+	LUAVALUE_POD_PUSH(UInt32Property, uint32);
+	LUAVALUE_POD_PUSH(Int16Property, int16);
+	LUAVALUE_POD_PUSH(UInt16Property, uint16);
+	LUAVALUE_POD_PUSH(Int8Property, int8);
+	LUAVALUE_POD_PUSH(ByteProperty, uint8);
+#undef LUAVALUE_POD_PUSH
+
+	if (LuaIsVectorProperty(Inner))
+	{
+		LuaPushVectorTableArray(L, reinterpret_cast<const FVector*>(Data), Num);
+		return true;
 	}
-#endif
 
-#if	ENGINE_MAJOR_VERSION > 4 || ENGINE_MINOR_VERSION >= 25
-FLuaValue ULuaState::FromUProperty(void* Buffer, FProperty * Property, bool& bSuccess, int32 Index)
-{
-	return FromFProperty(Buffer, Property, bSuccess, Index);
+	return false;
 }
-void ULuaState::ToUProperty(void* Buffer, FProperty * Property, FLuaValue Value, bool& bSuccess, int32 Index)
+
+// true if the keys of the table are exactly 1..Len (holes and non integer keys need the generic path)
+static bool LuaIsSequence(lua_State* L, const int TableIndex, const int32 Len)
 {
-	ToFProperty(Buffer, Property, Value, bSuccess, Index);
+	int32 Keys = 0;
+	lua_pushnil(L);
+	while (lua_next(L, TableIndex) != 0)
+	{
+		lua_pop(L, 1);
+		int bIsInteger = 0;
+		const lua_Integer Key = lua_tointegerx(L, -1, &bIsInteger);
+		if (!bIsInteger || lua_type(L, -1) != LUA_TNUMBER || Key < 1 || Key > Len || ++Keys > Len)
+		{
+			lua_pop(L, 1);
+			return false;
+		}
+	}
+	return Keys == Len;
 }
-#endif
 
 #if ENGINE_MAJOR_VERSION > 4 || ENGINE_MINOR_VERSION >= 25
-FLuaValue ULuaState::FromFProperty(void* Buffer, FProperty * Property, bool& bSuccess, int32 Index)
+static bool LuaReadPODArrayToProperty(lua_State* L, const int TableIndex, FArrayProperty* ArrayProperty, FScriptArrayHelper& Helper)
+{
+	FProperty* Inner = ArrayProperty->Inner;
 #else
-FLuaValue ULuaState::FromUProperty(void* Buffer, UProperty * Property, bool& bSuccess, int32 Index)
-#endif
+static bool LuaReadPODArrayToProperty(lua_State* L, const int TableIndex, UArrayProperty* ArrayProperty, FScriptArrayHelper& Helper)
+{
+	UProperty* Inner = ArrayProperty->Inner;
+#endif
+
+	if (!LuaIsSequence(L, TableIndex, (int32)lua_rawlen(L, TableIndex)))
+	{
+		return false;
+	}
+
+#define LUAVALUE_POD_READ(PropertyType, Type) if (LUAVALUE_PROP_IS(Inner, PropertyType))\
+	{\
+		const int32 Num = (int32)lua_rawlen(L, TableIndex);\
+		Helper.Resize(Num);\
+		if (Num > 0)\
+		{\
+			LuaReadPODArray(L, TableIndex, reinterpret_cast<Type*>(Helper.GetRawPtr(0)), Num);\
+		}\
+		return true;\
+	}
+
+	LUAVALUE_POD_READ(FloatProperty, float);
+	LUAVALUE_POD_READ(DoubleProperty, double);
+	LUAVALUE_POD_READ(IntProperty, int32);
+	LUAVALUE_POD_READ(Int64Property, int64);
+	LUAVALUE_POD_READ(UInt32Property, uint32);
+	LUAVALUE_POD_READ(Int16Property, int16);
+	LUAVALUE_POD_READ(UInt16Property, uint16);
+	LUAVALUE_POD_READ(Int8Property, int8);
+	LUAVALUE_POD_READ(ByteProperty, uint8);
+#undef LUAVALUE_POD_READ
+
+	if (LuaIsVectorProperty(Inner))
+	{
+		bool bPacked = false;
+		const int32 Num = LuaGetVectorArrayNum(L, TableIndex, bPacked);
+		Helper.Resize(Num);
+		if (Num > 0)
+		{
+			LuaReadVectorArray(L, TableIndex, reinterpret_cast<FVector*>(Helper.GetRawPtr(0)), Num, bPacked);
+		}
+		return true;
+	}
+
+	return false;
+}
+
+FLuaValue ULuaState::CreateLuaTableFromArray(const TArray<float>& Values)
+{
+	LuaPushPODArray(L, Values.GetData(), Values.Num());
+	FLuaValue NewTable = ToLuaValue(-1);
+	Pop();
+	return NewTable;
+}
+
+FLuaValue ULuaState::CreateLuaTableFromArray(const TArray<double>& Values)
+{
+	LuaPushPODArray(L, Values.GetData(), Values.Num());
+	FLuaValue NewTable = ToLuaValue(-1);
+	Pop();
+	return NewTable;
+}
+
+FLuaValue ULuaState::CreateLuaTableFromArray(const TArray<int32>& Values)
+{
+	LuaPushPODArray(L, Values.GetData(), Values.Num());
+	FLuaValue NewTable = ToLuaValue(-1);
+	Pop();
+	return NewTable;
+}
+
+FLuaValue ULuaState::CreateLuaTableFromArray(const TArray<int64>& Values)
+{
+	LuaPushPODArray(L, Values.GetData(), Values.Num());
+	FLuaValue NewTable = ToLuaValue(-1);
+	Pop();
+	return NewTable;
+}
+
+FLuaValue ULuaState::CreateLuaTableFromArray(const TArray<FVector>& Values)
+{
+	LuaPushPackedVectorArray(L, Values.GetData(), Values.Num());
+	FLuaValue NewTable = ToLuaValue(-1);
+	Pop();
+	return NewTable;
+}
+
+template<typename T>
+static bool LuaTableToPODArray(ULuaState* LuaState, FLuaValue& Table, TArray<T>& Values)
+{
+	if (Table.Type != ELuaValueType::Table || Table.LuaState != LuaState)
+		return false;
+
+	lua_State* L = LuaState->GetInternalLuaState();
+	LuaState->FromLuaValue(Table);
+	const int32 Num = (int32)lua_rawlen(L, -1);
+	Values.SetNumUninitialized(Num);
+	LuaReadPODArray(L, lua_gettop(L), Values.GetData(), Num);
+	LuaState->Pop();
+	return true;
+}
+
+bool ULuaState::LuaTableToArray(FLuaValue& Table, TArray<float>& Values)
+{
+	return LuaTableToPODArray(this, Table, Values);
+}
+
+bool ULuaState::LuaTableToArray(FLuaValue& Table, TArray<double>& Values)
+{
+	return LuaTableToPODArray(this, Table, Values);
+}
+
+bool ULuaState::LuaTableToArray(FLuaValue& Table, TArray<int32>& Values)
+{
+	return LuaTableToPODArray(this, Table, Values);
+}
+
+bool ULuaState::LuaTableToArray(FLuaValue& Table, TArray<int64>& Values)
+{
+	return LuaTableToPODArray(this, Table, Values);
+}
+
+bool ULuaState::LuaTableToArray(FLuaValue& Table, TArray<FVector>& Values)
+{
+	if (Table.Type != ELuaValueType::Table || Table.LuaState != this)
+		return false;
+
+	FromLuaValue(Table);
+	bool bPacked = false;
+	const int32 Num = LuaGetVectorArrayNum(L, GetTop(), bPacked);
+	Values.Init(FVector::ZeroVector, Num);
+	LuaReadVectorArray(L, GetTop(), Values.GetData(), Num, bPacked);
+	Pop();
+	return true;
+}
+
+FLuaValue ULuaState::CreateLuaLazyTable()
+{
+	FLuaValue NewTable;
+	NewTable.Type = ELuaValueType::Table;
+	NewTable.LuaState = this;
+	return NewTable;
+}
+
+FLuaValue ULuaState::CreateLuaThread(FLuaValue Value)
+{
+	FLuaValue NewThread;
+	NewThread.Type = ELuaValueType::Thread;
+	NewThread.LuaState = this;
+	FromLuaValue(NewThread);
+	lua_State* NewLuaThread = lua_tothread(L, -1);
+	FromLuaValue(Value, nullptr, NewLuaThread);
+	Pop();
+	return NewThread;
+}
+
+ELuaThreadStatus ULuaState::GetLuaThreadStatus(FLuaValue Value)
+{
+	if (Value.Type != ELuaValueType::Thread || Value.LuaState != this)
+		return ELuaThreadStatus::Invalid;
+
+	FromLuaValue(Value);
+	lua_State* LuaThread = lua_tothread(L, -1);
+	int ReturnValue = lua_status(LuaThread);
+	Pop();
+
+	if (ReturnValue == 0)
+		return ELuaThreadStatus::Ok;
+
+	if (ReturnValue == LUA_YIELD)
+		return ELuaThreadStatus::Suspended;
+
+	return ELuaThreadStatus::Error;
+}
+
+int32 ULuaState::GetLuaThreadStackTop(FLuaValue Value)
+{
+	if (Value.Type != ELuaValueType::Thread || Value.LuaState != this)
+		return MIN_int32;
+
+	FromLuaValue(Value);
+	lua_State* LuaThread = lua_tothread(L, -1);
+	int ReturnValue = lua_gettop(LuaThread);
+	Pop();
+
+	return ReturnValue;
+}
+
+TSharedRef<FLuaSmartReference> ULuaState::AddLuaSmartReference(FLuaValue Value)
+{
+	TSharedRef<FLuaSmartReference> Ref = MakeShared<FLuaSmartReference>();
+	Ref->LuaState = this;
+	Ref->Value = Value;
+
+	LuaSmartReferences.Add(Ref);
+
+	return Ref;
+}
+
+void ULuaState::RemoveLuaSmartReference(TSharedRef<FLuaSmartReference> Ref)
+{
+	LuaSmartReferences.Remove(Ref);
+}
+
+ULuaState::~ULuaState()
+{
+	FCoreUObjectDelegates::GetPostGarbageCollect().Remove(GCLuaDelegatesHandle);
+
+#if WITH_EDITOR
+	if (LuaConsole.LuaState)
+	{
+		IModularFeatures::Get().UnregisterModularFeature(IConsoleCommandExecutor::ModularFeatureName(), &LuaConsole);
+	}
+#endif
+
+	FLuaMachineModule::Get().UnregisterLuaState(this);
+
+	// usually already done by BeginDestroy (the pending objects could be gone by now, they are flushed there)
+	LuaStateAsyncInitCancel();
+	ShutdownLuaThread();
+	LuaJobSystem.Reset();
+
+	CloseUnrefQueue();
+	if (L)
+	{
+		lua_close(L);
+		L = nullptr;
+	}
+}
+
+void ULuaState::BeginDestroy()
+{
+	// the thread is stopped before the object is unreachable by the pending requests
+	LuaStateAsyncInitCancel();
+	ShutdownLuaThread();
+	LuaJobSystem.Reset();
+
+	// the collected objects are still alive here (the survivors get their ReceiveLuaGC)
+	CloseUnrefQueue();
+	if (L)
+	{
+		lua_close(L);
+		L = nullptr;
+	}
+	FlushPendingLuaGC();
+
+	Super::BeginDestroy();
+}
+
+#if ENGINE_MAJOR_VERSION > 4 || ENGINE_MINOR_VERSION >= 25
+#define LUAVALUE_PROP_CAST(Type, Type2) F##Type* __##Type##__ = CastField<F##Type>(Property);\
+	if (__##Type##__)\
+	{\
+		return FLuaValue((Type2)__##Type##__->GetPropertyValue_InContainer(Buffer, Index));\
+	}
+
+#define LUAVALUE_PROP_CAST_TOSTRING(Type) F##Type* __##Type##__ = CastField<F##Type>(Property);\
+	if (__##Type##__)\
+	{\
+		return FLuaValue(__##Type##__->GetPropertyValue_InContainer(Buffer, Index).ToString());\
+	}
+
+#define LUAVALUE_PROP_SET(Type, Value) F##Type* __##Type##__ = CastField<F##Type>(Property);\
+	if (__##Type##__)\
+	{\
+		__##Type##__->SetPropertyValue_InContainer(Buffer, Value, Index);\
+		return;\
+	}
+#else
+#define LUAVALUE_PROP_CAST(Type, Type2) U##Type* __##Type##__ = Cast<U##Type>(Property);\
+	if (__##Type##__)\
+	{\
+		return FLuaValue((Type2)__##Type##__->GetPropertyValue_InContainer(Buffer, Index));\
+	}
+
+#define LUAVALUE_PROP_CAST_TOSTRING(Type) U##Type* __##Type##__ = Cast<U##Type>(Property);\
+	if (__##Type##__)\
+	{\
+		return FLuaValue(__##Type##__->GetPropertyValue_InContainer(Buffer, Index).ToString());\
+	}
+
+#define LUAVALUE_PROP_SET(Type, Value) U##Type* __##Type##__ = Cast<U##Type>(Property);\
+	if (__##Type##__)\
+	{\
+		__##Type##__->SetPropertyValue_InContainer(Buffer, Value, Index);\
+		return;\
+	}
+#endif
+
+#if	ENGINE_MAJOR_VERSION > 4 || ENGINE_MINOR_VERSION >= 25
+FLuaValue ULuaState::FromUProperty(void* Buffer, FProperty * Property, bool& bSuccess, int32 Index)
+{
+	return FromFProperty(Buffer, Property, bSuccess, Index);
+}
+void ULuaState::ToUProperty(void* Buffer, FProperty * Property, FLuaValue Value, bool& bSuccess, int32 Index)
+{
+	ToFProperty(Buffer, Property, Value, bSuccess, Index);
+}
+#endif
+
+#if ENGINE_MAJOR_VERSION > 4 || ENGINE_MINOR_VERSION >= 25
+FLuaValue ULuaState::FromFProperty(void* Buffer, FProperty * Property, bool& bSuccess, int32 Index)
+#else
+FLuaValue ULuaState::FromUProperty(void* Buffer, UProperty * Property, bool& bSuccess, int32 Index)
+#endif
 {
 	bSuccess = true;
 
@@ -2172,15 +3466,22 @@ FLuaValue ULuaState::FromUProperty(void* Buffer, UProperty * Property, bool& bSu
 	if (UArrayProperty* ArrayProperty = Cast<UArrayProperty>(Property))
 #endif
 	{
-		FLuaValue NewLuaArray = CreateLuaTable();
 		FScriptArrayHelper_InContainer Helper(ArrayProperty, Buffer, Index);
+		if (Helper.Num() > 0 && LuaPushPODArrayFromProperty(L, ArrayProperty->Inner, Helper.GetRawPtr(0), Helper.Num()))
+		{
+			FLuaValue NewLuaArray = ToLuaValue(-1);
+			Pop();
+			return NewLuaArray;
+		}
+
+		FLuaTableBuilder NewLuaArray(this, Helper.Num());
 		for (int32 ArrayIndex = 0; ArrayIndex < Helper.Num(); ArrayIndex++)
 		{
 			uint8* ArrayItemPtr = Helper.GetRawPtr(ArrayIndex);
 			bool bArrayItemSuccess = false;
-			NewLuaArray.SetFieldByIndex(ArrayIndex + 1, FromProperty(ArrayItemPtr, ArrayProperty->Inner, bArrayItemSuccess, 0));
+			NewLuaArray.Add(FromProperty(ArrayItemPtr, ArrayProperty->Inner, bArrayItemSuccess, 0));
 		}
-		return NewLuaArray;
+		return NewLuaArray.Finish();
 	}
 
 #if ENGINE_MAJOR_VERSION > 4 || ENGINE_MINOR_VERSION >= 25
@@ -2189,8 +3490,8 @@ FLuaValue ULuaState::FromUProperty(void* Buffer, UProperty * Property, bool& bSu
 	if (UMapProperty* MapProperty = Cast<UMapProperty>(Property))
 #endif
 	{
-		FLuaValue NewLuaTable = CreateLuaTable();
 		FScriptMapHelper_InContainer Helper(MapProperty, Buffer, Index);
+		FLuaTableBuilder NewLuaTable(this, 0, Helper.Num());
 		for (int32 MapIndex = 0; MapIndex < Helper.Num(); MapIndex++)
 		{
 			uint8* ArrayKeyPtr = Helper.GetKeyPtr(MapIndex);
@@ -2200,7 +3501,7 @@ FLuaValue ULuaState::FromUProperty(void* Buffer, UProperty * Property, bool& bSu
 				FromProperty(ArrayKeyPtr, MapProperty->KeyProp, bArrayItemSuccess, 0).ToString(),
 				FromProperty(ArrayValuePtr, MapProperty->ValueProp, bArrayItemSuccess, 0));
 		}
-		return NewLuaTable;
+		return NewLuaTable.Finish();
 	}
 
 #if ENGINE_MAJOR_VERSION > 4 || ENGINE_MINOR_VERSION >= 25
@@ -2209,15 +3510,15 @@ FLuaValue ULuaState::FromUProperty(void* Buffer, UProperty * Property, bool& bSu
 	if (USetProperty* SetProperty = Cast<USetProperty>(Property))
 #endif
 	{
-		FLuaValue NewLuaArray = CreateLuaTable();
 		FScriptSetHelper_InContainer Helper(SetProperty, Buffer, Index);
+		FLuaTableBuilder NewLuaArray(this, Helper.Num());
 		for (int32 SetIndex = 0; SetIndex < Helper.Num(); SetIndex++)
 		{
 			uint8* ArrayItemPtr = Helper.GetElementPtr(SetIndex);
 			bool bArrayItemSuccess = false;
-			NewLuaArray.SetFieldByIndex(SetIndex + 1, FromProperty(ArrayItemPtr, SetProperty->ElementProp, bArrayItemSuccess, 0));
+			NewLuaArray.Add(FromProperty(ArrayItemPtr, SetProperty->ElementProp, bArrayItemSuccess, 0));
 		}
-		return NewLuaArray;
+		return NewLuaArray.Finish();
 	}
 
 #if ENGINE_MAJOR_VERSION > 4 || ENGINE_MINOR_VERSION >= 25
@@ -2247,7 +3548,17 @@ FLuaValue ULuaState::FromUProperty(void* Buffer, UProperty * Property, bool& bSu
 
 FLuaValue ULuaState::StructToLuaTable(UScriptStruct * InScriptStruct, const uint8 * StructData)
 {
-	FLuaValue NewLuaTable = CreateLuaTable();
+	int32 NumFields = 0;
+#if ENGINE_MAJOR_VERSION > 4 || ENGINE_MINOR_VERSION >= 25
+	for (TFieldIterator<FProperty> It(InScriptStruct); It; ++It)
+#else
+	for (TFieldIterator<UProperty> It(InScriptStruct); It; ++It)
+#endif
+	{
+		NumFields++;
+	}
+
+	FLuaTableBuilder NewLuaTable(this, 0, NumFields);
 #if ENGINE_MAJOR_VERSION > 4 || ENGINE_MINOR_VERSION >= 25
 	for (TFieldIterator<FProperty> It(InScriptStruct); It; ++It)
 #else
@@ -2259,11 +3570,10 @@ FLuaValue ULuaState::StructToLuaTable(UScriptStruct * InScriptStruct, const uint
 #else
 		UProperty* FieldProp = *It;
 #endif
-		FString PropName = FieldProp->GetName();
 		bool bTableItemSuccess = false;
-		NewLuaTable.SetField(PropName, FromProperty((void*)StructData, FieldProp, bTableItemSuccess, 0));
+		NewLuaTable.SetField(FieldProp->GetFName(), FromProperty((void*)StructData, FieldProp, bTableItemSuccess, 0));
 	}
-	return NewLuaTable;
+	return NewLuaTable.Finish();
 }
 
 FLuaValue ULuaState::StructToLuaTable(UScriptStruct * InScriptStruct, const TArray<uint8>&StructData)
@@ -2407,6 +3717,17 @@ void ULuaState::ToUProperty(void* Buffer, UProperty * Property, FLuaValue Value,
 #endif
 	{
 		FScriptArrayHelper_InContainer Helper(ArrayProperty, Buffer, Index);
+		if (Value.Type == ELuaValueType::Table && Value.LuaState == this)
+		{
+			FromLuaValue(Value);
+			const bool bPODArray = LuaReadPODArrayToProperty(L, GetTop(), ArrayProperty, Helper);
+			Pop();
+			if (bPODArray)
+			{
+				return;
+			}
+		}
+
 		TArray<FLuaValue> ArrayValues = ULuaBlueprintFunctionLibrary::LuaTableGetValues(Value);
 		Helper.Resize(ArrayValues.Num());
 		for (int32 ArrayIndex = 0; ArrayIndex < Helper.Num(); ArrayIndex++)
@@ -2462,171 +3783,862 @@ void ULuaState::ToUProperty(void* Buffer, UProperty * Property, FLuaValue Value,
 
 void ULuaState::LuaTableToStruct(FLuaValue & LuaValue, UScriptStruct * InScriptStruct, uint8 * StructData)
 {
+	if (LuaValue.Type == ELuaValueType::Table && LuaValue.LuaState == this)
+	{
+		FromLuaValue(LuaValue);
+		const int32 TableIndex = GetTop();
+		PushNil();
+		while (Next(TableIndex) != 0)
+		{
+			const FLuaInternedName* Key = InternName(-2);
+#if ENGINE_MAJOR_VERSION > 4 || ENGINE_MINOR_VERSION >= 25
+			FProperty* StructProp = Key ? InScriptStruct->FindPropertyByName(Key->Name) : nullptr;
+#else
+			UProperty* StructProp = Key ? InScriptStruct->FindPropertyByName(Key->Name) : nullptr;
+#endif
+			if (StructProp)
+			{
+				bool bStructValueSuccess = false;
+				ToProperty((void*)StructData, StructProp, ToLuaValue(-1), bStructValueSuccess, 0);
+			}
+			Pop();
+		}
+		Pop();
+		return;
+	}
+
 	TArray<FLuaValue> TableKeys = ULuaBlueprintFunctionLibrary::LuaTableGetKeys(LuaValue);
 	for (FLuaValue TableKey : TableKeys)
 	{
-#if ENGINE_MAJOR_VERSION > 4 || ENGINE_MINOR_VERSION >= 25
-		FProperty* StructProp = InScriptStruct->FindPropertyByName(TableKey.ToName());
-#else
-		UProperty* StructProp = InScriptStruct->FindPropertyByName(TableKey.ToName());
-#endif
-		if (StructProp)
+#if ENGINE_MAJOR_VERSION > 4 || ENGINE_MINOR_VERSION >= 25
+		FProperty* StructProp = InScriptStruct->FindPropertyByName(TableKey.ToName());
+#else
+		UProperty* StructProp = InScriptStruct->FindPropertyByName(TableKey.ToName());
+#endif
+		if (StructProp)
+		{
+			bool bStructValueSuccess = false;
+			ToProperty((void*)StructData, StructProp, LuaValue.GetField(TableKey.ToString()), bStructValueSuccess, 0);
+		}
+	}
+}
+
+#if ENGINE_MAJOR_VERSION > 4 || ENGINE_MINOR_VERSION >= 25
+void ULuaState::ToProperty(void* Buffer, FProperty * Property, FLuaValue Value, bool& bSuccess, int32 Index)
+{
+	ToFProperty(Buffer, Property, Value, bSuccess, Index);
+}
+
+FLuaValue ULuaState::FromProperty(void* Buffer, FProperty * Property, bool& bSuccess, int32 Index)
+{
+	return FromFProperty(Buffer, Property, bSuccess, Index);
+}
+#else
+void ULuaState::ToProperty(void* Buffer, UProperty * Property, FLuaValue Value, bool& bSuccess, int32 Index)
+{
+	ToUProperty(Buffer, Property, Value, bSuccess, Index);
+}
+FLuaValue ULuaState::FromProperty(void* Buffer, UProperty * Property, bool& bSuccess, int32 Index)
+{
+	return FromUProperty(Buffer, Property, bSuccess, Index);
+}
+#endif
+
+
+FLuaValue ULuaState::GetLuaValueFromProperty(UObject * InObject, const FString & PropertyName)
+{
+	if (!InObject)
+	{
+		return FLuaValue();
+	}
+
+	UClass* Class = InObject->GetClass();
+#if ENGINE_MAJOR_VERSION > 4 || ENGINE_MINOR_VERSION >= 25
+	FProperty* Property = nullptr;
+#else
+	UProperty* Property = nullptr;
+#endif
+	Property = Class->FindPropertyByName(*PropertyName);
+	if (Property)
+	{
+		bool bSuccess = false;
+		return FromProperty(InObject, Property, bSuccess);
+	}
+
+	return FLuaValue();
+}
+
+bool ULuaState::SetPropertyFromLuaValue(UObject * InObject, const FString & PropertyName, FLuaValue Value)
+{
+	if (!InObject)
+	{
+		return false;
+	}
+
+	UClass* Class = InObject->GetClass();
+#if ENGINE_MAJOR_VERSION > 4 || ENGINE_MINOR_VERSION >= 25
+	FProperty* Property = nullptr;
+#else
+	UProperty* Property = nullptr;
+#endif
+	Property = Class->FindPropertyByName(*PropertyName);
+	if (Property)
+	{
+		bool bSuccess = false;
+		ToProperty(InObject, Property, Value, bSuccess);
+		return bSuccess;
+	}
+
+	return false;
+}
+
+void ULuaState::SetUserDataMetaTable(FLuaValue MetaTable)
+{
+	UserDataMetaTable = MetaTable;
+}
+
+void ULuaState::SetupAndAssignUserDataMetatable(UObject * Context, TMap<FString, FLuaValue>&Metatable, lua_State * State)
+{
+	if (!State)
+	{
+		State = this->L;
+	}
+
+	PushInstanceTable(Context, State);
+	lua_setuservalue(State, -2);
+
+	if (ULuaUserDataObject* LuaUserDataObject = Cast<ULuaUserDataObject>(Context))
+	{
+		LuaUserDataObject->LuaUserDataRefs++;
+	}
+
+	FLuaValue* CachedMetatable = nullptr;
+	if (ULuaComponent* LuaComponent = Cast<ULuaComponent>(Context))
+	{
+		CachedMetatable = &LuaComponent->LuaUserDataMetatable;
+	}
+	else if (ULuaUserDataObject* LuaUserDataObject = Cast<ULuaUserDataObject>(Context))
+	{
+		CachedMetatable = &LuaUserDataObject->LuaUserDataMetatable;
+	}
+
+	if (!CachedMetatable)
+	{
+		PushUserDataMetatable(Context, Metatable, State);
+		lua_setmetatable(State, -2);
+		return;
+	}
+
+	// built once per object (or per archetype), the cached value dies with the VM
+	if (CachedMetatable->Type != ELuaValueType::Table || CachedMetatable->LuaState != this || CachedMetatable->UnrefQueue != UnrefQueue)
+	{
+		*CachedMetatable = GetSharedUserDataMetatable(Context, Metatable);
+		if (CachedMetatable->Type != ELuaValueType::Table)
+		{
+			PushUserDataMetatable(Context, Metatable, this->L);
+			*CachedMetatable = ToLuaValue(-1);
+			Pop();
+		}
+	}
+
+	FromLuaValue(*CachedMetatable, nullptr, State);
+	lua_setmetatable(State, -2);
+}
+
+void ULuaState::PushUserDataMetatable(UObject* Context, TMap<FString, FLuaValue>& Metatable, lua_State* State)
+{
+	lua_newtable(State);
+	lua_pushcfunction(State, ULuaState::MetaTableFunctionUserData__index);
+	lua_setfield(State, -2, "__index");
+	lua_pushcfunction(State, ULuaState::MetaTableFunctionUserData__newindex);
+	lua_setfield(State, -2, "__newindex");
+	lua_pushcfunction(State, ULuaState::MetaTableFunctionUserData__eq);
+	lua_setfield(State, -2, "__eq");
+	if (Cast<ULuaUserDataObject>(Context))
+	{
+		lua_pushcfunction(State, ULuaState::MetaTableFunctionUserData__gc);
+		lua_setfield(State, -2, "__gc");
+	}
+
+	for (TPair<FString, FLuaValue>& Pair : Metatable)
+	{
+		// first check for UFunction
+		if (Pair.Value.Type == ELuaValueType::UFunction)
+		{
+			UObject* FunctionOwner = Context;
+			if (ULuaComponent* LuaComponent = Cast<ULuaComponent>(Context))
+			{
+				FunctionOwner = LuaComponent->GetOwner();
+			}
+
+			if (FunctionOwner)
+			{
+				UFunction* Function = FunctionOwner->FindFunction(Pair.Value.FunctionName);
+				if (Function)
+				{
+					FLuaUserData* LuaCallContext = (FLuaUserData*)lua_newuserdata(State, sizeof(FLuaUserData));
+					LuaCallContext->Type = ELuaValueType::UFunction;
+					LuaCallContext->Context = Context;
+					LuaCallContext->Function = Function;
+
+					lua_newtable(State);
+					lua_pushcfunction(State, bRawLuaFunctionCall ? ULuaState::MetaTableFunction__rawcall : ULuaState::MetaTableFunction__call);
+					lua_setfield(State, -2, "__call");
+					lua_setmetatable(State, -2);
+				}
+				else
+				{
+					lua_pushnil(State);
+				}
+			}
+		}
+		else {
+			FromLuaValue(Pair.Value, nullptr, State);
+		}
+		lua_setfield(State, -2, TCHAR_TO_ANSI(*Pair.Key));
+	}
+}
+
+static bool LuaGetInstanceTableStorage(UObject* Context, TMap<FString, FLuaValue>*& Table, FLuaValue*& InstanceTable)
+{
+	if (ULuaComponent* LuaComponent = Cast<ULuaComponent>(Context))
+	{
+		Table = &LuaComponent->Table;
+		InstanceTable = &LuaComponent->LuaInstanceTable;
+		return true;
+	}
+
+	if (ULuaUserDataObject* LuaUserDataObject = Cast<ULuaUserDataObject>(Context))
+	{
+		Table = &LuaUserDataObject->Table;
+		InstanceTable = &LuaUserDataObject->LuaInstanceTable;
+		return true;
+	}
+
+	return false;
+}
+
+/* only immutable values not bound to a context can be shared by instances */
+static bool LuaIsShareableField(const FLuaValue& Value)
+{
+	switch (Value.Type)
+	{
+	case ELuaValueType::Bool:
+	case ELuaValueType::Integer:
+	case ELuaValueType::Number:
+	case ELuaValueType::String:
+	case ELuaValueType::UObject:
+		return true;
+	default:
+		break;
+	}
+	return false;
+}
+
+static bool LuaIsDefaultField(const TMap<FString, FLuaValue>* DefaultTable, const FString& Key, const FLuaValue& Value)
+{
+	if (!DefaultTable || !LuaIsShareableField(Value))
+	{
+		return false;
+	}
+
+	const FLuaValue* DefaultValue = DefaultTable->Find(Key);
+	if (!DefaultValue || DefaultValue->Type != Value.Type)
+	{
+		return false;
+	}
+
+	switch (Value.Type)
+	{
+	case ELuaValueType::Bool:
+		return DefaultValue->Bool == Value.Bool;
+	case ELuaValueType::Integer:
+		return DefaultValue->Integer == Value.Integer;
+	case ELuaValueType::Number:
+		return DefaultValue->Number == Value.Number;
+	case ELuaValueType::String:
+		return DefaultValue->String.Equals(Value.String, ESearchCase::CaseSensitive);
+	case ELuaValueType::UObject:
+		return DefaultValue->Object == Value.Object;
+	default:
+		break;
+	}
+	return false;
+}
+
+FLuaValue ULuaState::GetInstancePrototypeMetatable(UObject* Context, const TMap<FString, FLuaValue>*& DefaultTable)
+{
+	DefaultTable = nullptr;
+
+	UObject* Archetype = Context->GetArchetype();
+	TMap<FString, FLuaValue>* ArchetypeTable = nullptr;
+	FLuaValue* ArchetypeInstanceTable = nullptr;
+	if (!Archetype || Archetype == Context || !LuaGetInstanceTableStorage(Archetype, ArchetypeTable, ArchetypeInstanceTable))
+	{
+		return FLuaValue();
+	}
+
+	DefaultTable = ArchetypeTable;
+
+	if (FLuaValue* PrototypeMetatable = InstancePrototypeMetatables.Find(Archetype))
+	{
+		return *PrototypeMetatable;
+	}
+
+	FLuaTableBuilder Prototype(this, 0, ArchetypeTable->Num());
+	for (TPair<FString, FLuaValue>& Pair : *ArchetypeTable)
+	{
+		if (LuaIsShareableField(Pair.Value))
+		{
+			Prototype.SetField(Pair.Key, Pair.Value);
+		}
+	}
+
+	FLuaValue PrototypeTable = Prototype.Finish();
+	FLuaTableBuilder PrototypeMetatable(this, 0, 1);
+	PrototypeMetatable.SetField("__index", PrototypeTable);
+
+	// archetypes can be regenerated (blueprint compilation), purge the stale ones from time to time
+	if (InstancePrototypeMetatables.Num() > 0 && InstancePrototypeMetatables.Num() % 64 == 0)
+	{
+		for (auto It = InstancePrototypeMetatables.CreateIterator(); It; ++It)
+		{
+			if (!It->Key.IsValid())
+			{
+				It.RemoveCurrent();
+			}
+		}
+	}
+
+	return InstancePrototypeMetatables.Add(Archetype, PrototypeMetatable.Finish());
+}
+
+FLuaValue ULuaState::GetSharedUserDataMetatable(UObject* Context, const TMap<FString, FLuaValue>& Metatable)
+{
+	UObject* Archetype = Context->GetArchetype();
+	if (!Archetype || Archetype == Context || Archetype->GetClass() != Context->GetClass())
+	{
+		return FLuaValue();
+	}
+
+	const TMap<FString, FLuaValue>* ArchetypeMetatable = nullptr;
+	if (ULuaComponent* LuaComponent = Cast<ULuaComponent>(Archetype))
+	{
+		ArchetypeMetatable = &LuaComponent->Metatable;
+	}
+	else if (ULuaUserDataObject* LuaUserDataObject = Cast<ULuaUserDataObject>(Archetype))
+	{
+		ArchetypeMetatable = &LuaUserDataObject->Metatable;
+	}
+
+	// UFunctions are bound to the object, so only plain values can be shared
+	if (!ArchetypeMetatable || ArchetypeMetatable->Num() != Metatable.Num())
+	{
+		return FLuaValue();
+	}
+	for (const TPair<FString, FLuaValue>& Pair : Metatable)
+	{
+		if (!LuaIsDefaultField(ArchetypeMetatable, Pair.Key, Pair.Value))
+		{
+			return FLuaValue();
+		}
+	}
+
+	if (FLuaValue* SharedMetatable = SharedUserDataMetatables.Find(Archetype))
+	{
+		return *SharedMetatable;
+	}
+
+	PushUserDataMetatable(Archetype, const_cast<TMap<FString, FLuaValue>&>(*ArchetypeMetatable), L);
+	FLuaValue SharedMetatable = ToLuaValue(-1);
+	Pop();
+
+	// archetypes can be regenerated (blueprint compilation), purge the stale ones from time to time
+	if (SharedUserDataMetatables.Num() > 0 && SharedUserDataMetatables.Num() % 64 == 0)
+	{
+		for (auto It = SharedUserDataMetatables.CreateIterator(); It; ++It)
+		{
+			if (!It->Key.IsValid())
+			{
+				It.RemoveCurrent();
+			}
+		}
+	}
+
+	return SharedUserDataMetatables.Add(Archetype, SharedMetatable);
+}
+
+void ULuaState::FillInstanceTable(int32 TableIndex, UObject* Context, TMap<FString, FLuaValue>& Table, const TMap<FString, FLuaValue>* DefaultTable)
+{
+	// the instance holds only the fields differing from the prototype
+	for (TPair<FString, FLuaValue>& Pair : Table)
+	{
+		if (LuaIsDefaultField(DefaultTable, Pair.Key, Pair.Value))
+		{
+			continue;
+		}
+		FTCHARToUTF8 KeyUTF8(*Pair.Key);
+		lua_pushlstring(L, KeyUTF8.Get(), KeyUTF8.Length());
+		FromLuaValue(Pair.Value, Context);
+		lua_rawset(L, TableIndex);
+	}
+
+	if (DefaultTable)
+	{
+		for (const TPair<FString, FLuaValue>& Pair : *DefaultTable)
+		{
+			if (LuaIsShareableField(Pair.Value) && !Table.Contains(Pair.Key))
+			{
+				FTCHARToUTF8 KeyUTF8(*Pair.Key);
+				lua_pushlstring(L, KeyUTF8.Get(), KeyUTF8.Length());
+				LuaPushInstanceFieldTombstone(L);
+				lua_rawset(L, TableIndex);
+			}
+		}
+	}
+}
+
+void ULuaState::PushInstanceTable(UObject* Context, lua_State* State)
+{
+	if (!State)
+	{
+		State = this->L;
+	}
+
+	TMap<FString, FLuaValue>* Table = nullptr;
+	FLuaValue* InstanceTable = nullptr;
+	if (!Context || !LuaGetInstanceTableStorage(Context, Table, InstanceTable))
+	{
+		lua_pushnil(State);
+		return;
+	}
+
+	if (InstanceTable->Type != ELuaValueType::Table || InstanceTable->LuaState != this)
+	{
+		// the object moved to a new state, bring back the fields written in the old one
+		if (ULuaState* OldLuaState = InstanceTable->LuaState.Get())
+		{
+			OldLuaState->SyncInstanceTable(Context);
+		}
+
+		const TMap<FString, FLuaValue>* DefaultTable = nullptr;
+		FLuaValue PrototypeMetatable = GetInstancePrototypeMetatable(Context, DefaultTable);
+
+		lua_createtable(L, 0, DefaultTable ? 0 : Table->Num());
+		FillInstanceTable(GetTop(), Context, *Table, DefaultTable);
+		if (PrototypeMetatable.Type == ELuaValueType::Table)
+		{
+			FromLuaValue(PrototypeMetatable);
+			lua_setmetatable(L, -2);
+		}
+		*InstanceTable = ToLuaValue(-1);
+		Pop();
+
+		// purge dead owners from time to time
+		if (InstanceTableOwners.Num() > 0 && InstanceTableOwners.Num() % 256 == 0)
+		{
+			InstanceTableOwners.RemoveAllSwap([](const TWeakObjectPtr<UObject>& Owner) { return !Owner.IsValid(); });
+		}
+		InstanceTableOwners.Add(Context);
+	}
+
+	FromLuaValue(*InstanceTable, nullptr, State);
+}
+
+static void LuaInstanceTableToMap(ULuaState* LuaState, int32 TableIndex, TMap<FString, FLuaValue>& Table)
+{
+	lua_State* L = LuaState->GetInternalLuaState();
+	LuaState->PushNil();
+	while (LuaState->Next(TableIndex) != 0)
+	{
+		const int KeyType = lua_type(L, -2);
+		if (KeyType == LUA_TSTRING || KeyType == LUA_TNUMBER)
+		{
+			if (LuaIsInstanceFieldTombstone(L, -1))
+			{
+				Table.Remove(LuaState->ToLuaValue(-2).ToString());
+			}
+			else
+			{
+				Table.Add(LuaState->ToLuaValue(-2).ToString(), LuaState->ToLuaValue(-1));
+			}
+		}
+		LuaState->Pop();
+	}
+}
+
+bool ULuaState::GetInstanceTableFields(UObject* Context, TMap<FString, FLuaValue>& Fields)
+{
+	TMap<FString, FLuaValue>* Table = nullptr;
+	FLuaValue* InstanceTable = nullptr;
+	if (!Context || !LuaGetInstanceTableStorage(Context, Table, InstanceTable))
+	{
+		return false;
+	}
+
+	if (InstanceTable->Type != ELuaValueType::Table || InstanceTable->LuaState != this || !L)
+	{
+		return false;
+	}
+
+	Fields.Reset();
+
+	FromLuaValue(*InstanceTable);
+	const int32 TableIndex = GetTop();
+	// first the prototype defaults, then the instance overrides
+	if (lua_getmetatable(L, TableIndex))
+	{
+		if (lua_getfield(L, -1, "__index") == LUA_TTABLE)
+		{
+			LuaInstanceTableToMap(this, GetTop(), Fields);
+		}
+		Pop(2);
+	}
+	LuaInstanceTableToMap(this, TableIndex, Fields);
+	Pop();
+	return true;
+}
+
+void ULuaState::SyncInstanceTable(UObject* Context)
+{
+	TMap<FString, FLuaValue>* Table = nullptr;
+	FLuaValue* InstanceTable = nullptr;
+	if (!Context || !LuaGetInstanceTableStorage(Context, Table, InstanceTable))
+	{
+		return;
+	}
+
+	GetInstanceTableFields(Context, *Table);
+}
+
+void ULuaState::ReloadInstanceTable(UObject* Context)
+{
+	TMap<FString, FLuaValue>* Table = nullptr;
+	FLuaValue* InstanceTable = nullptr;
+	if (!Context || !LuaGetInstanceTableStorage(Context, Table, InstanceTable))
+	{
+		return;
+	}
+
+	if (InstanceTable->Type != ELuaValueType::Table || InstanceTable->LuaState != this || !L)
+	{
+		return;
+	}
+
+	// refill in place, userdata already in the VM keep pointing to the same table
+	FromLuaValue(*InstanceTable);
+	const int32 TableIndex = GetTop();
+	PushNil();
+	while (Next(TableIndex) != 0)
+	{
+		Pop();
+		PushValue(-1);
+		PushNil();
+		lua_rawset(L, TableIndex);
+	}
+
+	const TMap<FString, FLuaValue>* DefaultTable = nullptr;
+	if (lua_getmetatable(L, TableIndex))
+	{
+		Pop();
+		GetInstancePrototypeMetatable(Context, DefaultTable);
+	}
+	FillInstanceTable(TableIndex, Context, *Table, DefaultTable);
+	Pop();
+}
+
+void ULuaState::SyncInstanceTables()
+{
+	for (TWeakObjectPtr<UObject>& Owner : InstanceTableOwners)
+	{
+		if (UObject* Context = Owner.Get())
+		{
+			SyncInstanceTable(Context);
+		}
+	}
+	InstanceTableOwners.Empty();
+}
+
+void ULuaState::PushCachedUObject(UObject* Object, lua_State* State)
+{
+	if (!State)
+	{
+		State = this->L;
+	}
+
+	if (!Object)
+	{
+		lua_pushnil(State);
+		return;
+	}
+
+	// only LuaComponents of this state have a lifetime we can track
+	ULuaComponent* LuaComponent = Cast<ULuaComponent>(Object);
+
+	if (int* LuaRef = CachedUObjects.Find(Object))
+	{
+		lua_rawgeti(State, LUA_REGISTRYINDEX, *LuaRef);
+		// Metatable changed (LuaSetMetatable) after caching, the userdata already in the VM get the new one too
+		if (LuaComponent && LuaComponent->LuaUserDataMetatable.Type != ELuaValueType::Table)
+		{
+			SetupAndAssignUserDataMetatable(LuaComponent, LuaComponent->Metatable, State);
+		}
+		return;
+	}
+
+	if (!LuaComponent || LuaComponent->LuaState != GetClass())
+	{
+		FLuaValue LuaValue(Object);
+		FromLuaValue(LuaValue, nullptr, State);
+		return;
+	}
+
+	NewUObject(LuaComponent, State);
+	SetupAndAssignUserDataMetatable(LuaComponent, LuaComponent->Metatable, State);
+
+	lua_pushvalue(State, -1);
+	if (State != this->L)
+		lua_xmove(State, this->L, 1);
+	CachedUObjects.Add(Object, luaL_ref(this->L, LUA_REGISTRYINDEX));
+}
+
+void ULuaState::ReleaseCachedUObject(UObject* Object)
+{
+	int LuaRef = LUA_NOREF;
+	if (L && CachedUObjects.RemoveAndCopyValue(Object, LuaRef))
+	{
+		luaL_unref(L, LUA_REGISTRYINDEX, LuaRef);
+	}
+}
+
+FLuaValue ULuaState::NewLuaUserDataObject(TSubclassOf<ULuaUserDataObject> LuaUserDataObjectClass, bool bTrackObject)
+{
+	ULuaUserDataObject* LuaUserDataObject = nullptr;
+	FLuaUserDataObjectPool* Pool = LuaUserDataObjectPools.Find(LuaUserDataObjectClass);
+	while (Pool && Pool->Objects.Num() > 0)
+	{
+		ULuaUserDataObject* PooledObject = Pool->Objects.Pop();
+		PooledObject->bLuaInPool = false;
+		// pushed again to Lua (from a FLuaValue kept by C++ or Blueprints) after being pooled: evict it,
+		// it will come back to the pool when its userdata are collected
+		if (PooledObject->LuaUserDataRefs > 0 || PooledObject->bLuaGCPending || PooledObject->LuaTrackedIndex != INDEX_NONE)
+		{
+			continue;
+		}
+		LuaUserDataObject = PooledObject;
+		break;
+	}
+
+	if (!LuaUserDataObject)
+	{
+		LuaUserDataObject = NewObject<ULuaUserDataObject>(this, LuaUserDataObjectClass);
+	}
+
+	if (LuaUserDataObject)
+	{
+		if (bTrackObject)
 		{
-			bool bStructValueSuccess = false;
-			ToProperty((void*)StructData, StructProp, LuaValue.GetField(TableKey.ToString()), bStructValueSuccess, 0);
+			TrackLuaUserDataObject(LuaUserDataObject);
 		}
+		LuaUserDataObject->ReceiveLuaUserDataTableInit();
+		return FLuaValue(LuaUserDataObject);
 	}
-}
 
-#if ENGINE_MAJOR_VERSION > 4 || ENGINE_MINOR_VERSION >= 25
-void ULuaState::ToProperty(void* Buffer, FProperty * Property, FLuaValue Value, bool& bSuccess, int32 Index)
-{
-	ToFProperty(Buffer, Property, Value, bSuccess, Index);
+	return FLuaValue();
 }
 
-FLuaValue ULuaState::FromProperty(void* Buffer, FProperty * Property, bool& bSuccess, int32 Index)
-{
-	return FromFProperty(Buffer, Property, bSuccess, Index);
-}
-#else
-void ULuaState::ToProperty(void* Buffer, UProperty * Property, FLuaValue Value, bool& bSuccess, int32 Index)
+void ULuaState::TrackLuaUserDataObject(ULuaUserDataObject* LuaUserDataObject)
 {
-	ToUProperty(Buffer, Property, Value, bSuccess, Index);
-}
-FLuaValue ULuaState::FromProperty(void* Buffer, UProperty * Property, bool& bSuccess, int32 Index)
-{
-	return FromUProperty(Buffer, Property, bSuccess, Index);
+	if (LuaUserDataObject->LuaTrackedIndex == INDEX_NONE)
+	{
+		LuaUserDataObject->LuaTrackedIndex = TrackedLuaUserDataObjects.Add(LuaUserDataObject);
+	}
 }
-#endif
 
-
-FLuaValue ULuaState::GetLuaValueFromProperty(UObject * InObject, const FString & PropertyName)
+void ULuaState::UntrackLuaUserDataObject(ULuaUserDataObject* LuaUserDataObject)
 {
-	if (!InObject)
+	const int32 Index = LuaUserDataObject->LuaTrackedIndex;
+	if (Index == INDEX_NONE)
 	{
-		return FLuaValue();
+		return;
 	}
 
-	UClass* Class = InObject->GetClass();
-#if ENGINE_MAJOR_VERSION > 4 || ENGINE_MINOR_VERSION >= 25
-	FProperty* Property = nullptr;
-#else
-	UProperty* Property = nullptr;
-#endif
-	Property = Class->FindPropertyByName(*PropertyName);
-	if (Property)
+	LuaUserDataObject->LuaTrackedIndex = INDEX_NONE;
+	if (!TrackedLuaUserDataObjects.IsValidIndex(Index) || TrackedLuaUserDataObjects[Index] != LuaUserDataObject)
 	{
-		bool bSuccess = false;
-		return FromProperty(InObject, Property, bSuccess);
+		// should never happen, but better slow than wrong
+		TrackedLuaUserDataObjects.RemoveSwap(LuaUserDataObject);
+		return;
 	}
 
-	return FLuaValue();
+	TrackedLuaUserDataObjects.RemoveAtSwap(Index);
+	if (TrackedLuaUserDataObjects.IsValidIndex(Index) && TrackedLuaUserDataObjects[Index])
+	{
+		TrackedLuaUserDataObjects[Index]->LuaTrackedIndex = Index;
+	}
 }
 
-bool ULuaState::SetPropertyFromLuaValue(UObject * InObject, const FString & PropertyName, FLuaValue Value)
+void ULuaState::FlushPendingLuaGC()
 {
-	if (!InObject)
+	if (PendingLuaGCUserDataObjects.Num() == 0)
 	{
-		return false;
+		return;
 	}
 
-	UClass* Class = InObject->GetClass();
-#if ENGINE_MAJOR_VERSION > 4 || ENGINE_MINOR_VERSION >= 25
-	FProperty* Property = nullptr;
-#else
-	UProperty* Property = nullptr;
-#endif
-	Property = Class->FindPropertyByName(*PropertyName);
-	if (Property)
+	// ReceiveLuaGC can run Lua code, so new objects could be collected while iterating
+	TArray<ULuaUserDataObject*> Collected = MoveTemp(PendingLuaGCUserDataObjects);
+	PendingLuaGCUserDataObjects.Reset();
+
+	for (ULuaUserDataObject* LuaUserDataObject : Collected)
 	{
-		bool bSuccess = false;
-		ToProperty(InObject, Property, Value, bSuccess);
-		return bSuccess;
-	}
+		// the state (with its objects) could be in the middle of its destruction
+		if (!IsValid(LuaUserDataObject) || LuaUserDataObject->IsUnreachable() || LuaUserDataObject->HasAnyFlags(RF_BeginDestroyed))
+		{
+			continue;
+		}
 
-	return false;
+		LuaUserDataObject->bLuaGCPending = false;
+		// pushed again to Lua after the collection
+		if (LuaUserDataObject->LuaUserDataRefs > 0)
+		{
+			continue;
+		}
+
+		LuaUserDataObject->ReceiveLuaGC();
+
+		// nothing to reuse once the VM is closed
+		if (!L || !LuaUserDataObject->bLuaPooled || LuaUserDataObject->bLuaInPool || LuaUserDataObject->LuaUserDataRefs > 0 || LuaUserDataObject->LuaTrackedIndex != INDEX_NONE)
+		{
+			continue;
+		}
+
+		FLuaUserDataObjectPool& Pool = LuaUserDataObjectPools.FindOrAdd(LuaUserDataObject->GetClass());
+		if (Pool.Objects.Num() >= LuaUserDataObjectPoolSize)
+		{
+			continue;
+		}
+
+		ULuaUserDataObject* DefaultObject = LuaUserDataObject->GetClass()->GetDefaultObject<ULuaUserDataObject>();
+		LuaUserDataObject->Table = DefaultObject->Table;
+		LuaUserDataObject->Metatable = DefaultObject->Metatable;
+		LuaUserDataObject->LuaInstanceTable = FLuaValue();
+		LuaUserDataObject->LuaUserDataMetatable = FLuaValue();
+		LuaUserDataObject->ReceiveLuaPoolReset();
+		LuaUserDataObject->bLuaInPool = true;
+		Pool.Objects.Add(LuaUserDataObject);
+	}
 }
 
-void ULuaState::SetUserDataMetaTable(FLuaValue MetaTable)
+void ULuaState::LuaGCStep()
 {
-	UserDataMetaTable = MetaTable;
+	SCOPE_CYCLE_COUNTER(STAT_LuaGC);
+
+	const int32 Count = lua_gc(L, LUA_GCCOUNT, 0);
+	LuaGCStats.AllocatedKB = Count - LuaGCLastCount;
+
+	const double StartTime = FPlatformTime::Seconds();
+	const double EndTime = StartTime + LuaGCBudget / 1000.0;
+	int32 Steps = 0;
+	bool bCycleCompleted = false;
+	do
+	{
+		Steps++;
+		// returns 1 at the end of a cycle
+		if (ProtectedGC(LUA_GCSTEP, LuaGCStats.StepSize))
+		{
+			bCycleCompleted = true;
+			LuaGCStats.Cycles++;
+			break;
+		}
+	} while (FPlatformTime::Seconds() < EndTime);
+
+	const double Elapsed = FPlatformTime::Seconds() - StartTime;
+
+	// the collector is not keeping up with the allocations: bigger steps and a more aggressive stepmul
+	if (!bCycleCompleted && LuaGCStats.AllocatedKB > 0)
+	{
+		LuaGCStats.StepSize = FMath::Min(LuaGCStats.StepSize * 2, LUAMACHINE_GC_MAX_STEP);
+		lua_gc(L, LUA_GCSETSTEPMUL, 400);
+	}
+	// a single step goes over the budget, or memory is stable: smaller steps
+	else if ((Steps == 1 && Elapsed > LuaGCBudget / 1000.0) || LuaGCStats.AllocatedKB <= 0)
+	{
+		LuaGCStats.StepSize = FMath::Max(LuaGCStats.StepSize / 2, LUAMACHINE_GC_MIN_STEP);
+		lua_gc(L, LUA_GCSETSTEPMUL, 200);
+	}
+
+	LuaGCLastCount = lua_gc(L, LUA_GCCOUNT, 0);
+	LuaGCStats.Steps = Steps;
+	LuaGCStats.TimeMs = Elapsed * 1000.0;
 }
 
-void ULuaState::SetupAndAssignUserDataMetatable(UObject * Context, TMap<FString, FLuaValue>&Metatable, lua_State * State)
+void ULuaState::LuaGCFullCycle()
 {
-	if (!State)
+	if (LuaThread && !IsLuaStateOwner())
 	{
-		State = this->L;
+		LuaThread->Enqueue([this]() { LuaGCFullCycle(); });
+		return;
 	}
 
-	lua_newtable(State);
-	lua_pushcfunction(State, ULuaState::MetaTableFunctionUserData__index);
-	lua_setfield(State, -2, "__index");
-	lua_pushcfunction(State, ULuaState::MetaTableFunctionUserData__newindex);
-	lua_setfield(State, -2, "__newindex");
-	lua_pushcfunction(State, ULuaState::MetaTableFunctionUserData__eq);
-	lua_setfield(State, -2, "__eq");
-	if (Context->IsA<ULuaUserDataObject>())
+	if (!L || (LuaAllocator && LuaAllocator->ProtectedDepth > 0))
 	{
-		lua_pushcfunction(State, ULuaState::MetaTableFunctionUserData__gc);
-		lua_setfield(State, -2, "__gc");
+		return;
 	}
 
-	for (TPair<FString, FLuaValue>& Pair : Metatable)
+	SCOPE_CYCLE_COUNTER(STAT_LuaGC);
+	ProtectedGC(LUA_GCCOLLECT);
+	LuaGCStats.Cycles++;
+	LuaGCLastCount = lua_gc(L, LUA_GCCOUNT, 0);
+}
+
+void ULuaState::LuaEndFrame()
+{
+	if (LuaThread)
 	{
-		// first check for UFunction
-		if (Pair.Value.Type == ELuaValueType::UFunction)
+		// outbound events and the VM housekeeping (in the dedicated thread)
+		LuaThread->DrainGameThreadRequests();
+		// an event could have retired the state
+		if (!LuaThread)
 		{
-			UObject* FunctionOwner = Context;
-			if (ULuaComponent* LuaComponent = Cast<ULuaComponent>(Context))
-			{
-				FunctionOwner = LuaComponent->GetOwner();
-			}
-
-			if (FunctionOwner)
+			return;
+		}
+		FlushPendingLuaGC();
+		if (LuaJobSystem)
+		{
+			LuaJobSystem->DrainCompletedJobs();
+		}
+		LuaThread->Enqueue([this]()
 			{
-				UFunction* Function = FunctionOwner->FindFunction(Pair.Value.FunctionName);
-				if (Function)
+				DrainPendingUnrefs();
+				if (bLuaGCScheduler)
 				{
-					FLuaUserData* LuaCallContext = (FLuaUserData*)lua_newuserdata(State, sizeof(FLuaUserData));
-					LuaCallContext->Type = ELuaValueType::UFunction;
-					LuaCallContext->Context = Context;
-					LuaCallContext->Function = Function;
-
-					lua_newtable(State);
-					lua_pushcfunction(State, bRawLuaFunctionCall ? ULuaState::MetaTableFunction__rawcall : ULuaState::MetaTableFunction__call);
-					lua_setfield(State, -2, "__call");
-					lua_setmetatable(State, -2);
+					LuaGCStep();
 				}
-				else
+				if (LuaAllocator)
 				{
-					lua_pushnil(State);
+					LuaAllocator->EndFrame();
 				}
-			}
-		}
-		else {
-			FromLuaValue(Pair.Value, nullptr, State);
-		}
-		lua_setfield(State, -2, TCHAR_TO_ANSI(*Pair.Key));
+			});
+		return;
 	}
 
-	lua_setmetatable(State, -2);
-}
+	DrainPendingUnrefs();
+	FlushPendingLuaGC();
 
-FLuaValue ULuaState::NewLuaUserDataObject(TSubclassOf<ULuaUserDataObject> LuaUserDataObjectClass, bool bTrackObject)
-{
-	ULuaUserDataObject* LuaUserDataObject = NewObject<ULuaUserDataObject>(this, LuaUserDataObjectClass);
-	if (LuaUserDataObject)
+	if (LuaJobSystem)
 	{
-		if (bTrackObject)
-		{
-			TrackedLuaUserDataObjects.Add(LuaUserDataObject);
-		}
-		LuaUserDataObject->ReceiveLuaUserDataTableInit();
-		return FLuaValue(LuaUserDataObject);
+		LuaJobSystem->DrainCompletedJobs();
 	}
 
-	return FLuaValue();
+	if (bLuaGCScheduler)
+	{
+		LuaGCStep();
+	}
+
+	if (LuaAllocator)
+	{
+		LuaAllocator->EndFrame();
+	}
 }
 
 void ULuaState::SetLuaUserDataField(FLuaValue UserData, const FString & Key, FLuaValue Value)
@@ -2792,4 +4804,201 @@ FLuaValue ULuaState::RunString(const FString & CodeString, FString CodePath)
 void ULuaState::Error(const FString& ErrorString)
 {
 	luaL_error(L, TCHAR_TO_UTF8(*ErrorString));
-}
\ No newline at end of file
+}
+
+FLuaTableBuilder::FLuaTableBuilder(ULuaState* InLuaState, const int32 ArraySize, const int32 HashSize) : LuaState(InLuaState), NextArrayIndex(1)
+{
+	lua_State* L = LuaState->GetInternalLuaState();
+	lua_createtable(L, FMath::Max(ArraySize, 0), FMath::Max(HashSize, 0));
+	TableIndex = lua_gettop(L);
+}
+
+FLuaTableBuilder::~FLuaTableBuilder()
+{
+	// Finish() was never called, just drop the table
+	if (TableIndex > 0)
+	{
+		lua_remove(LuaState->GetInternalLuaState(), TableIndex);
+	}
+}
+
+void FLuaTableBuilder::Add(FLuaValue& Value, UObject* CallContext)
+{
+	SetFieldByIndex(NextArrayIndex, Value, CallContext);
+}
+
+void FLuaTableBuilder::SetField(const FString& Key, FLuaValue& Value, UObject* CallContext)
+{
+	SetField(TCHAR_TO_UTF8(*Key), Value, CallContext);
+}
+
+void FLuaTableBuilder::SetField(const char* Key, FLuaValue& Value, UObject* CallContext)
+{
+	check(TableIndex > 0);
+	lua_State* L = LuaState->GetInternalLuaState();
+	lua_pushstring(L, Key);
+	LuaState->FromLuaValue(Value, CallContext);
+	lua_rawset(L, TableIndex);
+}
+
+void FLuaTableBuilder::SetField(FName Key, FLuaValue& Value, UObject* CallContext)
+{
+	check(TableIndex > 0);
+	LuaState->PushName(Key);
+	LuaState->FromLuaValue(Value, CallContext);
+	lua_rawset(LuaState->GetInternalLuaState(), TableIndex);
+}
+
+void FLuaTableBuilder::SetFieldByIndex(const int32 Index, FLuaValue& Value, UObject* CallContext)
+{
+	check(TableIndex > 0);
+	LuaState->FromLuaValue(Value, CallContext);
+	lua_rawseti(LuaState->GetInternalLuaState(), TableIndex, Index);
+	if (Index >= NextArrayIndex)
+	{
+		NextArrayIndex = Index + 1;
+	}
+}
+
+FLuaValue FLuaTableBuilder::Finish()
+{
+	check(TableIndex > 0);
+	lua_State* L = LuaState->GetInternalLuaState();
+
+	FLuaValue NewTable;
+	NewTable.Type = ELuaValueType::Table;
+
+	if (lua_gettop(L) != TableIndex)
+	{
+		lua_pushvalue(L, TableIndex);
+		lua_remove(L, TableIndex);
+	}
+	// luaL_ref pops the table
+	NewTable.SetRef(LuaState, luaL_ref(L, LUA_REGISTRYINDEX));
+	TableIndex = 0;
+
+	return NewTable;
+}
+
+
+FLuaCallResult::FLuaCallResult(ULuaState* InLuaState, const int32 InFirstIndex, const int32 InNum, const bool bInSuccess) : LuaState(InLuaState), FirstIndex(InFirstIndex), NumValues(FMath::Max(InNum, 0)), bSuccess(bInSuccess)
+{
+}
+
+FLuaCallResult::FLuaCallResult(FLuaCallResult&& Other) : LuaState(Other.LuaState), FirstIndex(Other.FirstIndex), NumValues(Other.NumValues), bSuccess(Other.bSuccess)
+{
+	Other.LuaState = nullptr;
+	Other.FirstIndex = 0;
+	Other.NumValues = 0;
+}
+
+FLuaCallResult::~FLuaCallResult()
+{
+	Release();
+}
+
+void FLuaCallResult::Release()
+{
+	if (LuaState && FirstIndex > 0)
+	{
+		lua_settop(LuaState->GetInternalLuaState(), FirstIndex - 1);
+	}
+	LuaState = nullptr;
+	FirstIndex = 0;
+	NumValues = 0;
+}
+
+ELuaValueType FLuaCallResult::GetType(const int32 Index) const
+{
+	if (!IsValidIndex(Index))
+		return ELuaValueType::Nil;
+
+	lua_State* L = LuaState->GetInternalLuaState();
+	const int32 StackIndex = FirstIndex + Index;
+	switch (lua_type(L, StackIndex))
+	{
+	case LUA_TBOOLEAN:
+		return ELuaValueType::Bool;
+	case LUA_TNUMBER:
+		return lua_isinteger(L, StackIndex) ? ELuaValueType::Integer : ELuaValueType::Number;
+	case LUA_TSTRING:
+		return ELuaValueType::String;
+	case LUA_TTABLE:
+		return ELuaValueType::Table;
+	case LUA_TFUNCTION:
+		return ELuaValueType::Function;
+	case LUA_TTHREAD:
+		return ELuaValueType::Thread;
+	case LUA_TUSERDATA:
+		return Get(Index).Type;
+	}
+	return ELuaValueType::Nil;
+}
+
+bool FLuaCallResult::GetBool(const int32 Index) const
+{
+	if (!IsValidIndex(Index))
+		return false;
+	return lua_toboolean(LuaState->GetInternalLuaState(), FirstIndex + Index) != 0;
+}
+
+int64 FLuaCallResult::GetInteger(const int32 Index) const
+{
+	if (!IsValidIndex(Index))
+		return 0;
+
+	lua_State* L = LuaState->GetInternalLuaState();
+	const int32 StackIndex = FirstIndex + Index;
+	if (lua_isinteger(L, StackIndex))
+	{
+		return lua_tointeger(L, StackIndex);
+	}
+	return (int64)lua_tonumber(L, StackIndex);
+}
+
+double FLuaCallResult::GetNumber(const int32 Index) const
+{
+	if (!IsValidIndex(Index))
+		return 0;
+	return lua_tonumber(LuaState->GetInternalLuaState(), FirstIndex + Index);
+}
+
+FString FLuaCallResult::GetString(const int32 Index) const
+{
+	if (!IsValidIndex(Index))
+		return FString();
+
+	lua_State* L = LuaState->GetInternalLuaState();
+	const int32 StackIndex = FirstIndex + Index;
+	// do not use lua_tolstring() on numbers, it would change the value on the stack
+	if (lua_type(L, StackIndex) == LUA_TSTRING)
+	{
+		size_t StringLength = 0;
+		const char* String = lua_tolstring(L, StackIndex, &StringLength);
+		return FLuaValue(String, StringLength).String;
+	}
+	return Get(Index).ToString();
+}
+
+FLuaValue FLuaCallResult::Get(const int32 Index) const
+{
+	if (!IsValidIndex(Index))
+		return FLuaValue();
+	return LuaState->ToLuaValue(FirstIndex + Index);
+}
+
+void FLuaCallResult::AppendTo(TArray<FLuaValue>& Values) const
+{
+	Values.Reserve(Values.Num() + NumValues);
+	for (int32 Index = 0; Index < NumValues; Index++)
+	{
+		Values.Add(LuaState->ToLuaValue(FirstIndex + Index));
+	}
+}
+
+TArray<FLuaValue> FLuaCallResult::ToArray() const
+{
+	TArray<FLuaValue> Values;
+	AppendTo(Values);
+	return Values;
+}
@@ -0,0 +1,885 @@
+// Copyright 2018-2023 - Roberto De Ioris
+
+#include "LuaStateSnapshot.h"
+#include "LuaState.h"
+#include "LuaBlueprintPackage.h"
+#include "Serialization/MemoryWriter.h"
+#include "Serialization/MemoryReader.h"
+
+#define LUAMACHINE_SNAPSHOT_MAGIC 0x5341554C
+#define LUAMACHINE_SNAPSHOT_VERSION 1
+// nesting of tables and upvalues followed by the capture (as LUAI_MAXCCALLS for the Lua parser)
+#define LUAMACHINE_SNAPSHOT_MAX_DEPTH 200
+
+// pushes the table a fresh state already has for the given builtin name (or nil)
+static void LuaPushSnapshotBuiltin(ULuaState* LuaState, lua_State* L, const FString& BuiltinName)
+{
+	if (BuiltinName == TEXT("_G"))
+	{
+		lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
+	}
+	else if (BuiltinName == TEXT("@loaded"))
+	{
+		lua_getfield(L, LUA_REGISTRYINDEX, LUA_LOADED_TABLE);
+	}
+	else if (BuiltinName == TEXT("@preload"))
+	{
+		lua_getfield(L, LUA_REGISTRYINDEX, LUA_PRELOAD_TABLE);
+	}
+	else if (BuiltinName.StartsWith(TEXT("@bp:")))
+	{
+		FLuaValue PackageTable = LuaState->GetLuaBlueprintPackageTable(BuiltinName.Mid(4));
+		LuaState->FromLuaValue(PackageTable, nullptr, L);
+	}
+	else
+	{
+		lua_getfield(L, LUA_REGISTRYINDEX, LUA_LOADED_TABLE);
+		lua_getfield(L, -1, TCHAR_TO_ANSI(*BuiltinName));
+		lua_remove(L, -2);
+	}
+}
+
+struct FLuaSnapshotCapture
+{
+	FLuaStateSnapshot& Snapshot;
+	ULuaState* LuaState;
+	lua_State* L;
+
+	TMap<const void*, FString> BuiltinNames;
+	// C functions exposed by the builtin tables, so they can be found by name in another process
+	TMap<lua_CFunction, TPair<FString, FString>> CFunctionNames;
+	TMap<const void*, int32> VisitedTables;
+	TMap<const void*, int32> VisitedFunctions;
+	TMap<const char*, int32> VisitedStrings;
+	TMap<uint32, TArray<int32>> ByteCodesByCrc;
+	// upvalue id -> (function, upvalue)
+	TMap<void*, FIntPoint> UpvalueOwners;
+
+	// the capture is recursive, deeper graphs are refused
+	int32 Depth;
+	bool bTooDeep;
+
+	FLuaSnapshotCapture(FLuaStateSnapshot& InSnapshot, ULuaState* InLuaState, lua_State* InL) : Snapshot(InSnapshot), LuaState(InLuaState), L(InL), Depth(0), bTooDeep(false)
+	{
+	}
+
+	void AddBuiltin(const FString& Name)
+	{
+		if (lua_type(L, -1) == LUA_TTABLE)
+		{
+			BuiltinNames.Add(lua_topointer(L, -1), Name);
+			lua_pushnil(L);
+			while (lua_next(L, -2) != 0)
+			{
+				if (lua_type(L, -2) == LUA_TSTRING && lua_iscfunction(L, -1))
+				{
+					const lua_CFunction CFunction = lua_tocfunction(L, -1);
+					if (CFunction && !CFunctionNames.Contains(CFunction))
+					{
+						CFunctionNames.Add(CFunction, TPair<FString, FString>(Name, UTF8_TO_TCHAR(lua_tostring(L, -2))));
+					}
+				}
+				lua_pop(L, 1);
+			}
+		}
+		lua_pop(L, 1);
+	}
+
+	static int Writer(lua_State* L, const void* Data, size_t Size, void* UserData)
+	{
+		((TArray<uint8>*)UserData)->Append((const uint8*)Data, Size);
+		return 0;
+	}
+
+	int32 AddByteCode(TArray<uint8>& ByteCode)
+	{
+		// closures of the same prototype share the bytecode
+		const uint32 Crc = FCrc::MemCrc32(ByteCode.GetData(), ByteCode.Num());
+		TArray<int32>& Candidates = ByteCodesByCrc.FindOrAdd(Crc);
+		for (const int32 Candidate : Candidates)
+		{
+			if (Snapshot.ByteCodes[Candidate] == ByteCode)
+			{
+				return Candidate;
+			}
+		}
+		const int32 Index = Snapshot.ByteCodes.Add(MoveTemp(ByteCode));
+		Candidates.Add(Index);
+		return Index;
+	}
+
+	FLuaSnapshotValue Capture(int Index)
+	{
+		Index = lua_absindex(L, Index);
+		luaL_checkstack(L, 8, nullptr);
+
+		FLuaSnapshotValue Value;
+		switch (lua_type(L, Index))
+		{
+		case LUA_TBOOLEAN:
+			Value.Type = ELuaSnapshotValueType::Bool;
+			Value.Bool = lua_toboolean(L, Index) != 0;
+			break;
+		case LUA_TNUMBER:
+			if (lua_isinteger(L, Index))
+			{
+				Value.Type = ELuaSnapshotValueType::Integer;
+				Value.Integer = lua_tointeger(L, Index);
+			}
+			else
+			{
+				Value.Type = ELuaSnapshotValueType::Number;
+				Value.Number = lua_tonumber(L, Index);
+			}
+			break;
+		case LUA_TSTRING:
+		{
+			size_t Length = 0;
+			const char* String = lua_tolstring(L, Index, &Length);
+			Value.Type = ELuaSnapshotValueType::String;
+			if (int32* StringIndex = VisitedStrings.Find(String))
+			{
+				Value.Index = *StringIndex;
+				break;
+			}
+			Value.Index = Snapshot.Strings.AddDefaulted();
+			Snapshot.Strings[Value.Index].Append((const uint8*)String, Length);
+			VisitedStrings.Add(String, Value.Index);
+		}
+		break;
+		case LUA_TLIGHTUSERDATA:
+			Value.Type = ELuaSnapshotValueType::LightUserData;
+			Value.LightUserData = lua_touserdata(L, Index);
+			break;
+		case LUA_TTABLE:
+			Value.Type = ELuaSnapshotValueType::Table;
+			Value.Index = CaptureTable(Index);
+			if (Value.Index == INDEX_NONE)
+			{
+				Value.Type = ELuaSnapshotValueType::Nil;
+			}
+			break;
+		case LUA_TFUNCTION:
+			Value.Type = ELuaSnapshotValueType::Function;
+			Value.Index = CaptureFunction(Index);
+			if (Value.Index == INDEX_NONE)
+			{
+				Value.Type = ELuaSnapshotValueType::Nil;
+			}
+			break;
+		case LUA_TUSERDATA:
+		{
+			// files and bulk buffers are not FLuaUserData (bulk buffers look like a Nil one)
+			if (luaL_testudata(L, Index, LUA_FILEHANDLE))
+			{
+				break;
+			}
+			FLuaValue LuaValue = LuaState->ToLuaValue(Index, L);
+			if (LuaValue.Type == ELuaValueType::UObject || LuaValue.Type == ELuaValueType::UFunction)
+			{
+				FLuaSnapshotObject SnapshotObject;
+				SnapshotObject.Object = LuaValue.Object;
+				SnapshotObject.bFunction = LuaValue.Type == ELuaValueType::UFunction;
+				if (SnapshotObject.bFunction)
+				{
+					SnapshotObject.FunctionName = LuaValue.FunctionName;
+				}
+				Value.Type = ELuaSnapshotValueType::Value;
+				Value.Index = Snapshot.Values.Add(SnapshotObject);
+			}
+		}
+		break;
+		default:
+			// threads (and nil)
+			break;
+		}
+		return Value;
+	}
+
+	int32 CaptureTable(const int Index)
+	{
+		const void* Pointer = lua_topointer(L, Index);
+		if (int32* TableIndex = VisitedTables.Find(Pointer))
+		{
+			return *TableIndex;
+		}
+
+		if (Depth >= LUAMACHINE_SNAPSHOT_MAX_DEPTH)
+		{
+			bTooDeep = true;
+			return INDEX_NONE;
+		}
+
+		const int32 TableIndex = Snapshot.Tables.AddDefaulted();
+		VisitedTables.Add(Pointer, TableIndex);
+		if (FString* BuiltinName = BuiltinNames.Find(Pointer))
+		{
+			Snapshot.Tables[TableIndex].BuiltinName = *BuiltinName;
+		}
+
+		Depth++;
+		TArray<TPair<FLuaSnapshotValue, FLuaSnapshotValue>> Fields;
+		lua_pushnil(L);
+		while (lua_next(L, Index) != 0)
+		{
+			FLuaSnapshotValue Key = Capture(-2);
+			if (Key.Type != ELuaSnapshotValueType::Nil)
+			{
+				FLuaSnapshotValue FieldValue = Capture(-1);
+				if (FieldValue.Type != ELuaSnapshotValueType::Nil)
+				{
+					Fields.Add(TPair<FLuaSnapshotValue, FLuaSnapshotValue>(Key, FieldValue));
+				}
+			}
+			lua_pop(L, 1);
+		}
+
+		FLuaSnapshotValue Metatable;
+		if (lua_getmetatable(L, Index))
+		{
+			Metatable = Capture(-1);
+			lua_pop(L, 1);
+		}
+		Depth--;
+
+		// the array could have been reallocated by the recursion
+		Snapshot.Tables[TableIndex].Fields = MoveTemp(Fields);
+		Snapshot.Tables[TableIndex].Metatable = Metatable;
+		return TableIndex;
+	}
+
+	int32 CaptureFunction(const int Index)
+	{
+		const void* Pointer = lua_topointer(L, Index);
+		if (int32* FunctionIndex = VisitedFunctions.Find(Pointer))
+		{
+			return *FunctionIndex;
+		}
+
+		if (Depth >= LUAMACHINE_SNAPSHOT_MAX_DEPTH)
+		{
+			bTooDeep = true;
+			return INDEX_NONE;
+		}
+
+		const bool bCFunction = lua_iscfunction(L, Index) != 0;
+		int32 ByteCode = INDEX_NONE;
+		if (!bCFunction)
+		{
+			TArray<uint8> Dump;
+			lua_pushvalue(L, Index);
+			const int Ret = lua_dump(L, Writer, &Dump, 0);
+			lua_pop(L, 1);
+			if (Ret != 0)
+			{
+				return INDEX_NONE;
+			}
+			ByteCode = AddByteCode(Dump);
+		}
+
+		const int32 FunctionIndex = Snapshot.Functions.AddDefaulted();
+		VisitedFunctions.Add(Pointer, FunctionIndex);
+		Snapshot.Functions[FunctionIndex].ByteCode = ByteCode;
+		Snapshot.Functions[FunctionIndex].CFunction = bCFunction ? lua_tocfunction(L, Index) : nullptr;
+		if (TPair<FString, FString>* CFunctionName = bCFunction ? CFunctionNames.Find(Snapshot.Functions[FunctionIndex].CFunction) : nullptr)
+		{
+			Snapshot.Functions[FunctionIndex].CFunctionTable = CFunctionName->Key;
+			Snapshot.Functions[FunctionIndex].CFunctionField = CFunctionName->Value;
+		}
+
+		Depth++;
+		TArray<FLuaSnapshotValue> Upvalues;
+		TArray<FIntPoint> UpvalueJoins;
+		for (int UpvalueIndex = 1; lua_getupvalue(L, Index, UpvalueIndex) != nullptr; UpvalueIndex++)
+		{
+			FIntPoint Join(INDEX_NONE, INDEX_NONE);
+			// only Lua closures can share upvalues
+			if (!bCFunction)
+			{
+				void* UpvalueId = lua_upvalueid(L, Index, UpvalueIndex);
+				if (FIntPoint* Owner = UpvalueOwners.Find(UpvalueId))
+				{
+					Join = *Owner;
+				}
+				else
+				{
+					UpvalueOwners.Add(UpvalueId, FIntPoint(FunctionIndex, UpvalueIndex));
+				}
+			}
+			Upvalues.Add(Capture(-1));
+			UpvalueJoins.Add(Join);
+			lua_pop(L, 1);
+		}
+		Depth--;
+
+		Snapshot.Functions[FunctionIndex].Upvalues = MoveTemp(Upvalues);
+		Snapshot.Functions[FunctionIndex].UpvalueJoins = MoveTemp(UpvalueJoins);
+		return FunctionIndex;
+	}
+};
+
+TSharedPtr<FLuaStateSnapshot> FLuaStateSnapshot::Capture(ULuaState* LuaState)
+{
+	if (!LuaState)
+	{
+		return nullptr;
+	}
+
+	lua_State* L = LuaState->GetInternalLuaState();
+	if (!L)
+	{
+		return nullptr;
+	}
+	checkf(LuaState->IsLuaStateOwner(), TEXT("the VM of %s is owned by its dedicated thread (capture it in an FLuaStateOwnershipScope)"), *LuaState->GetName());
+
+	TSharedPtr<FLuaStateSnapshot> Snapshot = MakeShared<FLuaStateSnapshot>();
+	FLuaSnapshotCapture SnapshotCapture(*Snapshot, LuaState, L);
+
+	// tables that a fresh state already has, so that they are merged (and not duplicated) when restoring
+	lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
+	SnapshotCapture.AddBuiltin("_G");
+	lua_getfield(L, LUA_REGISTRYINDEX, LUA_LOADED_TABLE);
+	if (lua_type(L, -1) == LUA_TTABLE)
+	{
+		lua_pushnil(L);
+		while (lua_next(L, -2) != 0)
+		{
+			if (lua_type(L, -2) == LUA_TSTRING && lua_type(L, -1) == LUA_TTABLE && !SnapshotCapture.BuiltinNames.Contains(lua_topointer(L, -1)))
+			{
+				const FString ModuleName = UTF8_TO_TCHAR(lua_tostring(L, -2));
+				lua_pushvalue(L, -1);
+				SnapshotCapture.AddBuiltin(ModuleName);
+			}
+			lua_pop(L, 1);
+		}
+	}
+	SnapshotCapture.AddBuiltin("@loaded");
+	lua_getfield(L, LUA_REGISTRYINDEX, LUA_PRELOAD_TABLE);
+	SnapshotCapture.AddBuiltin("@preload");
+	for (const TPair<FString, ULuaBlueprintPackage*>& Pair : LuaState->LuaBlueprintPackages)
+	{
+		if (Pair.Value)
+		{
+			LuaState->FromLuaValue(Pair.Value->SelfTable, nullptr, L);
+			SnapshotCapture.AddBuiltin("@bp:" + Pair.Key);
+		}
+	}
+
+	lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
+	Snapshot->Globals = SnapshotCapture.Capture(-1);
+	lua_pop(L, 1);
+
+	// required modules not stored in a global
+	lua_getfield(L, LUA_REGISTRYINDEX, LUA_LOADED_TABLE);
+	SnapshotCapture.Capture(-1);
+	lua_pop(L, 1);
+
+	if (LuaState->UserDataMetaTable.Type == ELuaValueType::Table)
+	{
+		LuaState->FromLuaValue(LuaState->UserDataMetaTable, nullptr, L);
+		Snapshot->UserDataMetaTable = SnapshotCapture.Capture(-1);
+		lua_pop(L, 1);
+	}
+
+	if (SnapshotCapture.bTooDeep)
+	{
+		UE_LOG(LogLuaMachine, Error, TEXT("unable to capture %s: values nested deeper than %d levels"), *LuaState->GetName(), LUAMACHINE_SNAPSHOT_MAX_DEPTH);
+		return nullptr;
+	}
+
+	return Snapshot;
+}
+
+bool FLuaStateSnapshot::Restore(ULuaState* LuaState, FString& Error) const
+{
+	lua_State* L = LuaState ? LuaState->GetInternalLuaState() : nullptr;
+	if (!L)
+	{
+		Error = TEXT("invalid Lua state");
+		return false;
+	}
+
+	const int32 Top = lua_gettop(L);
+	luaL_checkstack(L, 8, nullptr);
+
+	// tables are at [1, N], functions at [N + 1, N + M]
+	lua_createtable(L, Tables.Num() + Functions.Num(), 0);
+	const int Objects = lua_gettop(L);
+
+	for (int32 TableIndex = 0; TableIndex < Tables.Num(); TableIndex++)
+	{
+		const FLuaSnapshotTable& Table = Tables[TableIndex];
+		bool bFound = false;
+		if (!Table.BuiltinName.IsEmpty())
+		{
+			LuaPushSnapshotBuiltin(LuaState, L, Table.BuiltinName);
+			bFound = lua_type(L, -1) == LUA_TTABLE;
+			if (!bFound)
+			{
+				lua_pop(L, 1);
+			}
+		}
+
+		if (!bFound)
+		{
+			lua_createtable(L, 0, Table.Fields.Num());
+		}
+		lua_rawseti(L, Objects, TableIndex + 1);
+	}
+
+	auto PushValue = [&](const FLuaSnapshotValue& Value)
+	{
+		switch (Value.Type)
+		{
+		case ELuaSnapshotValueType::Bool:
+			lua_pushboolean(L, Value.Bool ? 1 : 0);
+			break;
+		case ELuaSnapshotValueType::Integer:
+			lua_pushinteger(L, Value.Integer);
+			break;
+		case ELuaSnapshotValueType::Number:
+			lua_pushnumber(L, Value.Number);
+			break;
+		case ELuaSnapshotValueType::String:
+			lua_pushlstring(L, (const char*)Strings[Value.Index].GetData(), Strings[Value.Index].Num());
+			break;
+		case ELuaSnapshotValueType::Table:
+			lua_rawgeti(L, Objects, Value.Index + 1);
+			break;
+		case ELuaSnapshotValueType::Function:
+			lua_rawgeti(L, Objects, Tables.Num() + Value.Index + 1);
+			break;
+		case ELuaSnapshotValueType::LightUserData:
+			lua_pushlightuserdata(L, Value.LightUserData);
+			break;
+		case ELuaSnapshotValueType::Value:
+		{
+			const FLuaSnapshotObject& SnapshotObject = Values[Value.Index];
+			UObject* Object = SnapshotObject.Object.Get();
+			if (!IsValid(Object))
+			{
+				lua_pushnil(L);
+				break;
+			}
+			// owned by the new state
+			FLuaValue LuaValue = SnapshotObject.bFunction ? FLuaValue::FunctionOfObject(Object, SnapshotObject.FunctionName) : FLuaValue(Object);
+			LuaValue.LuaState = LuaState;
+			LuaState->FromLuaValue(LuaValue, nullptr, L);
+		}
+		break;
+		default:
+			lua_pushnil(L);
+			break;
+		}
+	};
+
+	// userdata created while filling the tables need the metatable already set
+	if (UserDataMetaTable.Type == ELuaSnapshotValueType::Table)
+	{
+		PushValue(UserDataMetaTable);
+		LuaState->UserDataMetaTable = LuaState->ToLuaValue(-1);
+		lua_pop(L, 1);
+	}
+
+	TBitArray<> SharedCFunctions(false, Functions.Num());
+	for (int32 FunctionIndex = 0; FunctionIndex < Functions.Num(); FunctionIndex++)
+	{
+		const FLuaSnapshotFunction& Function = Functions[FunctionIndex];
+		if (Function.ByteCode != INDEX_NONE)
+		{
+			const TArray<uint8>& ByteCode = ByteCodes[Function.ByteCode];
+			// mode "b": the bytecode is reused, never parsed again
+			if (luaL_loadbufferx(L, (const char*)ByteCode.GetData(), ByteCode.Num(), "snapshot", "b") != LUA_OK)
+			{
+				Error = ANSI_TO_TCHAR(lua_tostring(L, -1));
+				lua_settop(L, Top);
+				return false;
+			}
+		}
+		else
+		{
+			// library functions are taken (with their upvalues) from the new state
+			if (!Function.CFunctionTable.IsEmpty())
+			{
+				LuaPushSnapshotBuiltin(LuaState, L, Function.CFunctionTable);
+				if (lua_istable(L, -1))
+				{
+					lua_getfield(L, -1, TCHAR_TO_UTF8(*Function.CFunctionField));
+					lua_remove(L, -2);
+				}
+				if (lua_iscfunction(L, -1))
+				{
+					SharedCFunctions[FunctionIndex] = true;
+					lua_rawseti(L, Objects, Tables.Num() + FunctionIndex + 1);
+					continue;
+				}
+				lua_pop(L, 1);
+			}
+
+			// no pointer when coming from a serialized image
+			if (!Function.CFunction)
+			{
+				UE_LOG(LogLuaMachine, Warning, TEXT("unable to restore C function %s.%s from snapshot"), *Function.CFunctionTable, *Function.CFunctionField);
+				continue;
+			}
+
+			// upvalues are assigned later (they could reference this same function)
+			for (int32 UpvalueIndex = 0; UpvalueIndex < Function.Upvalues.Num(); UpvalueIndex++)
+			{
+				lua_pushnil(L);
+			}
+			lua_pushcclosure(L, Function.CFunction, Function.Upvalues.Num());
+		}
+		lua_rawseti(L, Objects, Tables.Num() + FunctionIndex + 1);
+	}
+
+	for (int32 TableIndex = 0; TableIndex < Tables.Num(); TableIndex++)
+	{
+		const FLuaSnapshotTable& Table = Tables[TableIndex];
+		lua_rawgeti(L, Objects, TableIndex + 1);
+		for (const TPair<FLuaSnapshotValue, FLuaSnapshotValue>& Field : Table.Fields)
+		{
+			PushValue(Field.Key);
+			PushValue(Field.Value);
+			if (lua_isnil(L, -2))
+			{
+				lua_pop(L, 2);
+				continue;
+			}
+			lua_rawset(L, -3);
+		}
+		if (Table.Metatable.Type == ELuaSnapshotValueType::Table)
+		{
+			PushValue(Table.Metatable);
+			lua_setmetatable(L, -2);
+		}
+		lua_pop(L, 1);
+	}
+
+	for (int32 FunctionIndex = 0; FunctionIndex < Functions.Num(); FunctionIndex++)
+	{
+		const FLuaSnapshotFunction& Function = Functions[FunctionIndex];
+		if (SharedCFunctions[FunctionIndex])
+		{
+			continue;
+		}
+		lua_rawgeti(L, Objects, Tables.Num() + FunctionIndex + 1);
+		for (int32 UpvalueIndex = 0; UpvalueIndex < Function.Upvalues.Num(); UpvalueIndex++)
+		{
+			const FIntPoint& Join = Function.UpvalueJoins[UpvalueIndex];
+			if (Join.X != INDEX_NONE)
+			{
+				lua_rawgeti(L, Objects, Tables.Num() + Join.X + 1);
+				const int JoinTop = lua_gettop(L);
+				// the bytecode decides the number of upvalues, never trust the image
+				if (lua_getupvalue(L, JoinTop - 1, UpvalueIndex + 1) && lua_getupvalue(L, JoinTop, Join.Y))
+				{
+					lua_upvaluejoin(L, JoinTop - 1, UpvalueIndex + 1, JoinTop, Join.Y);
+				}
+				lua_settop(L, JoinTop - 1);
+				continue;
+			}
+			PushValue(Function.Upvalues[UpvalueIndex]);
+			if (!lua_setupvalue(L, -2, UpvalueIndex + 1))
+			{
+				lua_pop(L, 1);
+			}
+		}
+		lua_pop(L, 1);
+	}
+
+	lua_settop(L, Top);
+	return true;
+}
+
+static void LuaSerializeSnapshotValue(FArchive& Ar, FLuaSnapshotValue& Value)
+{
+	uint8 Type = (uint8)Value.Type;
+	// addresses are meaningless in another process
+	if (Ar.IsSaving() && Value.Type == ELuaSnapshotValueType::LightUserData)
+	{
+		Type = (uint8)ELuaSnapshotValueType::Nil;
+	}
+	Ar << Type;
+
+	if (Ar.IsLoading())
+	{
+		Value = FLuaSnapshotValue();
+		Value.Type = (ELuaSnapshotValueType)Type;
+	}
+
+	switch ((ELuaSnapshotValueType)Type)
+	{
+	case ELuaSnapshotValueType::Bool:
+		Ar << Value.Bool;
+		break;
+	case ELuaSnapshotValueType::Integer:
+	{
+		int64 Integer = Value.Integer;
+		Ar << Integer;
+		Value.Integer = Integer;
+	}
+	break;
+	case ELuaSnapshotValueType::Number:
+	{
+		double Number = Value.Number;
+		Ar << Number;
+		Value.Number = Number;
+	}
+	break;
+	case ELuaSnapshotValueType::String:
+	case ELuaSnapshotValueType::Table:
+	case ELuaSnapshotValueType::Function:
+	case ELuaSnapshotValueType::Value:
+		Ar << Value.Index;
+		break;
+	case ELuaSnapshotValueType::Nil:
+		break;
+	default:
+		Ar.SetError();
+		break;
+	}
+}
+
+void FLuaStateSnapshot::Serialize(FArchive& Ar)
+{
+	Ar << Strings;
+	Ar << ByteCodes;
+
+	int32 NumTables = Tables.Num();
+	Ar << NumTables;
+	if (Ar.IsLoading())
+	{
+		if (NumTables < 0 || NumTables > Ar.TotalSize())
+		{
+			Ar.SetError();
+			return;
+		}
+		Tables.SetNum(NumTables);
+	}
+	for (FLuaSnapshotTable& Table : Tables)
+	{
+		Ar << Table.BuiltinName;
+		int32 NumFields = Table.Fields.Num();
+		Ar << NumFields;
+		if (Ar.IsLoading())
+		{
+			if (NumFields < 0 || NumFields > Ar.TotalSize())
+			{
+				Ar.SetError();
+				return;
+			}
+			Table.Fields.SetNum(NumFields);
+		}
+		for (TPair<FLuaSnapshotValue, FLuaSnapshotValue>& Field : Table.Fields)
+		{
+			LuaSerializeSnapshotValue(Ar, Field.Key);
+			LuaSerializeSnapshotValue(Ar, Field.Value);
+		}
+		LuaSerializeSnapshotValue(Ar, Table.Metatable);
+		if (Ar.IsError())
+		{
+			return;
+		}
+	}
+
+	int32 NumFunctions = Functions.Num();
+	Ar << NumFunctions;
+	if (Ar.IsLoading())
+	{
+		if (NumFunctions < 0 || NumFunctions > Ar.TotalSize())
+		{
+			Ar.SetError();
+			return;
+		}
+		Functions.SetNum(NumFunctions);
+	}
+	for (FLuaSnapshotFunction& Function : Functions)
+	{
+		Ar << Function.ByteCode;
+		Ar << Function.CFunctionTable;
+		Ar << Function.CFunctionField;
+		int32 NumUpvalues = Function.Upvalues.Num();
+		Ar << NumUpvalues;
+		if (Ar.IsLoading())
+		{
+			if (NumUpvalues < 0 || NumUpvalues > 255)
+			{
+				Ar.SetError();
+				return;
+			}
+			Function.CFunction = nullptr;
+			Function.Upvalues.SetNum(NumUpvalues);
+		}
+		for (FLuaSnapshotValue& Upvalue : Function.Upvalues)
+		{
+			LuaSerializeSnapshotValue(Ar, Upvalue);
+		}
+		Ar << Function.UpvalueJoins;
+		if (Ar.IsError())
+		{
+			return;
+		}
+	}
+
+	// UObjects by path, UFunctions by path and name
+	int32 NumValues = Values.Num();
+	Ar << NumValues;
+	if (Ar.IsLoading())
+	{
+		if (NumValues < 0 || NumValues > Ar.TotalSize())
+		{
+			Ar.SetError();
+			return;
+		}
+		Values.SetNum(NumValues);
+	}
+	for (FLuaSnapshotObject& Value : Values)
+	{
+		uint8 Type = (uint8)(Value.bFunction ? ELuaValueType::UFunction : ELuaValueType::UObject);
+		UObject* SavedObject = Value.Object.Get();
+		FString ObjectPath = Ar.IsSaving() && IsValid(SavedObject) ? FSoftObjectPath(SavedObject).ToString() : FString();
+		FString FunctionName = Value.bFunction ? Value.FunctionName.ToString() : FString();
+		Ar << Type;
+		Ar << ObjectPath;
+		Ar << FunctionName;
+		if (Ar.IsLoading())
+		{
+			FSoftObjectPath SoftObjectPath(ObjectPath);
+			UObject* Object = SoftObjectPath.ResolveObject();
+			// assets can be loaded, anything else (actors, components) must already exist
+			if (!Object && SoftObjectPath.IsAsset())
+			{
+				Object = SoftObjectPath.TryLoad();
+			}
+			Value.Object = Object;
+			Value.bFunction = (ELuaValueType)Type == ELuaValueType::UFunction;
+			Value.FunctionName = Value.bFunction ? FName(*FunctionName) : NAME_None;
+		}
+	}
+
+	LuaSerializeSnapshotValue(Ar, Globals);
+	LuaSerializeSnapshotValue(Ar, UserDataMetaTable);
+}
+
+void FLuaStateSnapshot::Save(TArray<uint8>& Image) const
+{
+	TArray<uint8> Payload;
+	FMemoryWriter PayloadWriter(Payload);
+	// saving does not change the snapshot
+	const_cast<FLuaStateSnapshot*>(this)->Serialize(PayloadWriter);
+
+	Image.Empty(Payload.Num() + 16);
+	FMemoryWriter Writer(Image);
+	uint32 Magic = LUAMACHINE_SNAPSHOT_MAGIC;
+	int32 Version = LUAMACHINE_SNAPSHOT_VERSION;
+	int32 LuaVersion = LUA_VERSION_NUM;
+	uint32 Crc = FCrc::MemCrc32(Payload.GetData(), Payload.Num());
+	Writer << Magic;
+	Writer << Version;
+	Writer << LuaVersion;
+	Writer << Crc;
+	Writer.Serialize(Payload.GetData(), Payload.Num());
+}
+
+TSharedPtr<FLuaStateSnapshot> FLuaStateSnapshot::Load(const TArray<uint8>& Image, FString& Error)
+{
+	FMemoryReader Reader(Image);
+	uint32 Magic = 0;
+	int32 Version = 0;
+	int32 LuaVersion = 0;
+	uint32 Crc = 0;
+	Reader << Magic;
+	Reader << Version;
+	Reader << LuaVersion;
+	Reader << Crc;
+	if (Reader.IsError() || Magic != LUAMACHINE_SNAPSHOT_MAGIC)
+	{
+		Error = TEXT("not a Lua state image");
+		return nullptr;
+	}
+
+	if (Version != LUAMACHINE_SNAPSHOT_VERSION || LuaVersion != LUA_VERSION_NUM)
+	{
+		Error = FString::Printf(TEXT("unsupported Lua state image version %d (Lua %d)"), Version, LuaVersion);
+		return nullptr;
+	}
+
+	const int64 Offset = Reader.Tell();
+	if (FCrc::MemCrc32(Image.GetData() + Offset, Image.Num() - Offset) != Crc)
+	{
+		Error = TEXT("corrupted Lua state image");
+		return nullptr;
+	}
+
+	TSharedPtr<FLuaStateSnapshot> Snapshot = MakeShared<FLuaStateSnapshot>();
+	Snapshot->Serialize(Reader);
+	if (Reader.IsError() || !Snapshot->IsValidGraph())
+	{
+		Error = TEXT("malformed Lua state image");
+		return nullptr;
+	}
+
+	return Snapshot;
+}
+
+bool FLuaStateSnapshot::IsValidGraph() const
+{
+	auto IsValidValue = [this](const FLuaSnapshotValue& Value)
+	{
+		switch (Value.Type)
+		{
+		case ELuaSnapshotValueType::String:
+			return Strings.IsValidIndex(Value.Index);
+		case ELuaSnapshotValueType::Table:
+			return Tables.IsValidIndex(Value.Index);
+		case ELuaSnapshotValueType::Function:
+			return Functions.IsValidIndex(Value.Index);
+		case ELuaSnapshotValueType::Value:
+			return Values.IsValidIndex(Value.Index);
+		default:
+			return true;
+		}
+	};
+
+	for (const FLuaSnapshotTable& Table : Tables)
+	{
+		for (const TPair<FLuaSnapshotValue, FLuaSnapshotValue>& Field : Table.Fields)
+		{
+			if (!IsValidValue(Field.Key) || !IsValidValue(Field.Value))
+			{
+				return false;
+			}
+		}
+		if (!IsValidValue(Table.Metatable))
+		{
+			return false;
+		}
+	}
+
+	for (const FLuaSnapshotFunction& Function : Functions)
+	{
+		if (Function.ByteCode != INDEX_NONE && !ByteCodes.IsValidIndex(Function.ByteCode))
+		{
+			return false;
+		}
+		if (Function.UpvalueJoins.Num() != Function.Upvalues.Num())
+		{
+			return false;
+		}
+		for (int32 UpvalueIndex = 0; UpvalueIndex < Function.Upvalues.Num(); UpvalueIndex++)
+		{
+			if (!IsValidValue(Function.Upvalues[UpvalueIndex]))
+			{
+				return false;
+			}
+			const FIntPoint& Join = Function.UpvalueJoins[UpvalueIndex];
+			if (Join.X != INDEX_NONE && (Function.ByteCode == INDEX_NONE || !Functions.IsValidIndex(Join.X) || Functions[Join.X].ByteCode == INDEX_NONE || Join.Y < 1 || Join.Y > Functions[Join.X].Upvalues.Num()))
+			{
+				return false;
+			}
+		}
+	}
+
+	return Globals.Type == ELuaSnapshotValueType::Table && IsValidValue(Globals) && IsValidValue(UserDataMetaTable);
+}
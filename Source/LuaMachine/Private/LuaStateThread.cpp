@@ -0,0 +1,260 @@
+// Copyright 2018-2023 - Roberto De Ioris
+
+#include "LuaStateThread.h"
+#include "LuaState.h"
+#include "HAL/RunnableThread.h"
+#include "HAL/Event.h"
+
+FLuaStateThread::FLuaStateThread(ULuaState* InLuaState) : LuaState(InLuaState), Thread(nullptr), LuaThreadId(0), OwnerThreadId(0), LentDepth(0)
+{
+	WakeUp = FPlatformProcess::GetSynchEventFromPool(false);
+	GameThreadWakeUp = FPlatformProcess::GetSynchEventFromPool(false);
+}
+
+FLuaStateThread::~FLuaStateThread()
+{
+	if (Thread)
+	{
+		Shutdown();
+	}
+
+	FPlatformProcess::ReturnSynchEventToPool(WakeUp);
+	FPlatformProcess::ReturnSynchEventToPool(GameThreadWakeUp);
+}
+
+bool FLuaStateThread::Start()
+{
+	Thread = FRunnableThread::Create(this, *FString::Printf(TEXT("LuaState_%s"), *LuaState->GetName()));
+	if (!Thread)
+	{
+		return false;
+	}
+	LuaThreadId = Thread->GetThreadID();
+	return true;
+}
+
+void FLuaStateThread::Shutdown()
+{
+	check(IsInGameThread());
+	// the Lua thread is waiting for us in the middle of a call
+	checkf(LentDepth == 0, TEXT("the dedicated thread of %s cannot be stopped by its own requests"), *LuaState->GetName());
+
+	if (Thread)
+	{
+		// a scope of the game thread could still own the VM (its Release() is harmless once the thread has exited)
+		FPlatformAtomics::InterlockedCompareExchange(&OwnerThreadId, 0, (int32)FPlatformTLS::GetCurrentThreadId());
+
+		bStopping = true;
+		WakeUp->Trigger();
+		// the remaining commands are executed, but their requests never reach the game thread
+		while (!bExited)
+		{
+			DiscardGameThreadRequests();
+			GameThreadWakeUp->Wait();
+		}
+		Thread->WaitForCompletion();
+		delete Thread;
+		Thread = nullptr;
+	}
+
+	DiscardGameThreadRequests();
+}
+
+void FLuaStateThread::Enqueue(TUniqueFunction<void()> Command)
+{
+	Commands.Enqueue(MoveTemp(Command));
+	WakeUp->Trigger();
+}
+
+void FLuaStateThread::PostToGameThread(TUniqueFunction<void()> Request)
+{
+	GameThreadRequests.Enqueue([Request = MoveTemp(Request)](const bool bDiscard) mutable
+		{
+			if (!bDiscard)
+			{
+				Request();
+			}
+		});
+	GameThreadWakeUp->Trigger();
+}
+
+void FLuaStateThread::DrainGameThreadRequests()
+{
+	check(IsInGameThread());
+	// a request could retire the state (and so release the thread)
+	TSharedRef<FLuaStateThread, ESPMode::ThreadSafe> KeepAlive = AsShared();
+	TUniqueFunction<void(const bool)> Request;
+	while (GameThreadRequests.Dequeue(Request))
+	{
+		Request(false);
+	}
+}
+
+void FLuaStateThread::DiscardGameThreadRequests()
+{
+	TUniqueFunction<void(const bool)> Request;
+	while (GameThreadRequests.Dequeue(Request))
+	{
+		Request(true);
+	}
+}
+
+bool FLuaStateThread::RunOnGameThread(TFunctionRef<void()> Request)
+{
+	check(IsInLuaThread());
+
+	// the Lua thread keeps the ownership, the game thread can touch the VM only while running the request
+	bool bExecuted = false;
+	FEvent* Done = FPlatformProcess::GetSynchEventFromPool(false);
+	GameThreadRequests.Enqueue([this, &Request, &bExecuted, Done](const bool bDiscard)
+		{
+			if (!bDiscard)
+			{
+				LentDepth++;
+				Request();
+				LentDepth--;
+				bExecuted = true;
+			}
+			Done->Trigger();
+		});
+	GameThreadWakeUp->Trigger();
+	Done->Wait();
+	FPlatformProcess::ReturnSynchEventToPool(Done);
+	return bExecuted;
+}
+
+int FLuaStateThread::CallOnGameThread(lua_State* L, lua_CFunction Function)
+{
+	lua_pushcfunction(L, Function);
+	lua_insert(L, 1);
+
+	int Status = LUA_OK;
+	if (!RunOnGameThread([L, &Status]()
+		{
+			Status = lua_pcall(L, lua_gettop(L) - 1, LUA_MULTRET, 0);
+		}))
+	{
+		return luaL_error(L, "the game thread is not available, the state is shutting down");
+	}
+
+	if (Status != LUA_OK)
+	{
+		return lua_error(L);
+	}
+
+	return lua_gettop(L);
+}
+
+bool FLuaStateThread::Acquire()
+{
+	// nested scope, or Lua code of the running command calling back into the game thread
+	if (IsOwnedByCurrentThread())
+	{
+		return false;
+	}
+
+	const bool bGameThread = IsInGameThread();
+	const int32 CurrentThreadId = (int32)FPlatformTLS::GetCurrentThreadId();
+	while (FPlatformAtomics::InterlockedCompareExchange(&OwnerThreadId, CurrentThreadId, 0) != 0)
+	{
+		if (bGameThread)
+		{
+			// the running command could be waiting for us
+			DrainGameThreadRequests();
+			GameThreadWakeUp->Wait();
+		}
+		else
+		{
+			// only the game thread serves the requests of the running command, the other threads just wait for the VM
+			FPlatformProcess::Sleep(0);
+		}
+	}
+	return true;
+}
+
+void FLuaStateThread::Release()
+{
+	SetOwner(0);
+	WakeUp->Trigger();
+	// the game thread could be waiting for a worker thread (not only for the Lua thread)
+	GameThreadWakeUp->Trigger();
+}
+
+bool FLuaStateThread::IsOwnedByCurrentThread() const
+{
+	// LentDepth is touched only by the game thread
+	if (IsInGameThread() && LentDepth > 0)
+	{
+		return true;
+	}
+	return FPlatformAtomics::AtomicRead(&OwnerThreadId) == (int32)FPlatformTLS::GetCurrentThreadId();
+}
+
+bool FLuaStateThread::IsInLuaThread() const
+{
+	return LuaThreadId != 0 && LuaThreadId == FPlatformTLS::GetCurrentThreadId();
+}
+
+void FLuaStateThread::SetOwner(const uint32 ThreadId)
+{
+	FPlatformAtomics::InterlockedExchange(&OwnerThreadId, (int32)ThreadId);
+}
+
+uint32 FLuaStateThread::Run()
+{
+	LuaThreadId = FPlatformTLS::GetCurrentThreadId();
+
+	for (;;)
+	{
+		{
+			TUniqueFunction<void()> Command;
+			if (!Commands.Dequeue(Command))
+			{
+				if (bStopping)
+				{
+					break;
+				}
+				WakeUp->Wait();
+				continue;
+			}
+
+			// the game thread is borrowing the VM
+			while (FPlatformAtomics::InterlockedCompareExchange(&OwnerThreadId, (int32)LuaThreadId, 0) != 0)
+			{
+				WakeUp->Wait();
+			}
+
+			// the captures are released while still owning the VM
+			Command();
+		}
+
+		SetOwner(0);
+		GameThreadWakeUp->Trigger();
+	}
+
+	bExited = true;
+	GameThreadWakeUp->Trigger();
+	return 0;
+}
+
+void FLuaStateThread::Stop()
+{
+	bStopping = true;
+	WakeUp->Trigger();
+}
+
+FLuaStateOwnershipScope::FLuaStateOwnershipScope(ULuaState* InLuaState) : LuaThread(InLuaState ? InLuaState->LuaThread : nullptr), bAcquired(false)
+{
+	if (LuaThread)
+	{
+		bAcquired = LuaThread->Acquire();
+	}
+}
+
+FLuaStateOwnershipScope::~FLuaStateOwnershipScope()
+{
+	if (bAcquired)
+	{
+		LuaThread->Release();
+	}
+}
@@ -4,11 +4,11 @@
 
 FLuaValue ULuaTableAsset::ToLuaTable(ULuaState* LuaState)
 {
-	FLuaValue NewTable = LuaState->CreateLuaTable();
+	FLuaTableBuilder NewTable(LuaState, 0, Table.Num());
 	for (TPair<FString, FLuaValue>& Pair : Table)
 	{
 		NewTable.SetField(Pair.Key, Pair.Value);
 	}
 
-	return NewTable;
+	return NewTable.Finish();
 }
\ No newline at end of file
@@ -49,12 +49,50 @@ void ULuaUserDataObject::RemoveLuaSmartReference(TSharedPtr<FLuaSmartReference>
 	}
 }
 
+TMap<FString, FLuaValue> ULuaUserDataObject::LuaGetTable() const
+{
+	ULuaState* LuaState = LuaInstanceTable.LuaState.Get();
+	if (!LuaState)
+	{
+		return Table;
+	}
+
+	FLuaStateOwnershipScope OwnershipScope(LuaState);
+	TMap<FString, FLuaValue> Fields;
+	// the instance table is only read
+	if (!LuaState->GetInstanceTableFields(const_cast<ULuaUserDataObject*>(this), Fields))
+	{
+		return Table;
+	}
+	return Fields;
+}
+
+void ULuaUserDataObject::LuaSyncTable()
+{
+	if (ULuaState* LuaState = LuaInstanceTable.LuaState.Get())
+	{
+		FLuaStateOwnershipScope OwnershipScope(LuaState);
+		LuaState->SyncInstanceTable(this);
+	}
+}
+
+void ULuaUserDataObject::LuaReloadTable()
+{
+	if (ULuaState* LuaState = LuaInstanceTable.LuaState.Get())
+	{
+		FLuaStateOwnershipScope OwnershipScope(LuaState);
+		LuaState->ReloadInstanceTable(this);
+	}
+}
+
 FLuaValue ULuaUserDataObject::LuaGetField(const FString& Name)
 {
 	ULuaState* LuaState = Cast<ULuaState>(GetOuter());
 	if (!LuaState)
 		return FLuaValue();
 
+	FLuaStateOwnershipScope OwnershipScope(LuaState);
+
 	// push component pointer as userdata
 	LuaState->NewUObject(this, nullptr);
 	LuaState->SetupAndAssignUserDataMetatable(this, Metatable, nullptr);
@@ -74,6 +112,8 @@ void ULuaUserDataObject::LuaSetField(const FString& Name, FLuaValue Value)
 	if (!LuaState)
 		return;
 
+	FLuaStateOwnershipScope OwnershipScope(LuaState);
+
 	// push component pointer as userdata
 	LuaState->NewUObject(this, nullptr);
 	LuaState->SetupAndAssignUserDataMetatable(this, Metatable, nullptr);
@@ -132,6 +172,11 @@ void ULuaUserDataObject::ReceiveLuaGC_Implementation()
 
 }
 
+void ULuaUserDataObject::ReceiveLuaPoolReset_Implementation()
+{
+
+}
+
 FLuaValue ULuaUserDataObject::ReceiveLuaMetaIndex_Implementation(FLuaValue Key)
 {
 	return FLuaValue();
@@ -139,8 +184,8 @@ FLuaValue ULuaUserDataObject::ReceiveLuaMetaIndex_Implementation(FLuaValue Key)
 
 FLuaValue ULuaUserDataObject::UFunctionToLuaValue(const FString& FunctionName)
 {
-	FName FunctionFName = FName(*FunctionName);
-	UFunction* Function = FindFunction(FunctionFName);
+	const FName FunctionFName(*FunctionName, FNAME_Find);
+	UFunction* Function = FunctionFName.IsNone() ? nullptr : FindFunction(FunctionFName);
 	if (!Function)
 	{
 		return FLuaValue();
@@ -157,6 +202,8 @@ FLuaValue ULuaUserDataObject::LuaCallFunction(const FString& Name, TArray<FLuaVa
 	if (!L)
 		return ReturnValue;
 
+	FLuaStateOwnershipScope OwnershipScope(L);
+
 	// push userdata pointer as userdata
 	L->NewUObject(this, nullptr);
 	L->SetupAndAssignUserDataMetatable(this, Metatable, nullptr);
@@ -32,6 +32,10 @@ FString FLuaValue::ToString() const
 
 FName FLuaValue::ToName() const
 {
+	if (Type == ELuaValueType::String)
+	{
+		return FName(*String);
+	}
 	return FName(*ToString());
 }
 
@@ -83,36 +87,22 @@ bool FLuaValue::ToBool() const
 	return true;
 }
 
+void FLuaValue::SetRef(ULuaState* InLuaState, const int InLuaRef)
+{
+	LuaState = InLuaState;
+	LuaRef = InLuaRef;
+	UnrefQueue = InLuaState ? InLuaState->GetUnrefQueue() : nullptr;
+}
+
 void FLuaValue::Unref()
 {
-	if (!LuaState.IsValid())
+	// deferred, so values can be released from any thread and in bulk (a closed VM drops the ref)
+	if (LuaRef != LUA_NOREF && UnrefQueue)
 	{
-		LuaRef = LUA_NOREF;
-		return;
-	}
-
-	if (Type == ELuaValueType::Table || Type == ELuaValueType::Function || Type == ELuaValueType::Thread)
-	{
-		if (LuaRef != LUA_NOREF)
-		{
-			// special case for when the engine is shutting down
-#if ENGINE_MAJOR_VERSION > 4 || ENGINE_MINOR_VERSION >= 24
-			if (IsEngineExitRequested())
-#else
-			if (GIsRequestingExit)
-#endif
-			{
-				if (!LuaState->IsValidLowLevel())
-				{
-					LuaRef = LUA_NOREF;
-					return;
-				}
-			}
-			// use UnrefCheck here to support moving of LuaState
-			LuaState->UnrefChecked(LuaRef);
-		}
-		LuaRef = LUA_NOREF;
+		UnrefQueue->Enqueue(LuaRef);
 	}
+	LuaRef = LUA_NOREF;
+	UnrefQueue = nullptr;
 }
 
 FLuaValue::~FLuaValue()
@@ -133,16 +123,33 @@ FLuaValue::FLuaValue(const FLuaValue& SourceValue)
 	FunctionName = SourceValue.FunctionName;
 	MulticastScriptDelegate = SourceValue.MulticastScriptDelegate;
 
-	// make a new reference to the table, to avoid it being destroyed
+	// make a new reference to the table, to avoid it being destroyed (only if its VM is still open)
 	if (LuaRef != LUA_NOREF)
 	{
-		LuaState->GetRef(LuaRef);
-		LuaRef = LuaState->NewRef();
+		if (LuaState.IsValid() && SourceValue.UnrefQueue && !SourceValue.UnrefQueue->IsClosed())
+		{
+			FLuaStateOwnershipScope OwnershipScope(LuaState.Get());
+			LuaState->GetRef(LuaRef);
+			LuaRef = LuaState->NewRef();
+			UnrefQueue = SourceValue.UnrefQueue;
+		}
+		else
+		{
+			LuaRef = LUA_NOREF;
+		}
 	}
 }
 
 FLuaValue& FLuaValue::operator = (const FLuaValue& SourceValue)
 {
+	if (this == &SourceValue)
+	{
+		return *this;
+	}
+
+	// release the currently owned reference (if any)
+	Unref();
+
 	Type = SourceValue.Type;
 	Object = SourceValue.Object;
 	LuaRef = SourceValue.LuaRef;
@@ -154,13 +161,65 @@ FLuaValue& FLuaValue::operator = (const FLuaValue& SourceValue)
 	FunctionName = SourceValue.FunctionName;
 	MulticastScriptDelegate = SourceValue.MulticastScriptDelegate;
 
-	// make a new reference to the table, to avoid it being destroyed
+	// make a new reference to the table, to avoid it being destroyed (only if its VM is still open)
 	if (LuaRef != LUA_NOREF)
 	{
-		LuaState->GetRef(LuaRef);
-		LuaRef = LuaState->NewRef();
+		if (LuaState.IsValid() && SourceValue.UnrefQueue && !SourceValue.UnrefQueue->IsClosed())
+		{
+			FLuaStateOwnershipScope OwnershipScope(LuaState.Get());
+			LuaState->GetRef(LuaRef);
+			LuaRef = LuaState->NewRef();
+			UnrefQueue = SourceValue.UnrefQueue;
+		}
+		else
+		{
+			LuaRef = LUA_NOREF;
+		}
+	}
+
+	return *this;
+}
+
+FLuaValue::FLuaValue(FLuaValue&& SourceValue)
+{
+	Type = SourceValue.Type;
+	Object = SourceValue.Object;
+	LuaRef = SourceValue.LuaRef;
+	LuaState = MoveTemp(SourceValue.LuaState);
+	Bool = SourceValue.Bool;
+	Integer = SourceValue.Integer;
+	Number = SourceValue.Number;
+	String = MoveTemp(SourceValue.String);
+	FunctionName = SourceValue.FunctionName;
+	MulticastScriptDelegate = SourceValue.MulticastScriptDelegate;
+	UnrefQueue = MoveTemp(SourceValue.UnrefQueue);
+
+	SourceValue.LuaRef = LUA_NOREF;
+}
+
+FLuaValue& FLuaValue::operator = (FLuaValue&& SourceValue)
+{
+	if (this == &SourceValue)
+	{
+		return *this;
 	}
 
+	Unref();
+
+	Type = SourceValue.Type;
+	Object = SourceValue.Object;
+	LuaRef = SourceValue.LuaRef;
+	LuaState = MoveTemp(SourceValue.LuaState);
+	Bool = SourceValue.Bool;
+	Integer = SourceValue.Integer;
+	Number = SourceValue.Number;
+	String = MoveTemp(SourceValue.String);
+	FunctionName = SourceValue.FunctionName;
+	MulticastScriptDelegate = SourceValue.MulticastScriptDelegate;
+	UnrefQueue = MoveTemp(SourceValue.UnrefQueue);
+
+	SourceValue.LuaRef = LUA_NOREF;
+
 	return *this;
 }
 
@@ -172,9 +231,10 @@ FLuaValue FLuaValue::SetField(const FString& Key, FLuaValue Value)
 	if (!LuaState.IsValid())
 		return *this;
 
+	FLuaStateOwnershipScope OwnershipScope(LuaState.Get());
 	LuaState->FromLuaValue(*this);
 	LuaState->FromLuaValue(Value);
-	LuaState->SetField(-2, TCHAR_TO_ANSI(*Key));
+	LuaState->SetField(-2, TCHAR_TO_UTF8(*Key));
 	LuaState->Pop();
 	return *this;
 }
@@ -187,9 +247,10 @@ FLuaValue FLuaValue::SetField(const FString& Key, lua_CFunction CFunction)
 	if (!LuaState.IsValid())
 		return *this;
 
+	FLuaStateOwnershipScope OwnershipScope(LuaState.Get());
 	LuaState->FromLuaValue(*this);
 	LuaState->PushCFunction(CFunction);
-	LuaState->SetField(-2, TCHAR_TO_ANSI(*Key));
+	LuaState->SetField(-2, TCHAR_TO_UTF8(*Key));
 	LuaState->Pop();
 	return *this;
 }
@@ -202,6 +263,7 @@ FLuaValue FLuaValue::SetMetaTable(FLuaValue MetaTable)
 	if (!LuaState.IsValid())
 		return *this;
 
+	FLuaStateOwnershipScope OwnershipScope(LuaState.Get());
 	LuaState->FromLuaValue(*this);
 	LuaState->FromLuaValue(MetaTable);
 	LuaState->SetMetaTable(-2);
@@ -219,8 +281,9 @@ FLuaValue FLuaValue::GetField(const FString& Key)
 	if (!LuaState.IsValid())
 		return FLuaValue();
 
+	FLuaStateOwnershipScope OwnershipScope(LuaState.Get());
 	LuaState->FromLuaValue(*this);
-	LuaState->GetField(-1, TCHAR_TO_ANSI(*Key));
+	LuaState->GetField(-1, TCHAR_TO_UTF8(*Key));
 	FLuaValue ReturnValue = LuaState->ToLuaValue(-1);
 	LuaState->Pop(2);
 	return ReturnValue;
@@ -238,6 +301,7 @@ FLuaValue FLuaValue::GetFieldByIndex(const int32 Index)
 		return FLuaValue();
 	}
 
+	FLuaStateOwnershipScope OwnershipScope(LuaState.Get());
 	LuaState->FromLuaValue(*this);
 	LuaState->RawGetI(-1, Index);
 	FLuaValue ReturnValue = LuaState->ToLuaValue(-1);
@@ -257,6 +321,7 @@ FLuaValue FLuaValue::SetFieldByIndex(const int32 Index, FLuaValue Value)
 		return *this;
 	}
 
+	FLuaStateOwnershipScope OwnershipScope(LuaState.Get());
 	LuaState->FromLuaValue(*this);
 	LuaState->FromLuaValue(Value);
 	LuaState->RawSetI(-2, Index);
@@ -290,9 +355,8 @@ FLuaValue FLuaValue::FromJsonValue(ULuaState* L, FJsonValue& JsonValue)
 	}
 	else if (JsonValue.Type == EJson::Array)
 	{
-		FLuaValue LuaArray = L->CreateLuaTable();
-		int32 Index = 1;
 		auto JsonValues = JsonValue.AsArray();
+		FLuaTableBuilder LuaArray(L, JsonValues.Num());
 		for (auto JsonItem : JsonValues)
 		{
 			FLuaValue LuaItem;
@@ -300,14 +364,14 @@ FLuaValue FLuaValue::FromJsonValue(ULuaState* L, FJsonValue& JsonValue)
 			{
 				LuaItem = FromJsonValue(L, *JsonItem);
 			}
-			LuaArray.SetFieldByIndex(Index++, LuaItem);
+			LuaArray.Add(LuaItem);
 		}
-		return LuaArray;
+		return LuaArray.Finish();
 	}
 	else if (JsonValue.Type == EJson::Object)
 	{
-		FLuaValue LuaTable = L->CreateLuaTable();
 		auto JsonObject = JsonValue.AsObject();
+		FLuaTableBuilder LuaTable(L, 0, JsonObject->Values.Num());
 		for (TPair<FString, TSharedPtr<FJsonValue>> Pair : JsonObject->Values)
 		{
 			FLuaValue LuaItem;
@@ -317,7 +381,7 @@ FLuaValue FLuaValue::FromJsonValue(ULuaState* L, FJsonValue& JsonValue)
 			}
 			LuaTable.SetField(Pair.Key, LuaItem);
 		}
-		return LuaTable;
+		return LuaTable.Finish();
 	}
 
 	// default to nil
@@ -347,6 +411,7 @@ TSharedPtr<FJsonValue> FLuaValue::ToJsonValue()
 
 		bool bIsArray = true;
 
+		FLuaStateOwnershipScope OwnershipScope(L);
 		TArray<TPair<FLuaValue, FLuaValue>> Items;
 		L->FromLuaValue(*this); // push the table
 		L->PushNil(); // first key
@@ -398,22 +463,28 @@ TArray<uint8> FLuaValue::ToBytes() const
 	if (Type != ELuaValueType::String)
 		return Bytes;
 
+	Bytes.AddUninitialized(String.Len());
+	ToBytes(Bytes.GetData());
+
+	return Bytes;
+}
+
+void FLuaValue::ToBytes(uint8* Bytes) const
+{
 	const int32 StringLength = String.Len();
-	Bytes.AddUninitialized(StringLength);
+	const TCHAR* Chars = *String;
 	for (int32 i = 0; i < StringLength; i++)
 	{
-		uint16 CharValue = (uint16)String[i];
+		uint16 CharValue = (uint16)Chars[i];
 		if (CharValue == 0xffff)
 		{
 			Bytes[i] = 0;
 		}
 		else
 		{
-			Bytes[i] = (uint8)String[i];
+			Bytes[i] = (uint8)Chars[i];
 		}
 	}
-
-	return Bytes;
 }
 
 FLuaValue FLuaValue::FromBase64(const FString& Base64)
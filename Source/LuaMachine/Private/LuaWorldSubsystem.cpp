@@ -0,0 +1,657 @@
+// Copyright 2018-2023 - Roberto De Ioris
+
+#include "LuaWorldSubsystem.h"
+#include "LuaComponent.h"
+#include "LuaMachine.h"
+#include "Engine/World.h"
+#include "Engine/Level.h"
+#include "GameFramework/Actor.h"
+#include "GameFramework/PlayerController.h"
+
+DECLARE_CYCLE_STAT(TEXT("Lua Components Tick"), STAT_LuaComponentsTick, STATGROUP_LuaMachine);
+DECLARE_DWORD_COUNTER_STAT(TEXT("Lua Components Tick Updates"), STAT_LuaComponentsTickUpdates, STATGROUP_LuaMachine);
+DECLARE_DWORD_COUNTER_STAT(TEXT("Lua Components Tick Skipped"), STAT_LuaComponentsTickSkipped, STATGROUP_LuaMachine);
+DECLARE_DWORD_COUNTER_STAT(TEXT("Lua Components Tick Deferred"), STAT_LuaComponentsTickDeferred, STATGROUP_LuaMachine);
+
+void FLuaTickBucketFunction::ExecuteTick(float DeltaTime, ELevelTick TickType, ENamedThreads::Type CurrentThread, const FGraphEventRef& MyCompletionGraphEvent)
+{
+	if (Subsystem)
+	{
+		Subsystem->TickBucket(*this, DeltaTime);
+	}
+}
+
+FString FLuaTickBucketFunction::DiagnosticMessage()
+{
+	return FString::Printf(TEXT("FLuaTickBucketFunction[%s]"), LuaState ? *LuaState->GetName() : TEXT("None"));
+}
+
+void ULuaWorldSubsystem::Initialize(FSubsystemCollectionBase& Collection)
+{
+	Super::Initialize(Collection);
+
+	LevelRemovedFromWorldHandle = FWorldDelegates::LevelRemovedFromWorld.AddUObject(this, &ULuaWorldSubsystem::LuaLevelRemovedFromWorld);
+}
+
+void ULuaWorldSubsystem::Deinitialize()
+{
+	FWorldDelegates::LevelRemovedFromWorld.Remove(LevelRemovedFromWorldHandle);
+
+	for (TUniquePtr<FLuaTickBucketFunction>& Bucket : TickBuckets)
+	{
+		Bucket->UnRegisterTickFunction();
+	}
+	TickBuckets.Empty();
+	StateFrames.Empty();
+	LuaComponentsIndex.Empty();
+	LuaGlobalNames.Empty();
+
+	Super::Deinitialize();
+}
+
+void ULuaWorldSubsystem::RegisterTickingComponent(ULuaComponent* LuaComponent)
+{
+	if (!LuaComponent || !LuaComponent->LuaState)
+	{
+		return;
+	}
+
+	FLuaTickBucketFunction* Bucket = nullptr;
+	for (TUniquePtr<FLuaTickBucketFunction>& CurrentBucket : TickBuckets)
+	{
+		if (CurrentBucket->LuaState == LuaComponent->LuaState && CurrentBucket->TickGroup == LuaComponent->LuaTickGroup)
+		{
+			Bucket = CurrentBucket.Get();
+			break;
+		}
+	}
+
+	if (!Bucket)
+	{
+		UWorld* World = GetWorld();
+		if (!World || !World->PersistentLevel)
+		{
+			return;
+		}
+
+		TUniquePtr<FLuaTickBucketFunction> NewBucket = MakeUnique<FLuaTickBucketFunction>();
+		NewBucket->Subsystem = this;
+		NewBucket->LuaState = LuaComponent->LuaState;
+		NewBucket->TickGroup = LuaComponent->LuaTickGroup;
+		NewBucket->bCanEverTick = true;
+		NewBucket->bStartWithTickEnabled = true;
+		NewBucket->RegisterTickFunction(World->PersistentLevel);
+		Bucket = NewBucket.Get();
+		TickBuckets.Add(MoveTemp(NewBucket));
+	}
+
+	for (const FLuaTickEntry& Entry : Bucket->Entries)
+	{
+		if (Entry.LuaComponent == LuaComponent)
+		{
+			return;
+		}
+	}
+
+	FLuaTickEntry NewEntry;
+	NewEntry.LuaComponent = LuaComponent;
+	NewEntry.Interval = 0;
+	// spread the updates of the components with the same interval over different frames (golden ratio sequence)
+	NewEntry.AccumulatedDeltaTime = FMath::Frac(Bucket->Entries.Num() * 0.618034f) * LuaComponent->LuaState->GetDefaultObject<ULuaState>()->LuaTickMaxInterval;
+	Bucket->Entries.Add(NewEntry);
+}
+
+void ULuaWorldSubsystem::UnregisterTickingComponent(ULuaComponent* LuaComponent)
+{
+	for (TUniquePtr<FLuaTickBucketFunction>& Bucket : TickBuckets)
+	{
+		// the slot is cleared (and purged on the next tick), as this could happen while the bucket is ticking
+		for (FLuaTickEntry& Entry : Bucket->Entries)
+		{
+			if (Entry.LuaComponent == LuaComponent)
+			{
+				Entry.LuaComponent = nullptr;
+			}
+		}
+	}
+
+	if (ULuaState* L = FLuaMachineModule::Get().GetLuaState(LuaComponent->LuaState, GetWorld(), true))
+	{
+		L->ReleaseCachedUObject(LuaComponent);
+	}
+}
+
+void ULuaWorldSubsystem::SetLuaTickSignificanceFunction(FLuaTickSignificanceFunction InSignificanceFunction)
+{
+	SignificanceFunction = InSignificanceFunction;
+}
+
+float ULuaWorldSubsystem::DefaultLuaTickSignificance(const ULuaComponent* LuaComponent, const TArray<FVector>& ViewLocations, float LODDistance)
+{
+	const AActor* Owner = LuaComponent ? LuaComponent->GetOwner() : nullptr;
+	if (!Owner || ViewLocations.Num() == 0 || LODDistance <= 0)
+	{
+		return 1;
+	}
+
+	const FVector Location = Owner->GetActorLocation();
+	float MinDistance = MAX_flt;
+	for (const FVector& ViewLocation : ViewLocations)
+	{
+		MinDistance = FMath::Min(MinDistance, static_cast<float>(FVector::Dist(Location, ViewLocation)));
+	}
+
+	float Significance = 1.0f - FMath::Clamp(MinDistance / LODDistance, 0.0f, 1.0f);
+	// offscreen actors are less relevant
+	if (!Owner->WasRecentlyRendered(0.2f))
+	{
+		Significance *= 0.5f;
+	}
+	return Significance;
+}
+
+FLuaTickStats ULuaWorldSubsystem::GetLuaTickStats(TSubclassOf<ULuaState> LuaState) const
+{
+	const FLuaTickStateFrame* StateFrame = StateFrames.Find(LuaState);
+	if (!StateFrame)
+	{
+		return FLuaTickStats();
+	}
+	return StateFrame->FrameCounter == GFrameCounter ? StateFrame->Last : StateFrame->Current;
+}
+
+ULuaWorldSubsystem::FLuaTickStateFrame& ULuaWorldSubsystem::GetStateFrame(TSubclassOf<ULuaState> LuaState)
+{
+	FLuaTickStateFrame& StateFrame = StateFrames.FindOrAdd(LuaState);
+	if (StateFrame.FrameCounter != GFrameCounter)
+	{
+		StateFrame.Last = StateFrame.Current;
+		StateFrame.Current = FLuaTickStats();
+		StateFrame.UsedTime = 0;
+		StateFrame.FrameCounter = GFrameCounter;
+	}
+	return StateFrame;
+}
+
+const TArray<FVector>& ULuaWorldSubsystem::GetViewLocations()
+{
+	if (ViewLocationsFrameCounter != GFrameCounter)
+	{
+		ViewLocations.Reset();
+		if (UWorld* World = GetWorld())
+		{
+			for (FConstPlayerControllerIterator It = World->GetPlayerControllerIterator(); It; ++It)
+			{
+				APlayerController* PlayerController = It->Get();
+				if (PlayerController)
+				{
+					FVector ViewLocation;
+					FRotator ViewRotation;
+					PlayerController->GetPlayerViewPoint(ViewLocation, ViewRotation);
+					ViewLocations.Add(ViewLocation);
+				}
+			}
+		}
+		ViewLocationsFrameCounter = GFrameCounter;
+	}
+	return ViewLocations;
+}
+
+void ULuaWorldSubsystem::UpdateEntries(FLuaTickBucketFunction& Bucket, ULuaState* L, float DeltaTime)
+{
+	const bool bLOD = L->LuaTickMaxInterval > 0;
+	const TArray<FVector>& CurrentViewLocations = bLOD ? GetViewLocations() : ViewLocations;
+
+	for (FLuaTickEntry& Entry : Bucket.Entries)
+	{
+		Entry.AccumulatedDeltaTime += DeltaTime;
+		if (!bLOD)
+		{
+			Entry.Interval = 0;
+			continue;
+		}
+
+		const ULuaComponent* LuaComponent = Entry.LuaComponent.Get();
+		const float Significance = SignificanceFunction ? SignificanceFunction(LuaComponent, CurrentViewLocations, L->LuaTickLODDistance) : DefaultLuaTickSignificance(LuaComponent, CurrentViewLocations, L->LuaTickLODDistance);
+		Entry.Interval = L->LuaTickMaxInterval * (1.0f - FMath::Clamp(Significance, 0.0f, 1.0f));
+	}
+}
+
+bool ULuaWorldSubsystem::CallComponentTick(ULuaState* L, ULuaComponent* LuaComponent, float DeltaTime)
+{
+	lua_State* State = L->GetInternalLuaState();
+
+	L->PushCachedUObject(LuaComponent);
+
+	// raw lookup (the __index metamethod can raise errors outside of a protected call and would run ReceiveLuaMetaIndex every frame)
+	if (lua_getuservalue(State, -1) == LUA_TTABLE)
+	{
+		L->PushName(LuaComponent->LuaTickFunction);
+		if (lua_rawget(State, -2) == LUA_TNIL)
+		{
+			// fields not overridden by the instance are in its prototype (the __index table of its metatable)
+			lua_pop(State, 1);
+			if (lua_getmetatable(State, -1))
+			{
+				lua_pushliteral(State, "__index");
+				if (lua_rawget(State, -2) == LUA_TTABLE)
+				{
+					L->PushName(LuaComponent->LuaTickFunction);
+					lua_rawget(State, -2);
+					lua_remove(State, -2);
+				}
+				lua_remove(State, -2);
+			}
+			else
+			{
+				lua_pushnil(State);
+			}
+		}
+		// remove the instance table
+		lua_remove(State, -2);
+	}
+	else
+	{
+		lua_pop(State, 1);
+		FLuaValue* TickFunction = LuaComponent->Table.Find(LuaComponent->LuaTickFunction.ToString());
+		if (TickFunction)
+		{
+			L->FromLuaValue(*TickFunction, LuaComponent, State);
+		}
+		else
+		{
+			lua_pushnil(State);
+		}
+	}
+
+	// tombstones of removed fields are not functions too
+	if (lua_type(State, -1) != LUA_TFUNCTION)
+	{
+		L->Pop(2);
+		return false;
+	}
+
+	// self
+	L->PushValue(-2);
+	lua_pushnumber(State, DeltaTime);
+
+	FLuaValue ReturnValue;
+	if (!L->PCall(2, ReturnValue, 0))
+	{
+		if (L->InceptionLevel == 0)
+		{
+			if (LuaComponent->bLogError)
+				L->LogError(L->LastError);
+			LuaComponent->OnLuaError.Broadcast(L->LastError);
+		}
+		L->Pop();
+	}
+
+	// remove the userdata
+	L->Pop();
+	return true;
+}
+
+void ULuaWorldSubsystem::TickBucket(FLuaTickBucketFunction& Bucket, float DeltaTime)
+{
+	SCOPE_CYCLE_COUNTER(STAT_LuaComponentsTick);
+
+	Bucket.Entries.RemoveAll([](const FLuaTickEntry& Entry) { return !Entry.LuaComponent.IsValid(); });
+	const int32 NumEntries = Bucket.Entries.Num();
+	if (NumEntries == 0)
+	{
+		return;
+	}
+
+	if (Bucket.NextEntry >= NumEntries)
+	{
+		Bucket.NextEntry = 0;
+	}
+
+	ULuaState* L = FLuaMachineModule::Get().GetLuaState(Bucket.LuaState, GetWorld());
+	if (!L)
+	{
+		return;
+	}
+
+	// states with a dedicated thread are ticked from the game thread too
+	FLuaStateOwnershipScope OwnershipScope(L);
+
+	FLuaTickStateFrame& StateFrame = GetStateFrame(Bucket.LuaState);
+
+	UpdateEntries(Bucket, L, DeltaTime);
+
+	// the entries to update (starting from the ones deferred in the previous frame)
+	TArray<int32, TInlineAllocator<256>> DueEntries;
+	for (int32 Index = 0; Index < NumEntries; Index++)
+	{
+		const int32 EntryIndex = (Bucket.NextEntry + Index) % NumEntries;
+		const FLuaTickEntry& Entry = Bucket.Entries[EntryIndex];
+		if (Entry.AccumulatedDeltaTime >= Entry.Interval)
+		{
+			DueEntries.Add(EntryIndex);
+		}
+	}
+
+	const int32 Skipped = NumEntries - DueEntries.Num();
+	// every component has been skipped by the LOD
+	if (DueEntries.Num() == 0)
+	{
+		Bucket.NextEntry = 0;
+		StateFrame.Current.Skipped += Skipped;
+		INC_DWORD_STAT_BY(STAT_LuaComponentsTickSkipped, Skipped);
+		return;
+	}
+
+	const double Budget = L->LuaTickBudget > 0 ? L->LuaTickBudget / 1000.0 : 0;
+	const double StartTime = FPlatformTime::Seconds();
+	int32 Updates = 0;
+
+	// single call with the array of components (and the array of their delta times)
+	if (!L->LuaTickBatchFunction.IsEmpty())
+	{
+		int32 MaxUpdates = DueEntries.Num();
+		if (Budget > 0 && Bucket.AverageUpdateTime > 0)
+		{
+			MaxUpdates = FMath::Clamp(static_cast<int32>((Budget - StateFrame.UsedTime) / Bucket.AverageUpdateTime), 1, DueEntries.Num());
+		}
+
+		lua_State* State = L->GetInternalLuaState();
+
+		int32 ItemsToPop = L->GetFieldFromTree(L->LuaTickBatchFunction);
+		lua_createtable(State, MaxUpdates, 0);
+		lua_pushnumber(State, DeltaTime);
+		lua_createtable(State, MaxUpdates, 0);
+		for (Updates = 0; Updates < MaxUpdates; Updates++)
+		{
+			FLuaTickEntry& Entry = Bucket.Entries[DueEntries[Updates]];
+			L->PushCachedUObject(Entry.LuaComponent.Get());
+			lua_rawseti(State, -4, Updates + 1);
+			lua_pushnumber(State, Entry.AccumulatedDeltaTime);
+			lua_rawseti(State, -2, Updates + 1);
+			Entry.AccumulatedDeltaTime = 0;
+		}
+
+		FLuaValue ReturnValue;
+		if (!L->PCall(3, ReturnValue, 0))
+		{
+			// remove the error message
+			L->Pop();
+		}
+		// the function has been removed by the call
+		L->Pop(ItemsToPop - 1);
+
+		if (Updates > 0)
+		{
+			const double UpdateTime = (FPlatformTime::Seconds() - StartTime) / Updates;
+			Bucket.AverageUpdateTime = Bucket.AverageUpdateTime > 0 ? FMath::Lerp(Bucket.AverageUpdateTime, UpdateTime, 0.1) : UpdateTime;
+		}
+	}
+	else
+	{
+		for (const int32 EntryIndex : DueEntries)
+		{
+			// at least one update per frame, to avoid starvation
+			if (Budget > 0 && Updates > 0 && StateFrame.UsedTime + (FPlatformTime::Seconds() - StartTime) >= Budget)
+			{
+				break;
+			}
+
+			// do not keep a reference to the entry, a script could register new components
+			ULuaComponent* LuaComponent = Bucket.Entries[EntryIndex].LuaComponent.Get();
+			const float EntryDeltaTime = Bucket.Entries[EntryIndex].AccumulatedDeltaTime;
+			Bucket.Entries[EntryIndex].AccumulatedDeltaTime = 0;
+			Updates++;
+
+			if (LuaComponent && LuaComponent->LuaState == Bucket.LuaState)
+			{
+				CallComponentTick(L, LuaComponent, EntryDeltaTime);
+			}
+		}
+	}
+
+	// deferred components keep their accumulated delta time and will be the first ones in the next frame
+	const int32 Deferred = DueEntries.Num() - Updates;
+	Bucket.NextEntry = Deferred > 0 ? DueEntries[Updates] : 0;
+
+	const double ElapsedTime = FPlatformTime::Seconds() - StartTime;
+	StateFrame.UsedTime += ElapsedTime;
+	StateFrame.Current.Updates += Updates;
+	StateFrame.Current.Skipped += Skipped;
+	StateFrame.Current.Deferred += Deferred;
+	StateFrame.Current.TimeMs += ElapsedTime * 1000.0;
+
+	INC_DWORD_STAT_BY(STAT_LuaComponentsTickUpdates, Updates);
+	INC_DWORD_STAT_BY(STAT_LuaComponentsTickSkipped, Skipped);
+	INC_DWORD_STAT_BY(STAT_LuaComponentsTickDeferred, Deferred);
+}
+
+void ULuaWorldSubsystem::FLuaComponentIndex::Add(ULuaComponent* LuaComponent)
+{
+	ByName.Add(LuaComponent->GetFName(), LuaComponent);
+	if (LuaComponent->LuaState && !ByState.Contains(LuaComponent->LuaState))
+	{
+		ByState.Add(LuaComponent->LuaState, LuaComponent);
+	}
+}
+
+void ULuaWorldSubsystem::FLuaComponentIndex::Rebuild()
+{
+	ByName.Reset();
+	ByState.Reset();
+	for (const TWeakObjectPtr<ULuaComponent>& LuaComponent : LuaComponents)
+	{
+		if (LuaComponent.IsValid())
+		{
+			Add(LuaComponent.Get());
+		}
+	}
+}
+
+void ULuaWorldSubsystem::RegisterLuaComponent(ULuaComponent* LuaComponent)
+{
+	AActor* Owner = LuaComponent ? LuaComponent->GetOwner() : nullptr;
+	if (!Owner)
+	{
+		return;
+	}
+
+	FLuaComponentIndex& Index = LuaComponentsIndex.FindOrAdd(Owner);
+	if (!Index.LuaComponents.Contains(LuaComponent))
+	{
+		Index.LuaComponents.Add(LuaComponent);
+		Index.Add(LuaComponent);
+	}
+}
+
+void ULuaWorldSubsystem::UnregisterLuaComponent(ULuaComponent* LuaComponent)
+{
+	AActor* Owner = LuaComponent ? LuaComponent->GetOwner() : nullptr;
+	if (!Owner)
+	{
+		return;
+	}
+
+	FLuaComponentIndex* Index = LuaComponentsIndex.Find(Owner);
+	if (!Index)
+	{
+		return;
+	}
+
+	Index->LuaComponents.RemoveAll([LuaComponent](const TWeakObjectPtr<ULuaComponent>& Item) { return !Item.IsValid() || Item.Get() == LuaComponent; });
+	if (Index->LuaComponents.Num() == 0)
+	{
+		LuaComponentsIndex.Remove(Owner);
+		return;
+	}
+	Index->Rebuild();
+}
+
+bool ULuaWorldSubsystem::FindLuaComponent(const AActor* Actor, TSubclassOf<ULuaState> State, const FName Name, ULuaComponent*& LuaComponent) const
+{
+	LuaComponent = nullptr;
+
+	const FLuaComponentIndex* Index = LuaComponentsIndex.Find(Actor);
+	if (!Index)
+	{
+		return false;
+	}
+
+	if (Name != NAME_None)
+	{
+		if (const TWeakObjectPtr<ULuaComponent>* Found = Index->ByName.Find(Name))
+		{
+			if (!State || ((*Found).IsValid() && (*Found)->LuaState == State))
+			{
+				LuaComponent = (*Found).Get();
+			}
+		}
+		return true;
+	}
+
+	if (State)
+	{
+		if (const TWeakObjectPtr<ULuaComponent>* Found = Index->ByState.Find(State))
+		{
+			LuaComponent = (*Found).Get();
+		}
+		return true;
+	}
+
+	for (const TWeakObjectPtr<ULuaComponent>& Item : Index->LuaComponents)
+	{
+		if (Item.IsValid())
+		{
+			LuaComponent = Item.Get();
+			break;
+		}
+	}
+	return true;
+}
+
+bool ULuaWorldSubsystem::RegisterLuaGlobalName(TSubclassOf<ULuaState> State, const FString& Name, UObject* Object)
+{
+	// dotted names need to walk (and create) tables, leave them to SetFieldFromTree
+	if (!State || !Object || Name.IsEmpty() || Name.Contains(TEXT(".")))
+	{
+		return false;
+	}
+
+	FLuaGlobalNames& GlobalNames = LuaGlobalNames.FindOrAdd(State);
+	GlobalNames.Entries.Add(Name, Object);
+	// nothing to evict until something has been resolved
+	if (GlobalNames.Cache.Type == ELuaValueType::Table)
+	{
+		GlobalNames.Dirty.Add(Name);
+	}
+	return true;
+}
+
+void ULuaWorldSubsystem::UnregisterLuaGlobalName(TSubclassOf<ULuaState> State, const FString& Name, UObject* Object)
+{
+	FLuaGlobalNames* GlobalNames = LuaGlobalNames.Find(State);
+	if (!GlobalNames)
+	{
+		return;
+	}
+
+	const TWeakObjectPtr<UObject>* Entry = GlobalNames->Entries.Find(Name);
+	// the name could have been taken by another object in the meantime
+	if (Entry && (!Entry->IsValid() || Entry->Get() == Object))
+	{
+		if (GlobalNames->Cache.Type == ELuaValueType::Table)
+		{
+			GlobalNames->Dirty.Add(Name);
+		}
+		GlobalNames->Entries.Remove(Name);
+	}
+}
+
+void ULuaWorldSubsystem::FlushLuaGlobalNames(FLuaGlobalNames& GlobalNames)
+{
+	if (GlobalNames.Dirty.Num() == 0)
+	{
+		return;
+	}
+
+	ULuaState* L = GlobalNames.Cache.LuaState.Get();
+	if (L && GlobalNames.Cache.Type == ELuaValueType::Table)
+	{
+		L->FromLuaValue(GlobalNames.Cache);
+		for (const FString& Name : GlobalNames.Dirty)
+		{
+			L->PushNil();
+			L->SetField(-2, TCHAR_TO_UTF8(*Name));
+		}
+		L->Pop();
+	}
+	GlobalNames.Dirty.Empty();
+}
+
+bool ULuaWorldSubsystem::ResolveLuaGlobalName(ULuaState* L, const char* Name, lua_State* State)
+{
+	FLuaGlobalNames* GlobalNames = LuaGlobalNames.Find(L->GetClass());
+	if (!GlobalNames)
+	{
+		return false;
+	}
+
+	// the cache is bound to a specific Lua VM
+	if (GlobalNames->Cache.LuaState.Get() != L || GlobalNames->Cache.Type != ELuaValueType::Table)
+	{
+		GlobalNames->Cache = L->CreateLuaTable();
+		GlobalNames->Dirty.Empty();
+	}
+	else
+	{
+		FlushLuaGlobalNames(*GlobalNames);
+	}
+
+	L->FromLuaValue(GlobalNames->Cache, nullptr, State);
+	if (lua_getfield(State, -1, Name) != LUA_TNIL)
+	{
+		lua_remove(State, -2);
+		return true;
+	}
+	lua_pop(State, 1);
+
+	const TWeakObjectPtr<UObject>* Entry = GlobalNames->Entries.Find(UTF8_TO_TCHAR(Name));
+	if (!Entry || !Entry->IsValid())
+	{
+		lua_pop(State, 1);
+		return false;
+	}
+
+	FLuaValue Value(Entry->Get());
+	L->FromLuaValue(Value, nullptr, State);
+	// cache[Name] = value
+	lua_pushvalue(State, -1);
+	lua_setfield(State, -3, Name);
+	lua_remove(State, -2);
+	return true;
+}
+
+void ULuaWorldSubsystem::LuaLevelRemovedFromWorld(ULevel* Level, UWorld* World)
+{
+	if (World != GetWorld())
+	{
+		return;
+	}
+
+	// a null level means the whole world is going away
+	for (TPair<TSubclassOf<ULuaState>, FLuaGlobalNames>& Pair : LuaGlobalNames)
+	{
+		for (auto It = Pair.Value.Entries.CreateIterator(); It; ++It)
+		{
+			UObject* Object = It->Value.Get();
+			if (!Level || !Object || Object->IsIn(Level))
+			{
+				if (Pair.Value.Cache.Type == ELuaValueType::Table)
+				{
+					Pair.Value.Dirty.Add(It->Key);
+				}
+				It.RemoveCurrent();
+			}
+		}
+	}
+}
@@ -0,0 +1,207 @@
+// Copyright 2018-2023 - Roberto De Ioris
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "ThirdParty/lua/lua.hpp"
+#include "LuaAllocator.generated.h"
+
+USTRUCT(BlueprintType)
+struct LUAMACHINE_API FLuaMemoryStats
+{
+	GENERATED_BODY()
+
+	/* bytes currently allocated by the VM */
+	UPROPERTY(BlueprintReadOnly, Category = "Lua")
+	int32 LiveBytes = 0;
+
+	UPROPERTY(BlueprintReadOnly, Category = "Lua")
+	int32 PeakBytes = 0;
+
+	/* bytes reserved by the size-class pages (used or in the free lists) */
+	UPROPERTY(BlueprintReadOnly, Category = "Lua")
+	int32 PooledBytes = 0;
+
+	UPROPERTY(BlueprintReadOnly, Category = "Lua")
+	int32 Allocations = 0;
+
+	UPROPERTY(BlueprintReadOnly, Category = "Lua")
+	int32 Frees = 0;
+
+	/* allocations in the last frame for each size class (16 bytes steps, the last item counts the big blocks) */
+	UPROPERTY(BlueprintReadOnly, Category = "Lua")
+	TArray<int32> FrameAllocationsBySizeClass;
+};
+
+/*
+ * lua_Alloc implementation for a single state (a lua_State is never used by two threads at the same time, so no locking).
+ * Blocks up to 256 bytes (strings, tables, closures, upvalues...) are carved from 64k pages and recycled
+ * through per size-class free lists, bigger blocks go straight to FMemory (everything goes to FMemory without pooling).
+ * Every size class has its own pages, so a tiny state still reserves a page for each class it uses: pooling is opt-in
+ * (ULuaState::bLuaPoolAllocator). Pages without live blocks are given back by Trim() (after a full collection).
+ *
+ * An optional budget makes growing allocations fail while inside a protected call: Lua reacts by running
+ * an emergency full collection and, if still not enough, by raising a (catchable) memory error.
+ * C++ functions called by Lua suspend the budget (FBridgeScope), so the error is never raised through C++ frames.
+ */
+class LUAMACHINE_API FLuaAllocator
+{
+public:
+	static constexpr int32 SizeClassGranularity = 16;
+	static constexpr int32 NumSizeClasses = 16;
+	static constexpr SIZE_T MaxSmallSize = SizeClassGranularity * NumSizeClasses;
+	static constexpr SIZE_T PageSize = 64 * 1024;
+
+	FLuaAllocator(const bool bInPooling = true);
+	~FLuaAllocator();
+
+	FLuaAllocator(const FLuaAllocator&) = delete;
+	FLuaAllocator& operator=(const FLuaAllocator&) = delete;
+
+	/* the lua_Alloc function, UserData is the FLuaAllocator */
+	static void* Alloc(void* UserData, void* Ptr, size_t OldSize, size_t NewSize);
+
+	/* plain FMemory based lua_Alloc (no pooling, no stats) */
+	static void* AllocFMemory(void* UserData, void* Ptr, size_t OldSize, size_t NewSize);
+
+	/* the allocator of L (nullptr if L does not use FLuaAllocator::Alloc) */
+	static FLuaAllocator* Get(lua_State* L)
+	{
+		void* UserData = nullptr;
+		return lua_getallocf(L, &UserData) == &FLuaAllocator::Alloc ? (FLuaAllocator*)UserData : nullptr;
+	}
+
+	/* snapshot of the per-frame counters, to be called once per frame */
+	void EndFrame();
+
+	/* release the pages without live blocks (returns the released bytes) */
+	SIZE_T Trim();
+
+	FLuaMemoryStats GetStats() const;
+
+	SIZE_T GetLiveBytes() const { return LiveBytes; }
+
+	/* memory owned by Lua objects but not allocated by Lua (like bulk buffers), false if it does not fit in the budget */
+	bool AddExternalBytes(const SIZE_T Size);
+	void RemoveExternalBytes(const SIZE_T Size);
+
+	/* 0 means no limit */
+	SIZE_T Budget;
+
+	/* the budget is enforced only while plain Lua code runs inside protected calls (a memory error outside of them would be a panic) */
+	int32 ProtectedDepth;
+
+	/* true while a C++ function called by Lua is running */
+	bool bInBridge;
+
+	/* the previous state is restored even if a Lua error skipped the destructors of the nested scopes */
+	struct FProtectedScope
+	{
+		FLuaAllocator* Allocator;
+		int32 SavedDepth;
+		bool bSavedInBridge;
+
+		FProtectedScope(FLuaAllocator* InAllocator) : Allocator(InAllocator), SavedDepth(0), bSavedInBridge(false)
+		{
+			if (Allocator)
+			{
+				SavedDepth = Allocator->ProtectedDepth;
+				bSavedInBridge = Allocator->bInBridge;
+				Allocator->ProtectedDepth = SavedDepth + 1;
+				// a new protected call catches its own memory errors
+				Allocator->bInBridge = false;
+			}
+		}
+
+		~FProtectedScope()
+		{
+			if (Allocator)
+			{
+				Allocator->ProtectedDepth = SavedDepth;
+				Allocator->bInBridge = bSavedInBridge;
+			}
+		}
+	};
+
+	/* C++ function called by Lua: a memory error would longjmp over its destructors, so the budget is suspended until it returns */
+	struct FBridgeScope
+	{
+		FLuaAllocator* Allocator;
+		bool bSavedInBridge;
+
+		FBridgeScope(lua_State* L) : Allocator(FLuaAllocator::Get(L)), bSavedInBridge(false)
+		{
+			if (Allocator)
+			{
+				bSavedInBridge = Allocator->bInBridge;
+				Allocator->bInBridge = true;
+			}
+		}
+
+		~FBridgeScope()
+		{
+			if (Allocator)
+			{
+				Allocator->bInBridge = bSavedInBridge;
+			}
+		}
+	};
+
+protected:
+	struct FFreeBlock
+	{
+		FFreeBlock* Next;
+	};
+
+	/* at the start of every page (pages are aligned to PageSize, so a block finds its page by masking its address) */
+	struct FPageHeader
+	{
+		int32 UsedBlocks;
+	};
+	static constexpr SIZE_T PageHeaderSize = SizeClassGranularity;
+	static_assert(sizeof(FPageHeader) <= PageHeaderSize, "the page header must fit in its slot");
+
+	static FORCEINLINE FPageHeader* GetPageHeader(void* Block)
+	{
+		return (FPageHeader*)((UPTRINT)Block & ~(UPTRINT)(PageSize - 1));
+	}
+
+	struct FSizeClass
+	{
+		FFreeBlock* FreeList = nullptr;
+		// bump allocation in the current page
+		uint8* Cursor = nullptr;
+		uint8* End = nullptr;
+		uint32 Allocations = 0;
+		uint32 FrameAllocations = 0;
+	};
+
+	FSizeClass SizeClasses[NumSizeClasses];
+	uint32 LargeAllocations = 0;
+	uint32 LargeFrameAllocations = 0;
+
+	TArray<void*> Pages;
+
+	bool bPooling;
+
+	SIZE_T LiveBytes;
+	SIZE_T PeakBytes;
+	uint32 Frees;
+	SIZE_T ReportedBytes;
+
+	TArray<int32> LastFrameAllocations;
+
+	static FORCEINLINE int32 GetSizeClass(const SIZE_T Size)
+	{
+		return (int32)((Size - 1) / SizeClassGranularity);
+	}
+
+	FORCEINLINE bool CanGrow(const SIZE_T OldSize, const SIZE_T NewSize) const
+	{
+		return Budget == 0 || ProtectedDepth == 0 || bInBridge || NewSize <= OldSize || LiveBytes + (NewSize - OldSize) <= Budget;
+	}
+
+	void* Malloc(const SIZE_T Size);
+	void Free(void* Ptr, const SIZE_T Size);
+	void* AllocSmall(const int32 SizeClass);
+};
@@ -7,6 +7,7 @@
 #include "LuaState.h"
 #include "LuaValue.h"
 #include "LuaTableAsset.h"
+#include "LuaWorldSubsystem.h"
 #include "UObject/TextProperty.h"
 #include "Runtime/Engine/Classes/Engine/World.h"
 #include "Runtime/Online/HTTP/Public/HttpModule.h"
@@ -20,6 +21,9 @@
 DECLARE_DYNAMIC_DELEGATE_ThreeParams(FLuaHttpSuccess, FLuaValue, ReturnValue, bool, bWasSuccessful, int32, StatusCode);
 DECLARE_DYNAMIC_DELEGATE_TwoParams(FLuaHttpResponseReceived, FLuaValue, Context, FLuaValue, Response);
 DECLARE_DYNAMIC_DELEGATE_OneParam(FLuaHttpError, FLuaValue, Context);
+DECLARE_DYNAMIC_DELEGATE_OneParam(FLuaStateInitialized, ULuaState*, LuaState);
+DECLARE_DYNAMIC_DELEGATE_TwoParams(FLuaJobCompleted, FLuaValue, ReturnValue, bool, bSuccess);
+DECLARE_DYNAMIC_DELEGATE_TwoParams(FLuaCallCompleted, FLuaValue, ReturnValue, bool, bSuccess);
 
 UENUM(BlueprintType)
 enum class ELuaReflectionType : uint8
@@ -30,6 +34,10 @@ enum class ELuaReflectionType : uint8
 };
 
 
+/*
+ * For states with bLuaDedicatedThread every node touching the VM, except the Async ones, blocks the game thread
+ * until the command running in the dedicated thread is complete.
+ */
 UCLASS()
 class LUAMACHINE_API ULuaBlueprintFunctionLibrary : public UBlueprintFunctionLibrary
 {
@@ -72,6 +80,9 @@ public:
 	UFUNCTION(BlueprintCallable, meta = (WorldContext = "WorldContextObject"), Category="Lua")
 	static void LuaSetGlobal(UObject* WorldContextObject, TSubclassOf<ULuaState> State, const FString& Name, FLuaValue Value);
 
+	UFUNCTION(BlueprintCallable, BlueprintPure, meta = (WorldContext = "WorldContextObject"), Category = "Lua")
+	static FLuaTickStats LuaGetTickStats(UObject* WorldContextObject, TSubclassOf<ULuaState> State);
+
 	UFUNCTION(BlueprintCallable, meta = (WorldContext = "WorldContextObject"), Category="Lua")
 	static void LuaSetUserDataMetaTable(UObject* WorldContextObject, TSubclassOf<ULuaState> State, FLuaValue MetaTable);
 
@@ -250,6 +261,26 @@ public:
 	UFUNCTION(BlueprintCallable, meta = (WorldContext = "WorldContextObject"), Category = "Lua")
 	static void LuaStateReload(UObject* WorldContextObject, TSubclassOf<ULuaState> State);
 
+	/* initialize the state in the background (VM, libraries and scripts compilation), Initialized gets an invalid state on error */
+	UFUNCTION(BlueprintCallable, meta = (WorldContext = "WorldContextObject"), Category = "Lua")
+	static void LuaStateInitAsync(UObject* WorldContextObject, TSubclassOf<ULuaState> State, FLuaStateInitialized Initialized);
+
+	/* run a global function of the job workers of the state (LuaJobWorkers), Completed gets its first return value (or the error) */
+	UFUNCTION(BlueprintCallable, meta = (WorldContext = "WorldContextObject", AutoCreateRefTerm = "Args"), Category = "Lua")
+	static void LuaJobDispatch(UObject* WorldContextObject, TSubclassOf<ULuaState> State, const FString& Function, TArray<FLuaValue> Args, FLuaJobCompleted Completed);
+
+	/* call a global function in the dedicated thread of the state (bLuaDedicatedThread, immediately for the other states), Completed gets its first return value in the game thread */
+	UFUNCTION(BlueprintCallable, meta = (WorldContext = "WorldContextObject", AutoCreateRefTerm = "Args"), Category = "Lua")
+	static void LuaGlobalCallAsync(UObject* WorldContextObject, TSubclassOf<ULuaState> State, const FString& Name, TArray<FLuaValue> Args, FLuaCallCompleted Completed);
+
+	/* serialize globals, loaded modules and functions of the state (for level transitions or save games) */
+	UFUNCTION(BlueprintCallable, meta = (WorldContext = "WorldContextObject"), Category = "Lua")
+	static bool LuaStateHibernate(UObject* WorldContextObject, TSubclassOf<ULuaState> State, TArray<uint8>& Image);
+
+	/* replace the state with one rebuilt from a LuaStateHibernate image, without running its scripts (trusted images only, see bAllowBytecodeImages) */
+	UFUNCTION(BlueprintCallable, meta = (WorldContext = "WorldContextObject"), Category = "Lua")
+	static bool LuaStateRestore(UObject* WorldContextObject, TSubclassOf<ULuaState> State, const TArray<uint8>& Image);
+
 	UFUNCTION(BlueprintCallable, meta = (WorldContext = "WorldContextObject"), Category="Lua")
 	static FLuaValue LuaRunFile(UObject* WorldContextObject, TSubclassOf<ULuaState> State, const FString& Filename, const bool bIgnoreNonExistent);
 
@@ -289,6 +320,12 @@ public:
 	UFUNCTION(BlueprintCallable, BlueprintPure, meta = (WorldContext = "WorldContextObject"), Category="Lua")
 	static int32 LuaGetUsedMemory(UObject* WorldContextObject, TSubclassOf<ULuaState> State);
 
+	UFUNCTION(BlueprintCallable, BlueprintPure, meta = (WorldContext = "WorldContextObject"), Category="Lua")
+	static FLuaMemoryStats LuaGetMemoryStats(UObject* WorldContextObject, TSubclassOf<ULuaState> State);
+
+	UFUNCTION(BlueprintCallable, BlueprintPure, meta = (WorldContext = "WorldContextObject"), Category="Lua")
+	static FLuaGCStats LuaGetGCStats(UObject* WorldContextObject, TSubclassOf<ULuaState> State);
+
 	UFUNCTION(BlueprintCallable, meta = (WorldContext = "WorldContextObject"), Category="Lua")
 	static void LuaGCCollect(UObject* WorldContextObject, TSubclassOf<ULuaState> State);
 
@@ -430,6 +467,18 @@ public:
 	UFUNCTION(BlueprintCallable, meta = (WorldContext = "WorldContextObject"), Category = "Lua")
 	static ULuaState* CreateDynamicLuaState(UObject* WorldContextObject, TSubclassOf<ULuaState> LuaStateClass);
 
+	/* close a state created by CreateDynamicLuaState (its pool, if any, is refilled with a new one) */
+	UFUNCTION(BlueprintCallable, Category = "Lua")
+	static void ReleaseDynamicLuaState(ULuaState* LuaState);
+
+	/* start initializing the DynamicPoolSize states of the class in the background (one per frame) */
+	UFUNCTION(BlueprintCallable, meta = (WorldContext = "WorldContextObject"), Category = "Lua")
+	static void WarmDynamicLuaStatePool(UObject* WorldContextObject, TSubclassOf<ULuaState> LuaStateClass);
+
+	/* new dynamic state copying the globals and modules of an initialized one, without running its scripts again */
+	UFUNCTION(BlueprintCallable, meta = (WorldContext = "WorldContextObject"), Category = "Lua")
+	static ULuaState* CloneLuaState(UObject* WorldContextObject, ULuaState* LuaState);
+
 private:
 	static void HttpRequestDone(FHttpRequestPtr Request, FHttpResponsePtr Response, bool bWasSuccessful, TSubclassOf<ULuaState> LuaState, TWeakObjectPtr<UWorld> World, const FString SecurityHeader, const FString SignaturePublicExponent, const FString SignatureModulus, FLuaHttpSuccess Completed);
 	static void HttpGenericRequestDone(FHttpRequestPtr Request, FHttpResponsePtr Response, bool bWasSuccessful, TWeakPtr<FLuaSmartReference> Context, FLuaHttpResponseReceived ResponseReceived, FLuaHttpError Error);
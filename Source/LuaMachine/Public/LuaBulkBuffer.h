@@ -0,0 +1,38 @@
+// Copyright 2018-2023 - Roberto De Ioris
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "ThirdParty/lua/lua.hpp"
+#include "LuaValue.h"
+
+/*
+ * Contiguous array of numbers exposed to Lua as an indexable userdata (see the "bulk" library).
+ * Type is always Nil (and it is the first member like in FLuaUserData), so the generic userdata
+ * conversions will just ignore it.
+ */
+struct LUAMACHINE_API FLuaBulkBuffer
+{
+	static constexpr int32 MaxStride = 16;
+
+	ELuaValueType Type;
+
+	// numbers per element (3 for vectors and rotators)
+	int32 Stride;
+
+	TArray<float> Data;
+
+	FLuaBulkBuffer()
+		: Type(ELuaValueType::Nil)
+		, Stride(1)
+	{
+	}
+
+	/* push a new buffer of Num elements (zero filled), the data is charged to the memory budget of the state (nullptr and nothing pushed if it does not fit) */
+	static FLuaBulkBuffer* New(lua_State* L, const int32 Num, const int32 Stride);
+	/* returns nullptr if the value at Index is not a buffer */
+	static FLuaBulkBuffer* Get(lua_State* L, int Index);
+
+	/* the "bulk" library: bulk.new(count[, stride]), bulk.gather(objects, field), bulk.scatter(buffer, objects, field) */
+	static int OpenLibrary(lua_State* L);
+};
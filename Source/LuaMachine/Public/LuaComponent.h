@@ -24,6 +24,8 @@ protected:
 	// Called when the game starts
 	virtual void BeginPlay() override;
 
+	virtual void EndPlay(const EEndPlayReason::Type EndPlayReason) override;
+
 public:	
 	// Called every frame
 	virtual void TickComponent(float DeltaTime, ELevelTick TickType, FActorComponentTickFunction* ThisTickFunction) override;
@@ -31,12 +33,40 @@ public:
 	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category="Lua")
 	TSubclassOf<ULuaState> LuaState;
 
-	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category="Lua")
+	/* the initial fields, Blueprints read and write the live ones (the instance table seen by scripts) */
+	UPROPERTY(EditAnywhere, BlueprintGetter=LuaGetTable, BlueprintSetter=LuaSetTable, Category="Lua")
 	TMap<FString, FLuaValue> Table;
 
-	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category="Lua")
+	/* the metamethods of the userdata, from C++ change it with LuaSetMetatable */
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, BlueprintSetter=LuaSetMetatable, Category="Lua")
 	TMap<FString, FLuaValue> Metatable;
 
+	// the Lua table holding the fields at runtime (Table is its initial value, C++ sees it with LuaSyncTable)
+	FLuaValue LuaInstanceTable;
+
+	// the Lua metatable built from Metatable (shared with the archetype when they match)
+	FLuaValue LuaUserDataMetatable;
+
+	/* a copy of the fields seen by scripts (Table until the component is pushed to Lua) */
+	UFUNCTION(BlueprintGetter)
+	TMap<FString, FLuaValue> LuaGetTable() const;
+
+	/* replace Table and the fields seen by scripts */
+	UFUNCTION(BlueprintSetter)
+	void LuaSetTable(const TMap<FString, FLuaValue>& NewTable);
+
+	/* replace Metatable, the userdata pushed from now on get the new metamethods */
+	UFUNCTION(BlueprintSetter)
+	void LuaSetMetatable(const TMap<FString, FLuaValue>& NewMetatable);
+
+	/* copy the fields written by scripts back to Table */
+	UFUNCTION(BlueprintCallable, Category="Lua")
+	void LuaSyncTable();
+
+	/* replace the fields seen by scripts with the content of Table */
+	UFUNCTION(BlueprintCallable, Category="Lua")
+	void LuaReloadTable();
+
 	UPROPERTY(EditAnywhere, Category="Lua")
 	bool bLazy;
 
@@ -49,6 +79,16 @@ public:
 	UPROPERTY(EditAnywhere, Category = "Lua")
 	TArray<FString> GlobalNames;
 
+	/* call LuaTickFunction(self, DeltaTime) every frame (batched with the other components of the same LuaState and tick group) */
+	UPROPERTY(EditAnywhere, Category = "Lua")
+	bool bLuaTick;
+
+	UPROPERTY(EditAnywhere, Category = "Lua", meta = (EditCondition = "bLuaTick"))
+	FName LuaTickFunction;
+
+	UPROPERTY(EditAnywhere, Category = "Lua", meta = (EditCondition = "bLuaTick"))
+	TEnumAsByte<ETickingGroup> LuaTickGroup;
+
 	UFUNCTION(BlueprintCallable, Category="Lua", meta = (AutoCreateRefTerm = "Args"))
 	FLuaValue LuaCallFunction(const FString& Name, TArray<FLuaValue> Args, bool bGlobal);
 
@@ -98,5 +138,9 @@ public:
 	ULuaState* LuaComponentGetState();
 
 	virtual void OnRegister() override;
+	virtual void OnUnregister() override;
+
+protected:
+	void UnregisterLuaGlobalNames();
 
 };
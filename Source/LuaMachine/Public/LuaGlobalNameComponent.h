@@ -21,11 +21,16 @@ protected:
 	// Called when the game starts
 	virtual void BeginPlay() override;
 
+	virtual void EndPlay(const EEndPlayReason::Type EndPlayReason) override;
+
+	void UnregisterLuaGlobalName();
+
 public:	
 	// Called every frame
 	virtual void TickComponent(float DeltaTime, ELevelTick TickType, FActorComponentTickFunction* ThisTickFunction) override;
 
 	virtual void OnRegister() override;
+	virtual void OnUnregister() override;
 
 	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Lua")
 	TSubclassOf<ULuaState> LuaState;
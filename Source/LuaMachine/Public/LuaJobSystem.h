@@ -0,0 +1,112 @@
+// Copyright 2018-2023 - Roberto De Ioris
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "ThirdParty/lua/lua.hpp"
+#include "Async/Future.h"
+#include "HAL/Runnable.h"
+#include "HAL/ThreadSafeBool.h"
+#include "Containers/Queue.h"
+
+enum class ELuaJobValueType : uint8
+{
+	Nil,
+	Bool,
+	Integer,
+	Number,
+	String,
+	Table,
+};
+
+/* plain data copied between Lua VMs (no functions, userdata or threads) */
+struct LUAMACHINE_API FLuaJobValue
+{
+	ELuaJobValueType Type = ELuaJobValueType::Nil;
+	bool Bool = false;
+	lua_Integer Integer = 0;
+	lua_Number Number = 0;
+	TArray<uint8> String;
+	TArray<FLuaJobValue> Keys;
+	TArray<FLuaJobValue> Values;
+
+	/* deep copy of the value at Index (false, with Error set, on unsupported types or cycles) */
+	static bool FromLua(lua_State* L, int Index, FLuaJobValue& Value, FString& Error);
+	void ToLua(lua_State* L) const;
+};
+
+struct LUAMACHINE_API FLuaJob
+{
+	/* global function of the worker states */
+	FString Function;
+	TArray<FLuaJobValue> Args;
+
+	/* valid once the future is ready */
+	TArray<FLuaJobValue> Results;
+	FString Error;
+	bool bSuccess = false;
+
+	/* ready as soon as a worker is done (never wait for it in the game thread while the job system is stopping) */
+	TSharedFuture<void> Future;
+	TPromise<void> Promise;
+
+	/* called in the game thread (at the end of the frame, or with an error when the job system is stopped) */
+	TFunction<void(const FLuaJob&)> OnCompleted;
+};
+
+/*
+ * A pool of worker threads, each one with its own lua_State initialized with the same code assets.
+ * Jobs (a function name plus plain data arguments) are executed by the first free worker, results
+ * are copied back and delivered to the game thread by DrainCompletedJobs() (called by the owner state at the end of the frame).
+ * The "job" library exposes it to the owner state: job.dispatch(name, ...), job.done(handle), job.result(handle), job.await(handle).
+ * Handles are userdata, a job whose handle is collected still runs but its results are discarded.
+ * Stopping the job system fails the jobs not started yet and delivers every completion (OnCompleted is always called once).
+ */
+class LUAMACHINE_API FLuaJobSystem
+{
+public:
+	/* Code is a list of (chunk name, source or bytecode) executed by every worker */
+	FLuaJobSystem(const int32 NumWorkers, const TArray<TPair<FString, TArray<uint8>>>& Code);
+	~FLuaJobSystem();
+
+	FLuaJobSystem(const FLuaJobSystem&) = delete;
+	FLuaJobSystem& operator=(const FLuaJobSystem&) = delete;
+
+	TSharedRef<FLuaJob> Dispatch(const FString& Function, TArray<FLuaJobValue> Args, TFunction<void(const FLuaJob&)> OnCompleted = nullptr);
+
+	void DrainCompletedJobs();
+
+	/* true once the destruction started: the running jobs are interrupted with an error */
+	FORCEINLINE bool IsStopping() const { return bStopping; }
+
+	/* the "job" library (only for states owning a job system) */
+	static int OpenLibrary(lua_State* L);
+
+protected:
+	class FWorker : public FRunnable
+	{
+	public:
+		FWorker(FLuaJobSystem* InJobSystem);
+		virtual ~FWorker();
+
+		virtual uint32 Run() override;
+		virtual void Stop() override;
+
+		FLuaJobSystem* JobSystem;
+		FEvent* WakeUp;
+		FRunnableThread* Thread;
+	};
+
+	TSharedPtr<FLuaJob> PopJob();
+	void RunJob(lua_State* L, FLuaJob& Job);
+
+	TArray<TPair<FString, TArray<uint8>>> Code;
+	TArray<FWorker*> Workers;
+
+	FCriticalSection PendingJobsLock;
+	TArray<TSharedPtr<FLuaJob>> PendingJobs;
+
+	TQueue<TSharedPtr<FLuaJob>, EQueueMode::Mpsc> CompletedJobs;
+
+	FThreadSafeBool bStopping;
+};
@@ -5,8 +5,10 @@
 #include "CoreMinimal.h"
 #include "Modules/ModuleManager.h"
 #include "UObject/GCObject.h"
+#include "UObject/ObjectKey.h"
 #include "LuaState.h"
 #include "HAL/IConsoleManager.h"
+#include "Containers/Ticker.h"
 
 DECLARE_MULTICAST_DELEGATE(FOnRegisteredLuaStatesChanged);
 DECLARE_MULTICAST_DELEGATE_OneParam(FOnNewLuaState, ULuaState*);
@@ -26,6 +28,26 @@ public:
 
 	ULuaState* GetLuaState(TSubclassOf<ULuaState> LuaStateClass, UWorld* InWorld, bool bCheckOnly=false);
 
+	/* like GetLuaState but the heavy part of the initialization runs on a worker thread (see ULuaState::LuaStateInitAsync) */
+	void GetLuaStateAsync(TSubclassOf<ULuaState> LuaStateClass, UWorld* InWorld, TFunction<void(ULuaState*)> OnInitialized);
+
+	/* true for the state shared by all the users of its class (the one returned by GetLuaState) */
+	bool IsSharedLuaState(const ULuaState* LuaState) const;
+
+	/* a new (not shared) state, taken from the pool of the class when its DynamicPoolSize is > 0 */
+	ULuaState* AcquireDynamicLuaState(TSubclassOf<ULuaState> LuaStateClass, UWorld* InWorld);
+	/* close a dynamic state, the pool will be refilled with a pristine one */
+	void ReleaseDynamicLuaState(ULuaState* LuaState);
+	/* start filling the pool of the class (one state per frame) */
+	void WarmDynamicLuaStatePool(TSubclassOf<ULuaState> LuaStateClass, UWorld* InWorld);
+	/* a new dynamic state with a deep copy of the globals of an initialized one (its scripts are not executed again) */
+	ULuaState* CloneLuaState(ULuaState* SourceLuaState, UWorld* InWorld);
+
+	/* binary image of the globals and modules of the state (see FLuaStateSnapshot) */
+	bool HibernateLuaState(TSubclassOf<ULuaState> LuaStateClass, UWorld* InWorld, TArray<uint8>& Image);
+	/* replace the state of the class with a new one built from the image (its scripts are not executed), images with Lua functions require bAllowBytecodeImages */
+	ULuaState* RestoreLuaState(TSubclassOf<ULuaState> LuaStateClass, UWorld* InWorld, const TArray<uint8>& Image);
+
 	TArray<ULuaState*> GetRegisteredLuaStates();
 
 	FOnNewLuaState OnNewLuaState;
@@ -34,6 +56,13 @@ public:
 	void LuaLevelAddedToWorld(ULevel* Level, UWorld* World);
 	void LuaLevelRemovedFromWorld(ULevel* Level, UWorld* World);
 
+	void LuaEndFrame();
+	/* the pools are refilled by the core ticker (running user init scripts from OnEndFrame is not safe) */
+	bool LuaPoolTick(float DeltaTime);
+	void LuaMemoryTrim();
+	void LuaPreLoadMap(const FString& MapName);
+	void LuaWorldCleanup(UWorld* World, bool bSessionEnded, bool bCleanupResources);
+
 	void AddReferencedObjects(FReferenceCollector& Collector) override;
 
 	void RegisterLuaConsoleCommand(const FString& CommandName, const FLuaValue& LuaConsoleCommand);
@@ -56,5 +85,42 @@ private:
 #else
 	TMap<TSubclassOf<ULuaState>, ULuaState*> LuaStates;
 #endif
+
+	// states of the bPerWorld classes
+#if ENGINE_MAJOR_VERSION >= 5 && ENGINE_MINOR_VERSION >= 4
+	TMap<TObjectKey<UWorld>, TMap<TSubclassOf<ULuaState>, TObjectPtr<ULuaState>>> PerWorldLuaStates;
+#else
+	TMap<TObjectKey<UWorld>, TMap<TSubclassOf<ULuaState>, ULuaState*>> PerWorldLuaStates;
+#endif
+
 	TSet<FString> LuaConsoleCommands;
+
+	struct FLuaDynamicStatePool
+	{
+		TArray<ULuaState*> LuaStates;
+		TWeakObjectPtr<UWorld> World;
+	};
+
+	TMap<TSubclassOf<ULuaState>, FLuaDynamicStatePool> DynamicLuaStatePools;
+
+	// dynamic states still get the end of frame work
+	TArray<TWeakObjectPtr<ULuaState>> DynamicLuaStates;
+
+#if ENGINE_MAJOR_VERSION >= 5 && ENGINE_MINOR_VERSION >= 4
+	TMap<TSubclassOf<ULuaState>, TObjectPtr<ULuaState>>& GetClassLuaStates(TSubclassOf<ULuaState> LuaStateClass, UWorld* InWorld);
+#else
+	TMap<TSubclassOf<ULuaState>, ULuaState*>& GetClassLuaStates(TSubclassOf<ULuaState> LuaStateClass, UWorld* InWorld);
+#endif
+
+	ULuaState* NewDynamicLuaState(TSubclassOf<ULuaState> LuaStateClass, UWorld* InWorld);
+	void RefillDynamicLuaStatePools();
+
+#if ENGINE_MAJOR_VERSION > 4
+	FTSTicker::FDelegateHandle LuaPoolTickHandle;
+#else
+	FDelegateHandle LuaPoolTickHandle;
+#endif
+
+	// the out of memory notification can come from any thread
+	FThreadSafeBool bPendingMemoryTrim;
 };
@@ -8,18 +8,25 @@
 #include "LuaValue.h"
 #include "LuaCode.h"
 #include "Runtime/Core/Public/Containers/Queue.h"
+#include "Async/Future.h"
 #include "Runtime/Launch/Resources/Version.h"
 #include "LuaDelegate.h"
 #include "LuaCommandExecutor.h"
+#include "LuaAllocator.h"
+#include "LuaJobSystem.h"
+#include "LuaStateThread.h"
 #include "LuaState.generated.h"
 
 LUAMACHINE_API DECLARE_LOG_CATEGORY_EXTERN(LogLuaMachine, Log, All);
 
+DECLARE_STATS_GROUP(TEXT("LuaMachine"), STATGROUP_LuaMachine, STATCAT_Advanced);
+
 /**
  *
  */
 
 class ULuaBlueprintPackage;
+struct FLuaStateSnapshot;
 
 struct FLuaUserData
 {
@@ -103,6 +110,40 @@ struct FLuaLibsLoader
 
 };
 
+USTRUCT()
+struct FLuaUserDataObjectPool
+{
+	GENERATED_BODY()
+
+	UPROPERTY()
+	TArray<ULuaUserDataObject*> Objects;
+};
+
+USTRUCT(BlueprintType)
+struct FLuaGCStats
+{
+	GENERATED_BODY()
+
+	/* time spent collecting in the last frame */
+	UPROPERTY(BlueprintReadOnly, Category = "Lua")
+	float TimeMs = 0;
+
+	UPROPERTY(BlueprintReadOnly, Category = "Lua")
+	int32 Steps = 0;
+
+	/* current size (in KB) of a single step */
+	UPROPERTY(BlueprintReadOnly, Category = "Lua")
+	int32 StepSize = 0;
+
+	/* completed collection cycles since the state creation */
+	UPROPERTY(BlueprintReadOnly, Category = "Lua")
+	int32 Cycles = 0;
+
+	/* KB allocated (net) in the last frame */
+	UPROPERTY(BlueprintReadOnly, Category = "Lua")
+	int32 AllocatedKB = 0;
+};
+
 USTRUCT(BlueprintType)
 struct FLuaDebug
 {
@@ -146,6 +187,58 @@ struct FLuaSmartReference : public TSharedFromThis<FLuaSmartReference>
 	FLuaValue Value;
 };
 
+/*
+ * A Lua string interned by ULuaState::InternName(): the string is pinned in the registry
+ * so its pointer can be used as a key for the whole life of the state.
+ */
+struct FLuaInternedName
+{
+	FName Name;
+	FString String;
+	uint32 StringHash;
+	int LuaRef;
+};
+
+/*
+ * View over the values returned by ULuaState::PCallMulti(): the values are left on the Lua stack
+ * and converted only when accessed (Index is 0-based). The slice (and anything pushed above it)
+ * is popped when the view is released or goes out of scope.
+ */
+struct LUAMACHINE_API FLuaCallResult
+{
+	FLuaCallResult(ULuaState* InLuaState, const int32 InFirstIndex, const int32 InNum, const bool bInSuccess = true);
+	FLuaCallResult(FLuaCallResult&& Other);
+	~FLuaCallResult();
+
+	FLuaCallResult(const FLuaCallResult&) = delete;
+	FLuaCallResult& operator=(const FLuaCallResult&) = delete;
+	FLuaCallResult& operator=(FLuaCallResult&&) = delete;
+
+	bool Succeeded() const { return bSuccess; }
+	int32 Num() const { return NumValues; }
+	bool IsValidIndex(const int32 Index) const { return Index >= 0 && Index < NumValues; }
+
+	ELuaValueType GetType(const int32 Index) const;
+	bool GetBool(const int32 Index) const;
+	int64 GetInteger(const int32 Index) const;
+	double GetNumber(const int32 Index) const;
+	FString GetString(const int32 Index) const;
+
+	FLuaValue Get(const int32 Index) const;
+	FLuaValue operator[](const int32 Index) const { return Get(Index); }
+
+	/* convert all of the values in a single pass */
+	void AppendTo(TArray<FLuaValue>& Values) const;
+	TArray<FLuaValue> ToArray() const;
+
+	void Release();
+
+protected:
+	ULuaState* LuaState;
+	int32 FirstIndex;
+	int32 NumValues;
+	bool bSuccess;
+};
 
 class ULuaUserDataObject;
 
@@ -158,6 +251,8 @@ public:
 	ULuaState();
 	~ULuaState();
 
+	virtual void BeginDestroy() override;
+
 	virtual UWorld* GetWorld() const override { return CurrentWorld; }
 
 	UPROPERTY(EditAnywhere, Category = "Lua")
@@ -175,9 +270,56 @@ public:
 	UPROPERTY(EditAnywhere, Category = "Lua")
 	TMap<FString, ULuaCode*> RequireTable;
 
+	/* executed right after the libraries are loaded (on a worker thread with LuaStateInitAsync): standard Lua only, no Table globals, Blueprint packages, RequireTable modules or UObjects */
+	UPROPERTY(EditAnywhere, Category = "Lua")
+	TArray<ULuaCode*> LuaPureInitCodeAssets;
+
+	/* number of worker threads (each one with its own VM) for the "job" library, 0 disables it */
+	UPROPERTY(EditAnywhere, Category = "Lua")
+	int32 LuaJobWorkers;
+
+	/* executed by every job worker VM, the global functions they define can be dispatched as jobs (standard Lua only) */
+	UPROPERTY(EditAnywhere, Category = "Lua", Meta = (EditCondition = "LuaJobWorkers > 0"))
+	TArray<ULuaCode*> LuaJobCodeAssets;
+
+	FORCEINLINE FLuaJobSystem* GetLuaJobSystem() const { return LuaJobSystem.Get(); }
+
+	/*
+	 * After the initialization the VM is owned by a dedicated thread: use FLuaStateOwnershipScope or queue commands (GetLuaThread) for accessing it.
+	 * WARNING: the synchronous Blueprint nodes (LuaGlobalCall, LuaValueCall, LuaTableGetField, ...) and the copies of table/function
+	 * values borrow the VM, BLOCKING the caller until the running command is complete: use LuaGlobalCallAsync from Blueprints.
+	 */
+	UPROPERTY(EditAnywhere, Category = "Lua")
+	bool bLuaDedicatedThread;
+
+	FORCEINLINE FLuaStateThread* GetLuaThread() const { return LuaThread.Get(); }
+
+	/* true if the current thread can touch the VM */
+	FORCEINLINE bool IsLuaStateOwner() const { return !LuaThread || LuaThread->IsOwnedByCurrentThread(); }
+
 	UPROPERTY(EditAnywhere, Category = "Lua")
 	bool bLuaOpenLibs;
 
+	/* expose the "bulk" library (gather/scatter of actors transforms and properties in contiguous buffers) */
+	UPROPERTY(EditAnywhere, Category = "Lua")
+	bool bLuaOpenBulkLibrary;
+
+	/* allocate the VM memory with the size-class pools of FLuaAllocator (otherwise plain FMemory), every pool reserves 64k pages: better suited for big long-lived states */
+	UPROPERTY(EditAnywhere, Category = "Lua")
+	bool bLuaPoolAllocator;
+
+	/* max bytes the VM can allocate (0 for no limit), scripts going over it get a "not enough memory" error after an emergency collection */
+	UPROPERTY(EditAnywhere, Category = "Lua")
+	int64 LuaMemoryBudget;
+
+	/* disable the automatic GC, the collector is stepped at the end of every frame within LuaGCBudget (full cycles on map loading) */
+	UPROPERTY(EditAnywhere, Category = "Lua")
+	bool bLuaGCScheduler;
+
+	/* milliseconds per frame for the GC scheduler */
+	UPROPERTY(EditAnywhere, Category = "Lua", meta = (EditCondition = "bLuaGCScheduler"))
+	float LuaGCBudget;
+
 	UPROPERTY(EditAnywhere, Category = "Lua", meta = (DisplayName = "Load Specific Lua Libraries (only if \"Lua Open Libs\" is false)"))
 	FLuaLibsLoader LuaLibsLoader;
 
@@ -259,6 +401,28 @@ public:
 	UPROPERTY(EditAnywhere, Category = "Lua")
 	bool bPersistent;
 
+	/* allow LuaStateRestore images containing Lua functions: their bytecode is loaded without any verification,
+	 * so enable it only if every image comes from a trusted source (never from user editable save games or the network) */
+	UPROPERTY(EditAnywhere, Category = "Lua")
+	bool bAllowBytecodeImages;
+
+	/* one instance of the state for each world (created on first use, closed on world cleanup) instead of one for the whole process */
+	UPROPERTY(EditAnywhere, Category = "Lua")
+	bool bPerWorld;
+
+	/* number of initialized states kept ready for CreateDynamicLuaState (refilled one per frame) */
+	UPROPERTY(EditAnywhere, Category = "Lua")
+	int32 DynamicPoolSize;
+
+	/* close the VM for good (GetLuaState will return nullptr from now on) */
+	void RetireLuaState();
+
+	/* globals and loaded modules of the initialized state, captured on first request */
+	TSharedPtr<const FLuaStateSnapshot> GetLuaSnapshot(const bool bRefresh = false);
+
+	/* when set (before GetLuaState), the VM is filled from the snapshot instead of running LuaCodeAsset/LuaFilename */
+	TSharedPtr<const FLuaStateSnapshot> InitSnapshot;
+
 	/* Enable debug of each Lua line. The LuaLineHook event will be triggered */
 	UPROPERTY(EditAnywhere, Category = "Lua")
 	bool bEnableLineHook;
@@ -284,9 +448,54 @@ public:
 
 	TArray<TSharedRef<FLuaSmartReference>> LuaSmartReferences;
 
+	/* each object knows its index (LuaTrackedIndex), so removal is a swap */
 	UPROPERTY()
 	TArray<ULuaUserDataObject*> TrackedLuaUserDataObjects;
 
+	void TrackLuaUserDataObject(ULuaUserDataObject* LuaUserDataObject);
+	void UntrackLuaUserDataObject(ULuaUserDataObject* LuaUserDataObject);
+
+	/* collected by Lua, waiting for ReceiveLuaGC at the end of the frame */
+	UPROPERTY()
+	TArray<ULuaUserDataObject*> PendingLuaGCUserDataObjects;
+
+	/* free objects of the classes with bLuaPooled */
+	UPROPERTY()
+	TMap<UClass*, FLuaUserDataObjectPool> LuaUserDataObjectPools;
+
+	/* max number of free objects kept for each pooled LuaUserDataObject class */
+	UPROPERTY(EditAnywhere, Category = "Lua")
+	int32 LuaUserDataObjectPoolSize = 256;
+
+	void FlushPendingLuaGC();
+
+	/* the allocator used for the VM, override for plugging a custom one (UserData is passed to lua_newstate) */
+	virtual lua_Alloc GetLuaAllocFunction(void*& UserData);
+
+	UFUNCTION(BlueprintCallable, BlueprintPure, Category = "Lua")
+	FLuaMemoryStats GetLuaMemoryStats() const;
+
+	UFUNCTION(BlueprintCallable, Category = "Lua")
+	void SetLuaMemoryBudget(const int64 Budget);
+
+	/* full collection, called by the module on the engine memory trim/out of memory notifications */
+	virtual void LuaMemoryTrim();
+
+	/* run the GC scheduler for this frame */
+	void LuaGCStep();
+
+	/* complete a whole cycle (used while loading maps, when nobody is looking) */
+	void LuaGCFullCycle();
+
+	/* lua_gc in a protected call (the __gc metamethods can raise errors), errors are logged and 0 is returned */
+	int ProtectedGC(const int What, const int Data = 0);
+
+	UFUNCTION(BlueprintCallable, BlueprintPure, Category = "Lua")
+	FLuaGCStats GetLuaGCStats() const { return LuaGCStats; }
+
+	/* called by the module at the end of every frame */
+	virtual void LuaEndFrame();
+
 	UFUNCTION(BlueprintNativeEvent, Category = "Lua", meta = (DisplayName = "Lua Level Added To World"))
 	void ReceiveLuaLevelAddedToWorld(ULevel* Level, UWorld* World);
 
@@ -307,6 +516,14 @@ public:
 
 	TQueue<FString> InceptionErrors;
 
+	// recreated for every VM (see FLuaUnrefQueue)
+	TRefCountPtr<FLuaUnrefQueue> UnrefQueue;
+
+	TUniquePtr<FLuaAllocator> LuaAllocator;
+
+	FLuaGCStats LuaGCStats;
+	int32 LuaGCLastCount;
+
 	void NewTable();
 
 	void SetMetaTable(int Index);
@@ -335,12 +552,19 @@ public:
 	bool PCall(int NArgs, FLuaValue& Value, int NRet = 1);
 	bool Call(int NArgs, FLuaValue& Value, int NRet = 1);
 
+	/* like PCall() with LUA_MULTRET, the function slot and the returned values are owned by the result view */
+	FLuaCallResult PCallMulti(int NArgs);
+
 	void Pop(int32 Amount = 1);
 
 	void PushNil();
 
 	void Unref(int Ref);
 	void UnrefChecked(int Ref);
+
+	/* the refs of the values are released by DrainPendingUnrefs (before entering the VM or at the end of the frame), nullptr without a VM */
+	FORCEINLINE FLuaUnrefQueue* GetUnrefQueue() const { return UnrefQueue.GetReference(); }
+	void DrainPendingUnrefs();
 	int NewRef();
 	void GetRef(int Ref);
 	int Next(int Index);
@@ -361,8 +585,22 @@ public:
 
 	void PushCFunction(lua_CFunction Function);
 
+	/* returns nullptr if the value at Index is not a string (or it is not suitable for an FName) */
+	const FLuaInternedName* InternName(int Index, lua_State* State = nullptr);
+	FName ToName(int Index, lua_State* State = nullptr);
+	void PushName(FName Name, lua_State* State = nullptr);
+
 	ULuaState* GetLuaState(UWorld* InWorld);
 
+	/*
+	 * VM, libraries, LuaPureInitCodeAssets and scripts compilation on a worker thread, then everything else
+	 * (Table, Blueprint packages, scripts execution, LuaStateInit) on the game thread before calling OnInitialized
+	 * (with nullptr on error). A GetLuaState() in the middle waits for the worker and completes the initialization.
+	 */
+	void LuaStateInitAsync(UWorld* InWorld, TFunction<void(ULuaState*)> OnInitialized);
+
+	FORCEINLINE bool IsLuaStateInitPending() const { return AsyncInitFuture.IsValid(); }
+
 	bool RunCode(const TArray<uint8>& Code, const FString& CodePath, int NRet = 0);
 	bool RunCode(const FString& Code, const FString& CodePath, int NRet = 0);
 
@@ -373,11 +611,28 @@ public:
 
 	FLuaValue CreateLuaLazyTable();
 
+	/* bulk transfer of POD arrays: tables are created with the exact size and filled/read with raw accessors */
+	FLuaValue CreateLuaTableFromArray(const TArray<float>& Values);
+	FLuaValue CreateLuaTableFromArray(const TArray<double>& Values);
+	FLuaValue CreateLuaTableFromArray(const TArray<int32>& Values);
+	FLuaValue CreateLuaTableFromArray(const TArray<int64>& Values);
+	/* vectors are packed in a flat numeric array (x1, y1, z1, x2, y2, z2, ...) */
+	FLuaValue CreateLuaTableFromArray(const TArray<FVector>& Values);
+
+	bool LuaTableToArray(FLuaValue& Table, TArray<float>& Values);
+	bool LuaTableToArray(FLuaValue& Table, TArray<double>& Values);
+	bool LuaTableToArray(FLuaValue& Table, TArray<int32>& Values);
+	bool LuaTableToArray(FLuaValue& Table, TArray<int64>& Values);
+	/* accepts both the packed layout and arrays of {X, Y, Z} tables */
+	bool LuaTableToArray(FLuaValue& Table, TArray<FVector>& Values);
+
 	bool RunFile(const FString& Filename, bool bIgnoreNonExistent, int NRet = 0, bool bNonContentDirectory=false);
 
 	static int MetaTableFunctionUserData__index(lua_State* L);
 	static int MetaTableFunctionUserData__newindex(lua_State* L);
 
+	static int MetaTableFunctionGlobal__index(lua_State* L);
+
 	static int TableFunction_print(lua_State* L);
 	static int TableFunction_package_preload(lua_State* L);
 	static int TableFunction_package_loader(lua_State* L);
@@ -444,11 +699,42 @@ public:
 
 	void SetupAndAssignUserDataMetatable(UObject* Context, TMap<FString, FLuaValue>& Metatable, lua_State* State);
 
+	/*
+	 * LuaComponent and LuaUserDataObject fields live in a Lua table (the userdata uservalue),
+	 * Blueprints access it through the Table getter/setter, C++ sees the Table map synchronized with the following functions
+	 */
+	void PushInstanceTable(UObject* Context, lua_State* State = nullptr);
+	/* the current fields of the instance table (false if the object has no instance table in this state) */
+	bool GetInstanceTableFields(UObject* Context, TMap<FString, FLuaValue>& Fields);
+	void SyncInstanceTable(UObject* Context);
+	void ReloadInstanceTable(UObject* Context);
+	void SyncInstanceTables();
+
 	const void* ToPointer(int Index);
 
 	UPROPERTY(EditAnywhere, Category = "Lua")
 	bool bRawLuaFunctionCall;
 
+	/* if set, LuaComponents with bLuaTick will be ticked by calling this global function once per frame with the array of components, the frame delta time and the array of the components delta times */
+	UPROPERTY(EditAnywhere, Category = "Lua")
+	FString LuaTickBatchFunction;
+
+	/* LuaComponents ticks: the least significant components are updated at this interval (in seconds), 0 disables the LOD */
+	UPROPERTY(EditAnywhere, Category = "Lua")
+	float LuaTickMaxInterval;
+
+	/* LuaComponents ticks: the distance from the viewers at which the default significance reaches 0 */
+	UPROPERTY(EditAnywhere, Category = "Lua")
+	float LuaTickLODDistance;
+
+	/* LuaComponents ticks: max milliseconds per frame, the remaining updates are deferred to the next frame (0 means no limit) */
+	UPROPERTY(EditAnywhere, Category = "Lua")
+	float LuaTickBudget;
+
+	/* push a userdata for Object, created on the first request and then cached in the registry (only for LuaComponents) */
+	void PushCachedUObject(UObject* Object, lua_State* State = nullptr);
+	void ReleaseCachedUObject(UObject* Object);
+
 	void GCLuaDelegatesCheck();
 
 	void RegisterLuaDelegate(UObject* InObject, ULuaDelegate* InLuaDelegate);
@@ -501,35 +787,128 @@ protected:
 	lua_State* L;
 	bool bDisabled;
 
+	/* the thread agnostic part of the initialization (it does not touch L) */
+	lua_State* LuaStateOpen(lua_Alloc AllocFunction, void* AllocUserData, const bool bPrecompileScripts, FString& Error);
+	/* game thread part of the initialization, the VM becomes L */
+	ULuaState* LuaStateSetup(lua_State* NewL, const bool bPrecompiled, const FString& Error);
+	ULuaState* LuaStateAsyncInitComplete();
+	void LuaStateAsyncInitCancel();
+	/* the remaining commands are executed, then the VM goes back to the game thread */
+	void ShutdownLuaThread();
+	/* before closing the VM: the refs released from now on are dropped */
+	void CloseUnrefQueue();
+	bool RunPrecompiledChunk(const int Slot, const int NRet = 0);
+
+	TUniquePtr<FLuaJobSystem> LuaJobSystem;
+
+	TSharedPtr<FLuaStateThread, ESPMode::ThreadSafe> LuaThread;
+
+	TFuture<lua_State*> AsyncInitFuture;
+	FString AsyncInitError;
+	bool bAsyncInitPrecompiled;
+	TArray<TFunction<void(ULuaState*)>> AsyncInitCallbacks;
+
 	UWorld* CurrentWorld;
 
 	FLuaValue UserDataMetaTable;
 
+	TSharedPtr<const FLuaStateSnapshot> LuaSnapshot;
+
+	friend struct FLuaStateSnapshot;
+	friend struct FLuaSnapshotCapture;
+	friend struct FLuaStateOwnershipScope;
+
 	virtual void LuaStateInit();
 
 	FDelegateHandle GCLuaDelegatesHandle;
 
+	TArray<TWeakObjectPtr<UObject>> InstanceTableOwners;
+
+	TMap<TWeakObjectPtr<UObject>, int> CachedUObjects;
+
+	/* archetype -> metatable chaining instance tables to the archetype defaults */
+	TMap<TWeakObjectPtr<UObject>, FLuaValue> InstancePrototypeMetatables;
+	FLuaValue GetInstancePrototypeMetatable(UObject* Context, const TMap<FString, FLuaValue>*& DefaultTable);
+	/* archetype -> userdata metatable shared by the instances with the archetype Metatable */
+	TMap<TWeakObjectPtr<UObject>, FLuaValue> SharedUserDataMetatables;
+	FLuaValue GetSharedUserDataMetatable(UObject* Context, const TMap<FString, FLuaValue>& Metatable);
+	void PushUserDataMetatable(UObject* Context, TMap<FString, FLuaValue>& Metatable, lua_State* State);
+	void FillInstanceTable(int32 TableIndex, UObject* Context, TMap<FString, FLuaValue>& Table, const TMap<FString, FLuaValue>* DefaultTable);
+
 	UPROPERTY()
 	TMap<TWeakObjectPtr<UObject>, FLuaDelegateGroup> LuaDelegatesMap;
 
 	FLuaCommandExecutor LuaConsole;
+
+	TMap<const char*, TUniquePtr<FLuaInternedName>> InternedLuaStrings;
+
+	struct FLuaPinnedName
+	{
+		FName Name;
+		int LuaRef;
+	};
+	TMap<FName, FLuaPinnedName> InternedNames;
+};
+
+/*
+ * Builds a Lua table in a single pass: the table is created presized (lua_createtable) and kept
+ * on the stack, fields are assigned with raw sets and Finish() returns it with a single registry ref.
+ * Pushes done while the builder is alive must be balanced.
+ */
+struct LUAMACHINE_API FLuaTableBuilder
+{
+	FLuaTableBuilder(ULuaState* InLuaState, const int32 ArraySize = 0, const int32 HashSize = 0);
+	~FLuaTableBuilder();
+
+	FLuaTableBuilder(const FLuaTableBuilder&) = delete;
+	FLuaTableBuilder& operator=(const FLuaTableBuilder&) = delete;
+
+	/* append the value at the next array index (starting from 1) */
+	void Add(FLuaValue& Value, UObject* CallContext = nullptr);
+	void Add(FLuaValue&& Value, UObject* CallContext = nullptr) { Add(Value, CallContext); }
+
+	void SetField(const FString& Key, FLuaValue& Value, UObject* CallContext = nullptr);
+	void SetField(const FString& Key, FLuaValue&& Value, UObject* CallContext = nullptr) { SetField(Key, Value, CallContext); }
+
+	void SetField(const char* Key, FLuaValue& Value, UObject* CallContext = nullptr);
+	void SetField(const char* Key, FLuaValue&& Value, UObject* CallContext = nullptr) { SetField(Key, Value, CallContext); }
+
+	void SetField(FName Key, FLuaValue& Value, UObject* CallContext = nullptr);
+	void SetField(FName Key, FLuaValue&& Value, UObject* CallContext = nullptr) { SetField(Key, Value, CallContext); }
+
+	void SetFieldByIndex(const int32 Index, FLuaValue& Value, UObject* CallContext = nullptr);
+	void SetFieldByIndex(const int32 Index, FLuaValue&& Value, UObject* CallContext = nullptr) { SetFieldByIndex(Index, Value, CallContext); }
+
+	/* pops the table from the stack, after this call the builder cannot be used anymore */
+	FLuaValue Finish();
+
+protected:
+	ULuaState* LuaState;
+	int32 TableIndex;
+	int32 NextArrayIndex;
 };
 
 #define LUACFUNCTION(FuncClass, FuncName, NumRetValues, NumArgs) static int FuncName ## _C(lua_State* L)\
 {\
 	FuncClass* LuaState = (FuncClass*)ULuaState::GetFromExtraSpace(L);\
+	if (LuaState->GetLuaThread() && !IsInGameThread())\
+	{\
+		return LuaState->GetLuaThread()->CallOnGameThread(L, FuncName ## _C);\
+	}\
+	FLuaAllocator::FBridgeScope BridgeScope(L);\
 	int TrueNumArgs = lua_gettop(L);\
 	if (TrueNumArgs != NumArgs)\
 	{\
 		return luaL_error(L, "invalid number of arguments for %s (got %d, expected %d)", #FuncName, TrueNumArgs, NumArgs);\
 	}\
 	TArray<FLuaValue> LuaArgs;\
+	LuaArgs.Reserve(NumArgs);\
 	for (int32 LuaArgIndex = 0; LuaArgIndex < NumArgs; LuaArgIndex++)\
 	{\
 		LuaArgs.Add(LuaState->ToLuaValue(LuaArgIndex + 1, L));\
 	}\
 	FLuaValue NilValue;\
-	TArray<FLuaValue> RetValues = LuaState->FuncName(LuaArgs);\
+	TArray<FLuaValue> RetValues = LuaState->FuncName(MoveTemp(LuaArgs));\
 	for (int32 RetIndex = 0; RetIndex < NumRetValues; RetIndex++)\
 	{\
 		if (RetIndex < RetValues.Num())\
@@ -0,0 +1,106 @@
+// Copyright 2018-2023 - Roberto De Ioris
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "ThirdParty/lua/lua.hpp"
+#include "LuaValue.h"
+
+class ULuaState;
+
+enum class ELuaSnapshotValueType : uint8
+{
+	Nil,
+	Bool,
+	Integer,
+	Number,
+	String,
+	Table,
+	Function,
+	LightUserData,
+	// UObject/UFunction userdata, rebuilt with FromLuaValue
+	Value,
+};
+
+struct LUAMACHINE_API FLuaSnapshotValue
+{
+	ELuaSnapshotValueType Type;
+	union
+	{
+		bool Bool;
+		lua_Integer Integer;
+		lua_Number Number;
+		void* LightUserData;
+		// index in the Strings/Tables/Functions/Values arrays of the snapshot
+		int32 Index;
+	};
+
+	FLuaSnapshotValue() : Type(ELuaSnapshotValueType::Nil), Integer(0) {}
+};
+
+struct LUAMACHINE_API FLuaSnapshotTable
+{
+	// tables already existing in a fresh state (standard libraries, loaded modules, blueprint packages) are merged instead of created
+	FString BuiltinName;
+	TArray<TPair<FLuaSnapshotValue, FLuaSnapshotValue>> Fields;
+	FLuaSnapshotValue Metatable;
+};
+
+struct LUAMACHINE_API FLuaSnapshotFunction
+{
+	// index in ByteCodes, INDEX_NONE for C functions
+	int32 ByteCode = INDEX_NONE;
+	lua_CFunction CFunction = nullptr;
+	// builtin table and field exposing the C function (the pointer is not serialized)
+	FString CFunctionTable;
+	FString CFunctionField;
+	TArray<FLuaSnapshotValue> Upvalues;
+	// for each upvalue, the (function, upvalue) it is shared with (X is INDEX_NONE if not shared)
+	TArray<FIntPoint> UpvalueJoins;
+};
+
+/* UObject/UFunction userdata: the snapshot is not a UObject, so the objects are weak (nil when restored after being collected) */
+struct LUAMACHINE_API FLuaSnapshotObject
+{
+	TWeakObjectPtr<UObject> Object;
+	// the function of UFunction userdata (the object is its context)
+	FName FunctionName;
+	bool bFunction = false;
+};
+
+/*
+ * The graph of values reachable from the globals of an initialized state, decoupled from its VM.
+ * Lua functions are kept as bytecode (shared by all the restores, so no parsing) and rebuilt with their upvalues,
+ * tables are deep-copied. Threads and foreign userdata (files, bulk buffers) are not captured (they become nil).
+ *
+ * The snapshot can be serialized to a binary image (UObjects as soft paths, C functions by library name) for
+ * hibernating a state across level transitions or in save games. Lua does not verify bytecode: never load images
+ * from untrusted sources (FLuaMachineModule::RestoreLuaState refuses images with bytecode unless bAllowBytecodeImages is set).
+ */
+struct LUAMACHINE_API FLuaStateSnapshot
+{
+	TArray<TArray<uint8>> Strings;
+	TArray<FLuaSnapshotTable> Tables;
+	TArray<FLuaSnapshotFunction> Functions;
+	TArray<TArray<uint8>> ByteCodes;
+	TArray<FLuaSnapshotObject> Values;
+
+	FLuaSnapshotValue Globals;
+	FLuaSnapshotValue UserDataMetaTable;
+
+	/* capture the globals (and the loaded modules) of an initialized state (nullptr if the graph is too deep) */
+	static TSharedPtr<FLuaStateSnapshot> Capture(ULuaState* LuaState);
+
+	/* copy the graph into a state with a fresh VM (LuaCodeAsset/LuaFilename not executed) */
+	bool Restore(ULuaState* LuaState, FString& Error) const;
+
+	void Serialize(FArchive& Ar);
+
+	/* binary image (with header and checksum) of the snapshot */
+	void Save(TArray<uint8>& Image) const;
+
+	static TSharedPtr<FLuaStateSnapshot> Load(const TArray<uint8>& Image, FString& Error);
+
+	/* every index in range (images can be corrupted) */
+	bool IsValidGraph() const;
+};
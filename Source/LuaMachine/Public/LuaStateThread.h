@@ -0,0 +1,130 @@
+// Copyright 2018-2023 - Roberto De Ioris
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "ThirdParty/lua/lua.hpp"
+#include "Async/Async.h"
+#include "Async/Future.h"
+#include "HAL/Runnable.h"
+#include "HAL/ThreadSafeBool.h"
+#include "Containers/Queue.h"
+
+class ULuaState;
+
+/*
+ * The thread owning the VM of a ULuaState with bLuaDedicatedThread.
+ * Commands are executed in order by the Lua thread, while the game thread can borrow the VM (FLuaStateOwnershipScope)
+ * between two commands. Lua code running in the Lua thread reaches UObjects through the game thread: the VM is handed
+ * to it until the request returns (CallOnGameThread). Outbound events (PostToGameThread) are executed by the game thread
+ * at the end of the frame or while it waits for the VM.
+ * Every access to the VM is checked against the owner thread (see ULuaState::IsLuaStateOwner).
+ */
+class LUAMACHINE_API FLuaStateThread : public FRunnable, public TSharedFromThis<FLuaStateThread, ESPMode::ThreadSafe>
+{
+public:
+	FLuaStateThread(ULuaState* InLuaState);
+	virtual ~FLuaStateThread();
+
+	FLuaStateThread(const FLuaStateThread&) = delete;
+	FLuaStateThread& operator=(const FLuaStateThread&) = delete;
+
+	bool Start();
+
+	/* game thread: the pending commands are executed before the thread exits, the requests to the game thread are discarded */
+	void Shutdown();
+
+	void Enqueue(TUniqueFunction<void()> Command);
+
+	/* the future is ready when the command has been executed (never block the game thread on it, use WaitForFuture) */
+	template<typename ResultType>
+	TFuture<ResultType> EnqueueWithFuture(TUniqueFunction<ResultType()> Command)
+	{
+		TPromise<ResultType> Promise;
+		TFuture<ResultType> Future = Promise.GetFuture();
+		Enqueue([Promise = MoveTemp(Promise), Command = MoveTemp(Command)]() mutable
+			{
+				SetPromise(Promise, Command);
+			});
+		return Future;
+	}
+
+	/* game thread: wait for a future of the Lua thread while serving its requests */
+	template<typename ResultType>
+	void WaitForFuture(const TFuture<ResultType>& Future)
+	{
+		while (!Future.IsReady())
+		{
+			DrainGameThreadRequests();
+			GameThreadWakeUp->Wait(1);
+		}
+	}
+
+	/* executed by the game thread at the end of the frame (any thread can post) */
+	void PostToGameThread(TUniqueFunction<void()> Request);
+
+	void DrainGameThreadRequests();
+
+	/* Lua thread: execute Request in the game thread, the VM is lent to the game thread until it returns (false if the request has been discarded) */
+	bool RunOnGameThread(TFunctionRef<void()> Request);
+
+	/* Lua thread: call Function (a lua_CFunction) with the same arguments in the game thread, errors are raised again in the Lua thread */
+	int CallOnGameThread(lua_State* L, lua_CFunction Function);
+
+	/*
+	 * wait for the running command (the whole command, not a single call) and take the VM (false if the caller already owns it).
+	 * Any thread can borrow the VM, but only the game thread serves the requests of the running command while waiting.
+	 */
+	bool Acquire();
+	void Release();
+
+	bool IsOwnedByCurrentThread() const;
+	bool IsInLuaThread() const;
+
+	/* game thread: true while executing a request of the Lua thread (that is waiting in the middle of a call) */
+	FORCEINLINE bool IsLentToGameThread() const { return LentDepth > 0; }
+
+	virtual uint32 Run() override;
+	virtual void Stop() override;
+
+protected:
+	void SetOwner(const uint32 ThreadId);
+	void DiscardGameThreadRequests();
+
+	ULuaState* LuaState;
+	FRunnableThread* Thread;
+	uint32 LuaThreadId;
+
+	// the thread allowed to touch the VM (0 when nobody is using it)
+	volatile int32 OwnerThreadId;
+
+	// requests of the Lua thread being executed by the game thread (that owns the VM in the meantime)
+	int32 LentDepth;
+
+	TQueue<TUniqueFunction<void()>, EQueueMode::Mpsc> Commands;
+	// the argument is true when the request is discarded (the thread is shutting down)
+	TQueue<TUniqueFunction<void(const bool)>, EQueueMode::Mpsc> GameThreadRequests;
+
+	// wakes up the Lua thread for new commands or when the game thread releases the VM
+	FEvent* WakeUp;
+	// wakes up the game thread waiting for the VM (new requests, VM released, thread exited)
+	FEvent* GameThreadWakeUp;
+
+	FThreadSafeBool bStopping;
+	FThreadSafeBool bExited;
+};
+
+/* the caller owns the VM of a state with a dedicated thread until the end of the scope (nothing is done for the other states) */
+struct LUAMACHINE_API FLuaStateOwnershipScope
+{
+	FLuaStateOwnershipScope(ULuaState* InLuaState);
+	~FLuaStateOwnershipScope();
+
+	FLuaStateOwnershipScope(const FLuaStateOwnershipScope&) = delete;
+	FLuaStateOwnershipScope& operator=(const FLuaStateOwnershipScope&) = delete;
+
+protected:
+	// the state could stop its thread while the scope is alive
+	TSharedPtr<FLuaStateThread, ESPMode::ThreadSafe> LuaThread;
+	bool bAcquired;
+};
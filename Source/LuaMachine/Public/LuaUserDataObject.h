@@ -25,12 +25,32 @@ public:
 
 	virtual UWorld* GetWorld() const override;
 
-	UPROPERTY(EditAnywhere, BlueprintReadOnly, Category = "Lua")
+	/* the initial fields, Blueprints read the live ones (the instance table seen by scripts) */
+	UPROPERTY(EditAnywhere, BlueprintGetter = LuaGetTable, Category = "Lua")
 	TMap<FString, FLuaValue> Table;
 
+	/* turned into a Lua metatable at the first push (C++ changes after that need LuaUserDataMetatable to be reset) */
 	UPROPERTY(EditAnywhere, BlueprintReadOnly, Category = "Lua")
 	TMap<FString, FLuaValue> Metatable;
 
+	// the Lua table holding the fields at runtime (Table is its initial value, C++ sees it with LuaSyncTable)
+	FLuaValue LuaInstanceTable;
+
+	// the Lua metatable built from Metatable (shared with the class defaults when they match)
+	FLuaValue LuaUserDataMetatable;
+
+	/* a copy of the fields seen by scripts (Table until the object is pushed to Lua) */
+	UFUNCTION(BlueprintGetter)
+	TMap<FString, FLuaValue> LuaGetTable() const;
+
+	/* copy the fields written by scripts back to Table */
+	UFUNCTION(BlueprintCallable, Category = "Lua")
+	void LuaSyncTable();
+
+	/* replace the fields seen by scripts with the content of Table */
+	UFUNCTION(BlueprintCallable, Category = "Lua")
+	void LuaReloadTable();
+
 	UPROPERTY(EditAnywhere, BlueprintReadOnly, Category = "Lua")
 	bool bImplicitSelf;
 
@@ -40,9 +60,25 @@ public:
 	UFUNCTION(BlueprintCallable, Category = "Lua")
 	void LuaSetField(const FString& Name, FLuaValue Value);
 
+	/* called at the end of the frame in which Lua collected the last userdata of this object */
 	UFUNCTION(BlueprintNativeEvent, Category = "Lua", meta = (DisplayName = "Lua UserData Metatable __gc"))
 	void ReceiveLuaGC();
 
+	/* collected objects are reset and reused by NewLuaUserDataObject (do not keep references to them after __gc) */
+	UPROPERTY(EditAnywhere, BlueprintReadOnly, Category = "Lua")
+	bool bLuaPooled = false;
+
+	/* called when the object goes back to the pool, after Table and Metatable have been restored to the class defaults */
+	UFUNCTION(BlueprintNativeEvent, Category = "Lua", meta = (DisplayName = "Lua UserData Pool Reset"))
+	void ReceiveLuaPoolReset();
+
+	// index in the tracked objects of the owning state
+	int32 LuaTrackedIndex = INDEX_NONE;
+	// live userdata (with __gc) pointing to this object
+	int32 LuaUserDataRefs = 0;
+	bool bLuaGCPending = false;
+	bool bLuaInPool = false;
+
 	UFUNCTION(BlueprintNativeEvent, Category = "Lua", meta = (DisplayName = "Lua UserData Metatable __index"))
 	FLuaValue ReceiveLuaMetaIndex(FLuaValue Key);
 
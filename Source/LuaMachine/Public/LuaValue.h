@@ -6,6 +6,9 @@
 #include "UObject/NoExportTypes.h"
 #include "ThirdParty/lua/lua.hpp"
 #include "Serialization/JsonSerializer.h"
+#include "Templates/RefCounting.h"
+#include "HAL/ThreadSafeBool.h"
+#include "Containers/Queue.h"
 #include "LuaValue.generated.h"
 
 // required for Mac
@@ -35,6 +38,48 @@ enum class ELuaValueType : uint8
 
 class ULuaState;
 
+/*
+ * The registry refs released by the values of a VM (from any thread), drained by the owning state.
+ * A new queue is created for every VM and closed with it, so the refs of a closed VM are never released in another one.
+ */
+class LUAMACHINE_API FLuaUnrefQueue : public FThreadSafeRefCountedObject
+{
+public:
+	FLuaUnrefQueue() : bClosed(false)
+	{
+	}
+
+	void Enqueue(const int Ref)
+	{
+		if (!bClosed)
+		{
+			Refs.Enqueue(Ref);
+		}
+	}
+
+	/* owner of the VM only */
+	bool Dequeue(int& Ref)
+	{
+		return Refs.Dequeue(Ref);
+	}
+
+	/* owner of the VM only, before closing it */
+	void Close()
+	{
+		bClosed = true;
+		Refs.Empty();
+	}
+
+	bool IsClosed() const
+	{
+		return bClosed;
+	}
+
+protected:
+	TQueue<int, EQueueMode::Mpsc> Refs;
+	FThreadSafeBool bClosed;
+};
+
 USTRUCT(BlueprintType)
 struct LUAMACHINE_API FLuaValue
 {
@@ -55,6 +100,10 @@ struct LUAMACHINE_API FLuaValue
 	FLuaValue(const FLuaValue& SourceValue);
 	FLuaValue& operator = (const FLuaValue &SourceValue);
 
+	// moving steals the registry reference (and the string buffer) instead of creating a new one
+	FLuaValue(FLuaValue&& SourceValue);
+	FLuaValue& operator = (FLuaValue&& SourceValue);
+
 	FLuaValue(const FString& InString) : FLuaValue()
 	{
 		Type = ELuaValueType::String;
@@ -155,6 +204,8 @@ struct LUAMACHINE_API FLuaValue
 	bool ToBool() const;
 
 	TArray<uint8> ToBytes() const;
+	/* Bytes must have room for String.Len() bytes (no allocations) */
+	void ToBytes(uint8* Bytes) const;
 
 	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category="Lua")
 	ELuaValueType Type;
@@ -162,6 +213,9 @@ struct LUAMACHINE_API FLuaValue
 	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category="Lua")
 	bool Bool;
 
+	// placed here to fill the padding after Type/Bool
+	int LuaRef;
+
 	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category="Lua")
 	int64 Integer;
 
@@ -177,10 +231,14 @@ struct LUAMACHINE_API FLuaValue
 	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category="Lua")
 	FName FunctionName;
 
-	int LuaRef;
-
 	TWeakObjectPtr<ULuaState> LuaState;
 
+	// where LuaRef is released, Unref() never touches the state (values can be destroyed by any thread)
+	TRefCountPtr<FLuaUnrefQueue> UnrefQueue;
+
+	/* the value owns InLuaRef in the registry of the current VM of InLuaState */
+	void SetRef(ULuaState* InLuaState, const int InLuaRef);
+
 	FLuaValue GetField(const FString& Key);
 	FLuaValue SetField(const FString& Key, FLuaValue Value);
 
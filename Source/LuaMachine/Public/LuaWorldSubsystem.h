@@ -0,0 +1,194 @@
+// Copyright 2018-2023 - Roberto De Ioris
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Subsystems/WorldSubsystem.h"
+#include "Engine/EngineBaseTypes.h"
+#include "UObject/ObjectKey.h"
+#include "LuaState.h"
+#include "LuaWorldSubsystem.generated.h"
+
+class ULuaComponent;
+class ULuaWorldSubsystem;
+
+USTRUCT(BlueprintType)
+struct FLuaTickStats
+{
+	GENERATED_BODY()
+
+	UPROPERTY(EditAnywhere, BlueprintReadOnly, Category = "Lua")
+	int32 Updates;
+
+	UPROPERTY(EditAnywhere, BlueprintReadOnly, Category = "Lua")
+	int32 Skipped;
+
+	UPROPERTY(EditAnywhere, BlueprintReadOnly, Category = "Lua")
+	int32 Deferred;
+
+	UPROPERTY(EditAnywhere, BlueprintReadOnly, Category = "Lua")
+	float TimeMs;
+
+	FLuaTickStats()
+		: Updates(0)
+		, Skipped(0)
+		, Deferred(0)
+		, TimeMs(0)
+	{
+	}
+};
+
+struct FLuaTickEntry
+{
+	TWeakObjectPtr<ULuaComponent> LuaComponent;
+	// time elapsed since the last update
+	float AccumulatedDeltaTime;
+	float Interval;
+};
+
+/*
+ * A single tick function for all of the LuaComponents (with bLuaTick) sharing the same LuaState and tick group
+ */
+USTRUCT()
+struct FLuaTickBucketFunction : public FTickFunction
+{
+	GENERATED_BODY()
+
+	ULuaWorldSubsystem* Subsystem;
+
+	TSubclassOf<ULuaState> LuaState;
+
+	TArray<FLuaTickEntry> Entries;
+
+	// where to start the next update (deferred components go first)
+	int32 NextEntry;
+
+	// moving average of the time spent by a single component update (in seconds)
+	double AverageUpdateTime;
+
+	FLuaTickBucketFunction()
+		: Subsystem(nullptr)
+		, NextEntry(0)
+		, AverageUpdateTime(0)
+	{
+	}
+
+	virtual void ExecuteTick(float DeltaTime, ELevelTick TickType, ENamedThreads::Type CurrentThread, const FGraphEventRef& MyCompletionGraphEvent) override;
+	virtual FString DiagnosticMessage() override;
+};
+
+template<>
+struct TStructOpsTypeTraits<FLuaTickBucketFunction> : public TStructOpsTypeTraitsBase2<FLuaTickBucketFunction>
+{
+	enum
+	{
+		WithCopy = false
+	};
+};
+
+/* returns the significance (0 least significant, 1 full update rate) of a component given the viewers locations */
+typedef TFunction<float(const ULuaComponent*, const TArray<FVector>&, float)> FLuaTickSignificanceFunction;
+
+UCLASS()
+class LUAMACHINE_API ULuaWorldSubsystem : public UWorldSubsystem
+{
+	GENERATED_BODY()
+
+public:
+	virtual void Initialize(FSubsystemCollectionBase& Collection) override;
+	virtual void Deinitialize() override;
+
+	void RegisterTickingComponent(ULuaComponent* LuaComponent);
+	void UnregisterTickingComponent(ULuaComponent* LuaComponent);
+
+	void TickBucket(FLuaTickBucketFunction& Bucket, float DeltaTime);
+
+	/* replace the default significance function (distance from the viewers and visibility) */
+	void SetLuaTickSignificanceFunction(FLuaTickSignificanceFunction InSignificanceFunction);
+
+	static float DefaultLuaTickSignificance(const ULuaComponent* LuaComponent, const TArray<FVector>& ViewLocations, float LODDistance);
+
+	/* stats of the last complete frame */
+	FLuaTickStats GetLuaTickStats(TSubclassOf<ULuaState> LuaState) const;
+
+	/* per-actor index of the LuaComponents, maintained by OnRegister/OnUnregister */
+	void RegisterLuaComponent(ULuaComponent* LuaComponent);
+	void UnregisterLuaComponent(ULuaComponent* LuaComponent);
+
+	/* State and Name are optional, returns false if the actor is not indexed */
+	bool FindLuaComponent(const AActor* Actor, TSubclassOf<ULuaState> State, const FName Name, ULuaComponent*& LuaComponent) const;
+
+	/* world scoped globals, resolved lazily by the _G __index of the state (returns false for dotted names) */
+	bool RegisterLuaGlobalName(TSubclassOf<ULuaState> State, const FString& Name, UObject* Object);
+	void UnregisterLuaGlobalName(TSubclassOf<ULuaState> State, const FString& Name, UObject* Object);
+
+	/* pushes the object registered as Name (nothing if it is not registered) */
+	bool ResolveLuaGlobalName(ULuaState* L, const char* Name, lua_State* State);
+
+protected:
+	TArray<TUniquePtr<FLuaTickBucketFunction>> TickBuckets;
+
+	FLuaTickSignificanceFunction SignificanceFunction;
+
+	struct FLuaTickStateFrame
+	{
+		uint64 FrameCounter = MAX_uint64;
+		double UsedTime = 0;
+		FLuaTickStats Current;
+		FLuaTickStats Last;
+	};
+
+	TMap<TSubclassOf<ULuaState>, FLuaTickStateFrame> StateFrames;
+	FLuaTickStateFrame& GetStateFrame(TSubclassOf<ULuaState> LuaState);
+
+	uint64 ViewLocationsFrameCounter = 0;
+	TArray<FVector> ViewLocations;
+	const TArray<FVector>& GetViewLocations();
+
+	struct FLuaComponentIndex
+	{
+		// registration order
+		TArray<TWeakObjectPtr<ULuaComponent>> LuaComponents;
+		TMap<FName, TWeakObjectPtr<ULuaComponent>> ByName;
+		// the first registered component of each state
+		TMap<TSubclassOf<ULuaState>, TWeakObjectPtr<ULuaComponent>> ByState;
+
+		void Add(ULuaComponent* LuaComponent);
+		void Rebuild();
+	};
+
+	TMap<TObjectKey<AActor>, FLuaComponentIndex> LuaComponentsIndex;
+
+	// Lua keys are case sensitive (FString and FName keys are not)
+	struct FLuaGlobalNameKeyFuncs : TDefaultMapKeyFuncs<FString, TWeakObjectPtr<UObject>, false>
+	{
+		static FORCEINLINE bool Matches(const FString& A, const FString& B)
+		{
+			return A.Equals(B, ESearchCase::CaseSensitive);
+		}
+
+		static FORCEINLINE uint32 GetKeyHash(const FString& Key)
+		{
+			return FCrc::StrCrc32(*Key);
+		}
+	};
+
+	struct FLuaGlobalNames
+	{
+		TMap<FString, TWeakObjectPtr<UObject>, FDefaultSetAllocator, FLuaGlobalNameKeyFuncs> Entries;
+		// resolved userdata, keyed by name
+		FLuaValue Cache;
+		// names whose cached value must be evicted, flushed in a single pass on the next lookup
+		TArray<FString> Dirty;
+	};
+
+	TMap<TSubclassOf<ULuaState>, FLuaGlobalNames> LuaGlobalNames;
+
+	void FlushLuaGlobalNames(FLuaGlobalNames& GlobalNames);
+
+	FDelegateHandle LevelRemovedFromWorldHandle;
+	void LuaLevelRemovedFromWorld(ULevel* Level, UWorld* World);
+
+	void UpdateEntries(FLuaTickBucketFunction& Bucket, ULuaState* L, float DeltaTime);
+	bool CallComponentTick(ULuaState* L, ULuaComponent* LuaComponent, float DeltaTime);
+};